@@ -0,0 +1,709 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Benchmarks of the libvmfs hot paths and of the tools built on it.
+ * Results are written as one JSON object per line, for regression tracking.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <spawn.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "vmfs.h"
+#include "bench.h"
+
+extern char **environ;
+
+/* Size of sequential and random reads */
+#define BENCH_SEQ_READ_SIZE   0x100000
+#define BENCH_RAND_READ_SIZE  0x1000
+
+/* Name under which results on the generated image are reported */
+#define BENCH_IMAGE_SYNTHETIC "synthetic-vmfs6"
+
+/* Magic of images created by the imager */
+#define BENCH_IMAGER_MAGIC    "VMFSIMG"
+
+static struct {
+   FILE *out;
+   uint64_t min_ns;
+   u_int entries;
+   u_int threads;
+   const char *fsck;
+   const char *imager;
+   char *tmp_dir;
+} bench = {
+   .min_ns  = 500000000ULL,
+   .entries = BENCH_DIR_ENTRIES,
+   .threads = 4,
+};
+
+/* Benchmarked operation, called "count" times per run */
+typedef int (*bench_op_t)(void *arg,uint64_t count);
+
+static inline uint64_t bench_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Random generator for offsets and names (xorshift) */
+static inline uint32_t bench_rand(uint32_t *state)
+{
+   *state ^= *state << 13;
+   *state ^= *state >> 17;
+   *state ^= *state << 5;
+   return(*state);
+}
+
+/* Output a JSON string */
+static void bench_json_str(const char *str)
+{
+   fputc('"',bench.out);
+
+   for(;*str;str++) {
+      if ((*str == '"') || (*str == '\\'))
+         fprintf(bench.out,"\\%c",*str);
+      else if ((u_char)*str < 0x20)
+         fprintf(bench.out,"\\u%04x",(u_char)*str);
+      else
+         fputc(*str,bench.out);
+   }
+
+   fputc('"',bench.out);
+}
+
+/* Output the result of a benchmark, "bytes" being 0 if not relevant */
+static void bench_report(const char *image,const char *name,uint64_t ops,
+                         uint64_t ns,uint64_t bytes)
+{
+   fprintf(bench.out,"{\"image\":");
+   bench_json_str(image);
+   fprintf(bench.out,",\"bench\":");
+   bench_json_str(name);
+   fprintf(bench.out,",\"ops\":%llu,\"ns\":%llu,\"ns_per_op\":%.1f",
+           (unsigned long long)ops,(unsigned long long)ns,
+           (double)ns / ops);
+
+   if (bytes)
+      fprintf(bench.out,",\"bytes\":%llu,\"mb_per_s\":%.1f",
+              (unsigned long long)bytes,
+              (double)bytes * 1000.0 / ((double)ns * 1.048576));
+
+   fprintf(bench.out,"}\n");
+   fflush(bench.out);
+}
+
+/* Output a skipped benchmark */
+static void bench_skip(const char *image,const char *name,const char *reason)
+{
+   fprintf(bench.out,"{\"image\":");
+   bench_json_str(image);
+   fprintf(bench.out,",\"bench\":");
+   bench_json_str(name);
+   fprintf(bench.out,",\"skipped\":");
+   bench_json_str(reason);
+   fprintf(bench.out,"}\n");
+   fflush(bench.out);
+}
+
+/*
+ * Run an operation in batches of doubling size, until the minimum time
+ * is reached. "bytes_per_op" is used to report a throughput.
+ */
+static void bench_run(const char *image,const char *name,bench_op_t op,
+                      void *arg,uint64_t bytes_per_op)
+{
+   uint64_t count,batch = 1,total = 0,ns = 0,start;
+
+   do {
+      start = bench_now();
+
+      if (op(arg,batch) == -1) {
+         bench_skip(image,name,"operation failed");
+         return;
+      }
+
+      ns += bench_now() - start;
+      total += batch;
+
+      /* Aim at the remaining time, growing at most 8 times per batch */
+      count = (ns < bench.min_ns) && ns ?
+              (total * (bench.min_ns - ns)) / ns : batch * 2;
+      batch = m_max(m_min(count,batch * 8),1);
+   } while(ns < bench.min_ns);
+
+   bench_report(image,name,total,ns,total * bytes_per_op);
+}
+
+/* === Block resolution and reads === */
+
+struct bench_file {
+   vmfs_file_t *f;
+   uint64_t size;
+   u_char *buf;
+   uint32_t seed;
+   off_t pos;
+};
+
+static int bench_op_get_block(void *arg,uint64_t count)
+{
+   struct bench_file *bf = arg;
+   uint64_t blk_id;
+
+   while(count--) {
+      if (vmfs_inode_get_block(bf->f->inode,bench_rand(&bf->seed) % bf->size,
+                               &blk_id) != 0)
+         return(-1);
+   }
+
+   return(0);
+}
+
+static int bench_op_pread_seq(void *arg,uint64_t count)
+{
+   struct bench_file *bf = arg;
+   size_t len;
+
+   while(count--) {
+      if (bf->pos >= bf->size)
+         bf->pos = 0;
+
+      len = m_min(BENCH_SEQ_READ_SIZE,bf->size - bf->pos);
+
+      if (vmfs_file_pread(bf->f,bf->buf,len,bf->pos) != len)
+         return(-1);
+
+      bf->pos += len;
+   }
+
+   return(0);
+}
+
+static int bench_op_pread_rand(void *arg,uint64_t count)
+{
+   struct bench_file *bf = arg;
+   off_t pos;
+
+   while(count--) {
+      pos = bench_rand(&bf->seed) % (bf->size / BENCH_RAND_READ_SIZE);
+      pos *= BENCH_RAND_READ_SIZE;
+
+      if (vmfs_file_pread(bf->f,bf->buf,BENCH_RAND_READ_SIZE,pos) !=
+          BENCH_RAND_READ_SIZE)
+         return(-1);
+   }
+
+   return(0);
+}
+
+/* Benchmark block resolution and reads of a file */
+static void bench_file(const char *image,vmfs_dir_t *root,const char *mode,
+                       const char *path)
+{
+   struct bench_file bf;
+   char name[64];
+
+   memset(&bf,0,sizeof(bf));
+   snprintf(name,sizeof(name),"get_block.%s",mode);
+
+   if (!(bf.f = vmfs_file_open_at(root,path))) {
+      bench_skip(image,name,"file not found");
+      return;
+   }
+
+   bf.size = vmfs_file_get_size(bf.f);
+
+   if (bf.size < BENCH_RAND_READ_SIZE) {
+      bench_skip(image,name,"file too small");
+      goto done;
+   }
+
+   if (!(bf.buf = iobuffer_alloc(BENCH_SEQ_READ_SIZE))) {
+      bench_skip(image,name,"out of memory");
+      goto done;
+   }
+
+   bf.seed = 0x12345678;
+   bench_run(image,name,bench_op_get_block,&bf,0);
+
+   snprintf(name,sizeof(name),"pread.seq.%s",mode);
+   bench_run(image,name,bench_op_pread_seq,&bf,
+             m_min(BENCH_SEQ_READ_SIZE,bf.size));
+
+   snprintf(name,sizeof(name),"pread.rand.%s",mode);
+   bench_run(image,name,bench_op_pread_rand,&bf,BENCH_RAND_READ_SIZE);
+
+ done:
+   iobuffer_free(bf.buf);
+   vmfs_file_close(bf.f);
+}
+
+/* === Directories === */
+
+struct bench_dir {
+   vmfs_dir_t *root;
+   vmfs_dir_t *d;
+   const char *path;
+   char **names;
+   u_int count;
+   uint32_t seed;
+};
+
+static int bench_op_dir_lookup(void *arg,uint64_t count)
+{
+   struct bench_dir *bd = arg;
+
+   while(count--) {
+      if (!vmfs_dir_lookup(bd->d,bd->names[bench_rand(&bd->seed) % bd->count]))
+         return(-1);
+   }
+
+   return(0);
+}
+
+static int bench_op_dir_open(void *arg,uint64_t count)
+{
+   struct bench_dir *bd = arg;
+   vmfs_dir_t *d;
+
+   while(count--) {
+      if (!(d = vmfs_dir_open_at(bd->root,bd->path)))
+         return(-1);
+
+      vmfs_dir_close(d);
+   }
+
+   return(0);
+}
+
+/* Path resolution, answered from the directory entry cache once warm */
+static int bench_op_dir_resolve(void *arg,uint64_t count)
+{
+   char path[VMFS_DIRENT_OFS_NAME_SIZE * 2 + 2];
+   struct bench_dir *bd = arg;
+   vmfs_file_t *f;
+
+   while(count--) {
+      snprintf(path,sizeof(path),"%s/%s",bd->path,
+               bd->names[bench_rand(&bd->seed) % bd->count]);
+
+      if (!(f = vmfs_file_open_at(bd->root,path)))
+         return(-1);
+
+      vmfs_file_close(f);
+   }
+
+   return(0);
+}
+
+/* Benchmark lookups in the large directory, or in the root directory */
+static void bench_dir(const char *image,vmfs_dir_t *root)
+{
+   const vmfs_dirent_t *entry;
+   struct bench_dir bd;
+   u_int i,max = 0;
+
+   memset(&bd,0,sizeof(bd));
+   bd.root = root;
+   bd.path = BENCH_DIR_LARGE;
+   bd.seed = 0x87654321;
+
+   if (!(bd.d = vmfs_dir_open_at(root,bd.path))) {
+      bd.path = ".";
+
+      if (!(bd.d = vmfs_dir_open_at(root,bd.path))) {
+         bench_skip(image,"dir.lookup","directory not found");
+         return;
+      }
+   }
+
+   while((entry = vmfs_dir_read(bd.d))) {
+      if (!strcmp(entry->name,".") || !strcmp(entry->name,".."))
+         continue;
+
+      if (bd.count == max) {
+         char **names;
+
+         max = max ? max * 2 : 256;
+
+         if (!(names = realloc(bd.names,max * sizeof(char *))))
+            break;
+
+         bd.names = names;
+      }
+
+      if (!(bd.names[bd.count] = strdup(entry->name)))
+         break;
+
+      bd.count++;
+   }
+
+   if (bd.count == 0) {
+      bench_skip(image,"dir.lookup","empty directory");
+   } else {
+      bench_run(image,"dir.lookup",bench_op_dir_lookup,&bd,0);
+      bench_run(image,"dir.open",bench_op_dir_open,&bd,0);
+      bench_run(image,"dir.resolve",bench_op_dir_resolve,&bd,0);
+   }
+
+   for(i=0;i<bd.count;i++)
+      free(bd.names[i]);
+
+   free(bd.names);
+   vmfs_dir_close(bd.d);
+}
+
+/* === Bitmaps === */
+
+static void bench_bitmap_cbk(vmfs_bitmap_t *b,uint32_t addr,void *opt_arg)
+{
+   (*(uint64_t *)opt_arg)++;
+}
+
+static int bench_op_bitmap_foreach(void *arg,uint64_t count)
+{
+   uint64_t items = 0;
+
+   while(count--)
+      vmfs_bitmap_foreach(arg,bench_bitmap_cbk,&items);
+
+   return(0);
+}
+
+static int bench_op_bitmap_check(void *arg,uint64_t count)
+{
+   while(count--) {
+      if (vmfs_bitmap_check(arg) != 0)
+         return(-1);
+   }
+
+   return(0);
+}
+
+/* Benchmark scans of all the bitmaps */
+static void bench_bitmaps(const char *image,const vmfs_fs_t *fs)
+{
+   static const struct {
+      const char *name;
+      enum vmfs_block_type type;
+   } bitmaps[] = {
+      { "fbb", VMFS_BLK_TYPE_FB },
+      { "sbc", VMFS_BLK_TYPE_SB },
+      { "pbc", VMFS_BLK_TYPE_PB },
+      { "fdc", VMFS_BLK_TYPE_FD },
+      { "pb2", VMFS_BLK_TYPE_PB2 },
+   };
+   vmfs_bitmap_t *b;
+   char name[64];
+   int i;
+
+   for(i=0;i<sizeof(bitmaps)/sizeof(bitmaps[0]);i++) {
+      b = vmfs_fs_get_bitmap(fs,bitmaps[i].type);
+      snprintf(name,sizeof(name),"bitmap.foreach.%s",bitmaps[i].name);
+
+      if (!b || !b->bmh.total_items) {
+         bench_skip(image,name,"bitmap disabled");
+         continue;
+      }
+
+      bench_run(image,name,bench_op_bitmap_foreach,b,0);
+
+      snprintf(name,sizeof(name),"bitmap.check.%s",bitmaps[i].name);
+      bench_run(image,name,bench_op_bitmap_check,b,0);
+   }
+}
+
+/* Run all the library benchmarks on an image */
+static void bench_image_lib(const char *image,const char *path)
+{
+   static const struct {
+      const char *mode;
+      const char *path;
+   } files[] = {
+      { "fb",   BENCH_FILE_FB },
+      { "sb",   BENCH_FILE_SB },
+      { "pb",   BENCH_FILE_PB },
+      { "pb2",  BENCH_FILE_PB2 },
+      { "dind", BENCH_FILE_DIND },
+   };
+   char *paths[2] = { (char *)path, NULL };
+   vmfs_flags_t flags;
+   vmfs_dir_t *root;
+   vmfs_fs_t *fs;
+   int i;
+
+   flags.packed = 0;
+
+   if (!(fs = vmfs_fs_open(paths,flags))) {
+      bench_skip(image,"libvmfs","unable to open filesystem");
+      return;
+   }
+
+   if (!(root = vmfs_dir_open_from_blkid(fs,VMFS_BLK_FD_BUILD(0,0,0)))) {
+      bench_skip(image,"libvmfs","unable to open root directory");
+      vmfs_fs_close(fs);
+      return;
+   }
+
+   for(i=0;i<sizeof(files)/sizeof(files[0]);i++)
+      bench_file(image,root,files[i].mode,files[i].path);
+
+   bench_dir(image,root);
+   bench_bitmaps(image,fs);
+
+   vmfs_dir_close(root);
+   vmfs_fs_close(fs);
+}
+
+/* === Tools === */
+
+/* Run a program, with its output to the given file, returning its status */
+static int bench_spawn(char *const argv[],const char *output)
+{
+   posix_spawn_file_actions_t actions;
+   pid_t pid;
+   int status;
+
+   posix_spawn_file_actions_init(&actions);
+   posix_spawn_file_actions_addopen(&actions,STDOUT_FILENO,output,
+                                    O_WRONLY|O_CREAT|O_TRUNC,0644);
+   posix_spawn_file_actions_addopen(&actions,STDERR_FILENO,"/dev/null",
+                                    O_WRONLY,0);
+
+   status = posix_spawn(&pid,argv[0],&actions,NULL,argv,environ);
+   posix_spawn_file_actions_destroy(&actions);
+
+   if (status != 0)
+      return(-1);
+
+   if ((waitpid(pid,&status,0) == -1) || !WIFEXITED(status))
+      return(-1);
+
+   return(WEXITSTATUS(status));
+}
+
+/* Time a single run of a program, "raw" being the raw image it handles */
+static void bench_program(const char *image,const char *name,
+                          char *const argv[],const char *output,
+                          const char *raw)
+{
+   struct stat st;
+   uint64_t start = bench_now();
+   int status;
+
+   if ((status = bench_spawn(argv,output)) != 0) {
+      char reason[64];
+
+      snprintf(reason,sizeof(reason),"exit status %d",status);
+      bench_skip(image,name,reason);
+      return;
+   }
+
+   start = bench_now() - start;
+   bench_report(image,name,1,start,
+                (raw && (stat(raw,&st) == 0)) ? st.st_size : 0);
+}
+
+/* Time the checker, whose first pass reads all the inodes from the FDC */
+static void bench_fsck(const char *image,const char *path)
+{
+   char threads[16],*argv[5];
+   char name[32];
+
+   if (!bench.fsck) {
+      bench_skip(image,"fsck","no fsck.vmfs given");
+      return;
+   }
+
+   argv[0] = (char *)bench.fsck;
+   argv[1] = "-j";
+   argv[2] = threads;
+   argv[3] = (char *)path;
+   argv[4] = NULL;
+
+   snprintf(threads,sizeof(threads),"1");
+   bench_program(image,"fsck.j1",argv,"/dev/null",NULL);
+
+   snprintf(threads,sizeof(threads),"%u",bench.threads);
+   snprintf(name,sizeof(name),"fsck.j%u",bench.threads);
+   bench_program(image,name,argv,"/dev/null",NULL);
+}
+
+/* Time imager import and extraction, starting from either form of image */
+static void bench_imager(const char *image,const char *path)
+{
+   char raw[PATH_MAX],img[PATH_MAX],magic[sizeof(BENCH_IMAGER_MAGIC)-1];
+   char *argv[4];
+   int fd,is_img = 0;
+
+   if (!bench.imager) {
+      bench_skip(image,"imager","no imager given");
+      return;
+   }
+
+   if ((fd = open(path,O_RDONLY)) != -1) {
+      is_img = (read(fd,magic,sizeof(magic)) == sizeof(magic)) &&
+               !memcmp(magic,BENCH_IMAGER_MAGIC,sizeof(magic));
+      close(fd);
+   }
+
+   snprintf(raw,sizeof(raw),"%s/extract.raw",bench.tmp_dir);
+   snprintf(img,sizeof(img),"%s/import.img",bench.tmp_dir);
+   argv[0] = (char *)bench.imager;
+
+   if (is_img) {
+      argv[1] = "-x";
+      argv[2] = (char *)path;
+      argv[3] = NULL;
+      bench_program(image,"imager.extract",argv,raw,raw);
+
+      argv[1] = raw;
+      argv[2] = NULL;
+      bench_program(image,"imager.import",argv,img,raw);
+   } else {
+      argv[1] = (char *)path;
+      argv[2] = NULL;
+      bench_program(image,"imager.import",argv,img,path);
+
+      argv[1] = "-x";
+      argv[2] = img;
+      argv[3] = NULL;
+      bench_program(image,"imager.extract",argv,raw,raw);
+   }
+
+   unlink(raw);
+   unlink(img);
+}
+
+/* Run all benchmarks on an image, reported under the given name */
+static void bench_image(const char *image,const char *path)
+{
+   bench_image_lib(image,path);
+   bench_fsck(image,path);
+   bench_imager(image,path);
+}
+
+static void show_usage(char *prog_name)
+{
+   char *name = basename(prog_name);
+
+   fprintf(stderr,"Syntax: %s [-g] [-n entries] [-t seconds] [-j threads] "
+           "[-f fsck.vmfs] [-i imager] [-o output] [<image>...]\n",name);
+   fprintf(stderr,"   -g : also run on a generated VMFS6 image\n");
+}
+
+/* Remove the temporary directory and the files left in it */
+static void bench_cleanup(void)
+{
+   char path[PATH_MAX];
+
+   if (!bench.tmp_dir)
+      return;
+
+   snprintf(path,sizeof(path),"%s/synthetic.vmfs",bench.tmp_dir);
+   unlink(path);
+   rmdir(bench.tmp_dir);
+}
+
+int main(int argc,char *argv[])
+{
+   static char tmp_dir[] = "/tmp/vmfs-bench.XXXXXX";
+   char synthetic[PATH_MAX];
+   const char *output = NULL;
+   int opt,i,generate = 0;
+   int out_fd;
+
+   while((opt = getopt(argc,argv,"gn:t:j:f:i:o:")) != -1) {
+      switch(opt) {
+         case 'g':
+            generate = 1;
+            break;
+         case 'n':
+            bench.entries = atoi(optarg);
+            break;
+         case 't':
+            bench.min_ns = strtod(optarg,NULL) * 1000000000.0;
+            break;
+         case 'j':
+            bench.threads = atoi(optarg);
+            break;
+         case 'f':
+            bench.fsck = optarg;
+            break;
+         case 'i':
+            bench.imager = optarg;
+            break;
+         case 'o':
+            output = optarg;
+            break;
+         default:
+            show_usage(argv[0]);
+            return(EXIT_FAILURE);
+      }
+   }
+
+   if ((!generate && (optind >= argc)) ||
+       (bench.entries > BENCH_DIR_ENTRIES_MAX) || !bench.threads) {
+      show_usage(argv[0]);
+      return(EXIT_FAILURE);
+   }
+
+   /* The library prints information on stdout, keep results apart */
+   if (output) {
+      bench.out = fopen(output,"w");
+   } else if ((out_fd = dup(STDOUT_FILENO)) != -1) {
+      bench.out = fdopen(out_fd,"w");
+      dup2(STDERR_FILENO,STDOUT_FILENO);
+   }
+
+   if (!bench.out) {
+      perror("output");
+      return(EXIT_FAILURE);
+   }
+
+   if (!(bench.tmp_dir = mkdtemp(tmp_dir))) {
+      perror("mkdtemp");
+      return(EXIT_FAILURE);
+   }
+
+   atexit(bench_cleanup);
+   vmfs_host_init();
+
+   if (generate) {
+      snprintf(synthetic,sizeof(synthetic),"%s/synthetic.vmfs",bench.tmp_dir);
+
+      if (bench_mkimage(synthetic,bench.entries) == -1)
+         bench_skip(BENCH_IMAGE_SYNTHETIC,"mkimage","unable to create image");
+      else
+         bench_image(BENCH_IMAGE_SYNTHETIC,synthetic);
+   }
+
+   for(i=optind;i<argc;i++)
+      bench_image(argv[i],argv[i]);
+
+   fclose(bench.out);
+   return(EXIT_SUCCESS);
+}
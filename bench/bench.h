@@ -0,0 +1,37 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Files of the synthetic images, one per block addressing mode */
+#define BENCH_FILE_FB      "fb.bin"       /* File blocks */
+#define BENCH_FILE_SB      "sb.bin"       /* Sub-blocks */
+#define BENCH_FILE_PB      "pb.bin"       /* Pointer block */
+#define BENCH_FILE_PB2     "pb2.bin"      /* PB2 pointer block */
+#define BENCH_FILE_DIND    "dind.bin"     /* Double indirect pointer blocks */
+
+/* Large directory of the synthetic images */
+#define BENCH_DIR_LARGE    "bigdir"
+#define BENCH_DIR_NAME_FMT "file%06u"
+
+/* Default and maximum number of entries in the large directory */
+#define BENCH_DIR_ENTRIES      4096
+#define BENCH_DIR_ENTRIES_MAX  16384
+
+/* Create a synthetic VMFS6 image, with "entries" files in the large dir */
+int bench_mkimage(const char *path,u_int entries);
+
+#endif
@@ -0,0 +1,2 @@
+bench_OPTIONS := noinst
+REQUIRES := libvmfs
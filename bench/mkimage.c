@@ -0,0 +1,728 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Synthetic VMFS6 images for the benchmarks, laid out the way libvmfs reads
+ * them: a single extent of one LVM segment, 1 MB file blocks and 64 KB
+ * sub-blocks. The root directory holds the meta files, one file per block
+ * addressing mode and a large directory of empty files.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "vmfs.h"
+#include "bench.h"
+
+/* Until a better API is defined */
+int vmfs_bmh_write(const vmfs_bitmap_header_t *bmh,u_char *buf);
+
+#define MKIMG_BLOCK_SIZE   0x100000
+#define MKIMG_SB_SIZE      0x10000
+#define MKIMG_VOL_SIZE     VMFS_LVM_SEGMENT_SIZE
+#define MKIMG_FB_COUNT     (MKIMG_VOL_SIZE / MKIMG_BLOCK_SIZE)
+
+/* Header size of all bitmap files */
+#define MKIMG_BMP_HDR_SIZE 0x10000
+
+/* First file block after the heartbeats, where libvmfs looks for the FDC */
+#define MKIMG_FDC_BASE \
+   ((VMFS_HB_BASE + VMFS_HB_NUM * VMFS_HB_SIZE) / MKIMG_BLOCK_SIZE)
+
+/* Number of inodes besides the large directory content */
+#define MKIMG_INODES_EXTRA 64
+
+/* Number of blocks of the files using pointer blocks */
+#define MKIMG_FB_FILE_BLOCKS  8
+#define MKIMG_SB_FILE_BLOCKS  4
+#define MKIMG_PB_FILE_BLOCKS  16
+
+/* Directory file layout (see vmfs_dir_read()) */
+#define MKIMG_DIR_OFS_FIRST   0x3b8
+#define MKIMG_DIR_OFS_PAGES   0x11000
+#define MKIMG_DIR_PAGE_HDR    0x40
+#define MKIMG_DIR_PER_PAGE    (VMFS_DIR_PAGE_SIZE / VMFS_DIRENT_SIZE)
+
+/* Bitmap file being built in memory */
+struct mkimg_bitmap {
+   vmfs_bitmap_header_t bmh;
+   vmfs_bitmap_entry_t *entries;
+   u_int entry_count;
+   uint32_t next;          /* Next item to allocate */
+   uint32_t fb;            /* First file block of the bitmap file */
+   u_char *buf;
+   size_t len;
+};
+
+/* Directory being built in memory */
+struct mkimg_dir {
+   u_char *inode;
+   vmfs_dirent_t *entries;
+   u_int count,max;
+};
+
+struct mkimg {
+   int fd;
+   time_t now;
+   uuid_t lvm_uuid;
+   struct mkimg_bitmap fbb,sbc,pbc,fdc,pb2;
+};
+
+/* Write data at a position of the logical volume */
+static int mkimg_write(struct mkimg *img,off_t pos,const u_char *buf,
+                       size_t len)
+{
+   pos += VMFS_VOLINFO_BASE + VMFS_VOL_DATA_OFFSET;
+   return((m_pwrite(img->fd,buf,len,pos) == len) ? 0 : -1);
+}
+
+/* Initialize a bitmap with all its items free */
+static int mkimg_bitmap_init(struct mkimg_bitmap *b,uint32_t magic,
+                             uint32_t items_per_entry,
+                             uint32_t entries_per_area,
+                             uint32_t data_size,uint32_t total_items)
+{
+   vmfs_bitmap_header_t *bmh = &b->bmh;
+   uint32_t items_per_area = items_per_entry * entries_per_area;
+   vmfs_bitmap_entry_t *e;
+   u_int i;
+
+   memset(b,0,sizeof(*b));
+   bmh->items_per_bitmap_entry = items_per_entry;
+   bmh->bmp_entries_per_area   = entries_per_area;
+   bmh->hdr_size    = MKIMG_BMP_HDR_SIZE;
+   bmh->data_size   = data_size;
+   bmh->area_size   = (entries_per_area * VMFS_BITMAP_ENTRY_SIZE) +
+                      (items_per_area * data_size);
+   bmh->total_items = total_items;
+   bmh->area_count  = (total_items + items_per_area - 1) / items_per_area;
+
+   b->entry_count = (total_items + items_per_entry - 1) / items_per_entry;
+   b->len = ALIGN_NUM(bmh->hdr_size + (bmh->area_count * bmh->area_size),
+                      MKIMG_BLOCK_SIZE);
+
+   if (!(b->entries = calloc(m_max(b->entry_count,1),sizeof(*b->entries))) ||
+       !(b->buf = calloc(1,b->len)))
+      return(-1);
+
+   /* Free items have their bit set */
+   for(i=0;i<b->entry_count;i++) {
+      e = &b->entries[i];
+      e->mdh.magic = magic;
+      e->id    = i;
+      e->total = m_min(items_per_entry,total_items - (i * items_per_entry));
+      e->free  = e->total;
+      memset(e->bitmap,0xff,e->total / 8);
+
+      if (e->total % 8)
+         e->bitmap[e->total / 8] = (1 << (e->total % 8)) - 1;
+   }
+
+   return(0);
+}
+
+/* Free a bitmap */
+static void mkimg_bitmap_free(struct mkimg_bitmap *b)
+{
+   free(b->entries);
+   free(b->buf);
+}
+
+/* Allocate the next free item of a bitmap */
+static int mkimg_bitmap_alloc(struct mkimg_bitmap *b,uint32_t *addr)
+{
+   uint32_t ipe = b->bmh.items_per_bitmap_entry;
+
+   if (b->next >= b->bmh.total_items)
+      return(-1);
+
+   *addr = b->next++;
+   return(vmfs_bitmap_set_item_status(&b->bmh,&b->entries[*addr / ipe],
+                                      *addr / ipe,*addr % ipe,1));
+}
+
+/* Get the data of a bitmap item */
+static u_char *mkimg_bitmap_item(struct mkimg_bitmap *b,uint32_t addr)
+{
+   const vmfs_bitmap_header_t *bmh = &b->bmh;
+   uint32_t items_per_area;
+
+   items_per_area = bmh->items_per_bitmap_entry * bmh->bmp_entries_per_area;
+
+   return(b->buf + bmh->hdr_size + ((addr / items_per_area) * bmh->area_size) +
+          (bmh->bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE) +
+          ((addr % items_per_area) * bmh->data_size));
+}
+
+/* Get the position of a bitmap item in the logical volume */
+static inline off_t mkimg_bitmap_item_pos(struct mkimg_bitmap *b,
+                                          const u_char *item)
+{
+   return(((off_t)b->fb * MKIMG_BLOCK_SIZE) + (item - b->buf));
+}
+
+/* Allocate contiguous file blocks */
+static int mkimg_alloc_fb(struct mkimg *img,u_int count,uint32_t *fb)
+{
+   uint32_t addr;
+   u_int i;
+
+   for(i=0;i<count;i++) {
+      if (mkimg_bitmap_alloc(&img->fbb,&addr) == -1)
+         return(-1);
+
+      if (i == 0)
+         *fb = addr;
+   }
+
+   return(0);
+}
+
+/* Allocate a sub-block, returning its block id */
+static u_char *mkimg_alloc_sb(struct mkimg *img,uint64_t *blk_id)
+{
+   uint32_t ipe = img->sbc.bmh.items_per_bitmap_entry;
+   uint32_t addr;
+
+   if (mkimg_bitmap_alloc(&img->sbc,&addr) == -1)
+      return NULL;
+
+   *blk_id = VMFS_BLK_SB_BUILD(addr / ipe,addr % ipe,0);
+   return(mkimg_bitmap_item(&img->sbc,addr));
+}
+
+/* Allocate a PB2 pointer block, returning its block id */
+static u_char *mkimg_alloc_pb2(struct mkimg *img,uint64_t *blk_id)
+{
+   uint32_t ipe = img->pb2.bmh.items_per_bitmap_entry;
+   uint32_t addr;
+
+   if (mkimg_bitmap_alloc(&img->pb2,&addr) == -1)
+      return NULL;
+
+   *blk_id = VMFS_BLK_PB2_BUILD(addr / ipe,addr % ipe,0);
+   return(mkimg_bitmap_item(&img->pb2,addr));
+}
+
+/* Allocate an inode */
+static u_char *mkimg_inode_alloc(struct mkimg *img,uint32_t type,
+                                 uint32_t mode,uint32_t zla,
+                                 uint64_t blk_size,uint32_t *id)
+{
+   uint32_t ipe = img->fdc.bmh.items_per_bitmap_entry;
+   vmfs_metadata_hdr_t mdh;
+   uint32_t addr;
+   u_char *buf;
+
+   if (mkimg_bitmap_alloc(&img->fdc,&addr) == -1)
+      return NULL;
+
+   buf = mkimg_bitmap_item(&img->fdc,addr);
+   *id = VMFS_BLK_FD_BUILD(addr / ipe,addr % ipe,0);
+
+   memset(&mdh,0,sizeof(mdh));
+   mdh.magic = VMFS_INODE_MAGIC;
+   mdh.pos   = mkimg_bitmap_item_pos(&img->fdc,buf);
+   vmfs_metadata_hdr_write(&mdh,buf);
+
+   write_le32(buf,VMFS_INODE_OFS_ID,*id);
+   write_le32(buf,VMFS_INODE_OFS_ID2,(addr % ipe) + 1);
+   write_le32(buf,VMFS_INODE_OFS_NLINK,1);
+   write_le32(buf,VMFS_INODE_OFS_TYPE,type);
+   write_le64(buf,VMFS_INODE_OFS_BLK_SIZE,blk_size);
+   write_le32(buf,VMFS_INODE_OFS_MTIME,img->now);
+   write_le32(buf,VMFS_INODE_OFS_CTIME,img->now);
+   write_le32(buf,VMFS_INODE_OFS_ATIME,img->now);
+   write_le32(buf,VMFS_INODE_OFS_MODE,mode);
+   write_le32(buf,VMFS_INODE_OFS_ZLA,zla);
+   return buf;
+}
+
+/* Set the size and the block count of an inode */
+static void mkimg_inode_set_size(u_char *inode,uint64_t size,
+                                 uint64_t blk_count)
+{
+   write_le64(inode,VMFS_INODE_OFS_SIZE,size);
+   write_le64(inode,VMFS_INODE_OFS_BLK_COUNT,blk_count);
+}
+
+/* Set a block of an inode */
+static inline void mkimg_inode_set_block(u_char *inode,u_int index,
+                                         uint64_t blk_id)
+{
+   write_le64(inode,VMFS_INODE_OFS_BLK_ARRAY+(index*sizeof(uint64_t)),blk_id);
+}
+
+/* Store a file held in contiguous file blocks */
+static int mkimg_store_fb_file(struct mkimg *img,u_char *inode,
+                               const u_char *buf,size_t len)
+{
+   u_int i,count = (len + MKIMG_BLOCK_SIZE - 1) / MKIMG_BLOCK_SIZE;
+   uint32_t fb;
+
+   if ((count > VMFS_INODE_BLK_COUNT) || (mkimg_alloc_fb(img,count,&fb) == -1))
+      return(-1);
+
+   for(i=0;i<count;i++)
+      mkimg_inode_set_block(inode,i,VMFS_BLK_FB_BUILD(fb + i,0));
+
+   mkimg_inode_set_size(inode,len,count);
+   return(mkimg_write(img,(off_t)fb * MKIMG_BLOCK_SIZE,buf,len));
+}
+
+/* Fill a file block with a pattern depending on its position in the file */
+static int mkimg_write_data_fb(struct mkimg *img,uint32_t fb,u_int index,
+                               u_char *buf)
+{
+   u_int i;
+
+   for(i=0;i<MKIMG_BLOCK_SIZE;i+=M_BLK_SIZE)
+      memset(buf + i,(index * 37 + i / M_BLK_SIZE) & 0xff,M_BLK_SIZE);
+
+   return(mkimg_write(img,(off_t)fb * MKIMG_BLOCK_SIZE,buf,MKIMG_BLOCK_SIZE));
+}
+
+/* Allocate and fill the data blocks of a file using pointer blocks */
+static int mkimg_fill_pb(struct mkimg *img,u_char *pb,u_int count,u_char *buf)
+{
+   uint32_t fb;
+   u_int i;
+
+   if (mkimg_alloc_fb(img,count,&fb) == -1)
+      return(-1);
+
+   for(i=0;i<count;i++) {
+      write_le64(pb,i*sizeof(uint64_t),VMFS_BLK_FB_BUILD(fb + i,0));
+
+      if (mkimg_write_data_fb(img,fb + i,i,buf) == -1)
+         return(-1);
+   }
+
+   return(0);
+}
+
+/* Add an entry to a directory */
+static int mkimg_dir_add(struct mkimg_dir *d,const char *name,uint32_t type,
+                         uint32_t id)
+{
+   vmfs_dirent_t *e;
+
+   if (d->count == d->max) {
+      d->max = d->max ? d->max * 2 : 64;
+
+      if (!(e = realloc(d->entries,d->max * sizeof(*e))))
+         return(-1);
+
+      d->entries = e;
+   }
+
+   e = &d->entries[d->count++];
+   memset(e,0,sizeof(*e));
+   e->type     = type;
+   e->block_id = id;
+   strncpy(e->name,name,VMFS_DIRENT_OFS_NAME_SIZE);
+   return(0);
+}
+
+/* Create a directory, with its "." and ".." entries */
+static int mkimg_dir_create(struct mkimg *img,struct mkimg_dir *d,
+                            uint32_t parent,uint32_t *id)
+{
+   memset(d,0,sizeof(*d));
+
+   if (!(d->inode = mkimg_inode_alloc(img,VMFS_FILE_TYPE_DIR,S_IFDIR | 0755,
+                                      VMFS_BLK_TYPE_FB,MKIMG_BLOCK_SIZE,id)))
+      return(-1);
+
+   write_le32(d->inode,VMFS_INODE_OFS_NLINK,2);
+
+   if (!parent)
+      parent = *id;
+
+   if ((mkimg_dir_add(d,".",VMFS_FILE_TYPE_DIR,*id) == -1) ||
+       (mkimg_dir_add(d,"..",VMFS_FILE_TYPE_DIR,parent) == -1))
+      return(-1);
+
+   return(0);
+}
+
+/* Set a nibble of the page map of a directory */
+static inline void mkimg_dir_set_page(u_char *map,u_int nibble,u_char val)
+{
+   if (nibble % 2)
+      map[nibble / 2] |= val;
+   else
+      map[nibble / 2] |= val << 4;
+}
+
+/* Store a directory: the first two entries, then pages of entries */
+static int mkimg_dir_store(struct mkimg *img,struct mkimg_dir *d)
+{
+   u_int i,page,pages;
+   size_t size,map_len;
+   u_char *buf,*ent;
+   int res;
+
+   pages = m_max((d->count - 2 + MKIMG_DIR_PER_PAGE - 1) / MKIMG_DIR_PER_PAGE,
+                 1);
+   size = MKIMG_DIR_OFS_PAGES + (pages * VMFS_DIR_PAGE_SIZE);
+   map_len = (size + 8191) / (VMFS_DIR_PAGE_SIZE * 2);
+
+   if (!(buf = calloc(1,size)))
+      return(-1);
+
+   for(i=0;i<d->count;i++) {
+      if (i < 2) {
+         ent = buf + MKIMG_DIR_OFS_FIRST + (i * VMFS_DIRENT_SIZE);
+      } else {
+         page = (i - 2) / MKIMG_DIR_PER_PAGE;
+         ent  = buf + MKIMG_DIR_OFS_PAGES + (page * VMFS_DIR_PAGE_SIZE) +
+                MKIMG_DIR_PAGE_HDR +
+                (((i - 2) % MKIMG_DIR_PER_PAGE) * VMFS_DIRENT_SIZE);
+      }
+
+      write_le32(ent,VMFS_DIRENT_OFS_TYPE,d->entries[i].type);
+      write_le32(ent,VMFS_DIRENT_OFS_BLK_ID,d->entries[i].block_id);
+      write_le32(ent,VMFS_DIRENT_OFS_REC_ID,d->entries[i].block_id);
+      memcpy(ent + VMFS_DIRENT_OFS_NAME,d->entries[i].name,
+             VMFS_DIRENT_OFS_NAME_SIZE);
+   }
+
+   /* Page n is described by nibble n + 1, the last one ends the directory */
+   for(page=0;page<pages;page++)
+      mkimg_dir_set_page(buf + VMFS_DIR_OFS_PAGE_MAP,page + 1,0x1);
+
+   if ((pages + 2) / 2 < map_len)
+      mkimg_dir_set_page(buf + VMFS_DIR_OFS_PAGE_MAP,pages + 1,0x8);
+
+   res = mkimg_store_fb_file(img,d->inode,buf,size);
+   free(buf);
+   free(d->entries);
+   return(res);
+}
+
+/* Create a file of the root directory */
+static u_char *mkimg_file_create(struct mkimg *img,struct mkimg_dir *root,
+                                 const char *name,uint32_t zla,
+                                 uint64_t blk_size)
+{
+   u_char *inode;
+   uint32_t id;
+
+   if (!(inode = mkimg_inode_alloc(img,VMFS_FILE_TYPE_FILE,0644,zla,blk_size,
+                                   &id)) ||
+       (mkimg_dir_add(root,name,VMFS_FILE_TYPE_FILE,id) == -1))
+      return NULL;
+
+   return inode;
+}
+
+/* Create the data files, one for each block addressing mode */
+static int mkimg_create_files(struct mkimg *img,struct mkimg_dir *root)
+{
+   u_char *inode,*pb,*pb2,*sb,*buf;
+   uint64_t blk_id,pb_id;
+   uint32_t fb;
+   u_int i;
+   int res = -1;
+
+   if (!(buf = malloc(MKIMG_BLOCK_SIZE)))
+      return(-1);
+
+   /* File blocks, allocated contiguously */
+   if (!(inode = mkimg_file_create(img,root,BENCH_FILE_FB,VMFS_BLK_TYPE_FB,
+                                   MKIMG_BLOCK_SIZE)) ||
+       (mkimg_alloc_fb(img,MKIMG_FB_FILE_BLOCKS,&fb) == -1))
+      goto done;
+
+   for(i=0;i<MKIMG_FB_FILE_BLOCKS;i++) {
+      mkimg_inode_set_block(inode,i,VMFS_BLK_FB_BUILD(fb + i,0));
+
+      if (mkimg_write_data_fb(img,fb + i,i,buf) == -1)
+         goto done;
+   }
+
+   mkimg_inode_set_size(inode,MKIMG_FB_FILE_BLOCKS * MKIMG_BLOCK_SIZE,
+                        MKIMG_FB_FILE_BLOCKS);
+
+   /* Sub-blocks, whose data lives in the SBC */
+   if (!(inode = mkimg_file_create(img,root,BENCH_FILE_SB,VMFS_BLK_TYPE_SB,
+                                   MKIMG_SB_SIZE)))
+      goto done;
+
+   for(i=0;i<MKIMG_SB_FILE_BLOCKS;i++) {
+      if (!(sb = mkimg_alloc_sb(img,&blk_id)))
+         goto done;
+
+      memset(sb,i + 1,MKIMG_SB_SIZE);
+      mkimg_inode_set_block(inode,i,blk_id);
+   }
+
+   mkimg_inode_set_size(inode,MKIMG_SB_FILE_BLOCKS * MKIMG_SB_SIZE,
+                        MKIMG_SB_FILE_BLOCKS);
+
+   /* A pointer block, stored as a sub-block */
+   if (!(inode = mkimg_file_create(img,root,BENCH_FILE_PB,VMFS_BLK_TYPE_PB,
+                                   MKIMG_BLOCK_SIZE)) ||
+       !(pb = mkimg_alloc_sb(img,&pb_id)) ||
+       (mkimg_fill_pb(img,pb,MKIMG_PB_FILE_BLOCKS,buf) == -1))
+      goto done;
+
+   mkimg_inode_set_block(inode,0,pb_id);
+   mkimg_inode_set_size(inode,MKIMG_PB_FILE_BLOCKS * MKIMG_BLOCK_SIZE,
+                        MKIMG_PB_FILE_BLOCKS);
+
+   /* A pointer block from the PB2 bitmap */
+   if (!(inode = mkimg_file_create(img,root,BENCH_FILE_PB2,VMFS_BLK_TYPE_PB2,
+                                   MKIMG_BLOCK_SIZE)) ||
+       !(pb2 = mkimg_alloc_pb2(img,&pb_id)) ||
+       (mkimg_fill_pb(img,pb2,MKIMG_PB_FILE_BLOCKS,buf) == -1))
+      goto done;
+
+   mkimg_inode_set_block(inode,0,pb_id);
+   mkimg_inode_set_size(inode,MKIMG_PB_FILE_BLOCKS * MKIMG_BLOCK_SIZE,
+                        MKIMG_PB_FILE_BLOCKS);
+
+   /* A primary pointer block, pointing to a secondary one */
+   if (!(inode = mkimg_file_create(img,root,BENCH_FILE_DIND,
+                                   VMFS5_ZLA_BASE + VMFS_BLK_TYPE_PB,
+                                   MKIMG_BLOCK_SIZE)) ||
+       !(pb = mkimg_alloc_sb(img,&pb_id)) ||
+       !(sb = mkimg_alloc_sb(img,&blk_id)) ||
+       (mkimg_fill_pb(img,sb,MKIMG_PB_FILE_BLOCKS,buf) == -1))
+      goto done;
+
+   write_le64(pb,0,blk_id);
+   mkimg_inode_set_block(inode,0,pb_id);
+   mkimg_inode_set_size(inode,MKIMG_PB_FILE_BLOCKS * MKIMG_BLOCK_SIZE,
+                        MKIMG_PB_FILE_BLOCKS);
+   res = 0;
+
+ done:
+   free(buf);
+   return(res);
+}
+
+/* Create the large directory */
+static int mkimg_create_large_dir(struct mkimg *img,struct mkimg_dir *root,
+                                  uint32_t root_id,u_int entries)
+{
+   char name[VMFS_DIRENT_OFS_NAME_SIZE];
+   struct mkimg_dir d;
+   uint32_t id,file_id;
+   u_int i;
+
+   if ((mkimg_dir_create(img,&d,root_id,&id) == -1) ||
+       (mkimg_dir_add(root,BENCH_DIR_LARGE,VMFS_FILE_TYPE_DIR,id) == -1))
+      return(-1);
+
+   for(i=0;i<entries;i++) {
+      snprintf(name,sizeof(name),BENCH_DIR_NAME_FMT,i);
+
+      if (!mkimg_inode_alloc(img,VMFS_FILE_TYPE_FILE,0644,VMFS_BLK_TYPE_FB,
+                             MKIMG_BLOCK_SIZE,&file_id) ||
+          (mkimg_dir_add(&d,name,VMFS_FILE_TYPE_FILE,file_id) == -1))
+         return(-1);
+   }
+
+   return(mkimg_dir_store(img,&d));
+}
+
+/* Store a bitmap file: header, entries and items */
+static int mkimg_bitmap_store(struct mkimg *img,struct mkimg_bitmap *b,
+                              u_char *inode)
+{
+   const vmfs_bitmap_header_t *bmh = &b->bmh;
+   u_int i,count = b->len / MKIMG_BLOCK_SIZE;
+   u_char *ent;
+
+   vmfs_bmh_write(bmh,b->buf);
+
+   for(i=0;i<b->entry_count;i++) {
+      ent = b->buf + bmh->hdr_size +
+            ((i / bmh->bmp_entries_per_area) * bmh->area_size) +
+            ((i % bmh->bmp_entries_per_area) * VMFS_BITMAP_ENTRY_SIZE);
+
+      b->entries[i].mdh.pos = mkimg_bitmap_item_pos(b,ent);
+      vmfs_bme_write(&b->entries[i],ent);
+   }
+
+   for(i=0;i<count;i++)
+      mkimg_inode_set_block(inode,i,VMFS_BLK_FB_BUILD(b->fb + i,0));
+
+   mkimg_inode_set_size(inode,b->len,count);
+   return(mkimg_write(img,(off_t)b->fb * MKIMG_BLOCK_SIZE,b->buf,b->len));
+}
+
+/* Write volume and filesystem information */
+static int mkimg_write_info(struct mkimg *img)
+{
+   DECL_ALIGNED_BUFFER(buf,8192);
+   char uuid_str[M_UUID_BUFLEN+1];
+   uuid_t uuid;
+
+   memset(buf,0,buf_len);
+   write_le32(buf,VMFS_VOLINFO_OFS_MAGIC,VMFS_VOLINFO_MAGIC);
+   write_le32(buf,VMFS_VOLINFO_OFS_VER,6);
+   strncpy((char *)buf+VMFS_VOLINFO_OFS_NAME,"bench",
+           VMFS_VOLINFO_OFS_NAME_SIZE);
+   write_le32(buf,VMFS_VOLINFO_OFS_SIZE,
+              (VMFS_VOL_DATA_OFFSET + MKIMG_VOL_SIZE) / 256);
+   uuid_generate(uuid);
+   write_uuid(buf,VMFS_VOLINFO_OFS_UUID,&uuid);
+
+   /* A single extent, holding a single segment */
+   write_le64(buf,VMFS_LVMINFO_OFS_SIZE,MKIMG_VOL_SIZE);
+   write_le64(buf,VMFS_LVMINFO_OFS_BLKS,2);
+   memcpy(buf+VMFS_LVMINFO_OFS_UUID_STR,m_uuid_to_str(img->lvm_uuid,uuid_str),
+          M_UUID_BUFLEN);
+   write_uuid(buf,VMFS_LVMINFO_OFS_UUID,&img->lvm_uuid);
+   write_le32(buf,VMFS_LVMINFO_OFS_NUM_SEGMENTS,1);
+   write_le32(buf,VMFS_LVMINFO_OFS_FIRST_SEGMENT,0);
+   write_le32(buf,VMFS_LVMINFO_OFS_LAST_SEGMENT,0);
+   write_le32(buf,VMFS_LVMINFO_OFS_NUM_EXTENTS,1);
+
+   if (m_pwrite(img->fd,buf,buf_len,VMFS_VOLINFO_BASE) != buf_len)
+      return(-1);
+
+   memset(buf,0,buf_len);
+   write_le32(buf,VMFS_FSINFO_OFS_MAGIC,VMFS_FSINFO_MAGIC);
+   write_le32(buf,VMFS_FSINFO_OFS_VOLVER,6);
+   buf[VMFS_FSINFO_OFS_VER] = 6;
+   uuid_generate(uuid);
+   write_uuid(buf,VMFS_FSINFO_OFS_UUID,&uuid);
+   strncpy((char *)buf+VMFS_FSINFO_OFS_LABEL,"bench",
+           VMFS_FSINFO_OFS_LABEL_SIZE);
+   write_le64(buf,VMFS_FSINFO_OFS_BLKSIZE,MKIMG_BLOCK_SIZE);
+   write_le32(buf,VMFS_FSINFO_OFS_CTIME,img->now);
+   write_uuid(buf,VMFS_FSINFO_OFS_LVM_UUID,&img->lvm_uuid);
+   write_le32(buf,VMFS_FSINFO_OFS_FDC_HEADER_SIZE,MKIMG_BMP_HDR_SIZE);
+   write_le32(buf,VMFS_FSINFO_OFS_FDC_BITMAP_COUNT,img->fdc.entry_count);
+   write_le32(buf,VMFS_FSINFO_OFS_SBSIZE,MKIMG_SB_SIZE);
+
+   return(mkimg_write(img,VMFS_FSINFO_BASE,buf,buf_len));
+}
+
+/* Create a synthetic VMFS6 image, with "entries" files in the large dir */
+int bench_mkimage(const char *path,u_int entries)
+{
+   static const struct {
+      const char *name;
+      size_t offset;
+   } meta_files[] = {
+      { ".fdc.sf", offsetof(struct mkimg,fdc) },
+      { ".fbb.sf", offsetof(struct mkimg,fbb) },
+      { ".sbc.sf", offsetof(struct mkimg,sbc) },
+      { ".pb2.sf", offsetof(struct mkimg,pb2) },
+      { ".pbc.sf", offsetof(struct mkimg,pbc) },
+   };
+   u_char *meta_inodes[sizeof(meta_files)/sizeof(meta_files[0])];
+   struct mkimg_bitmap *b;
+   struct mkimg_dir root;
+   struct mkimg img;
+   uint32_t root_id,id;
+   u_int i;
+   int res = -1;
+
+   memset(&img,0,sizeof(img));
+   img.now = time(NULL);
+   uuid_generate(img.lvm_uuid);
+
+   if ((img.fd = open(path,O_RDWR|O_CREAT|O_TRUNC,0644)) == -1) {
+      perror("open");
+      return(-1);
+   }
+
+   /* Items of the disabled PBC would never be used */
+   if ((mkimg_bitmap_init(&img.fbb,VMFS_BITMAP_MAGIC_FBB,128,2,0,
+                          MKIMG_FB_COUNT) == -1) ||
+       (mkimg_bitmap_init(&img.fdc,VMFS_BITMAP_MAGIC_FDC,32,4,
+                          VMFS_INODE_SIZE,
+                          entries + MKIMG_INODES_EXTRA) == -1) ||
+       (mkimg_bitmap_init(&img.sbc,VMFS_BITMAP_MAGIC_SBC,16,8,
+                          MKIMG_SB_SIZE,256) == -1) ||
+       (mkimg_bitmap_init(&img.pb2,VMFS_BITMAP_MAGIC_PB2,16,1,
+                          MKIMG_SB_SIZE,16) == -1) ||
+       (mkimg_bitmap_init(&img.pbc,VMFS_BITMAP_MAGIC_PBC,16,1,
+                          MKIMG_SB_SIZE,0) == -1))
+      goto done;
+
+   /*
+    * The FDC comes first, right after the heartbeats. The root directory
+    * and the meta files are its first items, read through its first block
+    * while the filesystem is being opened.
+    */
+   img.fbb.next = MKIMG_FDC_BASE;
+
+   for(i=0;i<sizeof(meta_files)/sizeof(meta_files[0]);i++) {
+      b = (struct mkimg_bitmap *)((u_char *)&img + meta_files[i].offset);
+
+      if (mkimg_alloc_fb(&img,b->len / MKIMG_BLOCK_SIZE,&b->fb) == -1)
+         goto done;
+   }
+
+   if (mkimg_dir_create(&img,&root,0,&root_id) == -1)
+      goto done;
+
+   write_le32(root.inode,VMFS_INODE_OFS_NLINK,3);
+
+   for(i=0;i<sizeof(meta_files)/sizeof(meta_files[0]);i++) {
+      if (!(meta_inodes[i] = mkimg_inode_alloc(&img,VMFS_FILE_TYPE_META,0400,
+                                               VMFS_BLK_TYPE_FB,
+                                               MKIMG_BLOCK_SIZE,&id)) ||
+          (mkimg_dir_add(&root,meta_files[i].name,VMFS_FILE_TYPE_META,
+                         id) == -1))
+         goto done;
+   }
+
+   if ((mkimg_create_files(&img,&root) == -1) ||
+       (mkimg_create_large_dir(&img,&root,root_id,entries) == -1) ||
+       (mkimg_dir_store(&img,&root) == -1))
+      goto done;
+
+   /*
+    * Bitmaps are stored last, once all their items are allocated. The FDC
+    * holds the inodes of the others, so it goes after them.
+    */
+   for(i=sizeof(meta_files)/sizeof(meta_files[0]);i-- > 0;) {
+      b = (struct mkimg_bitmap *)((u_char *)&img + meta_files[i].offset);
+
+      if (mkimg_bitmap_store(&img,b,meta_inodes[i]) == -1)
+         goto done;
+   }
+
+   if ((mkimg_write_info(&img) == -1) ||
+       (ftruncate(img.fd,VMFS_VOLINFO_BASE + VMFS_VOL_DATA_OFFSET +
+                  MKIMG_VOL_SIZE) == -1))
+      goto done;
+
+   res = 0;
+
+ done:
+   if (res == -1)
+      fprintf(stderr,"Unable to create synthetic image \"%s\"\n",path);
+
+   mkimg_bitmap_free(&img.fbb);
+   mkimg_bitmap_free(&img.fdc);
+   mkimg_bitmap_free(&img.sbc);
+   mkimg_bitmap_free(&img.pb2);
+   mkimg_bitmap_free(&img.pbc);
+   close(img.fd);
+   return(res);
+}
@@ -28,6 +28,7 @@ ifeq (,$(HAS_DLOPEN))
 $(call LINK_CHECK,dlopen)
 endif
 $(call LINK_CHECK,posix_memalign)
+$(call HEADER_CHECK,io_uring,linux/io_uring.h,IORING_OP_READ)
 
 # Generate cache file
 $(shell ($(foreach var,$(filter-out $(__VARS) __%,$(.VARIABLES)),echo '$(var) = $($(var))';)) > config.cache)
@@ -27,6 +27,9 @@
 #include <pwd.h>
 #include <grp.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include <libgen.h>
 #include "vmfs.h"
 #include "readcmd.h"
@@ -225,42 +228,92 @@ end:
    return ret;
 }
 
+/* Size of the buffer used to copy files */
+#define COPY_FILE_BUFFER_SIZE  (8 * 1024 * 1024)
+
 /* "copy_file" command */
 static int cmd_copy_file(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
-   u_char buffer[4096];
+   const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
+   u_char *buffer;
+   size_t buf_size,len;
+   ssize_t res;
    off_t pos;
-   size_t len;
+   struct stat st;
    vmfs_file_t *output;
-   FILE *input;
+   int input,ret = -1;
    
    if (argc < 2) {
       fprintf(stderr,"Usage: copy_file local_filename vmfs_filename\n");
       return(-1);
    }
 
-   if (!(input = fopen(argv[0],"r"))) {
+   if ((input = open(argv[0],O_RDONLY)) < 0) {
       fprintf(stderr,"Unable to open local file\n");
       return(-1);
    }
 
+   if (fstat(input,&st) < 0)
+      st.st_mode = 0;
+
+   /* Copy whole file blocks at once, from an aligned buffer */
+   buf_size = ALIGN_NUM(COPY_FILE_BUFFER_SIZE,vmfs_fs_get_blocksize(fs));
+
+   if (!(buffer = iobuffer_alloc(buf_size))) {
+      fprintf(stderr,"Unable to allocate memory\n");
+      close(input);
+      return(-1);
+   }
+
    if (!(output = vmfs_file_create_at(base_dir,argv[1],0644))) {
       fprintf(stderr,"Unable to create file.\n");
-      return(-1);
+      goto err_create;
    }
 
+   /* Reserve all the blocks up front when the size is known */
+   if (S_ISREG(st.st_mode) && (st.st_size > 0) &&
+       (res = vmfs_file_fallocate(output,0,st.st_size,0)) < 0)
+   {
+      fprintf(stderr,"Unable to allocate file: %s\n",strerror(-res));
+      goto err_io;
+   }
+
+   posix_fadvise(input,0,0,POSIX_FADV_SEQUENTIAL);
    pos = 0;
 
-   while(!feof(input)) {
-      len = fread(buffer,1,sizeof(buffer),input);
-      if (!len) break;
+   for(;;) {
+      for(len=0;len<buf_size;len+=res)
+         if ((res = read(input,buffer+len,buf_size-len)) <= 0)
+            break;
+
+      if (res < 0) {
+         fprintf(stderr,"Unable to read local file: %s\n",strerror(errno));
+         goto err_io;
+      }
+
+      if (!len)
+         break;
+
+      if ((res = vmfs_file_pwrite(output,buffer,len,pos)) != len) {
+         fprintf(stderr,"Unable to write file: %s\n",
+                 strerror(res < 0 ? -res : EIO));
+         goto err_io;
+      }
 
-      vmfs_file_pwrite(output,buffer,len,pos);
       pos += len;
    }
 
+   /* The local file may have shrunk while being copied */
+   if (pos < vmfs_file_get_size(output))
+      vmfs_file_truncate(output,pos);
+
+   ret = 0;
+ err_io:
    vmfs_file_close(output);
-   return(0);
+ err_create:
+   iobuffer_free(buffer);
+   close(input);
+   return(ret);
 }
 
 /* "chmod" command */
@@ -306,10 +359,14 @@ static int cmd_mkdir(vmfs_dir_t *base_dir,int argc,char *argv[])
 static int cmd_df(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
    const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
+   vmfs_bitmap_t *fbb;
    uint32_t alloc,total;
 
-   total = fs->fbb->bmh.total_items;
-   alloc = vmfs_bitmap_allocated_items(fs->fbb);
+   if (!(fbb = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_FB)))
+      return(-1);
+
+   total = fbb->bmh.total_items;
+   alloc = vmfs_bitmap_allocated_items(fbb);
 
    printf("Block size       : %"PRIu64" bytes\n",vmfs_fs_get_blocksize(fs));
 
@@ -362,20 +419,32 @@ static int cmd_get_file_block(vmfs_dir_t *base_dir,int argc,char *argv[])
 /* Check volume bitmaps */
 static int cmd_check_vol_bitmaps(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
+   static const struct {
+      enum vmfs_block_type type;
+      char *name;
+   } bitmaps[] = {
+      { VMFS_BLK_TYPE_FB, "FBB" },
+      { VMFS_BLK_TYPE_FD, "FDC" },
+      { VMFS_BLK_TYPE_PB, "PBC" },
+      { VMFS_BLK_TYPE_SB, "SBC" },
+   };
    const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
-   int errors = 0;
+   vmfs_bitmap_t *bmp;
+   int i,errors = 0;
 
-   printf("Checking FBB bitmaps...\n");
-   errors += vmfs_bitmap_check(fs->fbb);
+   /* Each bitmap is read in bulk once */
+   vmfs_fs_load_bitmap_snapshots(fs);
 
-   printf("Checking FDC bitmaps...\n");
-   errors += vmfs_bitmap_check(fs->fdc);
+   for(i=0;i<sizeof(bitmaps)/sizeof(bitmaps[0]);i++) {
+      printf("Checking %s bitmaps...\n",bitmaps[i].name);
 
-   printf("Checking PBC bitmaps...\n");
-   errors += vmfs_bitmap_check(fs->pbc);
+      if ((bmp = vmfs_fs_get_bitmap(fs,bitmaps[i].type)))
+         errors += vmfs_bitmap_check(bmp);
+      else
+         errors++;
+   }
 
-   printf("Checking SBC bitmaps...\n");   
-   errors += vmfs_bitmap_check(fs->sbc);
+   vmfs_fs_drop_bitmap_snapshots(fs);
 
    printf("Total errors: %d\n",errors);
    return(errors);
@@ -388,10 +457,29 @@ static int cmd_show_heartbeats(vmfs_dir_t *base_dir,int argc,char *argv[])
    return(vmfs_heartbeat_show_active(fs));
 }
 
+/* Show I/O and cache statistics */
+static int cmd_stats(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
+   size_t len;
+   char *buf;
+
+   len = vmfs_stats_format(fs,NULL,0) + 1;
+
+   if (!(buf = malloc(len)))
+      return(-1);
+
+   vmfs_stats_format(fs,buf,len);
+   fputs(buf,stdout);
+   free(buf);
+   return(0);
+}
+
 /* Read a block */
 static int cmd_read_block(vmfs_dir_t *base_dir,int argc,char *argv[])
 {    
    const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
+   vmfs_bitmap_t *bmp;
    uint64_t blk_id;
    uint32_t blk_type;
    uint64_t blk_size;
@@ -423,23 +511,27 @@ static int cmd_read_block(vmfs_dir_t *base_dir,int argc,char *argv[])
 
          /* Sub-Block */
          case VMFS_BLK_TYPE_SB:
-            vmfs_bitmap_get_item(fs->sbc,VMFS_BLK_SB_ENTRY(blk_id),
+            if (!(bmp = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB)))
+               break;
+            vmfs_bitmap_get_item(bmp,VMFS_BLK_SB_ENTRY(blk_id),
                                  VMFS_BLK_SB_ITEM(blk_id),buf);
-            len = fs->sbc->bmh.data_size;
+            len = bmp->bmh.data_size;
             break;
 
          /* Pointer Block */
          case VMFS_BLK_TYPE_PB:
-            vmfs_bitmap_get_item(fs->pbc,VMFS_BLK_PB_ENTRY(blk_id),
+            if (!(bmp = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB)))
+               break;
+            vmfs_bitmap_get_item(bmp,VMFS_BLK_PB_ENTRY(blk_id),
                                  VMFS_BLK_PB_ITEM(blk_id),buf);
-            len = fs->pbc->bmh.data_size;
+            len = bmp->bmh.data_size;
             break;
 
          /* File Descriptor / Inode */
          case VMFS_BLK_TYPE_FD:
-            vmfs_bitmap_get_item(fs->fdc,VMFS_BLK_FD_ENTRY(blk_id),
+            vmfs_bitmap_get_item(vmfs_fs_get_fdc(fs),VMFS_BLK_FD_ENTRY(blk_id),
                                  VMFS_BLK_FD_ITEM(blk_id),buf);
-            len = fs->fdc->bmh.data_size;
+            len = vmfs_fs_get_fdc(fs)->bmh.data_size;
             break;
 
          default:
@@ -534,6 +626,8 @@ static int cmd_free_block(vmfs_dir_t *base_dir,int argc,char *argv[])
 
 int cmd_show(vmfs_dir_t *base_dir,int argc,char *argv[]);
 
+int cmd_export(vmfs_dir_t *base_dir,int argc,char *argv[]);
+
 int cmd_show_bitmap(const char *path,int argc,char *argv[]);
 
 struct cmd {
@@ -545,6 +639,9 @@ struct cmd {
 /* Opens a shell */
 static int cmd_shell(vmfs_dir_t *base_dir,int argc,char *argv[]);
 
+/* Runs commands from a script or a Unix socket */
+static int cmd_batch(vmfs_dir_t *base_dir,int argc,char *argv[]);
+
 struct cmd cmd_array[] = {
    { "vmfs_version", "show vmfs version", cmd_getVmfsVersion },
    { "cat", "Concatenate files and print on standard output", cmd_cat },
@@ -552,18 +649,21 @@ struct cmd cmd_array[] = {
    { "ls", "List files in specified directory", cmd_ls },
    { "truncate", "Truncate file", cmd_truncate },
    { "copy_file", "Copy a file to VMFS volume", cmd_copy_file },
+   { "export", "Copy a directory tree to the host", cmd_export },
    { "chmod", "Change permissions", cmd_chmod },
    { "mkdir", "Create a directory", cmd_mkdir },
    { "df", "Show available free space", cmd_df },
    { "get_file_block", "Get file block", cmd_get_file_block },
    { "check_vol_bitmaps", "Check volume bitmaps", cmd_check_vol_bitmaps },
    { "show_heartbeats", "Show active heartbeats", cmd_show_heartbeats },
+   { "stats", "Show I/O and cache statistics", cmd_stats },
    { "read_block", "Read a block", cmd_read_block },
    { "alloc_block_fixed", "Allocate block (fixed)", cmd_alloc_block_fixed },
    { "alloc_block", "Find and Allocate a block", cmd_alloc_block },
    { "free_block", "Free block", cmd_free_block },
    { "show", "Display value(s) for the given variable", cmd_show },
    { "shell", "Opens a shell", cmd_shell },
+   { "batch", "Runs commands from a script or a Unix socket", cmd_batch },
 
    { NULL, NULL },
 };
@@ -619,10 +719,85 @@ static int pipe_exec(const char *cmd) {
    }
 }
 
+/* Whether a command is a session of its own, which can't be nested */
+static int cmd_is_session(const struct cmd *cmd)
+{
+   return((cmd->fn == cmd_shell) || (cmd->fn == cmd_batch));
+}
+
+/* 
+ * Executes a command line from a shell or batch session, handling "cd" and
+ * output redirections. Returns the command status, or -1 if it couldn't be
+ * run.
+ */
+static int shell_exec(vmfs_dir_t **cur_dir,const cmd_t *cmdline)
+{
+   struct cmd *cmd;
+   int out = -1;
+   int res;
+
+   if (!strcmp(cmdline->argv[0], "cd")) {
+      vmfs_dir_t *new_dir;
+
+      if (cmdline->argc != 2) {
+         fprintf(stderr, "Usage: cd <filespec>\n");
+         return(-1);
+      }
+      if (!(new_dir = vmfs_dir_open_from_filespec(*cur_dir,
+                                                  cmdline->argv[1]))) {
+         fprintf(stderr, "No such directory: %s\n", cmdline->argv[1]);
+         return(-1);
+      }
+      vmfs_dir_close(*cur_dir);
+      *cur_dir = new_dir;
+      return(0);
+   }
+
+   cmd = cmd_find(cmdline->argv[0]);
+   if (!cmd || cmd_is_session(cmd)) {
+      int i;
+      fprintf(stderr,"Unknown command: %s\n", cmdline->argv[0]);
+      fprintf(stderr,"Available commands:\n");
+      for(i=0;cmd_array[i].name;i++)
+         if (!cmd_is_session(&cmd_array[i]))
+            fprintf(stderr,"  - %s : %s\n",cmd_array[i].name,
+                                           cmd_array[i].description);
+      return(-1);
+   }
+
+   if (cmdline->redir) {
+      int fd;
+      if (cmdline->piped) {
+         if ((fd = pipe_exec(cmdline->redir)) < 0) {
+            fprintf(stderr, "Error executing pipe command: %s\n",
+                    strerror(errno));
+            return(-1);
+         }
+      } else if ((fd = open(cmdline->redir,O_CREAT|O_WRONLY|
+                            (cmdline->append?O_APPEND:O_TRUNC),
+                            0666)) < 0) {
+         fprintf(stderr, "Error opening %s: %s\n",cmdline->redir,
+                                                  strerror(errno));
+         return(-1);
+      }
+      fflush(stdout);
+      out=dup(1);
+      dup2(fd,1);
+      close(fd);
+   }
+   res = cmd->fn(*cur_dir,cmdline->argc-1,&cmdline->argv[1]);
+   if (cmdline->redir) {
+      fflush(stdout);
+      dup2(out,1);
+      close(out);
+      if (cmdline->piped) wait(NULL);
+   }
+   return(res);
+}
+
 /* Opens a shell */
 static int cmd_shell(vmfs_dir_t *base_dir,int argc,char *argv[])
 {
-   struct cmd *cmd = NULL;
    const cmd_t *cmdline = NULL;
    vmfs_dir_t *cur_dir = vmfs_dir_open_at(base_dir,".");
    if (!cur_dir) {
@@ -637,59 +812,7 @@ static int cmd_shell(vmfs_dir_t *base_dir,int argc,char *argv[])
       if (!strcmp(cmdline->argv[0], "exit") ||
           !strcmp(cmdline->argv[0], "quit")) goto cleanup;
 
-      if (!strcmp(cmdline->argv[0], "cd")) {
-         if (cmdline->argc == 2) {
-            vmfs_dir_t *new_dir;
-            if (!(new_dir = vmfs_dir_open_from_filespec(cur_dir,
-                                                        cmdline->argv[1]))) {
-               fprintf(stderr, "No such directory: %s\n", cmdline->argv[1]);
-               continue;
-            }
-            vmfs_dir_close(cur_dir);
-            cur_dir = new_dir;
-         } else {
-            fprintf(stderr, "Usage: cd <filespec>\n");
-         }
-         continue;
-      }
-
-      cmd = cmd_find(cmdline->argv[0]);
-      if (!cmd) {
-        int i;
-        fprintf(stderr,"Unknown command: %s\n", cmdline->argv[0]);
-        fprintf(stderr,"Available commands:\n");
-        for(i=0;cmd_array[i].name;i++)
-           if (cmd_array[i].fn != cmd_shell)
-              fprintf(stderr,"  - %s : %s\n",cmd_array[i].name,
-                                             cmd_array[i].description);
-      } else if (cmd->fn != cmd_shell) {
-        int out = -1;
-        if (cmdline->redir) {
-           int fd;
-           if (cmdline->piped) {
-              if ((fd = pipe_exec(cmdline->redir)) < 0) {
-                 fprintf(stderr, "Error executing pipe command: %s\n",
-                         strerror(errno));
-                 continue;
-              }
-           } else if ((fd = open(cmdline->redir,O_CREAT|O_WRONLY|
-                                 (cmdline->append?O_APPEND:O_TRUNC),
-                                 0666)) < 0) {
-              fprintf(stderr, "Error opening %s: %s\n",cmdline->redir,
-                                                       strerror(errno));
-              continue;
-           }
-           out=dup(1);
-           dup2(fd,1);
-           close(fd);
-        }
-        cmd->fn(cur_dir,cmdline->argc-1,&cmdline->argv[1]);
-        if (cmdline->redir) {
-           dup2(out,1);
-           close(out);
-           if (cmdline->piped) wait(NULL);
-        }
-      }
+      shell_exec(&cur_dir,cmdline);
    } while (1);
 cleanup:
    vmfs_dir_close(cur_dir);
@@ -697,6 +820,213 @@ cleanup:
    return(0);
 }
 
+/* 
+ * Runs the commands read from a stream, one per line, stopping at the end
+ * of the stream or on "exit". Empty lines and lines starting with '#' are
+ * ignored. Returns the number of commands which failed.
+ */
+static int batch_run(vmfs_dir_t *base_dir,FILE *in)
+{
+   const cmd_t *cmdline;
+   vmfs_dir_t *cur_dir;
+   char *line = NULL;
+   size_t len = 0;
+   int failed = 0;
+
+   if (!(cur_dir = vmfs_dir_open_at(base_dir,"."))) {
+      fprintf(stderr, "Couldn't open base directory\n");
+      return(1);
+   }
+
+   while (getline(&line,&len,in) >= 0) {
+      line[strcspn(line,"\r\n")] = 0;
+      if (line[strspn(line," \t")] == '#')
+         continue;
+
+      /* The command takes ownership of the line */
+      cmdline = parsecmd(line);
+      line = NULL;
+      len = 0;
+
+      if (!cmdline)
+         break;
+
+      if (cmdline->argc) {
+         if (!strcmp(cmdline->argv[0], "exit") ||
+             !strcmp(cmdline->argv[0], "quit")) {
+            freecmd(cmdline);
+            break;
+         }
+         if (shell_exec(&cur_dir,cmdline) != 0)
+            failed++;
+         fflush(stdout);
+      }
+      freecmd(cmdline);
+   }
+
+   free(line);
+   vmfs_dir_close(cur_dir);
+   return(failed);
+}
+
+/* Runs the commands sent on a client connection, replying on it */
+static void batch_serve_client(vmfs_dir_t *base_dir,int fd)
+{
+   int out,err;
+   FILE *in;
+
+   if (!(in = fdopen(fd,"r"))) {
+      close(fd);
+      return;
+   }
+
+   fflush(stdout);
+   fflush(stderr);
+   out = dup(1);
+   err = dup(2);
+   dup2(fd,1);
+   dup2(fd,2);
+
+   batch_run(base_dir,in);
+
+   fflush(stdout);
+   fflush(stderr);
+   dup2(out,1);
+   dup2(err,2);
+   close(out);
+   close(err);
+   fclose(in);
+}
+
+/* Accepts and serves client connections, one at a time */
+static int batch_serve(vmfs_dir_t *base_dir,int sock)
+{
+   int fd;
+
+   for(;;) {
+      if ((fd = accept(sock,NULL,NULL)) < 0) {
+         if (errno == EINTR)
+            continue;
+         fprintf(stderr,"accept: %s\n",strerror(errno));
+         return(-1);
+      }
+      batch_serve_client(base_dir,fd);
+   }
+}
+
+/* Listens on a Unix socket and serves clients from "jobs" processes */
+static int batch_listen(vmfs_dir_t *base_dir,const char *path,u_int jobs)
+{
+   struct sockaddr_un addr;
+   u_int i;
+   int sock;
+
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr,"Socket path too long: %s\n",path);
+      return(-1);
+   }
+
+   memset(&addr,0,sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path,path);
+
+   if ((sock = socket(AF_UNIX,SOCK_STREAM,0)) < 0) {
+      fprintf(stderr,"socket: %s\n",strerror(errno));
+      return(-1);
+   }
+
+   unlink(path);
+   if ((bind(sock,(struct sockaddr *)&addr,sizeof(addr)) < 0) ||
+       (listen(sock,SOMAXCONN) < 0)) {
+      fprintf(stderr,"Unable to listen on %s: %s\n",path,strerror(errno));
+      close(sock);
+      return(-1);
+   }
+
+   /* Clients going away must not kill the server */
+   signal(SIGPIPE,SIG_IGN);
+
+   /* Load the meta-files once, before the workers share them */
+   vmfs_fs_open_all_bitmaps(vmfs_dir_get_fs(base_dir));
+
+   if (jobs <= 1)
+      return(batch_serve(base_dir,sock));
+
+   for(i=0;i<jobs;i++) {
+      pid_t p;
+
+      if ((p = fork()) < 0) {
+         fprintf(stderr,"fork: %s\n",strerror(errno));
+         break;
+      }
+      if (p == 0) {
+         /* Device state such as I/O rings can't be shared with the parent */
+         vmfs_device_atfork_child(vmfs_dir_get_fs(base_dir)->dev);
+         exit(batch_serve(base_dir,sock) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+      }
+   }
+
+   while ((wait(NULL) > 0) || (errno == EINTR));
+
+   close(sock);
+   return(-1);
+}
+
+/* Runs commands from a script or a Unix socket */
+static int cmd_batch(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   const char *sock_path = NULL;
+   u_int jobs = 1;
+   FILE *in = stdin;
+   int failed;
+
+   while ((argc >= 2) && (argv[0][0] == '-')) {
+      if (!strcmp(argv[0],"-j"))
+         jobs = strtoul(argv[1],NULL,0);
+      else if (!strcmp(argv[0],"-s"))
+         sock_path = argv[1];
+      else
+         break;
+      argc -= 2;
+      argv += 2;
+   }
+
+   if ((argc > 1) || ((argc == 1) && sock_path) ||
+       ((argc == 1) && (argv[0][0] == '-'))) {
+      fprintf(stderr,"Usage: batch [script]\n"
+                     "       batch [-j jobs] -s socket\n");
+      return(-1);
+   }
+
+   if (sock_path) {
+#ifdef VMFS_WRITE
+      /* Worker processes don't share their caches */
+      if (jobs > 1) {
+         fprintf(stderr,"Parallel jobs are only supported read-only\n");
+         return(-1);
+      }
+#endif
+      return(batch_listen(base_dir,sock_path,jobs));
+   }
+
+   if (jobs > 1) {
+      fprintf(stderr,"Parallel jobs require a socket\n");
+      return(-1);
+   }
+
+   if (argc && !(in = fopen(argv[0],"r"))) {
+      fprintf(stderr,"Unable to open %s: %s\n",argv[0],strerror(errno));
+      return(-1);
+   }
+
+   failed = batch_run(base_dir,in);
+
+   if (in != stdin)
+      fclose(in);
+
+   return(failed ? 1 : 0);
+}
+
 int main(int argc,char *argv[])
 {
    vmfs_fs_t *fs;
@@ -0,0 +1,515 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "vmfs.h"
+
+/* Defined in debugvmfs.c */
+vmfs_dir_t *vmfs_dir_open_from_filespec(vmfs_dir_t *base_dir,
+                                        const char *filespec);
+
+/* Size of the buffer each worker copies files with */
+#define EXPORT_BUFFER_SIZE  (8 * 1024 * 1024)
+
+/* Granularity at which zero-filled data is left out of the output */
+#define EXPORT_SPARSE_SIZE  (64 * 1024)
+
+/* Maximum number of workers */
+#define EXPORT_MAX_THREADS  64
+
+/* Regular file to be copied */
+struct export_file {
+   uint32_t blk_id;
+   uint64_t size;
+   char *path;                /* Destination on the host */
+};
+
+/* Directory whose mode and times are set once its content is copied */
+struct export_dir {
+   mode_t mode;
+   time_t atime,mtime;
+   char *path;                /* Destination on the host */
+};
+
+/* Export shared by all the workers */
+struct export {
+   const vmfs_fs_t *fs;
+   struct export_file *files;
+   u_int file_count,file_max;
+   struct export_dir *dirs;
+   u_int dir_count,dir_max;
+   u_int next_file;
+   uint64_t bytes;            /* Data read from the VMFS */
+   u_int errors;
+};
+
+/* Export worker */
+struct export_worker {
+   struct export *exp;
+   pthread_t thread;
+};
+
+/* Queue a regular file for the workers */
+static int export_add_file(struct export *exp,uint32_t blk_id,
+                           uint64_t size,const char *path)
+{
+   struct export_file *files;
+   u_int max;
+
+   if (exp->file_count == exp->file_max) {
+      max = exp->file_max ? exp->file_max * 2 : 256;
+
+      if (!(files = realloc(exp->files,max * sizeof(*files))))
+         return(-1);
+
+      exp->files = files;
+      exp->file_max = max;
+   }
+
+   if (!(exp->files[exp->file_count].path = strdup(path)))
+      return(-1);
+
+   exp->files[exp->file_count].blk_id = blk_id;
+   exp->files[exp->file_count].size = size;
+   exp->file_count++;
+   return(0);
+}
+
+/* Remember a directory created on the host, see export_restore_dirs() */
+static int export_add_dir(struct export *exp,const struct stat *st,
+                          const char *path)
+{
+   struct export_dir *dirs;
+   u_int max;
+
+   if (exp->dir_count == exp->dir_max) {
+      max = exp->dir_max ? exp->dir_max * 2 : 64;
+
+      if (!(dirs = realloc(exp->dirs,max * sizeof(*dirs))))
+         return(-1);
+
+      exp->dirs = dirs;
+      exp->dir_max = max;
+   }
+
+   if (!(exp->dirs[exp->dir_count].path = strdup(path)))
+      return(-1);
+
+   exp->dirs[exp->dir_count].mode = st->st_mode & 07777;
+   exp->dirs[exp->dir_count].atime = st->st_atime;
+   exp->dirs[exp->dir_count].mtime = st->st_mtime;
+   exp->dir_count++;
+   return(0);
+}
+
+/* 
+ * Give the directories their real mode and times, subdirectories first
+ * since restricting a parent could prevent updating them.
+ */
+static void export_restore_dirs(struct export *exp)
+{
+   struct export_dir *ed;
+   struct timespec times[2];
+   u_int i;
+
+   for(i=exp->dir_count;i>0;i--) {
+      ed = &exp->dirs[i-1];
+
+      times[0].tv_sec = ed->atime;
+      times[0].tv_nsec = 0;
+      times[1].tv_sec = ed->mtime;
+      times[1].tv_nsec = 0;
+
+      if ((utimensat(AT_FDCWD,ed->path,times,0) < 0) ||
+          (chmod(ed->path,ed->mode) < 0))
+      {
+         fprintf(stderr,"Unable to set the status of %s: %s\n",ed->path,
+                 strerror(errno));
+         exp->errors++;
+      }
+   }
+}
+
+/* Recreate a symlink on the host */
+static int export_symlink(struct export *exp,uint32_t blk_id,
+                          const char *path)
+{
+   vmfs_file_t *f;
+   char *target;
+   ssize_t len;
+   int ret = -1;
+
+   if (!(f = vmfs_file_open_from_blkid(exp->fs,blk_id)))
+      return(-1);
+
+   len = vmfs_file_get_size(f);
+
+   if (!(target = malloc(len + 1)))
+      goto done;
+
+   if ((len = vmfs_file_pread(f,(u_char *)target,len,0)) >= 0) {
+      target[len] = 0;
+      ret = symlink(target,path);
+   }
+
+   free(target);
+ done:
+   vmfs_file_close(f);
+   return(ret);
+}
+
+/*
+ * Create the directories of a tree on the host, and queue the regular
+ * files it contains.
+ */
+static int export_walk(struct export *exp,vmfs_dir_t *d,const char *path)
+{
+   const vmfs_dirent_t *entry;
+   vmfs_dir_t *sub;
+   struct stat st;
+   char buf[PATH_MAX];
+
+   while((entry = vmfs_dir_read(d))) {
+      if (!strcmp(entry->name,".") || !strcmp(entry->name,".."))
+         continue;
+
+      if (snprintf(buf,sizeof(buf),"%s/%s",path,entry->name) >= sizeof(buf)) {
+         fprintf(stderr,"Path too long: %s/%s\n",path,entry->name);
+         exp->errors++;
+         continue;
+      }
+
+      if (vmfs_inode_stat_from_blkid(exp->fs,entry->block_id,&st) < 0) {
+         fprintf(stderr,"Unable to get status of %s\n",buf);
+         exp->errors++;
+         continue;
+      }
+
+      switch(entry->type) {
+         case VMFS_FILE_TYPE_DIR:
+            /* 
+             * Keep the directory writable until its content is copied,
+             * export_restore_dirs() then sets its real mode.
+             */
+            if ((mkdir(buf,(st.st_mode & 07777) | S_IRWXU) < 0) &&
+                (errno != EEXIST))
+            {
+               fprintf(stderr,"Unable to create %s: %s\n",buf,strerror(errno));
+               exp->errors++;
+               continue;
+            }
+
+            if (export_add_dir(exp,&st,buf) < 0)
+               return(-1);
+
+            if (!(sub = vmfs_dir_open_from_blkid(exp->fs,entry->block_id))) {
+               fprintf(stderr,"Unable to open directory %s\n",buf);
+               exp->errors++;
+               continue;
+            }
+
+            if (export_walk(exp,sub,buf) < 0) {
+               vmfs_dir_close(sub);
+               return(-1);
+            }
+
+            vmfs_dir_close(sub);
+            break;
+
+         case VMFS_FILE_TYPE_FILE:
+            if (export_add_file(exp,entry->block_id,st.st_size,buf) < 0)
+               return(-1);
+            break;
+
+         case VMFS_FILE_TYPE_SYMLINK:
+            if (export_symlink(exp,entry->block_id,buf) < 0) {
+               fprintf(stderr,"Unable to create symlink %s\n",buf);
+               exp->errors++;
+            }
+            break;
+
+         /* Filesystem metadata are not exported */
+         case VMFS_FILE_TYPE_META:
+            break;
+
+         default:
+            fprintf(stderr,"Skipping %s (type 0x%x)\n",buf,entry->type);
+      }
+   }
+
+   return(0);
+}
+
+/* Check whether a buffer only holds zeroes */
+static inline int export_is_zero(const u_char *buf,size_t len)
+{
+   return(!buf[0] && !memcmp(buf,buf + 1,len - 1));
+}
+
+/* Write a whole buffer at the given position */
+static int export_pwrite(int fd,const u_char *buf,size_t len,off_t pos)
+{
+   ssize_t res;
+
+   for(;len;buf+=res,len-=res,pos+=res)
+      if ((res = pwrite(fd,buf,len,pos)) <= 0)
+         return(-1);
+
+   return(0);
+}
+
+/* Write data read at "pos", leaving out its zero-filled pieces */
+static int export_write(int fd,const u_char *buf,size_t len,off_t pos)
+{
+   size_t i,start,plen;
+
+   for(i=start=0;i<len;i+=plen) {
+      plen = m_min(len - i,EXPORT_SPARSE_SIZE);
+
+      if (!export_is_zero(buf + i,plen))
+         continue;
+
+      if ((i > start) && export_pwrite(fd,buf + start,i - start,pos + start))
+         return(-1);
+
+      start = i + plen;
+   }
+
+   if (len > start)
+      return(export_pwrite(fd,buf + start,len - start,pos + start));
+
+   return(0);
+}
+
+/* Copy a regular file to the host, holes being left unallocated */
+static int export_copy(struct export *exp,struct export_file *ef,
+                       u_char *buf,size_t buf_size)
+{
+   vmfs_file_t *f;
+   struct stat st;
+   struct timespec times[2];
+   off_t pos,next,end;
+   ssize_t res;
+   int fd,ret = -1;
+
+   if (!(f = vmfs_file_open_from_blkid(exp->fs,ef->blk_id)))
+      return(-1);
+
+   vmfs_file_fstat(f,&st);
+
+   if ((fd = open(ef->path,O_WRONLY|O_CREAT|O_TRUNC,st.st_mode & 07777)) < 0)
+      goto err_open;
+
+   end = vmfs_file_get_size(f);
+
+   for(pos=0;pos<end;pos=next) {
+      /* Only -ENXIO means that the rest of the file is a hole */
+      if ((pos = vmfs_file_next_data(f,pos)) == -ENXIO)
+         break;
+
+      if (pos < 0)
+         goto err_io;
+
+      if (pos >= end)
+         break;
+
+      if ((next = vmfs_file_next_hole(f,pos)) < 0)
+         goto err_io;
+
+      if (next > end)
+         next = end;
+
+      for(;pos<next;pos+=res) {
+         res = vmfs_file_pread(f,buf,m_min(next - pos,buf_size),pos);
+
+         if (res <= 0)
+            goto err_io;
+
+         if (export_write(fd,buf,res,pos) < 0)
+            goto err_io;
+
+         __atomic_add_fetch(&exp->bytes,res,__ATOMIC_RELAXED);
+      }
+   }
+
+   /* Trailing holes and zeroes still have to extend the output */
+   if (ftruncate(fd,end) < 0)
+      goto err_io;
+
+   times[0].tv_sec = st.st_atime;
+   times[0].tv_nsec = 0;
+   times[1].tv_sec = st.st_mtime;
+   times[1].tv_nsec = 0;
+   futimens(fd,times);
+
+   ret = 0;
+ err_io:
+   if (close(fd) < 0)
+      ret = -1;
+ err_open:
+   vmfs_file_close(f);
+   return(ret);
+}
+
+/* Copy queued files until there are none left */
+static void *export_worker(void *arg)
+{
+   struct export_worker *w = arg;
+   struct export *exp = w->exp;
+   struct export_file *ef;
+   size_t buf_size;
+   u_char *buf;
+   u_int i;
+
+   buf_size = ALIGN_NUM(EXPORT_BUFFER_SIZE,vmfs_fs_get_blocksize(exp->fs));
+
+   /* Counted, so that the export is not reported as successful */
+   if (!(buf = iobuffer_alloc(buf_size))) {
+      fprintf(stderr,"Unable to allocate memory\n");
+      __atomic_add_fetch(&exp->errors,1,__ATOMIC_RELAXED);
+      return NULL;
+   }
+
+   while((i = __atomic_fetch_add(&exp->next_file,1,__ATOMIC_RELAXED)) <
+         exp->file_count)
+   {
+      ef = &exp->files[i];
+
+      if (export_copy(exp,ef,buf,buf_size) < 0) {
+         fprintf(stderr,"Unable to export %s\n",ef->path);
+         __atomic_add_fetch(&exp->errors,1,__ATOMIC_RELAXED);
+      }
+   }
+
+   iobuffer_free(buf);
+   return NULL;
+}
+
+/* Largest files first, so that they don't end up copied alone */
+static int export_file_cmp(const void *a,const void *b)
+{
+   const struct export_file *fa = a,*fb = b;
+
+   if (fa->size == fb->size)
+      return(0);
+
+   return((fa->size > fb->size) ? -1 : 1);
+}
+
+/* "export" command */
+int cmd_export(vmfs_dir_t *base_dir,int argc,char *argv[])
+{
+   struct export exp;
+   struct export_worker *workers;
+   struct timespec start,stop;
+   vmfs_dir_t *d;
+   double elapsed;
+   u_int i,started,threads = 0;
+   int ret = -1;
+
+   if ((argc >= 2) && (strcmp(argv[0],"-j") == 0)) {
+      threads = strtoul(argv[1],NULL,0);
+      argv += 2;
+      argc -= 2;
+   }
+
+   if (argc != 2) {
+      fprintf(stderr,"Usage: export [-j threads] filespec host_directory\n");
+      return(-1);
+   }
+
+   if (!threads) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = (cpus < 1) ? 1 : cpus;
+   }
+
+   memset(&exp,0,sizeof(exp));
+   exp.fs = vmfs_dir_get_fs(base_dir);
+
+   if (!(d = vmfs_dir_open_from_filespec(base_dir,argv[0]))) {
+      fprintf(stderr,"Unable to open directory %s\n",argv[0]);
+      return(-1);
+   }
+
+   if ((mkdir(argv[1],0755) < 0) && (errno != EEXIST)) {
+      fprintf(stderr,"Unable to create %s: %s\n",argv[1],strerror(errno));
+      goto err_mkdir;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC,&start);
+
+   if (export_walk(&exp,d,argv[1]) < 0) {
+      fprintf(stderr,"Unable to allocate memory\n");
+      goto err_walk;
+   }
+
+   qsort(exp.files,exp.file_count,sizeof(*exp.files),export_file_cmp);
+
+   threads = m_max(m_min(m_min(threads,exp.file_count),EXPORT_MAX_THREADS),1);
+
+   if (!(workers = calloc(threads,sizeof(*workers))))
+      goto err_walk;
+
+   for(i=0;i<threads;i++)
+      workers[i].exp = &exp;
+
+   /* The calling thread acts as the first worker */
+   for(started=1;started<threads;started++)
+      if (pthread_create(&workers[started].thread,NULL,
+                         export_worker,&workers[started]))
+         break;
+
+   export_worker(&workers[0]);
+
+   for(i=1;i<started;i++)
+      pthread_join(workers[i].thread,NULL);
+
+   free(workers);
+
+   export_restore_dirs(&exp);
+
+   clock_gettime(CLOCK_MONOTONIC,&stop);
+   elapsed = (stop.tv_sec - start.tv_sec) +
+             (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+   printf("Exported %u files, %llu bytes in %.2f s (%.1f MB/s, %u threads)\n",
+          exp.file_count,(unsigned long long)exp.bytes,elapsed,
+          elapsed > 0 ? exp.bytes / elapsed / 1048576 : 0.0,started);
+
+   if (exp.errors)
+      fprintf(stderr,"%u errors\n",exp.errors);
+   else
+      ret = 0;
+
+ err_walk:
+   for(i=0;i<exp.file_count;i++)
+      free(exp.files[i].path);
+   free(exp.files);
+   for(i=0;i<exp.dir_count;i++)
+      free(exp.dirs[i].path);
+   free(exp.dirs);
+ err_mkdir:
+   vmfs_dir_close(d);
+   return(ret);
+}
@@ -1,3 +1,3 @@
-LDFLAGS := $(DLOPEN_LDFLAGS)
+LDFLAGS := $(DLOPEN_LDFLAGS) -lpthread
 debugvmfs.o_CFLAGS := -include version
 REQUIRES := libvmfs libreadcmd
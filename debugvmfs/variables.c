@@ -52,6 +52,12 @@ static void *get_inode(void *value, const char *index);
 #define free_inode (void (*)(void *))vmfs_inode_release
 static void *get_lvm(void *value, const char *index);
 #define free_lvm NULL
+static void *get_fbb(void *value, const char *index);
+#define free_fbb NULL
+static void *get_pbc(void *value, const char *index);
+#define free_pbc NULL
+static void *get_sbc(void *value, const char *index);
+#define free_sbc NULL
 
 static char *get_value_none(void *value, short len);
 static char *get_value_uint(void *value, short len);
@@ -210,10 +216,10 @@ static const struct var_member inode[] = {
 static const struct var_member vmfs_fs[] = {
    GET_SUBVAR(vmfs_fs_t, lvm, vmfs_lvm, lvm),
    SUBVAR2(vmfs_fs_t, lvm, vmfs_lvm, dev, PTR),
-   SUBVAR(vmfs_fs_t, fbb, vmfs_bitmap, PTR),
-   SUBVAR(vmfs_fs_t, fdc, vmfs_bitmap, PTR),
-   SUBVAR(vmfs_fs_t, pbc, vmfs_bitmap, PTR),
-   SUBVAR(vmfs_fs_t, sbc, vmfs_bitmap, PTR),
+   GET_SUBVAR(vmfs_fs_t, fbb, vmfs_bitmap, fbb),
+   SUBVAR2(vmfs_fs_t, fdc, vmfs_bitmap, bitmaps[VMFS_BLK_TYPE_FD], PTR),
+   GET_SUBVAR(vmfs_fs_t, pbc, vmfs_bitmap, pbc),
+   GET_SUBVAR(vmfs_fs_t, sbc, vmfs_bitmap, sbc),
    GET_SUBVAR(vmfs_fs_t, blkid, blkid, blkid),
    GET_SUBVAR(vmfs_fs_t, dirent, dirent, dirent),
    GET_SUBVAR(vmfs_fs_t, inode, inode, inode),
@@ -646,7 +652,8 @@ static char *get_value_bitmap_item_dump(void *value, short len)
    if (size == 0) {
       /* If bitmap data size is 0, it is very likely the bitmap is fbb.
          But just in case, we make sure it is */
-      if (ref->bitmap->f->inode->fs->fbb != ref->bitmap)
+      if (vmfs_fs_get_bitmap(ref->bitmap->f->inode->fs,VMFS_BLK_TYPE_FB) !=
+          ref->bitmap)
          return NULL;
       size = vmfs_fs_get_blocksize(ref->bitmap->f->inode->fs);
       is_fbb = true;
@@ -702,7 +709,8 @@ static char *get_value_bitmap_item_blocks(void *value, short len)
 static void *get_pb_bitmap(void *value, const char *index)
 {
    struct vmfs_bitmap_item_ref *ref = (struct vmfs_bitmap_item_ref *) value;
-   if (ref->bitmap->f->inode->fs->pbc != ref->bitmap)
+   if (vmfs_fs_get_bitmap(ref->bitmap->f->inode->fs,VMFS_BLK_TYPE_PB) !=
+       ref->bitmap)
       return NULL;
    return value;
 }
@@ -784,9 +792,14 @@ static void *get_blkid(void *value, const char *index)
    }
    /* Normalize entry and item for fbb */
    if (info->type == VMFS_BLK_TYPE_FB) {
-      vmfs_fs_t *fs = (vmfs_fs_t *)value;
-      info->entry = info->item / fs->fbb->bmh.items_per_bitmap_entry;
-      info->item = info->item % fs->fbb->bmh.items_per_bitmap_entry;
+      vmfs_bitmap_t *fbb = vmfs_fs_get_bitmap((vmfs_fs_t *)value,
+                                              VMFS_BLK_TYPE_FB);
+      if (!fbb) {
+         free(info);
+         return NULL;
+      }
+      info->entry = info->item / fbb->bmh.items_per_bitmap_entry;
+      info->item = info->item % fbb->bmh.items_per_bitmap_entry;
    }
    return info;
 }
@@ -829,15 +842,20 @@ static char *get_value_mode(void *value, short len)
 static char *get_value_blocks(void *value, short len)
 {
    char *buf, *b;
-   int i, num = FIELD(vmfs_inode_t, blocks) / sizeof(uint64_t);
+   int i, num = FIELD(struct vmfs_inode_data, blocks) / sizeof(uint64_t);
 
    vmfs_inode_t *inode = (vmfs_inode_t *) value;
-   while (num > 0 && !inode->blocks[num - 1])
+   struct vmfs_inode_data *data = vmfs_inode_get_data(inode);
+
+   if (!data)
+      return strdup("");
+
+   while (num > 0 && !data->blocks[num - 1])
       num--;
 
    b = buf = malloc(sizeof("0x0000000000000000") * num + 1);
    for (i = 0; i < num; i++) {
-      sprintf(b, "0x%16lx%c", inode->blocks[i], (i + 1) % 4 ? ' ' : '\n');
+      sprintf(b, "0x%16lx%c", data->blocks[i], (i + 1) % 4 ? ' ' : '\n');
       b += sizeof("0x0000000000000000");
    }
 
@@ -874,6 +892,22 @@ static void *get_lvm(void *value, const char *index)
    return NULL;
 }
 
+/* Bitmaps other than the FDC are only opened on first use */
+static void *get_fbb(void *value, const char *index)
+{
+   return vmfs_fs_get_bitmap((vmfs_fs_t *) value, VMFS_BLK_TYPE_FB);
+}
+
+static void *get_pbc(void *value, const char *index)
+{
+   return vmfs_fs_get_bitmap((vmfs_fs_t *) value, VMFS_BLK_TYPE_PB);
+}
+
+static void *get_sbc(void *value, const char *index)
+{
+   return vmfs_fs_get_bitmap((vmfs_fs_t *) value, VMFS_BLK_TYPE_SB);
+}
+
 int show_var(const struct var *root_var, const char *arg)
 {
    int ret = 0;
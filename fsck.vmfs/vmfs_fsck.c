@@ -33,6 +33,7 @@
 /* Forward declarations */
 typedef struct vmfs_dir_map vmfs_dir_map_t;
 typedef struct vmfs_blk_map vmfs_blk_map_t;
+typedef struct vmfs_blk_map_table vmfs_blk_map_table_t;
 
 /* Directory mapping */
 struct vmfs_dir_map {
@@ -50,26 +51,42 @@ struct vmfs_dir_map {
 /* 
  * Block mapping, which allows to keep track of inodes given a block number.
  * Used for troubleshooting/debugging/future fsck.
+ *
+ * Mappings are kept in an open addressing hash table. For inodes, only
+ * the inode ID is kept. For other blocks, the first referencing inode is
+ * kept, further references being stored in arrays taken from an arena.
  */
-#define VMFS_BLK_MAP_BUCKETS     512
+#define VMFS_BLK_MAP_MIN_SLOTS   4096
 #define VMFS_BLK_MAP_MAX_INODES  32
+#define VMFS_BLK_MAP_ARENA_SIZE  0x100000
 
 struct vmfs_blk_map {
-   uint64_t blk_id;
-   union {
-      uint32_t inode_id[VMFS_BLK_MAP_MAX_INODES];
-      vmfs_inode_t inode;
-   };
+   uint64_t blk_id;          /* 0 means the slot is empty */
+   uint32_t inode_id;
+   uint32_t *more_inode_ids; /* VMFS_BLK_MAP_MAX_INODES - 1 entries */
    vmfs_dir_map_t *dir_map;
    u_int ref_count;
    u_int nlink;
    int status;
-   vmfs_blk_map_t *prev,*next;
+};
+
+/* Arena chunk */
+struct vmfs_blk_map_arena {
+   struct vmfs_blk_map_arena *next;
+   size_t used;
+   u_char data[];
+};
+
+struct vmfs_blk_map_table {
+   vmfs_blk_map_t *slots;
+   size_t size;              /* Power of two */
+   size_t count;
+   struct vmfs_blk_map_arena *arena;
 };
 
 typedef struct vmfs_fsck_info vmfs_fsck_info_t;
 struct vmfs_fsck_info {
-   vmfs_blk_map_t *blk_map[VMFS_BLK_MAP_BUCKETS];
+   vmfs_blk_map_table_t blk_map;
    u_int blk_count[VMFS_BLK_TYPE_MAX];
 
    vmfs_dir_map_t *dir_map;
@@ -192,109 +209,341 @@ char *vmfs_dir_map_get_path(vmfs_dir_map_t *map,char *buffer,size_t len)
 }
 
 /* Hash function for a block ID */
-static inline u_int vmfs_block_map_hash(uint64_t blk_id)
+static inline size_t vmfs_block_map_hash(uint64_t blk_id)
+{
+   blk_id *= 0x9e3779b97f4a7c15ULL;
+   return(blk_id ^ (blk_id >> 32));
+}
+
+/* Allocate memory from the arena of a block map table */
+static void *vmfs_block_map_arena_alloc(vmfs_blk_map_table_t *t,size_t len)
+{
+   struct vmfs_blk_map_arena *a = t->arena;
+   void *ptr;
+
+   len = ALIGN_NUM(len,sizeof(void *));
+
+   if (!a || ((a->used + len) > VMFS_BLK_MAP_ARENA_SIZE)) {
+      if (!(a = malloc(sizeof(*a) + VMFS_BLK_MAP_ARENA_SIZE)))
+         return NULL;
+
+      a->next = t->arena;
+      a->used = 0;
+      t->arena = a;
+   }
+
+   ptr = a->data + a->used;
+   a->used += len;
+   return ptr;
+}
+
+/* Free a block map table */
+static void vmfs_block_map_free(vmfs_blk_map_table_t *t)
 {
-   return(blk_id ^ (blk_id >> 5));
+   struct vmfs_blk_map_arena *a,*next;
+
+   for(a=t->arena;a;a=next) {
+      next = a->next;
+      free(a);
+   }
+
+   free(t->slots);
+   memset(t,0,sizeof(*t));
+}
+
+/* Get the slot of a block, or the empty slot where it belongs */
+static inline vmfs_blk_map_t *
+vmfs_block_map_lookup(const vmfs_blk_map_table_t *t,uint64_t blk_id)
+{
+   size_t i;
+
+   for(i=vmfs_block_map_hash(blk_id);;i++) {
+      vmfs_blk_map_t *map = &t->slots[i & (t->size - 1)];
+
+      if ((map->blk_id == blk_id) || !map->blk_id)
+         return map;
+   }
+}
+
+/* Double the size of a block map table */
+static int vmfs_block_map_grow(vmfs_blk_map_table_t *t)
+{
+   vmfs_blk_map_t *old_slots = t->slots;
+   size_t i,old_size = t->size;
+
+   t->size = old_size ? old_size * 2 : VMFS_BLK_MAP_MIN_SLOTS;
+
+   if (!(t->slots = calloc(t->size,sizeof(*t->slots)))) {
+      t->slots = old_slots;
+      t->size = old_size;
+      return(-1);
+   }
+
+   for(i=0;i<old_size;i++)
+      if (old_slots[i].blk_id)
+         *vmfs_block_map_lookup(t,old_slots[i].blk_id) = old_slots[i];
+
+   free(old_slots);
+   return(0);
 }
 
 /* Find a block mapping */
-vmfs_blk_map_t *vmfs_block_map_find(vmfs_blk_map_t **ht,uint64_t blk_id)
+vmfs_blk_map_t *vmfs_block_map_find(const vmfs_blk_map_table_t *t,
+                                    uint64_t blk_id)
 {   
    vmfs_blk_map_t *map;
-   u_int bucket;
 
-   bucket = vmfs_block_map_hash(blk_id) % VMFS_BLK_MAP_BUCKETS;
-
-   for(map=ht[bucket];map;map=map->next)
-      if (map->blk_id == blk_id)
-         return map;
+   if (!t->size)
+      return NULL;
 
-   return NULL;
+   map = vmfs_block_map_lookup(t,blk_id);
+   return(map->blk_id ? map : NULL);
 }
 
-/* Get a block mapping */
-vmfs_blk_map_t *vmfs_block_map_get(vmfs_blk_map_t **ht,uint64_t blk_id)
+/* 
+ * Get a block mapping. Adding mappings may move the existing ones, so the
+ * result is only valid until the next call.
+ */
+vmfs_blk_map_t *vmfs_block_map_get(vmfs_blk_map_table_t *t,uint64_t blk_id)
 {
    vmfs_blk_map_t *map;
-   u_int bucket;
-
-   if ((map = vmfs_block_map_find(ht,blk_id)) != NULL)
-      return map;
 
-   if (!(map = calloc(1,sizeof(*map))))
+   /* Keep the load factor under 3/4 */
+   if (((t->count + 1) * 4 > t->size * 3) && (vmfs_block_map_grow(t) == -1))
       return NULL;
 
-   bucket = vmfs_block_map_hash(blk_id) % VMFS_BLK_MAP_BUCKETS;
-
-   map->blk_id = blk_id;
+   map = vmfs_block_map_lookup(t,blk_id);
 
-   map->prev = NULL;
-   map->next = ht[bucket];
-   ht[bucket] = map;
+   if (!map->blk_id) {
+      map->blk_id = blk_id;
+      t->count++;
+   }
 
    return map;
 }
 
+/* Add an inode referencing a block */
+static void vmfs_block_map_add_ref(vmfs_blk_map_table_t *t,
+                                   vmfs_blk_map_t *map,uint32_t inode_id)
+{
+   if (map->ref_count == 0)
+      map->inode_id = inode_id;
+   else if (map->ref_count < VMFS_BLK_MAP_MAX_INODES) {
+      if (!map->more_inode_ids &&
+          !(map->more_inode_ids =
+            vmfs_block_map_arena_alloc(t,(VMFS_BLK_MAP_MAX_INODES - 1) *
+                                         sizeof(uint32_t))))
+         return;
+
+      map->more_inode_ids[map->ref_count - 1] = inode_id;
+   }
+
+   map->ref_count++;
+}
+
+/* Get the ID of the n-th inode referencing a block */
+static inline uint32_t vmfs_block_map_get_ref(const vmfs_blk_map_t *map,
+                                              u_int n)
+{
+   if (n == 0)
+      return(map->inode_id);
+
+   return(map->more_inode_ids ? map->more_inode_ids[n - 1] : 0);
+}
+
 /* Store block mapping of an inode */
 static void vmfs_fsck_store_block(const vmfs_inode_t *inode,
                                   uint32_t pb_blk,
                                   uint64_t blk_id,
                                   void *opt_arg)
 {
-   vmfs_blk_map_t **ht = opt_arg;
+   vmfs_blk_map_table_t *t = opt_arg;
    vmfs_blk_map_t *map;
 
-   if (!(map = vmfs_block_map_get(ht,blk_id)))
+   if (!(map = vmfs_block_map_get(t,blk_id)))
       return;
-   
-   if (map->ref_count < VMFS_BLK_MAP_MAX_INODES)
-      map->inode_id[map->ref_count] = inode->id;
 
-   map->ref_count++;
-   map->status = vmfs_block_get_status(inode->fs,blk_id);
+   /* The status only needs to be read once */
+   if (map->ref_count == 0)
+      map->status = vmfs_block_get_status(inode->fs,blk_id);
+
+   vmfs_block_map_add_ref(t,map,inode->id);
 }
 
 /* Store inode info */
-static int vmfs_fsck_store_inode(const vmfs_fs_t *fs,vmfs_blk_map_t **ht,
+static int vmfs_fsck_store_inode(const vmfs_fs_t *fs,vmfs_blk_map_table_t *t,
                                  const vmfs_inode_t *inode)
 {
    vmfs_blk_map_t *map;
 
-   if (!(map = vmfs_block_map_get(ht,inode->id)))
+   if (!(map = vmfs_block_map_get(t,inode->id)))
       return(-1);
    
-   memcpy(&map->inode,inode,sizeof(*inode));
+   map->inode_id = inode->id;
    map->status = vmfs_block_get_status(fs,inode->id);
    return(0);
 }
 
-/* Iterate over all inodes of the FS and get all block mappings  */
-int vmfs_fsck_get_all_block_mappings(const vmfs_fs_t *fs,
-                                     vmfs_fsck_info_t *fi)
+/* Merge block mappings collected separately into a single table */
+static void vmfs_fsck_merge_block_maps(vmfs_blk_map_table_t *dst,
+                                       vmfs_blk_map_table_t *src)
 {
-   vmfs_inode_t inode;
-   vmfs_bitmap_header_t *fdc_bmp;
-   uint32_t entry,item;
-   int i;
+   vmfs_blk_map_t *map,*cur;
+   u_int count,j;
+   size_t i;
 
-   fdc_bmp = &fs->fdc->bmh;
+   for(i=0;i<src->size;i++) {
+      map = &src->slots[i];
 
-   printf("Scanning %u FDC entries...\n",fdc_bmp->total_items);
+      if (!map->blk_id || !(cur = vmfs_block_map_get(dst,map->blk_id)))
+         continue;
 
-   for(i=0;i<fdc_bmp->total_items;i++) {
-      entry = i / fdc_bmp->items_per_bitmap_entry;
-      item  = i % fdc_bmp->items_per_bitmap_entry;
+      cur->status = map->status;
 
-      /* Skip undefined/deleted inodes */
-      if ((vmfs_inode_get(fs, VMFS_BLK_FD_BUILD(entry, item, 0), &inode) == -1) ||
-          !inode.nlink)
+      if (VMFS_BLK_TYPE(map->blk_id) == VMFS_BLK_TYPE_FD) {
+         cur->inode_id = map->inode_id;
          continue;
+      }
+
+      count = m_min(map->ref_count,VMFS_BLK_MAP_MAX_INODES);
+      for(j=0;j<count;j++)
+         vmfs_block_map_add_ref(dst,cur,vmfs_block_map_get_ref(map,j));
+
+      cur->ref_count += map->ref_count - count;
+   }
+
+   vmfs_block_map_free(src);
+}
+
+/* Number of inodes read at once when scanning the FDC */
+#define VMFS_FSCK_SCAN_ITEMS  128
+
+/* FDC scan shared by all the workers */
+struct vmfs_fsck_scan {
+   const vmfs_fs_t *fs;
+   u_int next_area;
+};
+
+/* FDC scan worker, collecting block mappings of its own */
+struct vmfs_fsck_worker {
+   struct vmfs_fsck_scan *scan;
+   pthread_t thread;
+   vmfs_blk_map_table_t blk_map;
+};
+
+/* Store the block mappings for the inodes of an FDC area */
+static int vmfs_fsck_scan_area(struct vmfs_fsck_worker *w,u_int area,
+                               u_char *buf,vmfs_inode_t *inode)
+{
+   const vmfs_fs_t *fs = w->scan->fs;
+   vmfs_bitmap_t *fdc = vmfs_fs_get_fdc(fs);
+   const vmfs_bitmap_header_t *fdc_bmp = &fdc->bmh;
+   uint32_t items_per_area,first,count,entry,item;
+   size_t len;
+   u_int i,j;
+
+   items_per_area = fdc_bmp->bmp_entries_per_area *
+                    fdc_bmp->items_per_bitmap_entry;
+   first = area * items_per_area;
+   count = m_min(items_per_area,fdc_bmp->total_items - first);
+
+   for(i=0;i<count;i+=VMFS_FSCK_SCAN_ITEMS) {
+      entry = (first + i) / fdc_bmp->items_per_bitmap_entry;
+      item  = (first + i) % fdc_bmp->items_per_bitmap_entry;
+      len   = m_min(count - i,VMFS_FSCK_SCAN_ITEMS) * fdc_bmp->data_size;
+
+      /* Inodes of an area are stored contiguously */
+      if (vmfs_file_pread(fdc->f,buf,len,
+                          vmfs_bitmap_get_item_pos(fdc,entry,item)) != len)
+         return(-1);
+
+      for(j=0;j<len / fdc_bmp->data_size;j++) {
+         /* Skip undefined/deleted inodes */
+         if ((vmfs_inode_read(inode,buf + (j * fdc_bmp->data_size)) == -1) ||
+             !inode->nlink)
+            continue;
+
+         inode->fs = fs;
+         vmfs_fsck_store_inode(fs,&w->blk_map,inode);
+
+         /* Decode the block list from the buffer already read */
+         if (!vmfs_inode_load_data(inode,buf + (j * fdc_bmp->data_size)))
+            vmfs_inode_foreach_block(inode,vmfs_fsck_store_block,
+                                     &w->blk_map);
+      }
+   }
+
+   return(0);
+}
 
-      inode.fs = fs;
-      vmfs_fsck_store_inode(fs,fi->blk_map,&inode);
-      vmfs_inode_foreach_block(&inode,vmfs_fsck_store_block,fi->blk_map);
+/* Scan FDC areas until there are none left */
+static void *vmfs_fsck_scan_worker(void *arg)
+{
+   struct vmfs_fsck_worker *w = arg;
+   const vmfs_bitmap_t *fdc = vmfs_fs_get_fdc(w->scan->fs);
+   vmfs_inode_t *inode;
+   u_char *buf;
+   u_int area;
+
+   buf = iobuffer_alloc(VMFS_FSCK_SCAN_ITEMS * fdc->bmh.data_size);
+   inode = calloc(1,sizeof(*inode));
+
+   if (buf && inode) {
+      while((area = __atomic_fetch_add(&w->scan->next_area,1,
+                                       __ATOMIC_RELAXED)) <
+            fdc->bmh.area_count)
+      {
+         if (vmfs_fsck_scan_area(w,area,buf,inode) == -1)
+            fprintf(stderr,"Unable to read FDC area %u\n",area);
+      }
    }
 
+   if (inode)
+      vmfs_inode_put_data(inode);
+   free(inode);
+   iobuffer_free(buf);
+   return NULL;
+}
+
+/* 
+ * Iterate over all inodes of the FS and get all block mappings, with
+ * "threads" workers each taking whole FDC areas.
+ */
+int vmfs_fsck_get_all_block_mappings(const vmfs_fs_t *fs,
+                                     vmfs_fsck_info_t *fi,u_int threads)
+{
+   struct vmfs_fsck_scan scan;
+   struct vmfs_fsck_worker *workers;
+   u_int i,started;
+
+   printf("Scanning %u FDC entries...\n",vmfs_fs_get_fdc(fs)->bmh.total_items);
+
+   scan.fs = fs;
+   scan.next_area = 0;
+
+   threads = m_max(m_min(threads,vmfs_fs_get_fdc(fs)->bmh.area_count),1);
+
+   if (!(workers = calloc(threads,sizeof(*workers))))
+      return(-1);
+
+   for(i=0;i<threads;i++)
+      workers[i].scan = &scan;
+
+   /* The calling thread acts as the first worker */
+   for(started=1;started<threads;started++)
+      if (pthread_create(&workers[started].thread,NULL,
+                         vmfs_fsck_scan_worker,&workers[started]))
+         break;
+
+   vmfs_fsck_scan_worker(&workers[0]);
+
+   for(i=1;i<started;i++)
+      pthread_join(workers[i].thread,NULL);
+
+   for(i=0;i<started;i++)
+      vmfs_fsck_merge_block_maps(&fi->blk_map,&workers[i].blk_map);
+
+   free(workers);
    return(0);
 }
 
@@ -306,7 +555,7 @@ void vmfs_fsck_show_inode_id(vmfs_blk_map_t *map)
    inode_count = m_min(map->ref_count,VMFS_BLK_MAP_MAX_INODES);
 
    for(i=0;i<inode_count;i++)
-      printf("0x%8.8x ",map->inode_id[i]);
+      printf("0x%8.8x ",vmfs_block_map_get_ref(map,i));
 
    printf("\n");
 }
@@ -316,10 +565,10 @@ void vmfs_fsck_count_blocks(vmfs_fsck_info_t *fi)
 {
    vmfs_blk_map_t *map;
    u_int blk_type;
-   int i;
+   size_t i;
 
-   for(i=0;i<VMFS_BLK_MAP_BUCKETS;i++) {
-      for(map=fi->blk_map[i];map;map=map->next) {
+   for(i=0;i<fi->blk_map.size;i++) {
+      if ((map = &fi->blk_map.slots[i])->blk_id) {
          blk_type = VMFS_BLK_TYPE(map->blk_id);
 
          if ((blk_type != VMFS_BLK_TYPE_FD) && (map->ref_count > 1)) {
@@ -364,7 +613,7 @@ int vmfs_fsck_walk_dir(const vmfs_fs_t *fs,
    vmfs_dir_seek(dir_entry,0);
 
    while((rec = vmfs_dir_read(dir_entry))) {
-      if (!(map = vmfs_block_map_find(fi->blk_map,rec->block_id))) {
+      if (!(map = vmfs_block_map_find(&fi->blk_map,rec->block_id))) {
          fi->undef_inodes++;
          continue;
       }
@@ -399,15 +648,15 @@ int vmfs_fsck_walk_dir(const vmfs_fs_t *fs,
 void vmfs_fsck_show_orphaned_inodes(vmfs_fsck_info_t *fi)
 {   
    vmfs_blk_map_t *map;
-   int i;
+   size_t i;
 
-   for(i=0;i<VMFS_BLK_MAP_BUCKETS;i++) {
-      for(map=fi->blk_map[i];map;map=map->next) {
+   for(i=0;i<fi->blk_map.size;i++) {
+      if ((map = &fi->blk_map.slots[i])->blk_id) {
          if (VMFS_BLK_TYPE(map->blk_id) != VMFS_BLK_TYPE_FD)
             continue;
 
          if (map->nlink == 0) {
-            printf("Orphaned inode 0x%8.8x\n",map->inode.id);
+            printf("Orphaned inode 0x%8.8x\n",map->inode_id);
             fi->orphaned_inodes++;
          }
       }
@@ -422,7 +671,7 @@ void vmfs_fsck_check_fb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 
    blk_id = VMFS_BLK_FB_BUILD(addr, 0);
 
-   if (!vmfs_block_map_find(fi->blk_map,blk_id)) {
+   if (!vmfs_block_map_find(&fi->blk_map,blk_id)) {
       printf("File Block 0x%8.8lx is lost.\n",blk_id);
       fi->lost_blocks++;
    }
@@ -440,7 +689,7 @@ void vmfs_fsck_check_sb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 
    blk_id = VMFS_BLK_SB_BUILD(entry, item, 0);
 
-   if (!vmfs_block_map_find(fi->blk_map,blk_id)) {
+   if (!vmfs_block_map_find(&fi->blk_map,blk_id)) {
       printf("Sub-Block 0x%8.8lx is lost.\n",blk_id);
       fi->lost_blocks++;
    }
@@ -458,7 +707,7 @@ void vmfs_fsck_check_pb_lost(vmfs_bitmap_t *b,uint32_t addr,void *opt)
 
    blk_id = VMFS_BLK_PB_BUILD(entry, item, 0);
 
-   if (!vmfs_block_map_find(fi->blk_map,blk_id)) {
+   if (!vmfs_block_map_find(&fi->blk_map,blk_id)) {
       printf("Pointer Block 0x%8.8lx is lost.\n",blk_id);
       fi->lost_blocks++;
    }
@@ -524,7 +773,7 @@ static void show_usage(char *prog_name)
    char *name = basename(prog_name);
 
    fprintf(stderr,"%s " VERSION "\n",name);
-   fprintf(stderr,"Syntax: %s <device_name...>\n\n",name);
+   fprintf(stderr,"Syntax: %s [-j threads] <device_name...>\n\n",name);
 }
 
 int main(int argc,char *argv[])
@@ -533,21 +782,44 @@ int main(int argc,char *argv[])
    vmfs_fs_t *fs;
    vmfs_flags_t flags;
    vmfs_dir_t *root_dir;
+   u_int threads = 1;
+   int opt;
+
+   while((opt = getopt(argc,argv,"j:")) != -1) {
+      switch(opt) {
+         case 'j':
+            threads = atoi(optarg);
+            break;
+         default:
+            show_usage(argv[0]);
+            return(0);
+      }
+   }
 
-   if (argc < 2) {
+   if (optind >= argc) {
       show_usage(argv[0]);
       return(0);
    }
 
    flags.packed = 0;
 
-   if (!(fs = vmfs_fs_open(&argv[1], flags))) {
+   if (!(fs = vmfs_fs_open(&argv[optind], flags))) {
       fprintf(stderr,"Unable to open filesystem\n");
       exit(EXIT_FAILURE);
    }
+
+   /* All the bitmaps are walked, open them up front */
+   if (vmfs_fs_open_all_bitmaps(fs) == -1) {
+      fprintf(stderr,"Unable to open filesystem bitmaps\n");
+      exit(EXIT_FAILURE);
+   }
    
+   /* Block status lookups are then answered from memory */
+   if (vmfs_fs_load_bitmap_snapshots(fs) == -1)
+      fprintf(stderr,"Unable to load bitmaps, reading them on demand\n");
+
    vmfs_fsck_init(&fsck_info);
-   vmfs_fsck_get_all_block_mappings(fs,&fsck_info);
+   vmfs_fsck_get_all_block_mappings(fs,&fsck_info,threads);
 
    if (!(root_dir = vmfs_dir_open_from_blkid(fs, VMFS_BLK_FD_BUILD(0, 0, 0)))) {
       fprintf(stderr,"Unable to open root directory\n");
@@ -559,9 +831,12 @@ int main(int argc,char *argv[])
    vmfs_fsck_count_blocks(&fsck_info);
    vmfs_fsck_show_orphaned_inodes(&fsck_info);
 
-   vmfs_bitmap_foreach(fs->fbb,vmfs_fsck_check_fb_lost,&fsck_info);
-   vmfs_bitmap_foreach(fs->sbc,vmfs_fsck_check_sb_lost,&fsck_info);
-   vmfs_bitmap_foreach(fs->pbc,vmfs_fsck_check_pb_lost,&fsck_info);
+   vmfs_bitmap_foreach(vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_FB),
+                       vmfs_fsck_check_fb_lost,&fsck_info);
+   vmfs_bitmap_foreach(vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB),
+                       vmfs_fsck_check_sb_lost,&fsck_info);
+   vmfs_bitmap_foreach(vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB),
+                       vmfs_fsck_check_pb_lost,&fsck_info);
 
    vmfs_fsck_check_dir_all(&fsck_info);
 
@@ -571,6 +846,7 @@ int main(int argc,char *argv[])
    printf("Orphaned inodes    : %u\n",fsck_info.orphaned_inodes);
    printf("Directory errors   : %u\n",fsck_info.dir_struct_errors);
 
+   vmfs_fs_drop_bitmap_snapshots(fs);
    vmfs_fs_close(fs);
    return(0);
 }
@@ -29,11 +29,29 @@
  *       In format version < 2, following 512B are a raw block.
  * 0x01: following chars are the number of blocks (512B) with zeroed data - 1
  *       in a variable-length encoding.
+ * 0x02: In format version >= 4, compressed chunk. Following chars are the
+ *       size of the compressed data in a variable-length encoding, followed
+ *       by the data of the whole chunk compressed in the LZ4 block format.
+ * 0x03: In format version >= 4, duplicated chunk. Following chars are the
+ *       number of a previous 0x02 chunk with the same data, in a
+ *       variable-length encoding.
  * 0x7f: following 4 bytes is the little-endian encoded Adler-32 checksum.
+ *       In format version >= 3, it is the checksum of the current chunk.
+ * 0x7e: In format version >= 3, block index, which is the last sequence.
+ *       Following 8 bytes are the number of blocks in the image, 4 bytes the
+ *       number of blocks per chunk, then 8 bytes for each chunk giving the
+ *       offset of its first sequence in the image. A final 8 bytes give the
+ *       offset of the 0x7e descriptor. All these are little-endian.
  *
+ * In format version >= 3, the blocks are split in chunks, each of which
+ * ends with a 0x7f sequence. No zero-block sequence spans chunks, so that
+ * each chunk can be decoded on its own.
+ *
+ * Format version 4 is only used for compressed images (-c), where a chunk
+ * may also consist of a single 0x02 or 0x03 sequence.
  */
 
-#define FORMAT_VERSION 2
+#define FORMAT_VERSION 4
 
 #ifdef __linux__
 #include <sys/ioctl.h>
@@ -49,6 +67,13 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+#include "vmfs.h"
+#include "lz4.h"
 
 static void die(char *fmt, ...)
 {
@@ -63,7 +88,8 @@ static void show_usage(char *prog_name)
 {
    char *name = basename(prog_name);
 
-   fprintf(stderr, "Syntax: %s [-x|-r] <image>\n",name);
+   fprintf(stderr, "Syntax: %s [-x|-r|-v|-c] <image>\n",name);
+   fprintf(stderr, "        %s -a <device> [<extent>...]\n",name);
 }
 
 static size_t do_reads(void *buf, size_t sz, size_t count)
@@ -84,12 +110,37 @@ static size_t do_reads(void *buf, size_t sz, size_t count)
    return(hlen);
 }
 
+/* Buffered input, for the image parser */
+static struct {
+   u_char buf[1 << 20];
+   size_t pos, len;
+   uint64_t offset;
+} in;
+
 static size_t do_read(void *buf, size_t count)
 {
-   return do_reads(buf, count, 1);
+   size_t hlen = 0, len;
+
+   while (hlen < count) {
+      if (in.pos == in.len) {
+         in.pos = 0;
+         if (!(in.len = do_reads(in.buf, 1, sizeof(in.buf))))
+            break;
+      }
+      len = count - hlen;
+      if (len > in.len - in.pos)
+         len = in.len - in.pos;
+      memcpy(buf + hlen, &in.buf[in.pos], len);
+      in.pos += len;
+      in.offset += len;
+      hlen += len;
+   }
+   if ((hlen > 0) && (hlen != count))
+      die("Short read\n");
+   return(hlen);
 }
 
-static void do_write(const void *buf, size_t count)
+static void do_writes(const void *buf, size_t count)
 {
    ssize_t hlen = 0, len;
 
@@ -106,46 +157,185 @@ static void do_write(const void *buf, size_t count)
       die("Short write\n");
 }
 
+/* Buffered output, flushed before seeking and on exit */
+static struct {
+   u_char buf[1 << 20];
+   size_t len;
+   uint64_t offset;
+} out;
+
+static void flush_output(void)
+{
+   do_writes(out.buf, out.len);
+   out.len = 0;
+}
+
+static void do_write(const void *buf, size_t count)
+{
+   out.offset += count;
+   if (out.len + count > sizeof(out.buf))
+      flush_output();
+   if (count >= sizeof(out.buf)) {
+      do_writes(buf, count);
+      return;
+   }
+   memcpy(&out.buf[out.len], buf, count);
+   out.len += count;
+}
+
 #define BLK_SIZE 512
 
+/* Number of blocks in an image chunk, also handled at once when importing */
+#define CHUNK_BLKS 2048
+#define CHUNK_SIZE (CHUNK_BLKS * BLK_SIZE)
+
 static const u_char const zero_blk[BLK_SIZE] = {0,};
 
 #define ADLER32_MODULO 65521
 
-static struct {
+/* Largest number of bytes that can be summed before sums overflow */
+#define ADLER32_NMAX 5552
+
+struct adler32 {
    uint32_t sum1, sum2;
-} adler32 = { 1, 0 };
+};
+
+#define ADLER32_INIT { 1, 0 }
+
+/* Add bytes to a pair of Adler-32 sums */
+static void adler32_update_c(uint32_t *sum1, uint32_t *sum2,
+                             const u_char *buf, size_t len)
+{
+   uint32_t s1 = *sum1, s2 = *sum2;
+   size_t n;
+
+   while (len) {
+      n = (len < ADLER32_NMAX) ? len : ADLER32_NMAX;
+      len -= n;
+      while (n >= 16) {
+         #define adler32_step s1 += (*buf++); s2 += s1
+         #define fourtimes(stuff) stuff; stuff; stuff; stuff
+         fourtimes(fourtimes(adler32_step));
+         n -= 16;
+      }
+      while (n--) {
+         adler32_step;
+      }
+      s1 %= ADLER32_MODULO;
+      s2 %= ADLER32_MODULO;
+   }
+   *sum1 = s1;
+   *sum2 = s2;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint32_t sum_epi32(__m128i v)
+{
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+   v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+   return _mm_cvtsi128_si32(v);
+}
+
+/* Same, 32 bytes at a time with SSSE3 */
+static __attribute__((target("ssse3")))
+void adler32_update_ssse3(uint32_t *sum1, uint32_t *sum2,
+                          const u_char *buf, size_t len)
+{
+   const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                      24, 23, 22, 21, 20, 19, 18, 17);
+   const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                      8, 7, 6, 5, 4, 3, 2, 1);
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i ones = _mm_set1_epi16(1);
+   uint32_t s1 = *sum1, s2 = *sum2;
+   size_t blocks = len / 32, n;
+
+   len -= blocks * 32;
+   while (blocks) {
+      __m128i v_s1 = zero, v_s2, v_ps, bytes;
+
+      n = (blocks < ADLER32_NMAX / 32) ? blocks : ADLER32_NMAX / 32;
+      blocks -= n;
+      /* Each 32 bytes add 32 times the current s1 to s2 */
+      v_ps = _mm_set_epi32(0, 0, 0, s1 * n);
+      v_s2 = _mm_set_epi32(0, 0, 0, s2);
+      do {
+         v_ps = _mm_add_epi32(v_ps, v_s1);
+         bytes = _mm_loadu_si128((const __m128i *)buf);
+         v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes, zero));
+         v_s2 = _mm_add_epi32(v_s2,
+                   _mm_madd_epi16(_mm_maddubs_epi16(bytes, tap1), ones));
+         bytes = _mm_loadu_si128((const __m128i *)(buf + 16));
+         v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes, zero));
+         v_s2 = _mm_add_epi32(v_s2,
+                   _mm_madd_epi16(_mm_maddubs_epi16(bytes, tap2), ones));
+         buf += 32;
+      } while (--n);
+      v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+      s1 = (s1 + sum_epi32(v_s1)) % ADLER32_MODULO;
+      s2 = sum_epi32(v_s2) % ADLER32_MODULO;
+   }
+   *sum1 = s1;
+   *sum2 = s2;
+   adler32_update_c(sum1, sum2, buf, len);
+}
+#endif
+
+static void (*adler32_update)(uint32_t *sum1, uint32_t *sum2,
+                              const u_char *buf, size_t len) = adler32_update_c;
 
-static void adler32_add(const u_char *buf, size_t blks)
+static void adler32_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   if (__builtin_cpu_supports("ssse3"))
+      adler32_update = adler32_update_ssse3;
+#endif
+}
+
+/* Append the sums of "len" bytes, computed from zero, to a checksum */
+static void adler32_combine(struct adler32 *adler32, uint32_t sum1,
+                            uint32_t sum2, size_t len)
+{
+   adler32->sum2 = (adler32->sum2 + sum2 +
+                    (uint64_t) (len % ADLER32_MODULO) * adler32->sum1) %
+                   ADLER32_MODULO;
+   adler32->sum1 = (adler32->sum1 + sum1) % ADLER32_MODULO;
+}
+
+static void adler32_add(struct adler32 *adler32, const u_char *buf,
+                        size_t blks)
 {
    size_t i;
    if (buf == zero_blk) {
       i = blks;
       while (i >= 65536 / BLK_SIZE) {
-         adler32.sum2 = (adler32.sum2 + 65536 * adler32.sum1) % ADLER32_MODULO;
+         adler32->sum2 = (adler32->sum2 + 65536 * adler32->sum1) % ADLER32_MODULO;
          i -= 65536 / BLK_SIZE;
       }
-      adler32.sum2 = (adler32.sum2 + i * BLK_SIZE * adler32.sum1) % ADLER32_MODULO;
-   } else {
-      uint32_t sum;
-      while(blks--) {
-         for (i = 0, sum = 0; i < BLK_SIZE / 16; i++) {
-            #define adler32_step sum += (*buf++); adler32.sum2 += sum
-            #define fourtimes(stuff) stuff; stuff; stuff; stuff
-            fourtimes(fourtimes(adler32_step));
-         }
-         adler32.sum2 += adler32.sum1 * BLK_SIZE;
-         adler32.sum1 += sum;
+      adler32->sum2 = (adler32->sum2 + i * BLK_SIZE * adler32->sum1) % ADLER32_MODULO;
+   } else
+      adler32_update(&adler32->sum1, &adler32->sum2, buf, blks * BLK_SIZE);
+}
 
-         adler32.sum1 %= ADLER32_MODULO;
-         adler32.sum2 %= ADLER32_MODULO;
-      }
-   }
+static uint32_t adler32_sum(const struct adler32 *adler32)
+{
+   return adler32->sum1 | (adler32->sum2 << 16);
+}
+
+static uint64_t read_le(const u_char *buf, int bytes)
+{
+   uint64_t num = 0;
+   while (bytes--)
+      num = (num << 8) | buf[bytes];
+   return num;
 }
 
-static uint32_t adler32_sum()
+static void write_le(u_char *buf, uint64_t num, int bytes)
 {
-   return adler32.sum1 | (adler32.sum2 << 16);
+   while (bytes--) {
+      *buf++ = num & 0xff;
+      num >>= 8;
+   }
 }
 
 static uint32_t do_read_number(void)
@@ -160,6 +350,7 @@ static uint32_t do_read_number(void)
 static void skip_zero_blocks(size_t blks)
 {
    off_t pos;
+   flush_output();
    if ((pos = lseek(1, BLK_SIZE * (off_t) blks, SEEK_CUR)) == -1)
       die("Seek error\n");
    ftruncate(1, pos);
@@ -175,20 +366,97 @@ static void (*write_zero_blocks)(size_t blks) = write_zero_blocks_;
 
 static void write_blocks(const u_char *buf, size_t blks)
 {
-   adler32_add(buf, blks);
-
    if (buf == zero_blk)
       write_zero_blocks(blks);
    else
       do_write(buf, blks * BLK_SIZE);
 }
 
+static u_int block_used_words(const u_char *buf);
+
+/* Decompress the data of a 0x02 sequence, returns the number of blocks */
+static size_t decompress_chunk(const u_char *cbuf, size_t clen, u_char *data)
+{
+   ssize_t len = lz4_decompress(cbuf, clen, data, CHUNK_SIZE);
+   if ((len <= 0) || (len % BLK_SIZE))
+      die("extract: corrupted chunk\n");
+   return len / BLK_SIZE;
+}
+
+/* Decompress the 0x02 sequence at the given offset of a seekable image */
+static size_t read_chunk_at(uint64_t offset, u_char *cbuf, u_char *data)
+{
+   u_char buf[6];
+   uint32_t num = 0;
+   int i;
+
+   if (pread(0, buf, 6, offset) != 6) {
+      if (errno == ESPIPE)
+         die("extract: duplicated chunks need a seekable image\n");
+      die("Read error\n");
+   }
+   if (buf[0] != 0x02)
+      die("extract: corrupted image\n");
+   for (i = 1; i < 6; i++) {
+      num |= (uint32_t) (buf[i] & 0x7f) << (7 * (i - 1));
+      if (!(buf[i] & 0x80))
+         break;
+   }
+   if ((i == 6) || (num > LZ4_COMPRESS_BOUND(CHUNK_SIZE)) ||
+       (pread(0, cbuf, num, offset + i + 1) != num))
+      die("extract: corrupted image\n");
+   return decompress_chunk(cbuf, num, data);
+}
+
+/* Output decompressed blocks, keeping zeroed blocks apart */
+static void extract_blocks(void (*write_blocks)(const u_char *, size_t),
+                           const u_char *buf, size_t blks)
+{
+   size_t i, n;
+   int zeroed;
+
+   for (i = 0; i < blks; i += n) {
+      zeroed = !block_used_words(buf + i * BLK_SIZE);
+      for (n = 1; (i + n < blks) &&
+                  ((!block_used_words(buf + (i + n) * BLK_SIZE)) == zeroed);
+           n++);
+      write_blocks(zeroed ? zero_blk : buf + i * BLK_SIZE, n);
+   }
+}
+
+/* Check the block index against the chunks found while extracting */
+static void check_index(const uint64_t *chunks, size_t count, uint64_t blks)
+{
+   uint64_t offset = in.offset - 1;
+   u_char buf[12];
+   size_t i;
+
+   do_read(buf, 12);
+   if ((read_le(buf, 8) != blks) ||
+       (count && (read_le(&buf[8], 4) == 0)))
+      die("extract: corrupted index\n");
+
+   for (i = 0; i < count; i++) {
+      do_read(buf, 8);
+      if (read_le(buf, 8) != chunks[i])
+         die("extract: corrupted index\n");
+   }
+   do_read(buf, 8);
+   if ((read_le(buf, 8) != offset) || do_read(buf, 1))
+      die("extract: corrupted index\n");
+}
+
 static void do_extract_(void (*write_blocks)(const u_char *, size_t))
 {
+   struct adler32 adler32 = ADLER32_INIT;
    u_char buf[BLK_SIZE];
    u_char version;
    u_char desc;
    uint32_t num;
+   uint64_t *chunks = NULL, blks = 0;
+   size_t count = 0, size = 0, n;
+   int chunk_start = 1;
+   u_char *data = NULL, *cbuf = NULL;
 
    /* Read file header */
    do_read(buf, 8);
@@ -199,6 +467,17 @@ static void do_extract_(void (*write_blocks)(const u_char *, size_t))
       die("extract: unsupported image format\n");
 
    while (do_read(&desc, 1)) {
+      /* Keep track of the chunks, to check the index */
+      if ((version >= 3) && chunk_start && (desc != 0x7e)) {
+         if (count == size) {
+            size = size ? size * 2 : 1024;
+            if (!(chunks = realloc(chunks, size * sizeof(*chunks))))
+               die("Out of memory\n");
+         }
+         chunks[count++] = in.offset - 1;
+         chunk_start = 0;
+      }
+
       switch (desc) {
       case 0x00:
          if (version >= 2) {
@@ -207,22 +486,63 @@ static void do_extract_(void (*write_blocks)(const u_char *, size_t))
          } else
             num = BLK_SIZE;
          do_read(buf, num);
+         adler32_add(&adler32, buf, 1);
          write_blocks(buf, 1);
+         blks++;
          break;
       case 0x01:
          num = do_read_number();
+         adler32_add(&adler32, zero_blk, num + 1);
          write_blocks(zero_blk, num + 1);
+         blks += num + 1;
+         break;
+      case 0x02:
+      case 0x03:
+         if (version < 4)
+            die("extract: corrupted image\n");
+         if (!data && (!(data = malloc(CHUNK_SIZE)) ||
+                       !(cbuf = malloc(LZ4_COMPRESS_BOUND(CHUNK_SIZE)))))
+            die("Out of memory\n");
+         num = do_read_number();
+         if (desc == 0x02) {
+            if (num > LZ4_COMPRESS_BOUND(CHUNK_SIZE))
+               die("extract: corrupted image\n");
+            do_read(cbuf, num);
+            n = decompress_chunk(cbuf, num, data);
+         } else {
+            /* Only previous chunks can be referenced */
+            if (num + 1 >= count)
+               die("extract: corrupted image\n");
+            n = read_chunk_at(chunks[num], cbuf, data);
+         }
+         adler32_add(&adler32, data, n);
+         extract_blocks(write_blocks, data, n);
+         blks += n;
          break;
       case 0x7f:
          do_read(buf, 4);
          num = buf[0] | buf[1] << 8 | buf[2] << 16 | buf[3] << 24;
-         if (num != adler32_sum())
+         if (num != adler32_sum(&adler32))
             die("extract: checksum mismatch\n");
+         if (version >= 3) {
+            adler32 = (struct adler32) ADLER32_INIT;
+            chunk_start = 1;
+         }
          break;
+      case 0x7e:
+         if (version < 3)
+            die("extract: corrupted image\n");
+         check_index(chunks, count, blks);
+         free(chunks);
+         free(data);
+         free(cbuf);
+         return;
       default:
          die("extract: corrupted image\n");
       }
    }
+   if (version >= 3)
+      die("extract: missing index\n");
 }
 
 static void do_extract(void)
@@ -247,18 +567,46 @@ enum block_type {
    raw,
 };
 
-static enum block_type detect_block_type(const u_char *buf)
+/* Classification of a set of blocks, and their Adler-32 sums from zero */
+struct blocks_info {
+   /* 32-bit words up to the last non-zero one, 0 for zeroed blocks */
+   u_char words[CHUNK_BLKS];
+   uint32_t sum1, sum2;
+};
+
+static u_int block_used_words(const u_char *buf)
 {
+#if defined(__x86_64__) || defined(__i386__)
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i *v = (const __m128i *) buf;
+   u_int i, mask;
+
+   for (i = BLK_SIZE / 16; i; i--) {
+      mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(&v[i - 1]),
+                                              zero)) ^ 0xffff;
+      if (mask)
+         return (i - 1) * 4 + (31 - __builtin_clz(mask)) / 4 + 1;
+   }
+   return 0;
+#else
    int i;
+   for (i = BLK_SIZE / 4; i; i--)
+      if (((uint32_t *)buf)[i - 1])
+         break;
+   return i;
+#endif
+}
 
-   if (buf == NULL)
-      return none;
+static void classify_blocks(const u_char *buf, size_t blks,
+                            struct blocks_info *info)
+{
+   size_t i;
 
-   for (i = 0; i < BLK_SIZE / 8; i++)
-      if (((uint64_t *)buf)[i])
-         return raw;
+   for (i = 0; i < blks; i++)
+      info->words[i] = block_used_words(buf + i * BLK_SIZE);
 
-   return zero;
+   info->sum1 = info->sum2 = 0;
+   adler32_update(&info->sum1, &info->sum2, buf, blks * BLK_SIZE);
 }
 
 static void end_consecutive_blocks(enum block_type type, uint32_t blks)
@@ -269,66 +617,572 @@ static void end_consecutive_blocks(enum block_type type, uint32_t blks)
    }
 }
 
+/* Whether chunks are compressed and deduplicated when importing */
+static int compress = 0;
+
 static void do_init_image(void)
 {
+   /* Uncompressed images are kept readable by older versions */
    const u_char const buf[8] =
-      { 'V', 'M', 'F', 'S', 'I', 'M', 'G', FORMAT_VERSION };
+      { 'V', 'M', 'F', 'S', 'I', 'M', 'G', compress ? FORMAT_VERSION : 3 };
+   do_write(buf, 8);
+}
+
+static enum block_type last = none;
+static uint32_t consecutive = 0;
+
+/* State of the image being written */
+static struct {
+   struct adler32 adler32;
+   uint64_t blks;
+   uint64_t *chunks;
+   size_t count, size;
+} image = { ADLER32_INIT };
+
+static void import_type(enum block_type current)
+{
+   if ((last != none) && (current != last)) {
+      end_consecutive_blocks(last, consecutive);
+      consecutive = 0;
+   }
+   last = current;
+}
+
+/* Get the number of blocks left in the current chunk, starting it if new */
+static size_t import_chunk_left(void)
+{
+   if (image.blks / CHUNK_BLKS == image.count) {
+      if (image.count == image.size) {
+         image.size = image.size ? image.size * 2 : 1024;
+         image.chunks = realloc(image.chunks,
+                                image.size * sizeof(*image.chunks));
+         if (!image.chunks)
+            die("Out of memory\n");
+      }
+      image.chunks[image.count++] = out.offset;
+   }
+   return CHUNK_BLKS - image.blks % CHUNK_BLKS;
+}
+
+static void import_end_chunk(void)
+{
+   uint32_t sum;
+
+   import_type(none);
+   sum = adler32_sum(&image.adler32);
+   do {
+      u_char b[5] = { 0x7f, sum & 0xff, (sum >> 8) & 0xff,
+                      (sum >> 16) & 0xff, (sum >> 24) & 0xff };
+      do_write(b, 5);
+   } while(0);
+   image.adler32 = (struct adler32) ADLER32_INIT;
+}
+
+/* Account for imported blocks, ending the chunk when full */
+static void import_advance(size_t blks)
+{
+   image.blks += blks;
+   if (!(image.blks % CHUNK_BLKS))
+      import_end_chunk();
+}
+
+static void import_zero_blocks(size_t blks)
+{
+   size_t n;
+
+   while (blks) {
+      n = import_chunk_left();
+      if (n > blks)
+         n = blks;
+      import_type(zero);
+      adler32_add(&image.adler32, zero_blk, n);
+      consecutive += n;
+      blks -= n;
+      import_advance(n);
+   }
+}
+
+/*
+ * Import classified blocks, which must not span chunks. The checksum is
+ * updated separately.
+ */
+static void import_classified_blocks(const u_char *buf, const u_char *words,
+                                     size_t blks)
+{
+   size_t i;
+
+   for (i = 0; i < blks; i++, buf += BLK_SIZE) {
+      import_chunk_left();
+      if (!words[i]) {
+         import_type(zero);
+         consecutive++;
+      } else {
+         import_type(raw);
+         do_write("\0", 1);
+         do_write_number(words[i]);
+         do_write(buf, words[i] * 4);
+      }
+      import_advance(1);
+   }
+}
+
+/* Hash of the data of a chunk, used for deduplication */
+static uint64_t chunk_hash(const u_char *buf, size_t len)
+{
+   uint64_t hash = len, word;
+   size_t i;
+
+   for (i = 0; i < len; i += 8) {
+      memcpy(&word, buf + i, 8);
+      hash = (hash ^ word) * 0x100000001b3ULL;
+      hash ^= hash >> 29;
+   }
+   return hash;
+}
+
+/*
+ * Compressed chunks already written, by hash, Adler-32 sums and size. Their
+ * compressed data is kept to check candidates, up to DEDUP_MAX_DATA bytes.
+ */
+#define DEDUP_MAX_DATA (256 << 20)
+
+struct dedup_entry {
+   uint64_t hash;
+   uint32_t sum1, sum2;
+   size_t blks;
+   uint64_t chunk;
+   u_char *cdata;
+   size_t clen;
+};
+
+static struct {
+   struct dedup_entry *entries;
+   size_t size, count, data_size;
+} dedup;
+
+static struct dedup_entry *dedup_find(uint64_t hash, uint32_t sum1,
+                                      uint32_t sum2, size_t blks)
+{
+   struct dedup_entry *e;
+   size_t i;
+
+   for (i = hash & (dedup.size - 1);; i = (i + 1) & (dedup.size - 1)) {
+      e = &dedup.entries[i];
+      if (!e->blks || ((e->hash == hash) && (e->sum1 == sum1) &&
+                       (e->sum2 == sum2) && (e->blks == blks)))
+         return e;
+   }
+}
+
+static void dedup_grow(void)
+{
+   struct dedup_entry *old = dedup.entries;
+   size_t i, size = dedup.size;
+
+   dedup.size = size ? size * 2 : 1024;
+   if (!(dedup.entries = calloc(dedup.size, sizeof(*dedup.entries))))
+      die("Out of memory\n");
+   for (i = 0; i < size; i++)
+      if (old[i].blks)
+         *dedup_find(old[i].hash, old[i].sum1, old[i].sum2,
+                     old[i].blks) = old[i];
+   free(old);
+}
+
+/* End the last chunk and write the block index */
+static void import_end(void)
+{
+   uint64_t offset;
+   u_char buf[12];
+   size_t i;
+
+   if (image.blks % CHUNK_BLKS)
+      import_end_chunk();
+
+   offset = out.offset;
+   do_write("\x7e", 1);
+   write_le(buf, image.blks, 8);
+   write_le(&buf[8], CHUNK_BLKS, 4);
+   do_write(buf, 12);
+   for (i = 0; i < image.count; i++) {
+      write_le(buf, image.chunks[i], 8);
+      do_write(buf, 8);
+   }
+   write_le(buf, offset, 8);
    do_write(buf, 8);
 }
 
 static void import_blocks(const u_char *buf, size_t blks)
 {
-   static enum block_type last = none, current;
-   static uint32_t consecutive = 0;
+   static struct blocks_info info;
+   size_t n;
 
+   if (buf == NULL) {
+      import_end();
+      return;
+   }
+   if (buf == zero_blk) {
+      import_zero_blocks(blks);
+      return;
+   }
    do {
-      current = detect_block_type(buf);
-      if ((last != none) && (current != last)) {
-         end_consecutive_blocks(last, consecutive);
-         consecutive = 0;
+      n = import_chunk_left();
+      if (n > blks)
+         n = blks;
+      classify_blocks(buf, n, &info);
+      adler32_combine(&image.adler32, info.sum1, info.sum2, n * BLK_SIZE);
+      import_classified_blocks(buf, info.words, n);
+      buf += n * BLK_SIZE;
+   } while (blks -= n);
+}
+
+/*
+ * Import pipeline: the main thread reads chunks of blocks, worker threads
+ * classify and checksum them, and a writer thread outputs them in order.
+ * Chunks of data never span image chunks. When compressing, they start
+ * with image chunks, and zeroed blocks in between data are part of them.
+ */
+#define PIPELINE_DEPTH 16
+#define PIPELINE_MAX_WORKERS 8
+
+enum chunk_state {
+   chunk_free,
+   chunk_read,
+   chunk_done,
+};
+
+struct chunk {
+   enum chunk_state state;
+   u_char *buf;
+   size_t blks;
+   /* Zeroed chunks have no data */
+   int zero;
+   struct blocks_info info;
+   /* Compressed data, hash and uncompressed size, when compressing */
+   u_char *cbuf;
+   size_t clen, plain;
+   uint64_t hash;
+};
+
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   struct chunk chunks[PIPELINE_DEPTH];
+   uint64_t filled, next_work;
+   int eof;
+   /* Chunk being filled, pending zeroed blocks, and input position */
+   struct chunk *cur;
+   size_t zero_blks;
+   uint64_t blks;
+} pipeline = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct chunk *pipeline_get_chunk(void)
+{
+   struct chunk *c = &pipeline.chunks[pipeline.filled % PIPELINE_DEPTH];
+
+   pthread_mutex_lock(&pipeline.lock);
+   while (c->state != chunk_free)
+      pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+   pthread_mutex_unlock(&pipeline.lock);
+
+   c->blks = 0;
+   c->zero = 0;
+   return c;
+}
+
+static void pipeline_queue_chunk(struct chunk *c)
+{
+   pthread_mutex_lock(&pipeline.lock);
+   c->state = chunk_read;
+   pipeline.filled++;
+   pthread_cond_broadcast(&pipeline.cond);
+   pthread_mutex_unlock(&pipeline.lock);
+}
+
+static void pipeline_flush(void)
+{
+   struct chunk *c;
+
+   if (pipeline.cur) {
+      pipeline_queue_chunk(pipeline.cur);
+      pipeline.cur = NULL;
+   }
+   if (pipeline.zero_blks) {
+      c = pipeline_get_chunk();
+      c->zero = 1;
+      c->blks = pipeline.zero_blks;
+      pipeline_queue_chunk(c);
+      pipeline.zero_blks = 0;
+   }
+}
+
+/* Read up to "blks" blocks from the input, returns the number read */
+static size_t pipeline_read_blocks(size_t blks)
+{
+   size_t n, len, total = 0;
+
+   if (pipeline.zero_blks) {
+      /* When compressing, zeroed blocks starting the chunk are kept */
+      n = compress ? pipeline.blks % CHUNK_BLKS : 0;
+      if (n > pipeline.zero_blks)
+         n = pipeline.zero_blks;
+      pipeline.zero_blks -= n;
+      pipeline_flush();
+      if (n) {
+         pipeline.cur = pipeline_get_chunk();
+         memset(pipeline.cur->buf, 0, n * BLK_SIZE);
+         pipeline.cur->blks = n;
       }
-      last = current;
-      switch (current) {
-      case zero:
-         if (buf == zero_blk) {
-            if (consecutive > (uint32_t) -blks)
-               end_consecutive_blocks(zero, (uint32_t) -1);
-            adler32_add(zero_blk, blks);
-            consecutive += blks;
-            return;
-         }
-         adler32_add(zero_blk, 1);
-         consecutive++;
+   }
+
+   while (blks) {
+      if (!pipeline.cur)
+         pipeline.cur = pipeline_get_chunk();
+
+      n = CHUNK_BLKS - pipeline.blks % CHUNK_BLKS;
+      if (n > blks)
+         n = blks;
+      len = do_reads(pipeline.cur->buf + pipeline.cur->blks * BLK_SIZE,
+                     BLK_SIZE, n) / BLK_SIZE;
+      pipeline.cur->blks += len;
+      pipeline.blks += len;
+      total += len;
+      blks -= len;
+
+      if (!(pipeline.blks % CHUNK_BLKS)) {
+         pipeline_queue_chunk(pipeline.cur);
+         pipeline.cur = NULL;
+      }
+      if (len < n)
+         break;
+   }
+   return total;
+}
+
+/* Add zeroed blocks */
+static void pipeline_zero_blocks(size_t blks)
+{
+   size_t n;
+
+   /* When compressing, the current chunk is filled with zeroed blocks */
+   if (compress && pipeline.cur) {
+      n = CHUNK_BLKS - pipeline.blks % CHUNK_BLKS;
+      if (n > blks)
+         n = blks;
+      memset(pipeline.cur->buf + pipeline.cur->blks * BLK_SIZE, 0,
+             n * BLK_SIZE);
+      pipeline.cur->blks += n;
+      pipeline.blks += n;
+      blks -= n;
+      if (!(pipeline.blks % CHUNK_BLKS)) {
+         pipeline_queue_chunk(pipeline.cur);
+         pipeline.cur = NULL;
+      }
+   } else if (pipeline.cur)
+      pipeline_flush();
+
+   pipeline.zero_blks += blks;
+   pipeline.blks += blks;
+}
+
+/* Size of a number in the variable-length encoding */
+static size_t number_size(uint32_t num)
+{
+   size_t sz = 1;
+   while (num >>= 7)
+      sz++;
+   return sz;
+}
+
+/* Compress a chunk, unless it only contains zeroed blocks */
+static void compress_chunk(struct chunk *c)
+{
+   size_t i, run = 0;
+
+   /* Size of the chunk without compression */
+   c->plain = 0;
+   for (i = 0; i < c->blks; i++) {
+      if (c->info.words[i]) {
+         if (run)
+            c->plain += 1 + number_size(run - 1);
+         c->plain += 1 + number_size(c->info.words[i]) +
+                     c->info.words[i] * 4;
+         run = 0;
+      } else
+         run++;
+   }
+   if (run == c->blks) {
+      c->zero = 1;
+      return;
+   }
+   if (run)
+      c->plain += 1 + number_size(run - 1);
+
+   c->hash = chunk_hash(c->buf, c->blks * BLK_SIZE);
+   c->clen = lz4_compress(c->buf, c->blks * BLK_SIZE, c->cbuf,
+                          LZ4_COMPRESS_BOUND(CHUNK_SIZE));
+}
+
+/*
+ * Import a compressed chunk, or a reference to a previous one with the same
+ * data. Chunks that don't compress well are imported as is.
+ */
+static void import_compressed_chunk(const struct chunk *c)
+{
+   struct dedup_entry *e;
+
+   adler32_combine(&image.adler32, c->info.sum1, c->info.sum2,
+                   c->blks * BLK_SIZE);
+
+   /* Compressed sequences are whole chunks */
+   if (image.blks % CHUNK_BLKS) {
+      import_classified_blocks(c->buf, c->info.words, c->blks);
+      return;
+   }
+   import_chunk_left();
+   if (dedup.count >= dedup.size * 3 / 4)
+      dedup_grow();
+   e = dedup_find(c->hash, c->info.sum1, c->info.sum2, c->blks);
+
+   /*
+    * Matching sums don't guarantee the same data. Compression being
+    * deterministic, chunks with the same data have the same compressed data.
+    */
+   if (e->blks && (e->clen == c->clen) &&
+       !memcmp(e->cdata, c->cbuf, c->clen)) {
+      do_write("\3", 1);
+      do_write_number(e->chunk);
+   } else if (c->clen + 1 + number_size(c->clen) < c->plain) {
+      if (!e->blks && (dedup.data_size + c->clen <= DEDUP_MAX_DATA) &&
+          (e->cdata = malloc(c->clen))) {
+         memcpy(e->cdata, c->cbuf, c->clen);
+         e->clen = c->clen;
+         e->hash = c->hash;
+         e->sum1 = c->info.sum1;
+         e->sum2 = c->info.sum2;
+         e->blks = c->blks;
+         e->chunk = image.count - 1;
+         dedup.count++;
+         dedup.data_size += c->clen;
+      }
+      do_write("\2", 1);
+      do_write_number(c->clen);
+      do_write(c->cbuf, c->clen);
+   } else {
+      import_classified_blocks(c->buf, c->info.words, c->blks);
+      return;
+   }
+   import_advance(c->blks);
+}
+
+static void *pipeline_worker(void *arg)
+{
+   struct chunk *c;
+
+   pthread_mutex_lock(&pipeline.lock);
+   for (;;) {
+      while ((pipeline.next_work == pipeline.filled) && !pipeline.eof)
+         pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+      if (pipeline.next_work == pipeline.filled)
          break;
-      case raw:
-         do {
-            int i;
-            for (i = BLK_SIZE / 4; i;i--)
-               if (((uint32_t *)buf)[i - 1])
-                  break;
-            do_write("\0", 1);
-            do_write_number(i);
-            do_write(buf, i * 4);
-            adler32_add(buf, 1);
-         } while(0);
+      c = &pipeline.chunks[pipeline.next_work++ % PIPELINE_DEPTH];
+      pthread_mutex_unlock(&pipeline.lock);
+
+      if (!c->zero)
+         classify_blocks(c->buf, c->blks, &c->info);
+      if (compress && !c->zero)
+         compress_chunk(c);
+
+      pthread_mutex_lock(&pipeline.lock);
+      c->state = chunk_done;
+      pthread_cond_broadcast(&pipeline.cond);
+   }
+   pthread_mutex_unlock(&pipeline.lock);
+   return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+   struct chunk *c;
+   uint64_t seq;
+
+   for (seq = 0;; seq++) {
+      c = &pipeline.chunks[seq % PIPELINE_DEPTH];
+
+      pthread_mutex_lock(&pipeline.lock);
+      while ((c->state != chunk_done) &&
+             !(pipeline.eof && (seq == pipeline.filled)))
+         pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+      pthread_mutex_unlock(&pipeline.lock);
+
+      if (c->state != chunk_done)
          break;
-      case none:
-         do {
-            uint32_t sum = adler32_sum();
-            u_char b[5] = { 0x7f, sum & 0xff, (sum >> 8) & 0xff,
-                            (sum >> 16) & 0xff, (sum >> 24) & 0xff };
-            do_write(b, 5);
-         } while(0);
-         return;
+
+      if (c->zero)
+         import_zero_blocks(c->blks);
+      else if (compress)
+         import_compressed_chunk(c);
+      else {
+         adler32_combine(&image.adler32, c->info.sum1, c->info.sum2,
+                         c->blks * BLK_SIZE);
+         import_classified_blocks(c->buf, c->info.words, c->blks);
       }
-      buf += BLK_SIZE;
-   } while (--blks);
+
+      pthread_mutex_lock(&pipeline.lock);
+      c->state = chunk_free;
+      pthread_cond_broadcast(&pipeline.cond);
+      pthread_mutex_unlock(&pipeline.lock);
+   }
+   import_end();
+   return NULL;
+}
+
+static int pipeline_start(pthread_t *threads)
+{
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   int i, workers;
+
+   workers = (cpus < 1) ? 1 : (cpus > PIPELINE_MAX_WORKERS) ?
+             PIPELINE_MAX_WORKERS : cpus;
+
+   for (i = 0; i < PIPELINE_DEPTH; i++)
+      if (posix_memalign((void **)&pipeline.chunks[i].buf, 4096,
+                         CHUNK_SIZE) ||
+          (compress && !(pipeline.chunks[i].cbuf =
+                            malloc(LZ4_COMPRESS_BOUND(CHUNK_SIZE)))))
+         die("Out of memory\n");
+
+   if (pthread_create(&threads[0], NULL, pipeline_writer, NULL))
+      die("Unable to create thread\n");
+   for (i = 1; i <= workers; i++)
+      if (pthread_create(&threads[i], NULL, pipeline_worker, NULL))
+         die("Unable to create thread\n");
+   return workers + 1;
+}
+
+static void pipeline_finish(pthread_t *threads, int count)
+{
+   int i;
+
+   pipeline_flush();
+
+   pthread_mutex_lock(&pipeline.lock);
+   pipeline.eof = 1;
+   pthread_cond_broadcast(&pipeline.cond);
+   pthread_mutex_unlock(&pipeline.lock);
+
+   for (i = 0; i < count; i++)
+      pthread_join(threads[i], NULL);
+   for (i = 0; i < PIPELINE_DEPTH; i++) {
+      free(pipeline.chunks[i].buf);
+      free(pipeline.chunks[i].cbuf);
+   }
 }
 
 static void do_import(void)
 {
-   u_char buf[BLK_SIZE * 16];
-   size_t len;
+   pthread_t threads[PIPELINE_MAX_WORKERS + 1];
+   int count;
 #ifdef __linux__
    struct stat st;
    int blocksize = 0;
@@ -341,32 +1195,334 @@ static void do_import(void)
 #endif
 
    do_init_image();
+   count = pipeline_start(threads);
 
 #ifdef __linux__
    if (blocksize) {
       uint32_t i, max = filesize / blocksize;
+      off_t pos = lseek(0, 0, SEEK_CUR);
       for (i = 0; i < max; i++) {
          uint32_t block = i;
          if (ioctl(0, FIBMAP, &block) < 0)
             goto fallback;
          if (block) {
-            lseek(0, (off_t) i * blocksize, SEEK_SET);
-            len = do_reads(buf, BLK_SIZE, blocksize / BLK_SIZE);
-            import_blocks(buf, len / BLK_SIZE);
+            /* Consecutive blocks are read without seeking */
+            if (pos != (off_t) i * blocksize)
+               lseek(0, (off_t) i * blocksize, SEEK_SET);
+            pos = (off_t) (i + 1) * blocksize;
+            pipeline_read_blocks(blocksize / BLK_SIZE);
          } else
-            import_blocks(zero_blk, blocksize / BLK_SIZE);
+            pipeline_zero_blocks(blocksize / BLK_SIZE);
       }
       if (filesize % blocksize)
-         import_blocks(zero_blk, (filesize % blocksize) / BLK_SIZE);
-      import_blocks(NULL, 0);
+         pipeline_zero_blocks((filesize % blocksize) / BLK_SIZE);
+      pipeline_finish(threads, count);
       return;
    }
 fallback:
 #endif
-   while ((len = do_reads(buf, BLK_SIZE, 16)))
-      import_blocks(buf, len / BLK_SIZE);
+   while (pipeline_read_blocks(CHUNK_BLKS));
 
-   import_blocks(NULL, 0);
+   pipeline_finish(threads, count);
+}
+
+/*
+ * Allocation-aware import: only the volume headers, the metadata, the
+ * blocks allocated in the VMFS bitmaps and the large file blocks referenced
+ * by inodes are read from the device, the rest being imported as zeroed
+ * blocks.
+ */
+static struct {
+   const vmfs_fs_t *fs;
+   const vmfs_volume_t *extent;
+   /* Device ranges to read */
+   struct range {
+      uint64_t start, end;
+   } *ranges;
+   size_t count, size;
+   /* Sorted file blocks of the meta-files only partially imported */
+   uint32_t *meta_blks;
+   size_t meta_count, meta_size;
+} alloc;
+
+/* Add a range of the device to read */
+static void alloc_add_range(uint64_t start, uint64_t len)
+{
+   struct range *last = alloc.count ? &alloc.ranges[alloc.count - 1] : NULL;
+
+   /* Ranges of a file are mostly added in order */
+   if (last && (last->end == (start & ~((uint64_t) BLK_SIZE - 1)))) {
+      last->end = ALIGN_NUM(start + len, BLK_SIZE);
+      return;
+   }
+   if (alloc.count == alloc.size) {
+      alloc.size = alloc.size ? alloc.size * 2 : 1024;
+      alloc.ranges = realloc(alloc.ranges, alloc.size * sizeof(*alloc.ranges));
+      if (!alloc.ranges)
+         die("Out of memory\n");
+   }
+   alloc.ranges[alloc.count].start = start & ~((uint64_t) BLK_SIZE - 1);
+   alloc.ranges[alloc.count].end = ALIGN_NUM(start + len, BLK_SIZE);
+   alloc.count++;
+}
+
+/* Add a range of the logical volume, if it is on the imaged extent */
+static void alloc_add_logical(uint64_t pos, uint64_t len)
+{
+   const vmfs_volinfo_t *info = &alloc.extent->vol_info;
+   uint64_t first = (uint64_t) info->first_segment * VMFS_LVM_SEGMENT_SIZE;
+   uint64_t last = (uint64_t) (info->last_segment + 1) * VMFS_LVM_SEGMENT_SIZE;
+
+   if (pos < first) {
+      if (pos + len <= first)
+         return;
+      len -= first - pos;
+      pos = first;
+   }
+   if (pos >= last)
+      return;
+   if (pos + len > last)
+      len = last - pos;
+   alloc_add_range(pos - first + alloc.extent->vmfs_base +
+                   VMFS_VOL_DATA_OFFSET, len);
+}
+
+/* Add a range of a meta-file, calling "blk_cbk" for each of its blocks */
+static void alloc_add_file_range(const vmfs_file_t *f, uint64_t pos,
+                                 uint64_t len, void (*blk_cbk)(uint32_t))
+{
+   uint64_t blk_size = vmfs_fs_get_blocksize(alloc.fs), blk_id, n;
+   uint32_t item;
+
+   while (len) {
+      n = blk_size - pos % blk_size;
+      if (n > len)
+         n = len;
+      if (vmfs_inode_get_block(f->inode, pos, &blk_id) < 0)
+         die("Unable to map meta-file block\n");
+      switch (VMFS_BLK_TYPE(blk_id)) {
+      case VMFS_BLK_TYPE_FB:
+      case VMFS_BLK_TYPE_PB2:
+         item = VMFS_BLK_FB_ITEM(blk_id);
+         if (blk_cbk)
+            blk_cbk(item);
+         else
+            alloc_add_logical(item * blk_size + pos % blk_size, n);
+         break;
+      case VMFS_BLK_TYPE_NONE:
+         break;
+      default:
+         die("Unexpected meta-file block type\n");
+      }
+      pos += n;
+      len -= n;
+   }
+}
+
+static void alloc_add_meta_blk(uint32_t item)
+{
+   if (alloc.meta_count == alloc.meta_size) {
+      alloc.meta_size = alloc.meta_size ? alloc.meta_size * 2 : 1024;
+      alloc.meta_blks = realloc(alloc.meta_blks,
+                                alloc.meta_size * sizeof(*alloc.meta_blks));
+      if (!alloc.meta_blks)
+         die("Out of memory\n");
+   }
+   alloc.meta_blks[alloc.meta_count++] = item;
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+   return (x > y) - (x < y);
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+   const struct range *x = a, *y = b;
+   return (x->start > y->start) - (x->start < y->start);
+}
+
+/* Add an allocated item of a meta-file bitmap */
+static void alloc_add_item(vmfs_bitmap_t *b, uint32_t addr, void *opt_arg)
+{
+   uint32_t entry = addr / b->bmh.items_per_bitmap_entry;
+   uint32_t item = addr % b->bmh.items_per_bitmap_entry;
+
+   alloc_add_file_range(b->f, vmfs_bitmap_get_item_pos(b, entry, item),
+                        b->bmh.data_size, NULL);
+}
+
+/* Add an allocated file block, unless it belongs to a meta-file */
+static void alloc_add_fb(vmfs_bitmap_t *b, uint32_t addr, void *opt_arg)
+{
+   uint64_t blk_size = vmfs_fs_get_blocksize(alloc.fs);
+
+   if (!bsearch(&addr, alloc.meta_blks, alloc.meta_count,
+                sizeof(*alloc.meta_blks), cmp_uint32))
+      alloc_add_logical(addr * blk_size, blk_size);
+}
+
+/*
+ * Add the large file blocks of an allocated inode. They are not tracked in
+ * the FBB, and are read like vmfs_block_read_lfb() does.
+ */
+static void alloc_add_inode_lfb(vmfs_bitmap_t *b, uint32_t addr,
+                                void *opt_arg)
+{
+   uint32_t entry = addr / b->bmh.items_per_bitmap_entry;
+   uint32_t item = addr % b->bmh.items_per_bitmap_entry;
+   uint64_t blk_size = vmfs_fs_get_blocksize(alloc.fs), blk_id, n;
+   vmfs_inode_t *inode;
+   off_t pos;
+
+   inode = vmfs_inode_acquire(alloc.fs, VMFS_BLK_FD_BUILD(entry, item, 0));
+   if (!inode)
+      die("Unable to read inode 0x%x\n", addr);
+   if (inode->blk_size) {
+      for (pos = 0; pos < inode->size; pos += n) {
+         n = m_min(inode->blk_size - pos % inode->blk_size,
+                   inode->size - pos);
+         if (vmfs_inode_get_block(inode, pos, &blk_id) < 0)
+            die("Unable to map block of inode 0x%x\n", addr);
+         if (VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_LFB)
+            alloc_add_logical(VMFS_BLK_FB_ITEM(blk_id) * blk_size +
+                              pos % LARGE_BLOCK_SIZE, n);
+      }
+   }
+   vmfs_inode_release(inode);
+}
+
+/* Add the header, bitmap entries and allocated items of a meta-file */
+static void alloc_add_bitmap(vmfs_bitmap_t *b)
+{
+   const vmfs_bitmap_header_t *bmh = &b->bmh;
+   u_int i;
+
+   alloc_add_file_range(b->f, 0, bmh->hdr_size, NULL);
+   for (i = 0; i < bmh->area_count; i++)
+      alloc_add_file_range(b->f, bmh->hdr_size + (uint64_t) i * bmh->area_size,
+                           bmh->bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE,
+                           NULL);
+   vmfs_bitmap_foreach(b, alloc_add_item, NULL);
+}
+
+/* Find the extent corresponding to the imaged device */
+static const vmfs_volume_t *alloc_get_extent(const vmfs_fs_t *fs,
+                                             const char *device)
+{
+   const vmfs_lvm_t *lvm = (const vmfs_lvm_t *) fs->dev;
+   int i;
+
+   if (!vmfs_device_is_lvm(fs->dev))
+      return NULL;
+   for (i = 0; i < lvm->loaded_extents; i++)
+      if (!strcmp(lvm->extents[i]->device, device))
+         return lvm->extents[i];
+   return NULL;
+}
+
+/* Build the sorted and merged list of the device ranges to import */
+static void alloc_build_ranges(void)
+{
+   const vmfs_fs_t *fs = alloc.fs;
+   vmfs_bitmap_t *meta[] = {
+      vmfs_fs_get_bitmap(fs, VMFS_BLK_TYPE_SB),
+      vmfs_fs_get_bitmap(fs, VMFS_BLK_TYPE_PB),
+      vmfs_fs_get_bitmap(fs, VMFS_BLK_TYPE_PB2),
+      vmfs_fs_get_fdc(fs),
+   };
+   size_t i, j;
+
+   /* Partition table and LVM headers */
+   alloc_add_range(0, alloc.extent->vmfs_base + VMFS_VOL_DATA_OFFSET);
+
+   /* Filesystem information and heartbeats */
+   alloc_add_logical(0, VMFS_HB_BASE + VMFS_HB_NUM * VMFS_HB_SIZE);
+
+   /* Meta-files holding sub-blocks, pointer blocks and inodes */
+   for (i = 0; i < sizeof(meta) / sizeof(meta[0]); i++) {
+      if (!meta[i] || !meta[i]->bmh.total_items)
+         continue;
+      alloc_add_file_range(meta[i]->f, 0, vmfs_file_get_size(meta[i]->f),
+                           alloc_add_meta_blk);
+      alloc_add_bitmap(meta[i]);
+   }
+   qsort(alloc.meta_blks, alloc.meta_count, sizeof(*alloc.meta_blks),
+         cmp_uint32);
+
+   /* Other allocated file blocks */
+   vmfs_bitmap_foreach(vmfs_fs_get_bitmap(fs, VMFS_BLK_TYPE_FB),
+                       alloc_add_fb, NULL);
+
+   /* Large file blocks, only known from the inodes referencing them */
+   vmfs_bitmap_foreach(vmfs_fs_get_fdc(fs), alloc_add_inode_lfb, NULL);
+
+   qsort(alloc.ranges, alloc.count, sizeof(*alloc.ranges), cmp_range);
+   for (i = 0, j = 1; j < alloc.count; j++) {
+      if (alloc.ranges[j].start <= alloc.ranges[i].end) {
+         if (alloc.ranges[j].end > alloc.ranges[i].end)
+            alloc.ranges[i].end = alloc.ranges[j].end;
+      } else
+         alloc.ranges[++i] = alloc.ranges[j];
+   }
+   if (alloc.count)
+      alloc.count = i + 1;
+}
+
+static void do_import_allocated(char **paths)
+{
+   pthread_t threads[PIPELINE_MAX_WORKERS + 1];
+   vmfs_flags_t flags;
+   uint64_t pos = 0, end, size;
+   vmfs_fs_t *fs;
+   int count, fd;
+   size_t i;
+
+   /* libvmfs reports on the standard output, which holds the image */
+   if (((fd = dup(1)) == -1) || (dup2(2, 1) == -1))
+      die("Unable to redirect output\n");
+   flags.packed = 0;
+   fs = vmfs_fs_open(paths, flags);
+   fflush(stdout);
+   dup2(fd, 1);
+   close(fd);
+
+   if (!fs)
+      die("Unable to open filesystem\n");
+   if (vmfs_fs_open_all_bitmaps(fs) == -1)
+      die("Unable to open filesystem bitmaps\n");
+   alloc.fs = fs;
+   if (!(alloc.extent = alloc_get_extent(fs, paths[0])))
+      die("Unable to find the extent on %s\n", paths[0]);
+   alloc_build_ranges();
+
+   if ((size = lseek(0, 0, SEEK_END)) == (uint64_t) -1)
+      die("Seek error\n");
+   size &= ~((uint64_t) BLK_SIZE - 1);
+
+   do_init_image();
+   count = pipeline_start(threads);
+
+   for (i = 0; (i < alloc.count) && (alloc.ranges[i].start < size); i++) {
+      end = m_min(alloc.ranges[i].end, size);
+      if (alloc.ranges[i].start > pos)
+         pipeline_zero_blocks((alloc.ranges[i].start - pos) / BLK_SIZE);
+      pos = alloc.ranges[i].start;
+      if (lseek(0, pos, SEEK_SET) == -1)
+         die("Seek error\n");
+      if (pipeline_read_blocks((end - pos) / BLK_SIZE) !=
+          (end - pos) / BLK_SIZE)
+         die("Short read\n");
+      pos = end;
+   }
+   if (pos < size)
+      pipeline_zero_blocks((size - pos) / BLK_SIZE);
+
+   pipeline_finish(threads, count);
+   vmfs_fs_close(fs);
+   free(alloc.ranges);
+   free(alloc.meta_blks);
 }
 
 static void do_reimport(void)
@@ -378,9 +1534,13 @@ static void do_reimport(void)
    import_blocks(NULL, 0);
 }
 
+static void verify_blocks(const u_char *buf, size_t blks)
+{
+}
+
 static void do_verify(void)
 {
-   do_extract_(adler32_add);
+   do_extract_(verify_blocks);
 }
 
 int main(int argc,char *argv[])
@@ -388,7 +1548,18 @@ int main(int argc,char *argv[])
    char *arg = NULL;
    void (*func)(void) = do_import;
    struct stat st;
+   char **paths = NULL;
 
+   if ((argc > 1) && !strcmp(argv[1],"-a")) {
+      /* Devices holding the other extents of the volume may follow */
+      if (argc < 3) {
+         show_usage(argv[0]);
+         return(0);
+      }
+      paths = &argv[2];
+      arg = argv[2];
+      argc = 1;
+   }
    if (argc > 1) {
       if (strcmp(argv[1],"-x") == 0) {
          func = do_extract;
@@ -399,9 +1570,12 @@ int main(int argc,char *argv[])
       } else if (strcmp(argv[1],"-v") == 0) {
          func = do_verify;
          argc--;
+      } else if (strcmp(argv[1],"-c") == 0) {
+         compress = 1;
+         argc--;
       }
       if (argc == 2)
-         arg = argv[(func == do_import) ? 1 : 2];
+         arg = argv[((func == do_import) && !compress) ? 1 : 2];
    }
    if (argc > 2) {
       show_usage(argv[0]);
@@ -422,6 +1596,11 @@ int main(int argc,char *argv[])
        ((st.st_size == 0) || !(fcntl(1, F_GETFL) & O_APPEND)))
       write_zero_blocks = skip_zero_blocks;
 
-   func();
+   adler32_init();
+   if (paths)
+      do_import_allocated(paths);
+   else
+      func();
+   flush_output();
    return(0);
 }
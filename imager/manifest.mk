@@ -1 +1,2 @@
 imager_OPTIONS := noinst
+REQUIRES := libvmfs
@@ -78,7 +78,6 @@ const cmd_t *readcmd(const char *prompt)
 {
    char *buf;
    int i;
-   cmd_t *cmd = NULL;
    if (!isatty(fileno(stdin)))
       prompt = NULL;
    if (!(buf = readline(prompt))) {
@@ -87,11 +86,22 @@ const cmd_t *readcmd(const char *prompt)
       return NULL;
    }
    for(i=strlen(buf)-1;(i>=0)&&(buf[i]==' ');buf[i--]=0);
+   if (buf[0])
+      add_history(buf);
+
+   return parsecmd(buf);
+}
+
+/* Return the command held in a line, taking ownership of the buffer */
+const cmd_t *parsecmd(char *buf)
+{
+   int i;
+   cmd_t *cmd = NULL;
+   for(i=strlen(buf)-1;(i>=0)&&(buf[i]==' ');buf[i--]=0);
    if (buf[0]==0) {
       free(buf);
       return &empty_cmd;
    }
-   add_history(buf);
 
    cmd = calloc(sizeof(cmd_t),1);
    cmd->buf = buf;
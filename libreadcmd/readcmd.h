@@ -34,5 +34,8 @@ char *local_readline(const char *prompt);
 /* Return a command after having prompted for it */
 const cmd_t *readcmd(const char *prompt);
 
+/* Return the command held in a line, taking ownership of the buffer */
+const cmd_t *parsecmd(char *buf);
+
 /* Free a command */
 void freecmd(const cmd_t *cmd);
@@ -0,0 +1,217 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Minimal LZ4 block format implementation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_HASH_BITS     14
+#define LZ4_MIN_MATCH     4
+#define LZ4_MAX_OFFSET    65535
+
+/* The last match must start before, and the last 5 bytes be literals */
+#define LZ4_MF_LIMIT      12
+#define LZ4_LAST_LITERALS 5
+
+static inline uint32_t lz4_read32(const u_char *p)
+{
+   uint32_t v;
+   memcpy(&v,p,sizeof(v));
+   return(v);
+}
+
+static inline uint32_t lz4_hash(uint32_t seq)
+{
+   return((seq * 2654435761U) >> (32 - LZ4_HASH_BITS));
+}
+
+/* Write a length using the 255-byte continuation encoding */
+static inline u_char *lz4_write_length(u_char *op,size_t len)
+{
+   while(len >= 255) {
+      *op++ = 255;
+      len -= 255;
+   }
+   *op++ = len;
+   return(op);
+}
+
+/* Write a sequence: literals followed by an optional match */
+static u_char *lz4_write_sequence(u_char *op,u_char *oend,
+                                  const u_char *lit,size_t lit_len,
+                                  size_t offset,size_t match_len)
+{
+   u_char *token;
+
+   /* Worst case size of the sequence */
+   if ((oend - op) < (lit_len + (lit_len / 255) + (match_len / 255) + 8))
+      return NULL;
+
+   token = op++;
+
+   if (lit_len >= 15) {
+      *token = 15 << 4;
+      op = lz4_write_length(op,lit_len - 15);
+   } else
+      *token = lit_len << 4;
+
+   memcpy(op,lit,lit_len);
+   op += lit_len;
+
+   if (!offset)
+      return(op);
+
+   *op++ = offset & 0xff;
+   *op++ = offset >> 8;
+
+   match_len -= LZ4_MIN_MATCH;
+
+   if (match_len >= 15) {
+      *token |= 15;
+      op = lz4_write_length(op,match_len - 15);
+   } else
+      *token |= match_len;
+
+   return(op);
+}
+
+/* 
+ * Compress a buffer. Returns the compressed size, or 0 if it doesn't fit
+ * in "dst_len" bytes.
+ */
+size_t lz4_compress(const u_char *src,size_t len,u_char *dst,size_t dst_len)
+{
+   uint32_t table[1 << LZ4_HASH_BITS];
+   const u_char *ip = src,*anchor = src,*end = src + len;
+   const u_char *ref,*m,*r;
+   u_char *op = dst,*oend = dst + dst_len;
+   uint32_t seq,h,attempts = 0;
+
+   memset(table,0,sizeof(table));
+
+   if (len > LZ4_MF_LIMIT) {
+      const u_char *mflimit = end - LZ4_MF_LIMIT;
+      const u_char *matchlimit = end - LZ4_LAST_LITERALS;
+
+      for(ip++;ip < mflimit;) {
+         seq = lz4_read32(ip);
+         h = lz4_hash(seq);
+         ref = src + table[h];
+         table[h] = ip - src;
+
+         if ((ref >= ip) || ((ip - ref) > LZ4_MAX_OFFSET) ||
+             (lz4_read32(ref) != seq))
+         {
+            /* Skip faster over data that doesn't compress */
+            ip += 1 + (attempts++ >> 6);
+            continue;
+         }
+
+         attempts = 0;
+
+         for(m=ip+LZ4_MIN_MATCH,r=ref+LZ4_MIN_MATCH;
+             (m < matchlimit) && (*m == *r);m++,r++);
+
+         while((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+            ip--;
+            ref--;
+         }
+
+         if (!(op = lz4_write_sequence(op,oend,anchor,ip - anchor,
+                                       ip - ref,m - ip)))
+            return(0);
+
+         anchor = ip = m;
+      }
+   }
+
+   if (!(op = lz4_write_sequence(op,oend,anchor,end - anchor,0,0)))
+      return(0);
+
+   return(op - dst);
+}
+
+/* Read a length using the 255-byte continuation encoding */
+static inline int lz4_read_length(const u_char **ip,const u_char *iend,
+                                  size_t *len)
+{
+   u_char b;
+
+   do {
+      if (*ip >= iend)
+         return(-1);
+      b = *(*ip)++;
+      *len += b;
+   } while(b == 255);
+
+   return(0);
+}
+
+/* Decompress a buffer. Returns the decompressed size, or -1 on error. */
+ssize_t lz4_decompress(const u_char *src,size_t len,
+                       u_char *dst,size_t dst_len)
+{
+   const u_char *ip = src,*iend = src + len;
+   u_char *op = dst,*oend = dst + dst_len;
+   size_t lit_len,match_len,offset;
+   u_char token;
+
+   while(ip < iend) {
+      token = *ip++;
+
+      lit_len = token >> 4;
+      if ((lit_len == 15) && (lz4_read_length(&ip,iend,&lit_len) == -1))
+         return(-1);
+
+      if ((lit_len > (iend - ip)) || (lit_len > (oend - op)))
+         return(-1);
+
+      memcpy(op,ip,lit_len);
+      ip += lit_len;
+      op += lit_len;
+
+      /* The last sequence has no match */
+      if (ip == iend)
+         break;
+
+      if ((iend - ip) < 2)
+         return(-1);
+
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+
+      if (!offset || (offset > (op - dst)))
+         return(-1);
+
+      match_len = token & 15;
+      if ((match_len == 15) && (lz4_read_length(&ip,iend,&match_len) == -1))
+         return(-1);
+
+      match_len += LZ4_MIN_MATCH;
+
+      if (match_len > (oend - op))
+         return(-1);
+
+      /* Matches may overlap the output */
+      for(;match_len;match_len--,op++)
+         *op = *(op - offset);
+   }
+
+   return(op - dst);
+}
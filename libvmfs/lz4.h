@@ -0,0 +1,39 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <sys/types.h>
+
+/* 
+ * Minimal implementation of the LZ4 block format, used to compress image
+ * chunks.
+ */
+
+/* Worst case size of the compressed form of "len" bytes */
+#define LZ4_COMPRESS_BOUND(len)  ((len) + ((len) / 255) + 16)
+
+/* 
+ * Compress a buffer. Returns the compressed size, or 0 if it doesn't fit
+ * in "dst_len" bytes.
+ */
+size_t lz4_compress(const u_char *src,size_t len,u_char *dst,size_t dst_len);
+
+/* Decompress a buffer. Returns the decompressed size, or -1 on error. */
+ssize_t lz4_decompress(const u_char *src,size_t len,
+                       u_char *dst,size_t dst_len);
+
+#endif
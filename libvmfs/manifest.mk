@@ -1,2 +1,4 @@
+LDFLAGS := -lpthread
 utils.o_CFLAGS := $(if $(HAS_POSIX_MEMALIGN),,-DNO_POSIX_MEMALIGN=1)
+vmfs_volume.o_CFLAGS := $(if $(HAS_IO_URING),-DHAVE_IO_URING=1)
 REQUIRES := uuid
@@ -125,12 +125,99 @@ char *m_fmode_to_str(u_int mode,char *buf)
 /* Count the number of bits set in a byte */
 int bit_count(u_char val)
 {
-   static int qb[16] = {
-      0, 1, 1, 2, 1, 2, 2, 3,
-      1, 2, 2, 3, 2, 3, 3, 4,
-   };
+   return(__builtin_popcount(val));
+}
+
+/* Count bits set in a bitmap, one 64-bit word at a time */
+static inline __attribute__((always_inline))
+u_int bitmap_count_set_words(const u_char *map,u_int nbits)
+{
+   u_int bit,count = 0;
+
+   for(bit=0;bit<nbits;bit+=64)
+      count += __builtin_popcountll(bitmap_get_word(map,bit,nbits));
+
+   return(count);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Same, using the POPCNT instruction */
+static __attribute__((target("popcnt")))
+u_int bitmap_count_set_popcnt(const u_char *map,u_int nbits)
+{
+   return(bitmap_count_set_words(map,nbits));
+}
+#endif
+
+/* Count the number of bits set in a bitmap of "nbits" bits */
+u_int bitmap_count_set(const u_char *map,u_int nbits)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   static int has_popcnt = -1;
+
+   if (has_popcnt < 0)
+      has_popcnt = __builtin_cpu_supports("popcnt") ? 1 : 0;
+
+   if (has_popcnt)
+      return(bitmap_count_set_popcnt(map,nbits));
+#endif
+   return(bitmap_count_set_words(map,nbits));
+}
+
+/* Find the first bit set in a bitmap of "nbits" bits, -1 if none */
+int bitmap_find_first_set(const u_char *map,u_int nbits)
+{
+   uint64_t word;
+   u_int bit;
+
+   for(bit=0;bit<nbits;bit+=64)
+      if ((word = bitmap_get_word(map,bit,nbits)))
+         return(bit + __builtin_ctzll(word));
+
+   return(-1);
+}
+
+/* Find the first bit set at or after "start" in a bitmap, -1 if none */
+int bitmap_find_next_set(const u_char *map,u_int start,u_int nbits)
+{
+   uint64_t word;
+   u_int bit;
+
+   if (start >= nbits)
+      return(-1);
+
+   bit = start & ~63;
+   word = bitmap_get_word(map,bit,nbits) & (~0ULL << (start & 63));
+
+   for(;;) {
+      if (word)
+         return(bit + __builtin_ctzll(word));
+
+      if ((bit += 64) >= nbits)
+         return(-1);
+
+      word = bitmap_get_word(map,bit,nbits);
+   }
+}
+
+/* Count the bits set in a row from "start" in a bitmap, up to "max" */
+u_int bitmap_count_run_set(const u_char *map,u_int start,u_int nbits,
+                           u_int max)
+{
+   uint64_t word;
+   u_int bit,avail,n,count = 0;
+
+   for(bit=start;(count < max) && (bit < nbits);bit+=n) {
+      word  = bitmap_get_word(map,bit & ~63,nbits) >> (bit & 63);
+      avail = 64 - (bit & 63);
+      n = ~word ? m_min(__builtin_ctzll(~word),avail) : 64;
+
+      count += n;
+      if (n < avail)
+         break;
+   }
 
-   return(qb[val >> 4] + qb[val & 0x0F]);
+   return(m_min(count,max));
 }
 
 /* Allocate a buffer with alignment compatible for direct I/O */
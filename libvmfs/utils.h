@@ -23,6 +23,7 @@
 #include <string.h>
 #include <uuid.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 /* Max and min macro */
 #define m_max(a,b) (((a) > (b)) ? (a) : (b))
@@ -168,6 +169,39 @@ char *m_fmode_to_str(u_int mode,char *buf);
 /* Count the number of bits set in a byte */
 int bit_count(u_char val);
 
+/* 
+ * Get 64 bits of a bitmap starting at "bit" (a multiple of 64), bits past
+ * "nbits" being cleared. Bit i of a bitmap is bit (i & 7) of byte (i >> 3).
+ */
+static inline uint64_t bitmap_get_word(const u_char *map,u_int bit,
+                                       u_int nbits)
+{
+   uint64_t word = 0;
+   u_int i,len;
+
+   if ((bit + 64) <= nbits)
+      return(read_le64(map,bit >> 3));
+
+   len = (nbits - bit + 7) >> 3;
+   for(i=0;i<len;i++)
+      word |= (uint64_t)map[(bit >> 3) + i] << (i * 8);
+
+   return(word & ((1ULL << (nbits - bit)) - 1));
+}
+
+/* Count the number of bits set in a bitmap of "nbits" bits */
+u_int bitmap_count_set(const u_char *map,u_int nbits);
+
+/* Find the first bit set in a bitmap of "nbits" bits, -1 if none */
+int bitmap_find_first_set(const u_char *map,u_int nbits);
+
+/* Find the first bit set at or after "start" in a bitmap, -1 if none */
+int bitmap_find_next_set(const u_char *map,u_int start,u_int nbits);
+
+/* Count the bits set in a row from "start" in a bitmap, up to "max" */
+u_int bitmap_count_run_set(const u_char *map,u_int start,u_int nbits,
+                           u_int max);
+
 /* Allocate a buffer with alignment compatible for direct I/O */
 u_char *iobuffer_alloc(size_t len);
 
@@ -24,20 +24,30 @@ typedef struct vmfs_fsinfo vmfs_fsinfo_t;
 typedef struct vmfs_lvminfo vmfs_lvminfo_t;
 typedef struct vmfs_heartbeat vmfs_heartbeat_t;
 typedef struct vmfs_metadata_hdr vmfs_metadata_hdr_t;
+typedef struct vmfs_metadata_txn vmfs_metadata_txn_t;
 typedef struct vmfs_block_info vmfs_block_info_t;
 typedef struct vmfs_bitmap_header vmfs_bitmap_header_t;
 typedef struct vmfs_bitmap_entry  vmfs_bitmap_entry_t;
 typedef struct vmfs_bitmap vmfs_bitmap_t;
 typedef struct vmfs_inode vmfs_inode_t;
+typedef struct vmfs_inode_extent vmfs_inode_extent_t;
 typedef struct vmfs_dirent vmfs_dirent_t;
 typedef struct vmfs_dir vmfs_dir_t;
 typedef struct vmfs_blk_array vmfs_blk_array_t;
 typedef struct vmfs_blk_list vmfs_blk_list_t;
 typedef struct vmfs_file vmfs_file_t;
+typedef struct vmfs_file_range vmfs_file_range_t;
 typedef struct vmfs_device vmfs_device_t;
+typedef struct vmfs_io_req vmfs_io_req_t;
+typedef struct vmfs_image vmfs_image_t;
 typedef struct vmfs_volume vmfs_volume_t;
 typedef struct vmfs_lvm vmfs_lvm_t;
 typedef struct vmfs_fs vmfs_fs_t;
+typedef struct vmfs_pbcache vmfs_pbcache_t;
+typedef struct vmfs_icache vmfs_icache_t;
+typedef struct vmfs_dcache vmfs_dcache_t;
+typedef struct vmfs_iopool vmfs_iopool_t;
+typedef struct vmfs_stats vmfs_stats_t;
 
 union vmfs_flags {
    int packed;
@@ -56,9 +66,15 @@ typedef union vmfs_flags vmfs_flags_t __attribute__((transparent_union));
 #include "vmfs_block.h"
 #include "vmfs_bitmap.h"
 #include "vmfs_inode.h"
+#include "vmfs_pbcache.h"
+#include "vmfs_icache.h"
+#include "vmfs_stats.h"
+#include "vmfs_device.h"
+#include "vmfs_image.h"
 #include "vmfs_dirent.h"
+#include "vmfs_dcache.h"
+#include "vmfs_iopool.h"
 #include "vmfs_file.h"
-#include "vmfs_device.h"
 #include "vmfs_volume.h"
 #include "vmfs_lvm.h"
 #include "vmfs_fs.h"
@@ -111,29 +111,50 @@ vmfs_bitmap_get_area_addr(const vmfs_bitmap_header_t *bmh,u_int area)
    return(bmh->hdr_size + (area * bmh->area_size));
 }
 
-/* Read a bitmap entry given a block id */
-int vmfs_bitmap_get_entry(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
-                          vmfs_bitmap_entry_t *bmp_entry)
-{   
-   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
+/* Get the index of the bitmap entry holding an item, in all areas */
+static inline u_int
+vmfs_bitmap_get_entry_index(const vmfs_bitmap_header_t *bmh,
+                            uint32_t entry,uint32_t item)
+{
    uint32_t items_per_area;
    u_int entry_idx,area;
    off_t addr;
 
-   addr = (entry * b->bmh.items_per_bitmap_entry) + item;
+   addr = (entry * bmh->items_per_bitmap_entry) + item;
 
-   items_per_area = vmfs_bitmap_get_items_per_area(&b->bmh);
+   items_per_area = vmfs_bitmap_get_items_per_area(bmh);
    area = addr / items_per_area;
 
-   entry_idx = (addr % items_per_area) / b->bmh.items_per_bitmap_entry;
+   entry_idx = (addr % items_per_area) / bmh->items_per_bitmap_entry;
+   return((area * bmh->bmp_entries_per_area) + entry_idx);
+}
 
-   addr = vmfs_bitmap_get_area_addr(&b->bmh,area);
-   addr += entry_idx * VMFS_BITMAP_ENTRY_SIZE;
+/* Get the position of a bitmap entry from its index */
+static inline off_t
+vmfs_bitmap_get_entry_addr(const vmfs_bitmap_header_t *bmh,u_int idx)
+{
+   return(vmfs_bitmap_get_area_addr(bmh,idx / bmh->bmp_entries_per_area) +
+          ((idx % bmh->bmp_entries_per_area) * VMFS_BITMAP_ENTRY_SIZE));
+}
 
-   if (vmfs_file_pread(b->f,buf,buf_len,addr) != buf_len)
-      return(-1);
+/* Read a bitmap entry given a block id */
+int vmfs_bitmap_get_entry(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
+                          vmfs_bitmap_entry_t *bmp_entry)
+{   
+   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
+   const u_char *ptr;
+   off_t addr;
 
-   vmfs_bme_read(bmp_entry,buf,1);
+   addr = vmfs_bitmap_get_entry_addr(&b->bmh,
+             vmfs_bitmap_get_entry_index(&b->bmh,entry,item));
+
+   if (!(ptr = vmfs_file_borrow(b->f,addr,buf_len))) {
+      if (vmfs_file_pread(b->f,buf,buf_len,addr) != buf_len)
+         return(-1);
+      ptr = buf;
+   }
+
+   vmfs_bme_read(bmp_entry,ptr,1);
    return(0);
 }
 
@@ -166,6 +187,17 @@ bool vmfs_bitmap_get_item(vmfs_bitmap_t *b, uint32_t entry, uint32_t item,
    return(vmfs_file_pread(b->f,buf,b->bmh.data_size,pos) == b->bmh.data_size);
 }
 
+/* 
+ * Get a pointer to a bitmap item in memory from its entry and item numbers,
+ * NULL if it has to be read with vmfs_bitmap_get_item().
+ */
+const u_char *vmfs_bitmap_borrow_item(vmfs_bitmap_t *b,uint32_t entry,
+                                      uint32_t item)
+{
+   off_t pos = vmfs_bitmap_get_item_pos(b,entry,item);
+   return(vmfs_file_borrow(b->f,pos,b->bmh.data_size));
+}
+
 /* Write a bitmap given its entry and item numbers */
 bool vmfs_bitmap_set_item(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
                           u_char *buf)
@@ -189,20 +221,10 @@ vmfs_bitmap_get_item_offset(const vmfs_bitmap_header_t *bmh,u_int addr,
 /* Update the first free item field */
 static void vmfs_bitmap_update_ffree(vmfs_bitmap_entry_t *entry)
 {
-   u_int array_idx,bit_idx;
    int i;
 
-   entry->ffree = 0;
-
-   for(i=0;i<entry->total;i++) {
-      array_idx = i >> 3;
-      bit_idx   = i & 0x07;
-
-      if (entry->bitmap[array_idx] & (1 << bit_idx)) {
-         entry->ffree = i;
-         break;
-      }
-   }
+   i = bitmap_find_first_set(entry->bitmap,entry->total);
+   entry->ffree = (i < 0) ? 0 : i;
 }
 
 /* Mark an item as free or allocated */
@@ -242,7 +264,7 @@ int vmfs_bitmap_set_item_status(const vmfs_bitmap_header_t *bmh,
 
 /* Get the status of an item (0=free,1=allocated) */
 int vmfs_bitmap_get_item_status(const vmfs_bitmap_header_t *bmh,
-                                vmfs_bitmap_entry_t *bmp_entry,
+                                const vmfs_bitmap_entry_t *bmp_entry,
                                 uint32_t entry,uint32_t item)
 {
    u_int array_idx,bit_idx;
@@ -260,27 +282,50 @@ int vmfs_bitmap_get_item_status(const vmfs_bitmap_header_t *bmh,
 /* Find a free item in a bitmap entry and mark it allocated */
 int vmfs_bitmap_alloc_item(vmfs_bitmap_entry_t *bmp_entry,uint32_t *item)
 {
-   u_int array_idx,bit_idx;
    int i;
 
    /* TODO: use first free field as a hint */
 
-   for(i=0;i<bmp_entry->total;i++) {
-      array_idx = i >> 3;
-      bit_idx   = i & 0x07;
-
-      if (bmp_entry->bitmap[array_idx] & (1 << bit_idx)) {
-         *item = i;
-         bmp_entry->bitmap[array_idx] &= ~(1 << bit_idx);
-         bmp_entry->free--;
-         vmfs_bitmap_update_ffree(bmp_entry);
-         return(0);
-      }
+   if ((i = bitmap_find_first_set(bmp_entry->bitmap,bmp_entry->total)) >= 0) {
+      *item = i;
+      bmp_entry->bitmap[i >> 3] &= ~(1 << (i & 0x07));
+      bmp_entry->free--;
+      vmfs_bitmap_update_ffree(bmp_entry);
+      return(0);
    }
 
    return(-1);
 }
 
+/* 
+ * Find free items in a row in a bitmap entry, from "hint" if possible, and
+ * mark up to "max" of them allocated. Returns the number of items allocated.
+ */
+int vmfs_bitmap_alloc_items(vmfs_bitmap_entry_t *bmp_entry,uint32_t hint,
+                            u_int max,uint32_t *item)
+{
+   u_int i,count;
+   int start;
+
+   start = bitmap_find_next_set(bmp_entry->bitmap,hint,bmp_entry->total);
+
+   if ((start < 0) &&
+       ((start = bitmap_find_first_set(bmp_entry->bitmap,
+                                       bmp_entry->total)) < 0))
+      return(-1);
+
+   count = bitmap_count_run_set(bmp_entry->bitmap,start,bmp_entry->total,
+                                max);
+
+   for(i=start;i<start+count;i++)
+      bmp_entry->bitmap[i >> 3] &= ~(1 << (i & 0x07));
+
+   *item = start;
+   bmp_entry->free -= count;
+   vmfs_bitmap_update_ffree(bmp_entry);
+   return(count);
+}
+
 /* Find a bitmap entry with at least "num_items" free in the specified area */
 int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
                                      u_int area,u_int num_items,
@@ -297,7 +342,7 @@ int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
    pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
    buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
 
-   if (!(buf = iobuffer_alloc(buf_len)))
+   if (!(buf = vmfs_iopool_get(fs->iopool,buf_len)))
       return(-1);
 
    if (vmfs_file_pread(b->f,buf,buf_len,pos) != buf_len)
@@ -328,7 +373,7 @@ int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
    }
 
  done:
-   iobuffer_free(buf);
+   vmfs_iopool_put(fs->iopool,buf,buf_len);
    return(res);
 }
 
@@ -345,38 +390,301 @@ int vmfs_bitmap_find_free_items(vmfs_bitmap_t *b,u_int num_items,
    return(-1);
 }
 
-/* Count the total number of allocated items in a bitmap area */
-uint32_t vmfs_bitmap_area_allocated_items(vmfs_bitmap_t *b,u_int area)
+/* Forget the summary of a bitmap (summary locked) */
+static void vmfs_bitmap_free_summary(vmfs_bitmap_t *b)
+{
+   free(b->sum_entries);
+   free(b->sum_areas);
+   b->sum_entries = NULL;
+   b->sum_areas = NULL;
+   b->sum_time = 0;
+}
+
+/* 
+ * Load the summary of a bitmap, reading all entries of an area at once
+ * (summary locked).
+ */
+static int vmfs_bitmap_load_summary(vmfs_bitmap_t *b)
 {
-   u_char buf[VMFS_BITMAP_ENTRY_SIZE];
+   struct vmfs_bitmap_count *entries,*areas;
    vmfs_bitmap_entry_t entry;
-   uint32_t count;
-   off_t pos;
-   int i;
+   u_char *buf;
+   size_t buf_len;
+   u_int i,j,idx;
 
-   pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
 
-   for(i=0,count=0;i<b->bmh.bmp_entries_per_area;i++) {
-      if (vmfs_file_pread(b->f,buf,sizeof(buf),pos) != sizeof(buf))
-         break;
+   if (!buf_len || !b->bmh.area_count)
+      return(-1);
+
+   entries = calloc(b->bmh.area_count * b->bmh.bmp_entries_per_area,
+                    sizeof(*entries));
+   areas = calloc(b->bmh.area_count,sizeof(*areas));
+   buf = iobuffer_alloc(buf_len);
+
+   if (!entries || !areas || !buf)
+      goto err;
+
+   for(i=0,idx=0;i<b->bmh.area_count;i++) {
+      off_t addr = vmfs_bitmap_get_area_addr(&b->bmh,i);
+      const u_char *ptr;
+      ssize_t len = buf_len;
+
+      if (!(ptr = vmfs_file_borrow(b->f,addr,buf_len))) {
+         if ((len = vmfs_file_pread(b->f,buf,buf_len,addr)) < 0)
+            goto err;
+         ptr = buf;
+      }
+
+      for(j=0;j<b->bmh.bmp_entries_per_area;j++,idx++) {
+         /* Entries missing at the end of the file are left empty */
+         if (((j + 1) * VMFS_BITMAP_ENTRY_SIZE) > len)
+            continue;
+
+         vmfs_bme_read(&entry,ptr + (j * VMFS_BITMAP_ENTRY_SIZE),0);
+
+         entries[idx].total = entry.total;
+         entries[idx].free  = entry.free;
+         areas[i].total += entry.total;
+         areas[i].free  += entry.free;
+      }
+   }
+
+   vmfs_bitmap_free_summary(b);
+   b->sum_entries = entries;
+   b->sum_areas = areas;
+   b->sum_total.total = b->sum_total.free = 0;
+
+   for(i=0;i<b->bmh.area_count;i++) {
+      b->sum_total.total += areas[i].total;
+      b->sum_total.free  += areas[i].free;
+   }
+
+   b->sum_time = vmfs_host_get_uptime();
+   iobuffer_free(buf);
+   return(0);
+
+ err:
+   iobuffer_free(buf);
+   free(entries);
+   free(areas);
+   return(-1);
+}
+
+/* Make sure the summary of a bitmap is loaded and recent (summary locked) */
+static int vmfs_bitmap_get_summary(vmfs_bitmap_t *b)
+{
+   if (b->sum_entries &&
+       ((vmfs_host_get_uptime() - b->sum_time) < VMFS_BITMAP_SUMMARY_EXPIRE))
+      return(0);
+
+   return(vmfs_bitmap_load_summary(b));
+}
+
+/* 
+ * Update the summary and snapshot of a bitmap after a change on one of
+ * its entries.
+ */
+void vmfs_bitmap_update_summary(vmfs_bitmap_t *b,
+                                const vmfs_bitmap_entry_t *bmp_entry)
+{
+   struct vmfs_bitmap_count *cnt;
+   u_int area;
+
+   pthread_mutex_lock(&b->sum_lock);
+
+   if (b->snap && (bmp_entry->id < b->snap_count))
+      b->snap[bmp_entry->id] = *bmp_entry;
+
+   if (!b->sum_entries)
+      goto done;
+
+   area = bmp_entry->id / b->bmh.bmp_entries_per_area;
 
-      vmfs_bme_read(&entry,buf,0);
-      count += entry.total - entry.free;
-      pos += sizeof(buf);
+   /* The bitmap has grown, load it again next time */
+   if (area >= b->bmh.area_count) {
+      vmfs_bitmap_free_summary(b);
+      goto done;
+   }
+
+   cnt = &b->sum_entries[bmp_entry->id];
+
+   b->sum_areas[area].total += bmp_entry->total - cnt->total;
+   b->sum_areas[area].free  += bmp_entry->free - cnt->free;
+   b->sum_total.total += bmp_entry->total - cnt->total;
+   b->sum_total.free  += bmp_entry->free - cnt->free;
+
+   cnt->total = bmp_entry->total;
+   cnt->free  = bmp_entry->free;
+
+ done:
+   pthread_mutex_unlock(&b->sum_lock);
+}
+
+/* 
+ * Find a bitmap entry with at least "num_items" free, starting with the
+ * entry with index "start" and wrapping around. The summary is used to
+ * skip full entries, so that only candidate entries are read and locked.
+ */
+int vmfs_bitmap_find_free_items_from(vmfs_bitmap_t *b,u_int start,
+                                     u_int num_items,
+                                     vmfs_bitmap_entry_t *entry)
+{
+   DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
+   vmfs_fs_t *fs;
+   u_int i,idx,count;
+   bool full;
+
+   fs = (vmfs_fs_t *)vmfs_file_get_fs(b->f);
+   count = b->bmh.area_count * b->bmh.bmp_entries_per_area;
+
+   for(i=0;i<count;i++) {
+      idx = (start + i) % count;
+
+      pthread_mutex_lock(&b->sum_lock);
+
+      if (vmfs_bitmap_get_summary(b) < 0) {
+         pthread_mutex_unlock(&b->sum_lock);
+         return(vmfs_bitmap_find_free_items(b,num_items,entry));
+      }
+
+      full = (b->sum_entries[idx].free < num_items);
+      pthread_mutex_unlock(&b->sum_lock);
+
+      if (full)
+         continue;
+
+      if (vmfs_file_pread(b->f,buf,buf_len,
+                          vmfs_bitmap_get_entry_addr(&b->bmh,idx)) != buf_len)
+         continue;
+
+      vmfs_bme_read(entry,buf,1);
+
+      if (!vmfs_metadata_is_locked(&entry->mdh) &&
+          (entry->free >= num_items) &&
+          !vmfs_metadata_lock(fs,entry->mdh.pos,buf,buf_len,&entry->mdh))
+      {
+         vmfs_bme_read(entry,buf,1);
+
+         if (entry->free >= num_items)
+            return(0);
+
+         vmfs_metadata_unlock(fs,&entry->mdh);
+      }
+
+      /* The summary was not accurate anymore */
+      vmfs_bitmap_update_summary(b,entry);
    }
 
-   return count;
+   return(-1);
+}
+
+/* Load a snapshot of all the entries of a bitmap in memory */
+int vmfs_bitmap_load_snapshot(vmfs_bitmap_t *b)
+{
+   vmfs_bitmap_entry_t *snap,*e;
+   const u_char *ptr;
+   u_char *buf;
+   size_t buf_len;
+   ssize_t len;
+   u_int i,j,count;
+
+   buf_len = b->bmh.bmp_entries_per_area * VMFS_BITMAP_ENTRY_SIZE;
+
+   if (!buf_len || !b->bmh.area_count)
+      return(-1);
+
+   snap = calloc(b->bmh.area_count * b->bmh.bmp_entries_per_area,
+                 sizeof(*snap));
+   buf = iobuffer_alloc(buf_len);
+
+   if (!snap || !buf)
+      goto err;
+
+   /* Read each area at once, stopping at the end of the file */
+   for(i=0,count=0;i<b->bmh.area_count;i++) {
+      len = vmfs_file_pread(b->f,buf,buf_len,
+                            vmfs_bitmap_get_area_addr(&b->bmh,i));
+      if (len < 0)
+         goto err;
+
+      for(j=0;((j + 1) * VMFS_BITMAP_ENTRY_SIZE) <= len;j++,count++) {
+         ptr = buf + (j * VMFS_BITMAP_ENTRY_SIZE);
+         e = &snap[count];
+
+         /* The total may be bogus, so don't trust it for the copy */
+         vmfs_bme_read(e,ptr,0);
+         memcpy(e->bitmap,&ptr[VMFS_BME_OFS_BITMAP],sizeof(e->bitmap));
+      }
+
+      if (j < b->bmh.bmp_entries_per_area)
+         break;
+   }
+
+   iobuffer_free(buf);
+
+   pthread_mutex_lock(&b->sum_lock);
+   free(b->snap);
+   b->snap = snap;
+   b->snap_count = count;
+   pthread_mutex_unlock(&b->sum_lock);
+   return(0);
+
+ err:
+   iobuffer_free(buf);
+   free(snap);
+   return(-1);
+}
+
+/* Drop the snapshot of a bitmap */
+void vmfs_bitmap_drop_snapshot(vmfs_bitmap_t *b)
+{
+   pthread_mutex_lock(&b->sum_lock);
+   free(b->snap);
+   b->snap = NULL;
+   b->snap_count = 0;
+   pthread_mutex_unlock(&b->sum_lock);
+}
+
+/* Get a bitmap entry from the snapshot, NULL if not available */
+const vmfs_bitmap_entry_t *
+vmfs_bitmap_get_snapshot_entry(const vmfs_bitmap_t *b,
+                               uint32_t entry,uint32_t item)
+{
+   u_int idx;
+
+   if (!b->snap)
+      return NULL;
+
+   idx = vmfs_bitmap_get_entry_index(&b->bmh,entry,item);
+   return((idx < b->snap_count) ? &b->snap[idx] : NULL);
+}
+
+/* Count the total number of allocated items in a bitmap area */
+uint32_t vmfs_bitmap_area_allocated_items(vmfs_bitmap_t *b,u_int area)
+{
+   uint32_t count = 0;
+
+   pthread_mutex_lock(&b->sum_lock);
+
+   if ((area < b->bmh.area_count) && !vmfs_bitmap_get_summary(b))
+      count = b->sum_areas[area].total - b->sum_areas[area].free;
+
+   pthread_mutex_unlock(&b->sum_lock);
+   return(count);
 }
 
 /* Count the total number of allocated items in a bitmap */
 uint32_t vmfs_bitmap_allocated_items(vmfs_bitmap_t *b)
 {
-   uint32_t count;
-   u_int i;
-   
-   for(i=0,count=0;i<b->bmh.area_count;i++)
-      count += vmfs_bitmap_area_allocated_items(b,i);
+   uint32_t count = 0;
 
+   pthread_mutex_lock(&b->sum_lock);
+
+   if (!vmfs_bitmap_get_summary(b))
+      count = b->sum_total.total - b->sum_total.free;
+
+   pthread_mutex_unlock(&b->sum_lock);
    return(count);
 }
 
@@ -387,9 +695,9 @@ void vmfs_bitmap_area_foreach(vmfs_bitmap_t *b,u_int area,
 {
    DECL_ALIGNED_BUFFER(buf,VMFS_BITMAP_ENTRY_SIZE);
    vmfs_bitmap_entry_t entry;
+   uint64_t word,mask;
    off_t pos;
    uint32_t addr;
-   u_int array_idx,bit_idx;
    u_int i,j;
 
    pos = vmfs_bitmap_get_area_addr(&b->bmh,area);
@@ -400,16 +708,19 @@ void vmfs_bitmap_area_foreach(vmfs_bitmap_t *b,u_int area,
 
       vmfs_bme_read(&entry,buf,1);
 
-      for(j=0;j<entry.total;j++) {
-         array_idx = j >> 3;
-         bit_idx   = j & 0x07;
-         
-         addr =  area * vmfs_bitmap_get_items_per_area(&b->bmh);
-         addr += i * b->bmh.items_per_bitmap_entry;
-         addr += j;
+      addr =  area * vmfs_bitmap_get_items_per_area(&b->bmh);
+      addr += i * b->bmh.items_per_bitmap_entry;
 
-         if (!(entry.bitmap[array_idx] & (1 << bit_idx)))
-            cbk(b,addr,opt_arg);
+      /* Allocated items have their bit cleared */
+      for(j=0;j<entry.total;j+=64) {
+         mask = ((j + 64) <= entry.total) ? ~0ULL :
+                (1ULL << (entry.total - j)) - 1;
+         word = ~bitmap_get_word(entry.bitmap,j,entry.total) & mask;
+
+         while(word) {
+            cbk(b,addr + j + __builtin_ctzll(word),opt_arg);
+            word &= word - 1;
+         }
       }
 
       pos += buf_len;
@@ -429,79 +740,76 @@ void vmfs_bitmap_foreach(vmfs_bitmap_t *b,vmfs_bitmap_foreach_cbk_t cbk,
 /* Check coherency of a bitmap file */
 int vmfs_bitmap_check(vmfs_bitmap_t *b)
 {  
-   u_char buf[VMFS_BITMAP_ENTRY_SIZE];
-   vmfs_bitmap_entry_t entry;
+   const vmfs_bitmap_entry_t *entry;
    uint32_t total_items;
    uint32_t magic;
    uint32_t entry_id;
-   int i,j,k,errors;
-   int bmap_size;
+   int errors;
    int bmap_count;
-   off_t pos;
+   bool own_snap;
 
    errors      = 0;
    total_items = 0;
    magic       = 0;
-   entry_id    = 0;
 
-   for(i=0;i<b->bmh.area_count;i++) {
-      pos = vmfs_bitmap_get_area_addr(&b->bmh,i);
+   /* Work on a snapshot, so that all entries are read in bulk */
+   if ((own_snap = !b->snap) && (vmfs_bitmap_load_snapshot(b) == -1)) {
+      /* An empty bitmap has no entries to load */
+      if (!b->bmh.total_items)
+         return(0);
 
-      for(j=0;j<b->bmh.bmp_entries_per_area;j++) {
-         if (vmfs_file_pread(b->f,buf,sizeof(buf),pos) != sizeof(buf))
-            break;
+      printf("Unable to read the bitmap entries\n");
+      return(1);
+   }
 
-         vmfs_bme_read(&entry,buf,0);
+   for(entry_id=0;entry_id<b->snap_count;entry_id++) {
+      entry = &b->snap[entry_id];
 
-         if (entry.mdh.magic == 0)
-            goto done;
+      if (entry->mdh.magic == 0)
+         break;
 
-         /* check the entry ID */
-         if (entry.id != entry_id) {
-            printf("Entry 0x%x has incorrect ID 0x%x\n",entry_id,entry.id);
-            errors++;
-         }
-         
-         /* check the magic number */
-         if (magic == 0) {
-            magic = entry.mdh.magic;
-         } else {
-            if (entry.mdh.magic != magic) {
-               printf("Entry 0x%x has an incorrect magic id (0x%x)\n",
-                      entry_id,entry.mdh.magic);
-               errors++;
-            }
-         }
-         
-         /* check the number of items */
-         if (entry.total > b->bmh.items_per_bitmap_entry) {
-            printf("Entry 0x%x has an incorrect total of 0x%2.2x items\n",
-                   entry_id,entry.total);
+      /* check the entry ID */
+      if (entry->id != entry_id) {
+         printf("Entry 0x%x has incorrect ID 0x%x\n",entry_id,entry->id);
+         errors++;
+      }
+      
+      /* check the magic number */
+      if (magic == 0) {
+         magic = entry->mdh.magic;
+      } else {
+         if (entry->mdh.magic != magic) {
+            printf("Entry 0x%x has an incorrect magic id (0x%x)\n",
+                   entry_id,entry->mdh.magic);
             errors++;
          }
+      }
+      
+      /* check the number of items */
+      if (entry->total > b->bmh.items_per_bitmap_entry) {
+         printf("Entry 0x%x has an incorrect total of 0x%2.2x items\n",
+                entry_id,entry->total);
+         errors++;
+      }
 
-         /* check the bitmap array */
-         bmap_size = (entry.total + 7) / 8;
-         bmap_count = 0;
+      /* check the bitmap array */
+      bmap_count = bitmap_count_set(entry->bitmap,
+                                    m_min(ALIGN_NUM(entry->total,8),
+                                          VMFS_BITMAP_BMP_MAX_SIZE * 8));
 
-         for(k=0;k<bmap_size;k++) {
-            bmap_count += bit_count(buf[VMFS_BME_OFS_BITMAP+k]);
-         }
-
-         if (bmap_count != entry.free) {
-            printf("Entry 0x%x has an incorrect bitmap array "
-                   "(bmap_count=0x%x instead of 0x%x)\n",
-                   entry_id,bmap_count,entry.free);
-            errors++;
-         }
-
-         total_items += entry.total;
-         entry_id++;
-         pos += sizeof(buf);
+      if (bmap_count != entry->free) {
+         printf("Entry 0x%x has an incorrect bitmap array "
+                "(bmap_count=0x%x instead of 0x%x)\n",
+                entry_id,bmap_count,entry->free);
+         errors++;
       }
+
+      total_items += entry->total;
    }
 
- done:
+   if (own_snap)
+      vmfs_bitmap_drop_snapshot(b);
+
    if (total_items != b->bmh.total_items) {
       printf("Total number of items (0x%x) doesn't match header info (0x%x)\n",
              total_items,b->bmh.total_items);
@@ -534,6 +842,12 @@ static inline vmfs_bitmap_t *vmfs_bitmap_open_from_file(vmfs_file_t *f)
    //hexdump(buf, buf_len);
    vmfs_bmh_read(&b->bmh, buf);
    b->f = f;
+
+   if ((b->bmh.data_size > sizeof(uint64_t)) &&
+       !(b->bmh.data_size & (b->bmh.data_size - 1)))
+      b->ptr_shift = __builtin_ctz(b->bmh.data_size / sizeof(uint64_t));
+
+   pthread_mutex_init(&b->sum_lock,NULL);
    dprintf("leave\n");   
    return b;
 }
@@ -558,6 +872,9 @@ void vmfs_bitmap_close(vmfs_bitmap_t *b)
 {
    if (b != NULL) {
       vmfs_file_close(b->f);
+      vmfs_bitmap_free_summary(b);
+      free(b->snap);
+      pthread_mutex_destroy(&b->sum_lock);
       free(b);
    }
 }
@@ -69,12 +69,47 @@ struct vmfs_bitmap_entry {
    uint8_t bitmap[VMFS_BITMAP_BMP_MAX_SIZE];
 };
 
+/* Free and total item counts of a bitmap entry or area */
+struct vmfs_bitmap_count {
+   uint32_t total;
+   uint32_t free;
+};
+
+/* 
+ * Summaries older than this (in usecs) are reloaded, since other hosts
+ * may have allocated or freed items.
+ */
+#define VMFS_BITMAP_SUMMARY_EXPIRE  (10 * 1000000)
+
 /* A bitmap file instance */
 struct vmfs_bitmap {
    vmfs_file_t *f;
    vmfs_bitmap_header_t bmh;
+
+   /* 
+    * log2 of the number of 64-bit block pointers an item holds, when used
+    * for pointer blocks. 0 if not a power of two.
+    */
+   u_int ptr_shift;
+
+   /* In-memory summary of the entries, loaded on demand */
+   pthread_mutex_t sum_lock;
+   struct vmfs_bitmap_count *sum_entries;
+   struct vmfs_bitmap_count *sum_areas;
+   struct vmfs_bitmap_count sum_total;
+   uint64_t sum_time;
+
+   /* Snapshot of all the entries, only loaded on request */
+   vmfs_bitmap_entry_t *snap;
+   u_int snap_count;
 };
 
+/* Number of 64-bit block pointers held by an item of a pointer block bitmap */
+static inline uint32_t vmfs_bitmap_ptrs_per_item(const vmfs_bitmap_t *b)
+{
+   return(b->bmh.data_size / sizeof(uint64_t));
+}
+
 /* Callback prototype for vmfs_bitmap_foreach() */
 typedef void (*vmfs_bitmap_foreach_cbk_t)(vmfs_bitmap_t *b,uint32_t addr,
                                           void *opt_arg);
@@ -99,6 +134,13 @@ off_t vmfs_bitmap_get_item_pos(vmfs_bitmap_t *b,uint32_t entry,uint32_t item);
 bool vmfs_bitmap_get_item(vmfs_bitmap_t *b, uint32_t entry, uint32_t item,
                           u_char *buf);
 
+/* 
+ * Get a pointer to a bitmap item in memory from its entry and item numbers,
+ * NULL if it has to be read with vmfs_bitmap_get_item().
+ */
+const u_char *vmfs_bitmap_borrow_item(vmfs_bitmap_t *b,uint32_t entry,
+                                      uint32_t item);
+
 /* Write a bitmap given its entry and item numbers */
 bool vmfs_bitmap_set_item(vmfs_bitmap_t *b,uint32_t entry,uint32_t item,
                           u_char *buf);
@@ -111,12 +153,19 @@ int vmfs_bitmap_set_item_status(const vmfs_bitmap_header_t *bmh,
 
 /* Get the status of an item (0=free,1=allocated) */
 int vmfs_bitmap_get_item_status(const vmfs_bitmap_header_t *bmh,
-                                vmfs_bitmap_entry_t *bmp_entry,
+                                const vmfs_bitmap_entry_t *bmp_entry,
                                 uint32_t entry,uint32_t item);
 
 /* Find a free item in a bitmap entry and mark it allocated */
 int vmfs_bitmap_alloc_item(vmfs_bitmap_entry_t *bmp_entry,uint32_t *item);
 
+/* 
+ * Find free items in a row in a bitmap entry, from "hint" if possible, and
+ * mark up to "max" of them allocated. Returns the number of items allocated.
+ */
+int vmfs_bitmap_alloc_items(vmfs_bitmap_entry_t *bmp_entry,uint32_t hint,
+                            u_int max,uint32_t *item);
+
 /* Find a bitmap entry with at least "num_items" free in the specified area */
 int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
                                      u_int area,u_int num_items,
@@ -126,6 +175,32 @@ int vmfs_bitmap_area_find_free_items(vmfs_bitmap_t *b,
 int vmfs_bitmap_find_free_items(vmfs_bitmap_t *b,u_int num_items,
                                 vmfs_bitmap_entry_t *entry);
 
+/* 
+ * Find a bitmap entry with at least "num_items" free, starting with the
+ * entry with index "start" and wrapping around.
+ */
+int vmfs_bitmap_find_free_items_from(vmfs_bitmap_t *b,u_int start,
+                                     u_int num_items,
+                                     vmfs_bitmap_entry_t *entry);
+
+/* 
+ * Update the summary and snapshot of a bitmap after a change on one of
+ * its entries.
+ */
+void vmfs_bitmap_update_summary(vmfs_bitmap_t *b,
+                                const vmfs_bitmap_entry_t *bmp_entry);
+
+/* Load a snapshot of all the entries of a bitmap in memory */
+int vmfs_bitmap_load_snapshot(vmfs_bitmap_t *b);
+
+/* Drop the snapshot of a bitmap */
+void vmfs_bitmap_drop_snapshot(vmfs_bitmap_t *b);
+
+/* Get a bitmap entry from the snapshot, NULL if not available */
+const vmfs_bitmap_entry_t *
+vmfs_bitmap_get_snapshot_entry(const vmfs_bitmap_t *b,
+                               uint32_t entry,uint32_t item);
+
 /* Count the total number of allocated items in a bitmap area */
 uint32_t vmfs_bitmap_area_allocated_items(vmfs_bitmap_t *b,u_int area);
 
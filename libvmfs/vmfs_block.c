@@ -79,6 +79,7 @@ int vmfs_block_get_info(uint64_t blk_id, vmfs_block_info_t *info)
 /* Get block status (allocated or free) */
 int vmfs_block_get_status(const vmfs_fs_t *fs,uint64_t blk_id)
 {
+   const vmfs_bitmap_entry_t *snap_entry;
    vmfs_bitmap_entry_t entry;
    vmfs_bitmap_t *bmp;
    vmfs_block_info_t info;
@@ -89,6 +90,11 @@ int vmfs_block_get_status(const vmfs_fs_t *fs,uint64_t blk_id)
    if (!(bmp = vmfs_fs_get_bitmap(fs, info.type)))
       return(-1);
 
+   /* Use the bitmap snapshot, when one has been loaded */
+   if ((snap_entry = vmfs_bitmap_get_snapshot_entry(bmp,info.entry,info.item)))
+      return(vmfs_bitmap_get_item_status(&bmp->bmh,snap_entry,
+                                         info.entry,info.item));
+
    if (vmfs_bitmap_get_entry(bmp,info.entry,info.item,&entry) == -1)
       return(-1);
 
@@ -127,7 +133,8 @@ static int vmfs_block_set_status(const vmfs_fs_t *fs,uint64_t blk_id,
    }
 
    /* Update entry and release lock */
-   vmfs_bme_update(fs,&entry);
+   if (!vmfs_bme_update(fs,&entry))
+      vmfs_bitmap_update_summary(bmp,&entry);
    vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
    return(0);
 }
@@ -141,6 +148,10 @@ int vmfs_block_alloc_specified(const vmfs_fs_t *fs,uint64_t blk_id)
 /* Free the specified block */
 int vmfs_block_free(const vmfs_fs_t *fs,uint64_t blk_id)
 {
+   if ((VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_PB) ||
+       (VMFS_BLK_TYPE(blk_id) == VMFS_BLK_TYPE_PB2))
+      vmfs_pbcache_invalidate(fs,blk_id);
+
    return(vmfs_block_set_status(fs,blk_id,0));
 }
 
@@ -154,6 +165,10 @@ int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint64_t *blk_id)
    if (!(bmp = vmfs_fs_get_bitmap(fs, blk_type)))
       return(-EINVAL);
 
+   /* File blocks follow the allocation cursor */
+   if (blk_type == VMFS_BLK_TYPE_FB)
+      return(vmfs_block_alloc_fb_extent(fs,0,1,blk_id) < 0 ? -ENOSPC : 0);
+
    if (vmfs_bitmap_find_free_items(bmp,1,&entry) == -1)
       return(-ENOSPC);
 
@@ -162,7 +177,8 @@ int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint64_t *blk_id)
       return(-ENOSPC);
    }
 
-   vmfs_bme_update(fs,&entry);
+   if (!vmfs_bme_update(fs,&entry))
+      vmfs_bitmap_update_summary(bmp,&entry);
    vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
 
    switch(blk_type) {
@@ -184,6 +200,63 @@ int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint64_t *blk_id)
    return(0);
 }
 
+/* 
+ * Allocate up to "max" physically contiguous file blocks, as close as
+ * possible to the "hint" file block address, or to the allocation cursor
+ * of the filesystem if 0. Returns the number of blocks allocated, the
+ * first one being stored in "blk_id".
+ */
+int vmfs_block_alloc_fb_extent(const vmfs_fs_t *fs,uint32_t hint,u_int max,
+                               uint64_t *blk_id)
+{
+   vmfs_bitmap_t *bmp = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_FB);
+   vmfs_bitmap_entry_t entry;
+   vmfs_metadata_txn_t txn;
+   uint32_t items_per_entry,item,addr;
+   int count;
+
+   if (!bmp)
+      return(-EIO);
+
+   items_per_entry = bmp->bmh.items_per_bitmap_entry;
+
+   if (!hint)
+      hint = __atomic_load_n(&fs->fb_cursor,__ATOMIC_RELAXED);
+
+   /* 
+    * Only a single bitmap entry is locked for the whole extent, and the
+    * candidates tried before it share its reservation.
+    */
+   vmfs_metadata_txn_begin((vmfs_fs_t *)fs,&txn);
+
+   if (vmfs_bitmap_find_free_items_from(bmp,hint / items_per_entry,1,
+                                        &entry) == -1)
+   {
+      vmfs_metadata_txn_end((vmfs_fs_t *)fs,&txn);
+      return(-ENOSPC);
+   }
+
+   item = (entry.id == (hint / items_per_entry)) ? hint % items_per_entry : 0;
+
+   if ((count = vmfs_bitmap_alloc_items(&entry,item,max,&item)) < 0) {
+      vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
+      vmfs_metadata_txn_end((vmfs_fs_t *)fs,&txn);
+      return(-ENOSPC);
+   }
+
+   if (!vmfs_bme_update(fs,&entry))
+      vmfs_bitmap_update_summary(bmp,&entry);
+   vmfs_metadata_unlock((vmfs_fs_t *)fs,&entry.mdh);
+   vmfs_metadata_txn_end((vmfs_fs_t *)fs,&txn);
+
+   addr = (entry.id * items_per_entry) + item;
+   *blk_id = VMFS_BLK_FB_BUILD(addr, 0);
+
+   __atomic_store_n(&((vmfs_fs_t *)fs)->fb_cursor,addr + count,
+                    __ATOMIC_RELAXED);
+   return(count);
+}
+
 /* Zeroize a file block */
 int vmfs_block_zeroize_fb(const vmfs_fs_t *fs,uint64_t blk_id)
 {
@@ -213,7 +286,7 @@ int vmfs_block_zeroize_fb(const vmfs_fs_t *fs,uint64_t blk_id)
 int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,                     
                        u_int start,u_int end)
 {     
-   DECL_ALIGNED_BUFFER(buf,fs->pbc->bmh.data_size);
+   vmfs_bitmap_t *pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB);
    uint32_t pbc_entry,pbc_item;
    uint64_t blk_id;
    int i,count = 0;
@@ -221,26 +294,31 @@ int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,
    if (VMFS_BLK_TYPE(pb_blk) != VMFS_BLK_TYPE_PB)
       return(-EINVAL);
 
+   if (!pbc)
+      return(-EIO);
+
+   DECL_ALIGNED_BUFFER_WOL(buf,pbc->bmh.data_size);
+
    pbc_entry = VMFS_BLK_PB_ENTRY(pb_blk);
    pbc_item  = VMFS_BLK_PB_ITEM(pb_blk);
 
-   if (!vmfs_bitmap_get_item(fs->pbc,pbc_entry,pbc_item,buf))
+   if (!vmfs_bitmap_get_item(pbc,pbc_entry,pbc_item,buf))
       return(-EIO);
 
    for(i=start;i<end;i++) {
-      blk_id = read_le64(buf,i*sizeof(uint32_t));
+      blk_id = read_le64(buf,i*sizeof(uint64_t));
 
       if (blk_id != 0) {
          vmfs_block_free(fs,blk_id);
-         write_le32(buf,i*sizeof(uint32_t),0);
+         write_le64(buf,i*sizeof(uint64_t),0);
          count++;
       }
    }
 
-   if ((start == 0) && (end == (buf_len / sizeof(uint32_t))))
+   if ((start == 0) && (end == vmfs_bitmap_ptrs_per_item(pbc)))
       vmfs_block_free(fs,pb_blk);
    else {
-      if (!vmfs_bitmap_set_item(fs->pbc,pbc_entry,pbc_item,buf))
+      if (!vmfs_bitmap_set_item(pbc,pbc_entry,pbc_item,buf))
          return(-EIO);
    }
 
@@ -251,20 +329,25 @@ int vmfs_block_free_pb(const vmfs_fs_t *fs,uint32_t pb_blk,
 ssize_t vmfs_block_read_sb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
                            u_char *buf,size_t len)
 {
-   DECL_ALIGNED_BUFFER_WOL(tmpbuf,fs->sbc->bmh.data_size);
+   vmfs_bitmap_t *sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB);
    uint32_t offset,sbc_entry,sbc_item;
    size_t clen;
-   dprintf("blk_id 0x%016lx fs->sbc->bmh.data_size %u\n", blk_id, fs->sbc->bmh.data_size);
 
-   offset = pos % fs->sbc->bmh.data_size;
-   clen   = m_min(fs->sbc->bmh.data_size - offset,len);
+   if (!sbc)
+      return(-EIO);
+
+   DECL_ALIGNED_BUFFER_WOL(tmpbuf,sbc->bmh.data_size);
+   dprintf("blk_id 0x%016lx sbc->bmh.data_size %u\n", blk_id, sbc->bmh.data_size);
+
+   offset = pos % sbc->bmh.data_size;
+   clen   = m_min(sbc->bmh.data_size - offset,len);
    sbc_entry = VMFS_BLK_SB_ENTRY(blk_id);
    sbc_item  = VMFS_BLK_SB_ITEM(blk_id);
    dprintf("entry %lu %u item %lu %u (%lx %lx)\n", 
 		VMFS_BLK_SB_ENTRY(blk_id), sbc_entry, VMFS_BLK_SB_ITEM(blk_id), sbc_item,
 		VMFS_BLK_VALUE(blk_id, VMFS_BLK_SB_ITEM_LSB_MASK),
 		VMFS_BLK_FILL(VMFS_BLK_VALUE(blk_id, VMFS_BLK_SB_ITEM_LSB_MASK), VMFS_BLK_SB_ITEM_VALUE_LSB_MASK) );
-   if (!vmfs_bitmap_get_item(fs->sbc,sbc_entry,sbc_item,tmpbuf))
+   if (!vmfs_bitmap_get_item(sbc,sbc_entry,sbc_item,tmpbuf))
       return(-EIO);
 
    memcpy(buf,tmpbuf+offset,clen);
@@ -275,62 +358,54 @@ ssize_t vmfs_block_read_sb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
 ssize_t vmfs_block_write_sb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
                             u_char *buf,size_t len)
 {
-   DECL_ALIGNED_BUFFER_WOL(tmpbuf,fs->sbc->bmh.data_size);
+   vmfs_bitmap_t *sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB);
    uint32_t offset,sbc_entry,sbc_item;
    size_t clen;
 
-   offset = pos % fs->sbc->bmh.data_size;
-   clen   = m_min(fs->sbc->bmh.data_size - offset,len);
+   if (!sbc)
+      return(-EIO);
+
+   DECL_ALIGNED_BUFFER_WOL(tmpbuf,sbc->bmh.data_size);
+
+   offset = pos % sbc->bmh.data_size;
+   clen   = m_min(sbc->bmh.data_size - offset,len);
 
    sbc_entry = VMFS_BLK_SB_ENTRY(blk_id);
    sbc_item  = VMFS_BLK_SB_ITEM(blk_id);
 
    /* If we write completely the sub-block, no need to read something */
-   if (!offset && (clen == fs->sbc->bmh.data_size)) {
-      if (!vmfs_bitmap_set_item(fs->sbc,sbc_entry,sbc_item,tmpbuf))
+   if (!offset && (clen == sbc->bmh.data_size)) {
+      if (!vmfs_bitmap_set_item(sbc,sbc_entry,sbc_item,tmpbuf))
          return(-EIO);
       
       return(clen);
    }
 
    /* Read the full block and update a piece of it */
-   if (!vmfs_bitmap_get_item(fs->sbc,sbc_entry,sbc_item,tmpbuf))
+   if (!vmfs_bitmap_get_item(sbc,sbc_entry,sbc_item,tmpbuf))
       return(-EIO);
 
    memcpy(tmpbuf+offset,buf,clen);
 
-   if (!vmfs_bitmap_set_item(fs->sbc,sbc_entry,sbc_item,tmpbuf))
+   if (!vmfs_bitmap_set_item(sbc,sbc_entry,sbc_item,tmpbuf))
       return(-EIO);
 
    return(clen);
 }
 
-/* Read a piece of a file block */
-ssize_t vmfs_block_read_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
-                           u_char *buf,size_t len)
+/* Read data from file blocks, given the first block item and an offset */
+static ssize_t vmfs_block_read_fb_range(const vmfs_fs_t *fs,uint32_t fb_item,
+                                        uint64_t offset,u_char *buf,
+                                        size_t clen)
 {
-   uint64_t offset,n_offset,blk_size;
-   size_t clen,n_clen;
-   uint32_t fb_item;
+   uint64_t n_offset;
+   size_t n_clen;
    u_char *tmpbuf;
 
-   blk_size = vmfs_fs_get_blocksize(fs);
-
-   offset = pos % blk_size;
-   clen   = m_min(blk_size - offset,len);
-
    /* Use "normalized" offset / length to access data (for direct I/O) */
    n_offset = offset & ~(M_DIO_BLK_SIZE - 1);
    n_clen   = ALIGN_NUM(clen + (offset - n_offset),M_DIO_BLK_SIZE);
 
-   fb_item = VMFS_BLK_FB_ITEM(blk_id);
-
-   dprintf("blk id %lx %lx %lx %lx\n", 
-      VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_LSB_MASK), 
-	  VMFS_BLK_FILL(VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_LSB_MASK), VMFS_BLK_FB_ITEM_VALUE_LSB_MASK),
-	  VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_MSB_MASK), 
-      VMFS_BLK_FILL(VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_MSB_MASK), VMFS_BLK_FB_ITEM_VALUE_MSB_MASK));
-
    /* If everything is aligned for direct I/O, store directly in user buffer */
    if ((n_offset == offset) && (n_clen == clen) &&
        ALIGN_CHECK((uintptr_t)buf,M_DIO_BLK_SIZE))
@@ -343,20 +418,55 @@ ssize_t vmfs_block_read_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
    }
 
    /* Allocate a temporary buffer and copy result to user buffer */
-   if (!(tmpbuf = iobuffer_alloc(n_clen)))
+   VMFS_STATS_INC(fs->stats,read_unaligned);
+
+   if (!(tmpbuf = vmfs_iopool_get(fs->iopool,n_clen)))
       return(-1);
    dprintf("2: fb_item %d n_offset %lu off %lu sz %lu (0x%lx) %lu\n", fb_item, n_offset, offset, n_clen, n_clen, clen);
    if (vmfs_fs_read(fs,fb_item,n_offset,tmpbuf,n_clen) != n_clen) {
-      iobuffer_free(tmpbuf);
+      vmfs_iopool_put(fs->iopool,tmpbuf,n_clen);
       return(-EIO);
    }
 
    memcpy(buf,tmpbuf+(offset-n_offset),clen);
 
-   iobuffer_free(tmpbuf);
+   vmfs_iopool_put(fs->iopool,tmpbuf,n_clen);
    return(clen);
 }
 
+/* Read a piece of a file block */
+ssize_t vmfs_block_read_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
+                           u_char *buf,size_t len)
+{
+   uint64_t offset,blk_size;
+   size_t clen;
+
+   blk_size = vmfs_fs_get_blocksize(fs);
+
+   offset = pos % blk_size;
+   clen   = m_min(blk_size - offset,len);
+
+   dprintf("blk id %lx %lx %lx %lx\n", 
+      VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_LSB_MASK), 
+	  VMFS_BLK_FILL(VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_LSB_MASK), VMFS_BLK_FB_ITEM_VALUE_LSB_MASK),
+	  VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_MSB_MASK), 
+      VMFS_BLK_FILL(VMFS_BLK_VALUE(blk_id, VMFS_BLK_FB_ITEM_MSB_MASK), VMFS_BLK_FB_ITEM_VALUE_MSB_MASK));
+
+   return(vmfs_block_read_fb_range(fs,VMFS_BLK_FB_ITEM(blk_id),
+                                   offset,buf,clen));
+}
+
+/* 
+ * Read a piece of a run of physically contiguous file blocks, starting
+ * with the specified block.
+ */
+ssize_t vmfs_block_read_fb_run(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
+                               u_char *buf,size_t len)
+{
+   return(vmfs_block_read_fb_range(fs,VMFS_BLK_FB_ITEM(blk_id),
+                                   pos % vmfs_fs_get_blocksize(fs),buf,len));
+}
+
 /* Write a piece of a file block */
 ssize_t vmfs_block_write_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
                             u_char *buf,size_t len)
@@ -391,7 +501,9 @@ ssize_t vmfs_block_write_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
    }
 
    /* Allocate a temporary buffer */
-   if (!(tmpbuf = iobuffer_alloc(n_clen)))
+   VMFS_STATS_INC(fs->stats,write_unaligned);
+
+   if (!(tmpbuf = vmfs_iopool_get(fs->iopool,n_clen)))
       return(-1);
 
    /* Read the original block and add user data */
@@ -404,11 +516,11 @@ ssize_t vmfs_block_write_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
    if (vmfs_fs_write(fs,fb_item,n_offset,tmpbuf,n_clen) != n_clen)
       goto err_io;
 
-   iobuffer_free(tmpbuf);
+   vmfs_iopool_put(fs->iopool,tmpbuf,n_clen);
    return(clen);
 
  err_io:
-   iobuffer_free(tmpbuf);
+   vmfs_iopool_put(fs->iopool,tmpbuf,n_clen);
    return(-EIO);
 }
 
@@ -455,16 +567,18 @@ ssize_t vmfs_block_read_lfb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
    }
 
    /* Allocate a temporary buffer and copy result to user buffer */
-   if (!(tmpbuf = iobuffer_alloc(n_clen)))
+   VMFS_STATS_INC(fs->stats,read_unaligned);
+
+   if (!(tmpbuf = vmfs_iopool_get(fs->iopool,n_clen)))
       return(-1);
    dprintf("2: fb_item %d n_offset %lu off %lu sz %lu (0x%lx) %lu\n", fb_item, n_offset, offset, n_clen, n_clen, clen);
    if (vmfs_fs_read(fs,fb_item,n_offset,tmpbuf,n_clen) != n_clen) {
-      iobuffer_free(tmpbuf);
+      vmfs_iopool_put(fs->iopool,tmpbuf,n_clen);
       return(-EIO);
    }
 
    memcpy(buf,tmpbuf+(offset-n_offset),clen);
 
-   iobuffer_free(tmpbuf);
+   vmfs_iopool_put(fs->iopool,tmpbuf,n_clen);
    return(clen);
 }
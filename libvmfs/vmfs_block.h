@@ -78,6 +78,8 @@ enum vmfs_block_type {
 
 #define VMFS_BLK_FB_TBZ_CLEAR(blk_id) ((blk_id) & ~(VMFS_BLK_FILL(VMFS_BLK_FB_TBZ_FLAG, VMFS_BLK_FB_FLAGS_MASK)))
 
+#define VMFS_BLK_FB_TBZ_SET(blk_id) ((blk_id) | VMFS_BLK_FILL(VMFS_BLK_FB_TBZ_FLAG, VMFS_BLK_FB_FLAGS_MASK))
+
 #define VMFS_BLK_FB_BUILD(item, flags) \
    (VMFS_BLK_FILL(VMFS_BLK_VALUE(item, VMFS_BLK_FB_ITEM_VALUE_LSB_MASK), VMFS_BLK_FB_ITEM_LSB_MASK) | \
 	VMFS_BLK_FILL(VMFS_BLK_VALUE(item, VMFS_BLK_FB_ITEM_VALUE_MSB_MASK), VMFS_BLK_FB_ITEM_MSB_MASK) | \
@@ -223,6 +225,15 @@ int vmfs_block_free(const vmfs_fs_t *fs,uint64_t blk_id);
 /* Allocate a single block */
 int vmfs_block_alloc(const vmfs_fs_t *fs,uint32_t blk_type,uint64_t *blk_id);
 
+/* 
+ * Allocate up to "max" physically contiguous file blocks, as close as
+ * possible to the "hint" file block address, or to the allocation cursor
+ * of the filesystem if 0. Returns the number of blocks allocated, the
+ * first one being stored in "blk_id".
+ */
+int vmfs_block_alloc_fb_extent(const vmfs_fs_t *fs,uint32_t hint,u_int max,
+                               uint64_t *blk_id);
+
 /* Zeroize a file block */
 int vmfs_block_zeroize_fb(const vmfs_fs_t *fs,uint64_t blk_id);
 
@@ -242,6 +253,13 @@ ssize_t vmfs_block_write_sb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
 ssize_t vmfs_block_read_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
                            u_char *buf,size_t len);
 
+/* 
+ * Read a piece of a run of physically contiguous file blocks, starting
+ * with the specified block.
+ */
+ssize_t vmfs_block_read_fb_run(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
+                               u_char *buf,size_t len);
+
 /* Write a piece of a file block */
 ssize_t vmfs_block_write_fb(const vmfs_fs_t *fs,uint64_t blk_id,off_t pos,
                             u_char *buf,size_t len);
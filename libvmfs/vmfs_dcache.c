@@ -0,0 +1,242 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Directory entry cache, used by path resolution.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vmfs.h"
+
+/* Hash function for (parent, name) keys (FNV-1a) */
+static inline uint32_t vmfs_dcache_hash(uint32_t parent,const char *name)
+{
+   uint32_t hash = 2166136261U ^ parent;
+
+   while(*name) {
+      hash ^= (u_char)*name++;
+      hash *= 16777619U;
+   }
+
+   return(hash);
+}
+
+/* Remove an entry from its hash bucket (cache locked) */
+static void vmfs_dcache_unhash(struct vmfs_dcache_entry *e)
+{
+   if (e->next != NULL)
+      e->next->pprev = e->pprev;
+
+   *(e->pprev) = e->next;
+   e->pprev = NULL;
+   e->next = NULL;
+   e->parent = 0;
+}
+
+/* Move an entry at the head of the LRU list (cache locked) */
+static void vmfs_dcache_touch(vmfs_dcache_t *dc,struct vmfs_dcache_entry *e)
+{
+   if (dc->lru_head == e)
+      return;
+
+   /* Unlink */
+   e->lru_prev->lru_next = e->lru_next;
+   if (e->lru_next)
+      e->lru_next->lru_prev = e->lru_prev;
+   else
+      dc->lru_tail = e->lru_prev;
+
+   /* Insert at head */
+   e->lru_prev = NULL;
+   e->lru_next = dc->lru_head;
+   dc->lru_head->lru_prev = e;
+   dc->lru_head = e;
+}
+
+/* Move an unused entry at the tail of the LRU list (cache locked) */
+static void vmfs_dcache_retire(vmfs_dcache_t *dc,struct vmfs_dcache_entry *e)
+{
+   vmfs_dcache_unhash(e);
+
+   if (dc->lru_tail == e)
+      return;
+
+   if (e->lru_prev)
+      e->lru_prev->lru_next = e->lru_next;
+   else
+      dc->lru_head = e->lru_next;
+   e->lru_next->lru_prev = e->lru_prev;
+
+   e->lru_next = NULL;
+   e->lru_prev = dc->lru_tail;
+   dc->lru_tail->lru_next = e;
+   dc->lru_tail = e;
+}
+
+/* Find an entry (cache locked) */
+static struct vmfs_dcache_entry *
+vmfs_dcache_find(vmfs_dcache_t *dc,uint32_t parent,const char *name,
+                 uint32_t hash)
+{
+   struct vmfs_dcache_entry *e;
+
+   for(e=dc->buckets[hash & (VMFS_DCACHE_BUCKETS - 1)];e;e=e->next)
+      if ((e->hash == hash) && (e->parent == parent) &&
+          !strcmp(e->dirent.name,name))
+         return e;
+
+   return NULL;
+}
+
+/* Create a directory entry cache */
+vmfs_dcache_t *vmfs_dcache_create(void)
+{
+   vmfs_dcache_t *dc;
+   int i;
+
+   if (!(dc = calloc(1,sizeof(*dc))))
+      return NULL;
+
+   if (!(dc->entries = calloc(VMFS_DCACHE_ENTRIES,sizeof(*dc->entries)))) {
+      free(dc);
+      return NULL;
+   }
+
+   /* Chain all the (unused) entries in the LRU list */
+   for(i=0;i<VMFS_DCACHE_ENTRIES;i++) {
+      dc->entries[i].lru_prev = (i > 0) ? &dc->entries[i-1] : NULL;
+      dc->entries[i].lru_next =
+         (i < VMFS_DCACHE_ENTRIES - 1) ? &dc->entries[i+1] : NULL;
+   }
+
+   dc->lru_head = &dc->entries[0];
+   dc->lru_tail = &dc->entries[VMFS_DCACHE_ENTRIES - 1];
+
+   pthread_mutex_init(&dc->lock,NULL);
+   return dc;
+}
+
+/* Destroy a directory entry cache */
+void vmfs_dcache_destroy(vmfs_dcache_t *dc)
+{
+   if (!dc)
+      return;
+
+   pthread_mutex_destroy(&dc->lock);
+   free(dc->entries);
+   free(dc);
+}
+
+/*
+ * Look for a name in a directory. Returns 1 and fills "entry" if the name
+ * exists, 0 if it is known not to exist, and -1 if it is not cached.
+ */
+int vmfs_dcache_lookup(vmfs_dcache_t *dc,uint32_t parent,const char *name,
+                       vmfs_dirent_t *entry)
+{
+   struct vmfs_dcache_entry *e;
+   int res = -1;
+
+   pthread_mutex_lock(&dc->lock);
+
+   if ((e = vmfs_dcache_find(dc,parent,name,vmfs_dcache_hash(parent,name)))) {
+      vmfs_dcache_touch(dc,e);
+
+      if (e->negative) {
+         res = 0;
+      } else {
+         *entry = e->dirent;
+         res = 1;
+      }
+      dc->hits++;
+   } else
+      dc->misses++;
+
+   pthread_mutex_unlock(&dc->lock);
+   return(res);
+}
+
+/* Record the result of a lookup, "entry" being NULL for a missing name */
+void vmfs_dcache_add(vmfs_dcache_t *dc,uint32_t parent,const char *name,
+                     const vmfs_dirent_t *entry)
+{
+   uint32_t hash = vmfs_dcache_hash(parent,name);
+   struct vmfs_dcache_entry *e,**bucket;
+
+   if (strlen(name) >= sizeof(e->dirent.name))
+      return;
+
+   pthread_mutex_lock(&dc->lock);
+
+   /* Reuse the least recently used entry if not already present */
+   if (!(e = vmfs_dcache_find(dc,parent,name,hash))) {
+      e = dc->lru_tail;
+      if (e->pprev)
+         vmfs_dcache_unhash(e);
+
+      bucket = &dc->buckets[hash & (VMFS_DCACHE_BUCKETS - 1)];
+      e->next  = *bucket;
+      e->pprev = bucket;
+
+      if (e->next != NULL)
+         e->next->pprev = &e->next;
+
+      *bucket = e;
+   }
+
+   e->parent = parent;
+   e->hash = hash;
+
+   if (entry) {
+      e->negative = false;
+      e->dirent = *entry;
+   } else {
+      e->negative = true;
+      memset(&e->dirent,0,sizeof(e->dirent));
+      strcpy(e->dirent.name,name);
+   }
+
+   vmfs_dcache_touch(dc,e);
+   pthread_mutex_unlock(&dc->lock);
+}
+
+/* Drop the cached result for a name in a directory */
+void vmfs_dcache_invalidate(vmfs_dcache_t *dc,uint32_t parent,
+                            const char *name)
+{
+   struct vmfs_dcache_entry *e;
+
+   pthread_mutex_lock(&dc->lock);
+
+   if ((e = vmfs_dcache_find(dc,parent,name,vmfs_dcache_hash(parent,name))))
+      vmfs_dcache_retire(dc,e);
+
+   pthread_mutex_unlock(&dc->lock);
+}
+
+/* Drop all cached entries of a directory */
+void vmfs_dcache_invalidate_dir(vmfs_dcache_t *dc,uint32_t parent)
+{
+   int i;
+
+   pthread_mutex_lock(&dc->lock);
+
+   for(i=0;i<VMFS_DCACHE_ENTRIES;i++)
+      if (dc->entries[i].pprev && (dc->entries[i].parent == parent))
+         vmfs_dcache_retire(dc,&dc->entries[i]);
+
+   pthread_mutex_unlock(&dc->lock);
+}
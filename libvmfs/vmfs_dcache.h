@@ -0,0 +1,75 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_DCACHE_H
+#define VMFS_DCACHE_H
+
+#include <stdbool.h>
+
+/*
+ * Directory entry cache, keyed by (parent directory block id, name).
+ * Negative entries record names known not to exist.
+ * VMFS_DCACHE_BUCKETS must be a power of two.
+ */
+#define VMFS_DCACHE_BUCKETS  1024
+#define VMFS_DCACHE_ENTRIES  4096
+
+struct vmfs_dcache_entry {
+   uint32_t parent;          /* 0 means the entry is unused */
+   uint32_t hash;
+   bool negative;
+   vmfs_dirent_t dirent;
+
+   struct vmfs_dcache_entry **pprev,*next;
+   struct vmfs_dcache_entry *lru_prev,*lru_next;
+};
+
+struct vmfs_dcache {
+   pthread_mutex_t lock;
+   struct vmfs_dcache_entry *buckets[VMFS_DCACHE_BUCKETS];
+   struct vmfs_dcache_entry *entries;
+
+   /* All entries, most recently used first */
+   struct vmfs_dcache_entry *lru_head,*lru_tail;
+
+   /* Statistics */
+   uint64_t hits,misses;
+};
+
+/* Create a directory entry cache */
+vmfs_dcache_t *vmfs_dcache_create(void);
+
+/* Destroy a directory entry cache */
+void vmfs_dcache_destroy(vmfs_dcache_t *dc);
+
+/*
+ * Look for a name in a directory. Returns 1 and fills "entry" if the name
+ * exists, 0 if it is known not to exist, and -1 if it is not cached.
+ */
+int vmfs_dcache_lookup(vmfs_dcache_t *dc,uint32_t parent,const char *name,
+                       vmfs_dirent_t *entry);
+
+/* Record the result of a lookup, "entry" being NULL for a missing name */
+void vmfs_dcache_add(vmfs_dcache_t *dc,uint32_t parent,const char *name,
+                     const vmfs_dirent_t *entry);
+
+/* Drop the cached result for a name in a directory */
+void vmfs_dcache_invalidate(vmfs_dcache_t *dc,uint32_t parent,
+                            const char *name);
+
+/* Drop all cached entries of a directory */
+void vmfs_dcache_invalidate_dir(vmfs_dcache_t *dc,uint32_t parent);
+
+#endif
@@ -19,6 +19,19 @@
 
 #include "vmfs.h"
 
+/* Asynchronous I/O request */
+#define VMFS_IO_READ   0x01
+#define VMFS_IO_WRITE  0x02
+
+struct vmfs_io_req {
+   u_int op;
+   u_char *buf;
+   size_t len;
+   ssize_t res;   /* Bytes transferred or negative errno, once done */
+   bool done;
+   off_t dev_pos; /* Private to the device */
+};
+
 struct vmfs_device {
    ssize_t (*read)(const vmfs_device_t *dev, off_t pos,
                    u_char *buf, size_t len);
@@ -27,37 +40,176 @@ struct vmfs_device {
    int (*reserve)(const vmfs_device_t *dev, off_t pos);
    int (*release)(const vmfs_device_t *dev, off_t pos);
    void (*close)(vmfs_device_t *dev);
+
+   /* 
+    * Optional asynchronous interface: submit() queues a request at the
+    * given position, complete() waits until at least "min" of the queued
+    * requests are done and returns the number of completed requests.
+    */
+   int (*submit)(const vmfs_device_t *dev, vmfs_io_req_t *req, off_t pos);
+   int (*complete)(const vmfs_device_t *dev, u_int min);
+
+   /* 
+    * Optional: get a file descriptor and the offset at which the given
+    * range can be accessed directly, e.g. to splice it.
+    */
+   int (*map_fd)(const vmfs_device_t *dev, off_t pos, size_t len,
+                 int *fd, off_t *fd_pos);
+
+   /* 
+    * Optional: get a pointer to the given range in memory, valid until the
+    * device is closed, to decode it without copying it.
+    */
+   const u_char *(*borrow)(const vmfs_device_t *dev, off_t pos, size_t len);
+
+   /* 
+    * Optional: called in a child process after fork(), to set up again
+    * the state which can't be shared with the parent, e.g. I/O rings.
+    */
+   void (*atfork_child)(vmfs_device_t *dev);
+
    uuid_t *uuid;
+
+   /* Optional: counters updated by the wrappers below */
+   vmfs_stats_t *stats;
 };
 
 static inline ssize_t vmfs_device_read(const vmfs_device_t *dev, off_t pos,
                                        u_char *buf, size_t len)
 {
-   return dev->read(dev, pos, buf, len);
+   uint64_t start;
+   ssize_t res;
+
+   if (!dev->stats)
+      return dev->read(dev, pos, buf, len);
+
+   start = vmfs_stats_now();
+   res = dev->read(dev, pos, buf, len);
+   vmfs_stats_op_end(&dev->stats->dev_read, start, res, len);
+   return res;
 }
 
 static inline ssize_t vmfs_device_write(const vmfs_device_t *dev, off_t pos,
                                         const u_char *buf, size_t len)
 {
-   if (dev->write)
+   uint64_t start;
+   ssize_t res;
+
+   if (!dev->write)
+      return -1;
+
+   if (!dev->stats)
       return dev->write(dev, pos, buf, len);
-   return -1;
+
+   start = vmfs_stats_now();
+   res = dev->write(dev, pos, buf, len);
+   vmfs_stats_op_end(&dev->stats->dev_write, start, res, len);
+   return res;
 }
 
 static inline int vmfs_device_reserve(const vmfs_device_t *dev, off_t pos)
 {
-   if (dev->reserve)
-     return dev->reserve(dev, pos);
-   return 0;
+   uint64_t start;
+   int res;
+
+   if (!dev->reserve)
+      return 0;
+
+   if (!dev->stats)
+      return dev->reserve(dev, pos);
+
+   start = vmfs_stats_now();
+   res = dev->reserve(dev, pos);
+   vmfs_stats_op_end(&dev->stats->reserve, start, res, 0);
+   return res;
 }
 
 static inline int vmfs_device_release(const vmfs_device_t *dev, off_t pos)
 {
-   if (dev->release)
-     return dev->release(dev, pos);
+   if (!dev->release)
+      return 0;
+
+   if (dev->stats)
+      VMFS_STATS_INC(dev->stats, release);
+
+   return dev->release(dev, pos);
+}
+
+/* 
+ * Queue an I/O request. Devices without asynchronous support process it
+ * immediately.
+ */
+static inline int vmfs_device_submit(const vmfs_device_t *dev,
+                                     vmfs_io_req_t *req, off_t pos)
+{
+   uint64_t start;
+   int res;
+
+   req->done = 0;
+
+   if (dev->submit) {
+      if (!dev->stats)
+         return dev->submit(dev, req, pos);
+
+      /* Only the submission is timed */
+      start = vmfs_stats_now();
+      res = dev->submit(dev, req, pos);
+      vmfs_stats_op_end(&dev->stats->dev_submit, start,
+                        (res < 0) ? res : (ssize_t)req->len, req->len);
+      return res;
+   }
+
+   if (req->op == VMFS_IO_WRITE)
+      req->res = vmfs_device_write(dev, pos, req->buf, req->len);
+   else
+      req->res = vmfs_device_read(dev, pos, req->buf, req->len);
+   req->done = 1;
    return 0;
 }
 
+/* Wait for at least "min" queued requests to be done */
+static inline int vmfs_device_complete(const vmfs_device_t *dev, u_int min)
+{
+   if (dev->complete)
+      return dev->complete(dev, min);
+   return 0;
+}
+
+/* Get a file descriptor and offset giving direct access to a range */
+static inline int vmfs_device_map_fd(const vmfs_device_t *dev, off_t pos,
+                                     size_t len, int *fd, off_t *fd_pos)
+{
+   uint64_t start;
+   int res;
+
+   if (!dev->map_fd)
+      return -1;
+
+   if (!dev->stats)
+      return dev->map_fd(dev, pos, len, fd, fd_pos);
+
+   /* The data is read by the caller, count it as mapped */
+   start = vmfs_stats_now();
+   res = dev->map_fd(dev, pos, len, fd, fd_pos);
+   vmfs_stats_op_end(&dev->stats->dev_map, start, res ? -1 : len, len);
+   return res;
+}
+
+/* Get a pointer to a range in memory, NULL if it has to be read */
+static inline const u_char *vmfs_device_borrow(const vmfs_device_t *dev,
+                                               off_t pos, size_t len)
+{
+   if (dev->borrow)
+      return dev->borrow(dev, pos, len);
+   return NULL;
+}
+
+static inline void vmfs_device_atfork_child(vmfs_device_t *dev)
+{
+   if (dev->atfork_child)
+      dev->atfork_child(dev);
+}
+
 static inline void vmfs_device_close(vmfs_device_t *dev)
 {
    if (dev->close)
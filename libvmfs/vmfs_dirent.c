@@ -47,18 +47,254 @@ static int vmfs_dirent_write(const vmfs_dirent_t *entry,u_char *buf)
    return(0);
 }
 
+/* Hash function for entry names (FNV-1a) */
+static inline uint32_t vmfs_dir_hash_name(const char *name)
+{
+   uint32_t hash = 2166136261U;
+
+   while(*name) {
+      hash ^= (u_char)*name++;
+      hash *= 16777619U;
+   }
+
+   return(hash);
+}
+
+/* Build the name index of a directory */
+static int vmfs_dir_build_index(vmfs_dir_t *d)
+{
+   const vmfs_dirent_t *rec;
+   uint32_t size,max_entries,i;
+
+   /* Upper bound on the number of entries, to keep the table half empty */
+   max_entries = vmfs_file_get_size(d->dir) / VMFS_DIRENT_SIZE + 2;
+   for(size=16;size<2*max_entries;size<<=1);
+
+   if (!(d->index = calloc(size,sizeof(*d->index))))
+      return(-1);
+
+   d->index_size = size;
+
+   vmfs_dir_seek(d,0);
+   while((rec = vmfs_dir_read(d))) {
+      uint32_t hash = vmfs_dir_hash_name(rec->name);
+
+      for(i=hash;d->index[i & (size - 1)].pos;i++);
+      d->index[i & (size - 1)].hash = hash;
+      d->index[i & (size - 1)].pos  = d->pos;
+   }
+
+   d->index_end = d->pos;
+   return(0);
+}
+
+/* Drop the name index of a directory */
+static void vmfs_dir_free_index(vmfs_dir_t *d)
+{
+   free(d->index);
+   d->index = NULL;
+   d->index_size = 0;
+}
+
+/* Release a reference on the shared content of a directory */
+static void vmfs_dir_cache_put(struct vmfs_dir_cache *dc)
+{
+   u_int i;
+
+   if (!dc || (__atomic_sub_fetch(&dc->ref_count,1,__ATOMIC_ACQ_REL) != 0))
+      return;
+
+   for(i=0;i<dc->page_count;i++)
+      free(dc->pages[i]);
+
+   pthread_mutex_destroy(&dc->lock);
+   free(dc->pages);
+   free(dc->ar_hb_exist);
+   free(dc);
+}
+
+/* Create the shared content of a directory, reading only its page map */
+static struct vmfs_dir_cache *vmfs_dir_cache_create(vmfs_file_t *f)
+{
+   struct vmfs_dir_cache *dc;
+   size_t map_len;
+
+   if (!(dc = calloc(1,sizeof(*dc))))
+      return NULL;
+
+   dc->ref_count = 1;
+   dc->data_seq = f->inode->data_seq;
+   dc->size = vmfs_file_get_size(f);
+   dc->page_count = (dc->size + VMFS_DIR_PAGE_SIZE - 1) / VMFS_DIR_PAGE_SIZE;
+   pthread_mutex_init(&dc->lock,NULL);
+   dprintf("dir size %ld\n", dc->size);
+
+   if (!(dc->pages = calloc(dc->page_count ? dc->page_count : 1,
+                            sizeof(*dc->pages))))
+      goto err;
+
+   /* Entries are only read, and may be used in place from a mapping */
+   dc->map = vmfs_file_borrow(f,0,dc->size);
+
+   /* One nibble per page, pages being counted from the page map */
+   map_len = (dc->size + 8191) / (VMFS_DIR_PAGE_SIZE * 2);
+
+   if (dc->size >= VMFS_DIR_OFS_PAGE_MAP + map_len) {
+      if (!(dc->ar_hb_exist = calloc(1,map_len)))
+         goto err;
+
+      if (dc->map)
+         memcpy(dc->ar_hb_exist,dc->map + VMFS_DIR_OFS_PAGE_MAP,map_len);
+      else if (vmfs_file_pread(f,dc->ar_hb_exist,map_len,
+                               VMFS_DIR_OFS_PAGE_MAP) != map_len)
+         goto err;
+   }
+
+   return dc;
+
+ err:
+   vmfs_dir_cache_put(dc);
+   return NULL;
+}
+
+/* Get the shared content of a directory, creating it if missing or stale */
+static struct vmfs_dir_cache *vmfs_dir_cache_get(vmfs_file_t *f)
+{
+   vmfs_inode_t *inode = f->inode;
+   struct vmfs_dir_cache *dc,*cur;
+
+   cur = __atomic_load_n(&inode->dir_cache,__ATOMIC_ACQUIRE);
+
+   if (cur && (cur->data_seq == inode->data_seq)) {
+      __atomic_add_fetch(&cur->ref_count,1,__ATOMIC_ACQ_REL);
+      VMFS_STATS_INC(inode->fs->stats,dir_cache_hits);
+      return cur;
+   }
+
+   VMFS_STATS_INC(inode->fs->stats,dir_cache_misses);
+
+   if (!(dc = vmfs_dir_cache_create(f)))
+      return NULL;
+
+   /* 
+    * The inode keeps a reference on the new content. If another handle
+    * already replaced the stale one, ours is simply not shared.
+    */
+   __atomic_add_fetch(&dc->ref_count,1,__ATOMIC_ACQ_REL);
+
+   if (__atomic_compare_exchange_n(&inode->dir_cache,&cur,dc,0,
+                                   __ATOMIC_RELEASE,__ATOMIC_ACQUIRE))
+      vmfs_dir_cache_put(cur);
+   else
+      __atomic_sub_fetch(&dc->ref_count,1,__ATOMIC_ACQ_REL);
+
+   return dc;
+}
+
+/* Drop the reference of a directory inode on its shared content */
+void vmfs_dir_cache_drop(vmfs_inode_t *inode)
+{
+   struct vmfs_dir_cache *dc = inode->dir_cache;
+
+   inode->dir_cache = NULL;
+   vmfs_dir_cache_put(dc);
+}
+
+/* 
+ * Get the page of a directory holding the entry at the given offset, reading
+ * it on first access. Returns NULL past the end of the directory.
+ */
+static const u_char *vmfs_dir_cache_page(struct vmfs_dir_cache *dc,
+                                         vmfs_file_t *f,uint32_t off)
+{
+   uint32_t page = off / VMFS_DIR_PAGE_SIZE;
+   off_t page_pos = (off_t)page * VMFS_DIR_PAGE_SIZE;
+   size_t len;
+   u_char *buf;
+
+   if (off + VMFS_DIRENT_SIZE > dc->size)
+      return NULL;
+
+   if (dc->map)
+      return(dc->map + page_pos);
+
+   pthread_mutex_lock(&dc->lock);
+
+   if (!(buf = dc->pages[page]) && (buf = malloc(VMFS_DIR_PAGE_SIZE))) {
+      len = m_min(VMFS_DIR_PAGE_SIZE,dc->size - page_pos);
+      dprintf("%s : read page %u\n", __FUNCTION__, page);
+
+      if (vmfs_file_pread(f,buf,len,page_pos) != len) {
+         free(buf);
+         buf = NULL;
+      } else
+         dc->pages[page] = buf;
+   }
+
+   pthread_mutex_unlock(&dc->lock);
+   return buf;
+}
+
+/* Get the content of a directory up to date */
+static int vmfs_dir_cache_entries(vmfs_dir_t *d)
+{
+   vmfs_dir_cache_put(d->cache);
+
+   /* Entries may have changed */
+   vmfs_dir_free_index(d);
+
+   if (!(d->cache = vmfs_dir_cache_get(d->dir)))
+      return(-1);
+
+   return(0);
+}
+
+/* Check that the content of a directory is still valid */
+static inline void vmfs_dir_check_cache(vmfs_dir_t *d)
+{
+   if (d->cache && (d->cache->data_seq != d->dir->inode->data_seq))
+      vmfs_dir_cache_entries(d);
+}
+
 /* Search for an entry into a directory ; affects position of the next
 entry vmfs_dir_read will return */
 const vmfs_dirent_t *vmfs_dir_lookup(vmfs_dir_t *d,const char *name)
 {
    const vmfs_dirent_t *rec;
-   vmfs_dir_seek(d,0);
+   uint32_t hash,i;
 
-   while((rec = vmfs_dir_read(d))) {
-      if (!strcmp(rec->name,name))
+   if (d)
+      vmfs_dir_check_cache(d);
+
+   if (d && !d->index)
+      vmfs_dir_build_index(d);
+
+   /* Without index, scan all entries */
+   if (!d || !d->index) {
+      vmfs_dir_seek(d,0);
+
+      while((rec = vmfs_dir_read(d))) {
+         if (!strcmp(rec->name,name))
+            return(rec);
+      }
+
+      return(NULL);
+   }
+
+   hash = vmfs_dir_hash_name(name);
+
+   for(i=hash;d->index[i & (d->index_size - 1)].pos;i++) {
+      struct vmfs_dir_index_slot *slot = &d->index[i & (d->index_size - 1)];
+
+      if (slot->hash != hash)
+         continue;
+
+      vmfs_dir_seek(d,slot->pos - 1);
+      if ((rec = vmfs_dir_read(d)) && !strcmp(rec->name,name))
          return(rec);
    }
 
+   vmfs_dir_seek(d,d->index_end);
    return(NULL);
 }
 
@@ -90,31 +326,87 @@ static char *vmfs_dirent_read_symlink(const vmfs_fs_t *fs,
    return str;
 }
 
+/* Get the block id of an open directory */
+static inline uint32_t vmfs_dir_get_blk_id(vmfs_dir_t *d)
+{
+   return(d->dir->inode->id);
+}
+
+/* 
+ * Search for a name in the directory with the given block id, using the
+ * directory entry cache. "*dir" is the corresponding open directory, if
+ * any, and is opened here when needed (then "*close_dir" is set).
+ * Returns 1 if found, 0 if not, and -1 on error.
+ */
+static int vmfs_dir_lookup_cached(const vmfs_fs_t *fs,uint32_t dir_blk_id,
+                                  vmfs_dir_t **dir,int *close_dir,
+                                  const char *name,vmfs_dirent_t *entry)
+{
+   const vmfs_dirent_t *rec;
+   int res;
+
+   if ((res = vmfs_dcache_lookup(fs->dcache,dir_blk_id,name,entry)) >= 0)
+      return(res);
+
+   if (!*dir) {
+      if (!(*dir = vmfs_dir_open_from_blkid(fs,dir_blk_id)))
+         return(-1);
+      *close_dir = 1;
+   }
+
+   rec = vmfs_dir_lookup(*dir,name);
+   vmfs_dcache_add(fs->dcache,dir_blk_id,name,rec);
+
+   if (!rec)
+      return(0);
+
+   *entry = *rec;
+   return(1);
+}
+
+/* Search for an entry in a directory given by its block id */
+int vmfs_dir_lookup_from_blkid(const vmfs_fs_t *fs,uint32_t dir_blk_id,
+                               const char *name,vmfs_dirent_t *entry)
+{
+   vmfs_dir_t *dir = NULL;
+   int close_dir = 0;
+   int res;
+
+   res = vmfs_dir_lookup_cached(fs,dir_blk_id,&dir,&close_dir,name,entry);
+
+   if (close_dir)
+      vmfs_dir_close(dir);
+
+   return(res);
+}
+
 /* Resolve a path name to a block id */
 uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
                                int follow_symlink)
 {
-   vmfs_dir_t *cur_dir,*sub_dir;
-   const vmfs_dirent_t *rec;
+   vmfs_dir_t *cur_dir;
+   vmfs_dirent_t rec;
+   vmfs_inode_t *inode;
    char *nam, *ptr,*sl,*symlink;
    int close_dir = 0;
    const vmfs_fs_t *fs = vmfs_dir_get_fs(base_dir);
-   uint32_t ret = 0;
+   uint32_t cur_blk_id,type,ret = 0;
    dprintf("look for file %s\n",  path);
 
-   cur_dir = base_dir;
+   if (!fs)
+      return(0);
 
+   /* Directories are only opened when the cache can't answer */
    if (*path == '/') {
-      if (!(cur_dir = vmfs_dir_open_from_blkid(fs,VMFS_BLK_FD_BUILD(0, 0, 0))))
-         return(0);
+      cur_dir = NULL;
+      cur_blk_id = VMFS_BLK_FD_BUILD(0, 0, 0);
       path++;
-      close_dir = 1;
+   } else {
+      cur_dir = base_dir;
+      cur_blk_id = vmfs_dir_get_blk_id(base_dir);
    }
 
-   if (!(rec = vmfs_dir_lookup(cur_dir,".")))
-      return(0);
-
-   ret = rec->block_id;
+   ret = cur_blk_id;
 
    nam = ptr = strdup(path);
    dprintf("start to search %s\n", path);
@@ -129,46 +421,71 @@ uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
          continue;
       }
              
-      if (!(rec = vmfs_dir_lookup(cur_dir,ptr))) {
+      if (vmfs_dir_lookup_cached(fs,cur_blk_id,&cur_dir,&close_dir,
+                                 ptr,&rec) != 1) {
+         errno = ENOENT;
          ret = 0;
          break;
       }
       
-      ret = rec->block_id;
+      ret = rec.block_id;
+      type = rec.type;
 
       if ((sl == NULL) && !follow_symlink)
          break;
 
       /* follow the symlink if we have an entry of this type */
-      if (rec->type == VMFS_FILE_TYPE_SYMLINK) {
-         if (!(symlink = vmfs_dirent_read_symlink(fs,rec))) {
+      if (rec.type == VMFS_FILE_TYPE_SYMLINK) {
+         if (!(symlink = vmfs_dirent_read_symlink(fs,&rec))) {
             ret = 0;
             break;
          }
 
+         /* Relative symlinks need the current directory to be open */
+         if (!cur_dir) {
+            if (!(cur_dir = vmfs_dir_open_from_blkid(fs,cur_blk_id))) {
+               free(symlink);
+               ret = 0;
+               break;
+            }
+            close_dir = 1;
+         }
+
          ret = vmfs_dir_resolve_path(cur_dir,symlink,1);
          free(symlink);
 
          if (!ret)
             break;
+
+         /* Walking through the link depends on what it points to */
+         if (sl != NULL) {
+            if (!(inode = vmfs_inode_acquire(fs,ret))) {
+               ret = 0;
+               break;
+            }
+            type = inode->type;
+            vmfs_inode_release(inode);
+         }
       }
 
       /* last token */
       if (sl == NULL)
          break;
 
-      /* we must have a directory here */
-      if (!(sub_dir = vmfs_dir_open_from_blkid(fs,ret)))
-      {
+      /* Only a directory can be walked through, even with a trailing "/" */
+      if (type != VMFS_FILE_TYPE_DIR) {
+         errno = ENOTDIR;
          ret = 0;
          break;
       }
 
+      /* it is opened on the next miss */
       if (close_dir)
          vmfs_dir_close(cur_dir);
 
-      cur_dir = sub_dir;
-      close_dir = 1;
+      cur_dir = NULL;
+      close_dir = 0;
+      cur_blk_id = ret;
       ptr = sl + 1;
    }
    free(nam);
@@ -179,31 +496,6 @@ uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
    return(ret);
 }
 
-/* Cache content of a directory */
-static int vmfs_dir_cache_entries(vmfs_dir_t *d)
-{
-   off_t dir_size;
-   int cn_page;
-   if (d->buf != NULL)
-      free(d->buf);
-
-   dir_size = vmfs_file_get_size(d->dir);
-   cn_page = (dir_size+8191) / (4096*2); // get ceil number of pages;
-   dprintf("dir size %ld\n", dir_size);
-
-   if (!(d->buf = calloc(1,dir_size)))
-      return(-1);
-   if (!(d->ar_hb_exist = calloc(1, cn_page)))
-      return(-1);
-   if (vmfs_file_pread(d->dir,d->buf,dir_size,0) != dir_size) {
-      free(d->buf);
-      return(-1);
-   }
-   memcpy(d->ar_hb_exist, d->buf+0x10040, cn_page);
-//	hexdump(d->buf, dir_size);
-   return(0);
-}
-
 /* Open a directory file */
 static vmfs_dir_t *vmfs_dir_open_from_file(vmfs_file_t *file)
 {
@@ -257,12 +549,14 @@ by subsequent calls */
 const vmfs_dirent_t *vmfs_dir_read(vmfs_dir_t *d)
 {
    u_char hb;
-   u_char *buf;
+   const u_char *buf,*page;
    uint32_t off=0;   
    uint32_t cn_pages, off_in_page;
    uint32_t cn_dirent_per_page = 4096 / VMFS_DIRENT_SIZE; // 0x1000/0x120 = 0x0e
    if (d == NULL)
       return(NULL);
+
+   vmfs_dir_check_cache(d);
 // weafon: very wired offset, should take time to figure out why 11040
    do {
 	  if (d->pos<2)
@@ -277,12 +571,14 @@ const vmfs_dirent_t *vmfs_dir_read(vmfs_dir_t *d)
 		  off_in_page = (d->pos-2) % cn_dirent_per_page;
 		  off = 0x11000 + cn_pages*0x1000 + 0x40 + (off_in_page*VMFS_DIRENT_SIZE);
 	  }  
-      if (d->ar_hb_exist)
+      if (d->cache && d->cache->ar_hb_exist)
       {
+         u_char *ar_hb_exist = d->cache->ar_hb_exist;
+
          dprintf("%u cn_pages %d ar_hb_exist[%d]:%d 0x%x , watch-hb 0x%x\n",
-         	d->pos, cn_pages, (cn_pages+1)/2,(cn_pages+1)%2, d->ar_hb_exist[(cn_pages+1)/2],
-         	(((d->ar_hb_exist[(cn_pages+1)/2] << (4*((cn_pages+1)%2))) & 0xf0)>>4));
-         hb = (((d->ar_hb_exist[(cn_pages+1)/2] << (4*((cn_pages+1)%2))) & 0xf0)>>4);
+         	d->pos, cn_pages, (cn_pages+1)/2,(cn_pages+1)%2, ar_hb_exist[(cn_pages+1)/2],
+         	(((ar_hb_exist[(cn_pages+1)/2] << (4*((cn_pages+1)%2))) & 0xf0)>>4));
+         hb = (((ar_hb_exist[(cn_pages+1)/2] << (4*((cn_pages+1)%2))) & 0xf0)>>4);
          if ((hb&0x08)>0)
          	return(NULL);
          if ((hb&0x01)==0)
@@ -293,10 +589,10 @@ const vmfs_dirent_t *vmfs_dir_read(vmfs_dir_t *d)
          }
       }
       dprintf("called for off 0x%x d->pos %d 4KB-offset %d\n", off, d->pos, ((d->pos-2)/0x0e));	
-      if (d->buf) {
-	     if (off>= vmfs_file_get_size(d->dir))
-	         return(NULL);
-         buf = &d->buf[off];
+      if (d->cache) {
+         if (!(page = vmfs_dir_cache_page(d->cache,d->dir,off)))
+            return(NULL);
+         buf = page + (off % VMFS_DIR_PAGE_SIZE);
       } else {
          u_char _buf[VMFS_DIRENT_SIZE];
 	     dprintf("%s : call for file_pread off %u d->pos %d\n", __FUNCTION__, off, d->pos);
@@ -317,10 +613,8 @@ int vmfs_dir_close(vmfs_dir_t *d)
    if (d == NULL)
       return(-1);
 
-   if (d->buf)
-      free(d->buf);
-   if (d->ar_hb_exist)
-      free(d->ar_hb_exist);
+   vmfs_dir_cache_put(d->cache);
+   vmfs_dir_free_index(d);
    vmfs_file_close(d->dir);
    free(d);
    return(0);
@@ -331,6 +625,7 @@ int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
 {  
    vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_dir_get_fs(d);
    u_char buf[VMFS_DIRENT_SIZE];
+   vmfs_metadata_txn_t txn;
    vmfs_dirent_t entry;
    off_t dir_size;
    ssize_t res;
@@ -341,6 +636,8 @@ int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
    if (vmfs_dir_lookup(d,name) != NULL)
       return(-EEXIST);
 
+   vmfs_dcache_invalidate(fs->dcache,vmfs_dir_get_blk_id(d),name);
+
    memset(&entry,0,sizeof(entry));
    entry.type      = inode->type;
    entry.block_id  = inode->id;
@@ -350,7 +647,10 @@ int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode)
 
    dir_size = vmfs_file_get_size(d->dir);
 
+   /* Growing the directory may allocate several blocks */
+   vmfs_metadata_txn_begin(fs,&txn);
    res = vmfs_file_pwrite(d->dir,buf,sizeof(buf),dir_size);
+   vmfs_metadata_txn_end(fs,&txn);
 
    if (res != sizeof(buf))
       return((res < 0) ? res : -ENOSPC);
@@ -375,11 +675,14 @@ int vmfs_dir_unlink_inode(vmfs_dir_t *d,off_t pos,vmfs_dirent_t *entry)
    if (!(inode = vmfs_inode_acquire(fs,entry->block_id)))
       return(-ENOENT);
 
+   vmfs_dcache_invalidate(fs->dcache,vmfs_dir_get_blk_id(d),entry->name);
+
    if (!--inode->nlink) {
+      vmfs_file_discard_inode(inode);
       vmfs_inode_truncate(inode,0);
       vmfs_block_free(fs,inode->id);
    } else {
-      inode->update_flags |= VMFS_INODE_SYNC_META;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_META);
    }
 
    vmfs_inode_release(inode);
@@ -405,6 +708,7 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
                     vmfs_inode_t **inode)
 {
    vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_dir_get_fs(d);
+   vmfs_metadata_txn_t txn;
    vmfs_dir_t *new_dir;
    vmfs_inode_t *new_inode;
    int res;
@@ -415,9 +719,12 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    if (vmfs_dir_lookup(d,name))
       return(-EEXIST);
 
+   /* The inode and directory updates share a single reservation */
+   vmfs_metadata_txn_begin(fs,&txn);
+
    /* Allocate inode for the new directory */
    if ((res = vmfs_inode_alloc(fs,VMFS_FILE_TYPE_DIR,mode,&new_inode)) < 0)
-      return(res);
+      goto done;
 
    if (!(new_dir = vmfs_dir_open_from_inode(new_inode))) {
       res = -ENOENT;
@@ -429,10 +736,12 @@ int vmfs_dir_create(vmfs_dir_t *d,const char *name,mode_t mode,
    vmfs_dir_link_inode(d,name,new_inode);
 
    *inode = new_inode;
-   return(0);
+   goto done;
 
  err_open_dir:
    vmfs_inode_release(new_inode);
+ done:
+   vmfs_metadata_txn_end(fs,&txn);
    return(res);
 }
 
@@ -464,7 +773,10 @@ int vmfs_dir_delete(vmfs_dir_t *d,const char *name)
 
    d->dir->inode->nlink--;
    sub->dir->inode->nlink = 1;
-   sub->dir->inode->update_flags |= VMFS_INODE_SYNC_META;
+   vmfs_inode_set_dirty(sub->dir->inode,VMFS_INODE_SYNC_META);
+
+   /* Forget about "." and ".." */
+   vmfs_dcache_invalidate_dir(fs->dcache,vmfs_dir_get_blk_id(sub));
 
    /* Update the parent directory */
    pos = (d->pos - 1) * VMFS_DIRENT_SIZE;
@@ -46,12 +46,44 @@ struct vmfs_dirent {
    char name[129];
 };
 
+/* Slot of the name index of a directory */
+struct vmfs_dir_index_slot {
+   uint32_t hash;
+   uint32_t pos;         /* Entry position + 1, 0 for an empty slot */
+};
+
+/* Size of the pages of a directory file */
+#define VMFS_DIR_PAGE_SIZE  0x1000
+
+/* Offset of the page map of a directory file */
+#define VMFS_DIR_OFS_PAGE_MAP  0x10040
+
+/*
+ * Content of a directory, shared by all its handles and hung off its inode.
+ * Pages are read on first access, and only when marked as present in the
+ * page map.
+ */
+struct vmfs_dir_cache {
+   u_int ref_count;
+   pthread_mutex_t lock;
+   u_int data_seq;         /* Inode data_seq the content is valid for */
+   off_t size;
+   u_int page_count;
+   u_char **pages;
+   const u_char *map;      /* Whole directory in the mapped device, if any */
+   u_char *ar_hb_exist;    /* Page map */
+};
+
 struct vmfs_dir {
    vmfs_file_t *dir;
    uint32_t pos;
    vmfs_dirent_t dirent;
-   u_char *buf;
-   u_char *ar_hb_exist;
+   struct vmfs_dir_cache *cache;
+
+   /* Name index, built by the first lookup */
+   struct vmfs_dir_index_slot *index;
+   uint32_t index_size;    /* Power of two */
+   uint32_t index_end;     /* Position after the last entry */
 };
 
 static inline const vmfs_fs_t *vmfs_dir_get_fs(vmfs_dir_t *d)
@@ -63,7 +95,18 @@ static inline const vmfs_fs_t *vmfs_dir_get_fs(vmfs_dir_t *d)
 entry vmfs_dir_read will return */
 const vmfs_dirent_t *vmfs_dir_lookup(vmfs_dir_t *dir,const char *name);
 
-/* Resolve a path to a block id */
+/* 
+ * Search for an entry in a directory given by its block id, using the
+ * directory entry cache. Returns 1 if found, 0 if not, and -1 on error.
+ */
+int vmfs_dir_lookup_from_blkid(const vmfs_fs_t *fs,uint32_t dir_blk_id,
+                               const char *name,vmfs_dirent_t *entry);
+
+/* 
+ * Resolve a path to a block id. Returns 0 on failure, with errno set to
+ * ENOENT for a missing entry and ENOTDIR when a non-final component is
+ * not a directory.
+ */
 uint32_t vmfs_dir_resolve_path(vmfs_dir_t *base_dir,const char *path,
                                int follow_symlink);
 
@@ -90,6 +133,9 @@ static inline void vmfs_dir_seek(vmfs_dir_t *d, uint32_t pos)
 /* Close a directory */
 int vmfs_dir_close(vmfs_dir_t *d);
 
+/* Drop the reference of a directory inode on its shared content */
+void vmfs_dir_cache_drop(vmfs_inode_t *inode);
+
 /* Link an inode to a directory with the specified name */
 int vmfs_dir_link_inode(vmfs_dir_t *d,const char *name,vmfs_inode_t *inode);
 
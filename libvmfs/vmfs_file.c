@@ -41,6 +41,7 @@ vmfs_file_t *vmfs_file_open_from_host(const char *path)
 
    f->flags = VMFS_FILE_FLAG_FD;
    f->fd = fd;
+   pthread_mutex_init(&f->ra_lock,NULL);
    return f;
 }
 
@@ -53,6 +54,7 @@ vmfs_file_t *vmfs_file_open_from_inode(const vmfs_inode_t *inode)
       return NULL;
 
    f->inode = (vmfs_inode_t *)inode;
+   pthread_mutex_init(&f->ra_lock,NULL);
    return f;
 }
 
@@ -83,23 +85,29 @@ int vmfs_file_create(vmfs_dir_t *d,const char *name,mode_t mode,
                      vmfs_inode_t **inode)
 {      
    vmfs_fs_t *fs = (vmfs_fs_t *)vmfs_dir_get_fs(d);
+   vmfs_metadata_txn_t txn;
    vmfs_inode_t *new_inode;
    int res;
 
    if (!vmfs_fs_readwrite(fs))
       return(-EROFS);
 
+   /* The inode and directory updates share a single reservation */
+   vmfs_metadata_txn_begin(fs,&txn);
+
    if ((res = vmfs_inode_alloc(fs,VMFS_FILE_TYPE_FILE,mode,&new_inode)) < 0)
-      return(res);
+      goto done;
 
    if ((res = vmfs_dir_link_inode(d,name,new_inode)) < 0) {
       vmfs_block_free(fs,new_inode->id);
       vmfs_inode_release(new_inode);
-      return(res);
+      goto done;
    }
 
    *inode = new_inode;
-   return(0);
+ done:
+   vmfs_metadata_txn_end(fs,&txn);
+   return(res);
 }
 
 /* Create a file */
@@ -132,32 +140,456 @@ vmfs_file_t *vmfs_file_create_at(vmfs_dir_t *dir,const char *path,mode_t mode)
    return f;
 }
 
+/* Wait for the requests of a read-ahead window and forget its content */
+static void vmfs_file_ra_drop(vmfs_file_t *f,struct vmfs_file_ra_win *w)
+{
+   vmfs_fs_wait(vmfs_file_get_fs(f),w->reqs,w->queued);
+   w->queued = 0;
+   w->len = 0;
+}
+
+/* Free the read-ahead windows of a file */
+static void vmfs_file_ra_free(vmfs_file_t *f)
+{
+   int i;
+
+   if (!f->ra)
+      return;
+
+   for(i=0;i<VMFS_FILE_RA_WINDOWS;i++) {
+      vmfs_file_ra_drop(f,&f->ra[i]);
+      iobuffer_free(f->ra[i].buf);
+   }
+
+   free(f->ra);
+   f->ra = NULL;
+}
+
 /* Close a file */
 int vmfs_file_close(vmfs_file_t *f)
 {
+   int res = 0;
+
    if (f == NULL)
       return(-1);
 
    if (f->flags & VMFS_FILE_FLAG_FD)
        close(f->fd);
-   else
+   else {
+       res = vmfs_file_flush(f);
+
+       /* 
+        * The last writer frees the buffer. Data that couldn't be written
+        * is dropped, the error being returned.
+        */
+       if (f->flags & VMFS_FILE_FLAG_WB) {
+          struct vmfs_file_wb *wb = f->inode->wb;
+
+          pthread_mutex_lock(&wb->lock);
+          if (!--wb->writers) {
+             __atomic_store_n(&wb->len,0,__ATOMIC_RELAXED);
+             iobuffer_free(wb->buf);
+             wb->buf = NULL;
+          }
+          pthread_mutex_unlock(&wb->lock);
+       }
+
+       vmfs_file_ra_free(f);
        vmfs_inode_release(f->inode);
+   }
 
+   pthread_mutex_destroy(&f->ra_lock);
    free(f);
-   return(0);
+   return(res);
 }
 
-/* Read data from a file at the specified position */
-ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+/* Read data from a single block of a file */
+static ssize_t vmfs_file_read_block(vmfs_file_t *f,uint64_t blk_id,
+                                    u_char *buf,size_t len,off_t pos)
 {
    const vmfs_fs_t *fs = vmfs_file_get_fs(f);
-   uint64_t blk_id;
    uint32_t blk_type;
-   uint64_t blk_size,blk_len;
-   uint64_t file_size,offset;
+
+   blk_type = VMFS_BLK_TYPE(blk_id);
+   dprintf("%s : call for pos %ld , got blk_id %lu (0x%lx) type %u\n", __FUNCTION__, pos, blk_id, blk_id, blk_type);
+
+   switch(blk_type) {
+      /* File-Block */
+      case VMFS_BLK_TYPE_FB:
+      case VMFS_BLK_TYPE_PB2:
+         return(vmfs_block_read_fb(fs,blk_id,pos,buf,len));
+
+      /* Sub-Block */
+      case VMFS_BLK_TYPE_SB:
+         return(vmfs_block_read_sb(fs,blk_id,pos,buf,len));
+
+      /* Large File-Block */
+      case VMFS_BLK_TYPE_LFB:
+         return(vmfs_block_read_lfb(fs,blk_id,pos,buf,len));
+
+      /* Inline in the inode */
+      case VMFS_BLK_TYPE_FD:
+         if (blk_id == f->inode->id) {
+            struct vmfs_inode_data *data = vmfs_inode_get_data(f->inode);
+
+            if (!data)
+               return(-EIO);
+
+            memcpy(buf, data->content + pos, len);
+            return(len);
+         }
+
+      default:
+         fprintf(stderr,"VMFS: unknown block type 0x%2.2x\n",blk_type);
+         return(-EIO);
+   }
+}
+
+/* Check whether an extent can be read directly into the given buffer */
+static inline bool vmfs_file_extent_aligned(const vmfs_fs_t *fs,
+                                            const vmfs_inode_extent_t *ext,
+                                            const u_char *buf)
+{
+   return(ALIGN_CHECK(ext->pos % vmfs_fs_get_blocksize(fs),M_DIO_BLK_SIZE) &&
+          ALIGN_CHECK(ext->len,M_DIO_BLK_SIZE) &&
+          ALIGN_CHECK((uintptr_t)buf,M_DIO_BLK_SIZE));
+}
+
+/* Read data from the blocks of a file */
+static ssize_t vmfs_file_read_blocks(vmfs_file_t *f,u_char *buf,size_t len,
+                                     off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_inode_extent_t ext[VMFS_FILE_PREAD_EXTENTS];
+   vmfs_io_req_t reqs[VMFS_FILE_PREAD_EXTENTS];
+   uint64_t file_size;
    ssize_t res=0,rlen = 0;
-   size_t exp_len;
-   int err;
+   size_t done;
+   int i,count,queued,err;
+
+   file_size = vmfs_file_get_size(f);
+   dprintf("%s call with blk size %lu file size %lu\n", __FUNCTION__, vmfs_fs_get_blocksize(fs), file_size);
+   while((len > 0) && (pos < file_size)) {
+      count = vmfs_inode_get_extents(f->inode,pos,len,
+                                     ext,VMFS_FILE_PREAD_EXTENTS);
+      if (count < 0)
+      {
+         dprintf("%s : fail to get extents at 0x%lx\n", __FUNCTION__, pos);
+         return(count);
+      }
+
+      if (count == 0)
+         break;
+
+      /* 
+       * Aligned runs of file blocks are queued on the device, so that
+       * they are all in flight at the same time.
+       */
+      for(i=0,queued=0,done=0;i<count;i++) {
+         u_char *ext_buf = buf + done;
+
+         switch(ext[i].type) {
+            /* Unallocated or to-be-zeroed blocks */
+            case VMFS_INODE_EXTENT_HOLE:
+            case VMFS_INODE_EXTENT_TBZ:
+               memset(ext_buf,0,ext[i].len);
+               res = ext[i].len;
+               break;
+
+            /* Contiguous file blocks, read at once */
+            case VMFS_INODE_EXTENT_DATA:
+               if (vmfs_file_extent_aligned(fs,&ext[i],ext_buf)) {
+                  vmfs_io_req_t *req = &reqs[queued];
+
+                  req->buf = ext_buf;
+                  req->len = ext[i].len;
+                  res = vmfs_fs_submit_read(fs,VMFS_BLK_FB_ITEM(ext[i].blk_id),
+                                            ext[i].pos %
+                                            vmfs_fs_get_blocksize(fs),
+                                            req);
+                  if (res == 0) {
+                     queued++;
+                     res = ext[i].len;
+                  }
+               } else {
+                  res = vmfs_block_read_fb_run(fs,ext[i].blk_id,ext[i].pos,
+                                               ext_buf,ext[i].len);
+               }
+               break;
+
+            default:
+               res = vmfs_file_read_block(f,ext[i].blk_id,
+                                          ext_buf,ext[i].len,ext[i].pos);
+         }
+         dprintf("%s : call end with res %ld for extent type %u\n", __FUNCTION__, res, ext[i].type);
+
+         /* Error while reading block, abort immediately */
+         if (res < 0) {
+            vmfs_fs_wait(fs,reqs,queued);
+            return(res);
+         }
+
+         done += res;
+
+         /* Short read, resolve extents again from the new position */
+         if (res < ext[i].len)
+            break;
+      }
+
+      if ((err = vmfs_fs_wait(fs,reqs,queued)) < 0)
+         return(err);
+
+      for(i=0;i<queued;i++)
+         if (reqs[i].res != reqs[i].len)
+            return(-EIO);
+
+      /* Move file position and keep track of bytes currently read */
+      pos += done;
+      rlen += done;
+
+      /* Move buffer position */
+      buf += done;
+      len -= done;
+   }
+
+   return(rlen);
+}
+
+/* 
+ * Copy data from the read-ahead windows, for the beginning of the given
+ * piece of a file (read-ahead locked). Returns the number of bytes copied.
+ */
+static size_t vmfs_file_ra_copy(vmfs_file_t *f,u_char *buf,size_t len,
+                                off_t pos)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   struct vmfs_file_ra_win *w;
+   size_t clen,done = 0;
+   int i,j;
+
+   if (!f->ra)
+      return(0);
+
+   for(i=0;i<VMFS_FILE_RA_WINDOWS;i++) {
+      w = &f->ra[i];
+
+      if (!w->len)
+         continue;
+
+      /* The file has been modified since the window has been read */
+      if (w->data_seq != f->inode->data_seq) {
+         vmfs_file_ra_drop(f,w);
+         continue;
+      }
+
+      if ((pos < w->pos) || (pos >= (w->pos + w->len)))
+         continue;
+
+      if (vmfs_fs_wait(fs,w->reqs,w->queued) < 0) {
+         vmfs_file_ra_drop(f,w);
+         continue;
+      }
+
+      for(j=0;j<w->queued;j++)
+         if (w->reqs[j].res != w->reqs[j].len)
+            break;
+
+      if (j < w->queued) {
+         w->queued = 0;
+         w->len = 0;
+         continue;
+      }
+
+      w->queued = 0;
+
+      clen = m_min(len,w->pos + w->len - pos);
+      memcpy(buf,w->buf + (pos - w->pos),clen);
+
+      buf  += clen;
+      len  -= clen;
+      pos  += clen;
+      done += clen;
+
+      /* The data may continue in the other window */
+      i = -1;
+      if (!len)
+         break;
+   }
+
+   return(done);
+}
+
+/* 
+ * Queue reads for a read-ahead window starting at the given position
+ * (read-ahead locked). Only holes and aligned runs of file blocks are
+ * prefetched.
+ */
+static void vmfs_file_ra_fill(vmfs_file_t *f,struct vmfs_file_ra_win *w,
+                              off_t pos,size_t len)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_inode_extent_t ext[VMFS_FILE_PREAD_EXTENTS];
+   size_t done = 0;
+   int i,count;
+
+   len = ALIGN_NUM(len,M_DIO_BLK_SIZE);
+
+   if (w->buf_len < len) {
+      iobuffer_free(w->buf);
+      w->buf_len = 0;
+
+      if (!(w->buf = iobuffer_alloc(len)))
+         return;
+
+      w->buf_len = len;
+   }
+
+   count = vmfs_inode_get_extents(f->inode,pos,len,
+                                  ext,VMFS_FILE_PREAD_EXTENTS);
+
+   for(i=0;i<count;i++) {
+      u_char *ext_buf = w->buf + done;
+
+      if ((ext[i].type == VMFS_INODE_EXTENT_HOLE) ||
+          (ext[i].type == VMFS_INODE_EXTENT_TBZ))
+      {
+         memset(ext_buf,0,ext[i].len);
+      }
+      else if ((ext[i].type == VMFS_INODE_EXTENT_DATA) &&
+               vmfs_file_extent_aligned(fs,&ext[i],ext_buf))
+      {
+         vmfs_io_req_t *req = &w->reqs[w->queued];
+
+         req->buf = ext_buf;
+         req->len = ext[i].len;
+
+         if (vmfs_fs_submit_read(fs,VMFS_BLK_FB_ITEM(ext[i].blk_id),
+                                 ext[i].pos % vmfs_fs_get_blocksize(fs),
+                                 req) < 0)
+            break;
+
+         w->queued++;
+      }
+      else
+         break;
+
+      done += ext[i].len;
+   }
+
+   if (!done)
+      return;
+
+   w->pos = pos;
+   w->len = done;
+   w->data_seq = f->inode->data_seq;
+
+   /* Get the requests going while the caller processes its data */
+   vmfs_fs_start_io(fs);
+}
+
+/* Check whether data read ahead covers a position (read-ahead locked) */
+static bool vmfs_file_ra_covers(const vmfs_file_t *f,off_t pos)
+{
+   const struct vmfs_file_ra_win *w;
+   int i;
+
+   if (!f->ra)
+      return(false);
+
+   for(i=0;i<VMFS_FILE_RA_WINDOWS;i++) {
+      w = &f->ra[i];
+
+      if (w->len && (w->data_seq == f->inode->data_seq) &&
+          (pos >= w->pos) && (pos < (w->pos + w->len)))
+         return(true);
+   }
+
+   return(false);
+}
+
+/* Update sequential access detection after a read (read-ahead locked) */
+static inline void vmfs_file_ra_track(vmfs_file_t *f,off_t pos,size_t len)
+{
+   if (pos != f->ra_next)
+      f->ra_seq_len = 0;
+
+   f->ra_seq_len += len;
+   f->ra_next = pos + len;
+}
+
+/* 
+ * Update sequential access detection after a read, and start reading
+ * ahead the following data if needed (read-ahead locked).
+ */
+static void vmfs_file_ra_update(vmfs_file_t *f,off_t pos,size_t len)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   struct vmfs_file_ra_win *w;
+   uint64_t file_size;
+   off_t end;
+   size_t window;
+   int i;
+
+   vmfs_file_ra_track(f,pos,len);
+
+   if (!fs->read_ahead || (f->ra_seq_len < VMFS_FILE_RA_MIN))
+      return;
+
+   if (!f->ra && !(f->ra = calloc(VMFS_FILE_RA_WINDOWS,sizeof(*f->ra))))
+      return;
+
+   window = m_min(f->ra_seq_len,fs->read_ahead);
+   file_size = vmfs_file_get_size(f);
+
+   /* Keep up to a window of data ahead of the reader */
+   for(;;) {
+      end = f->ra_next;
+      w = NULL;
+
+      for(i=0;i<VMFS_FILE_RA_WINDOWS;i++) {
+         if (!f->ra[i].len || ((f->ra[i].pos + f->ra[i].len) <= f->ra_next)) {
+            w = &f->ra[i];
+            continue;
+         }
+
+         end = m_max(end,f->ra[i].pos + f->ra[i].len);
+      }
+
+      if (!w || (end >= file_size) || (end >= (f->ra_next + window)))
+         break;
+
+      vmfs_file_ra_drop(f,w);
+      vmfs_file_ra_fill(f,w,end,m_min(window,file_size - end));
+
+      if (!w->len)
+         break;
+   }
+}
+
+/* Write out the data buffered for a file if it overlaps a range */
+static inline int vmfs_file_flush_range(vmfs_file_t *f,off_t pos,
+                                        uint64_t len)
+{
+   struct vmfs_file_wb *wb;
+   bool overlap;
+
+   if (!vmfs_file_dirty(f))
+      return(0);
+
+   wb = f->inode->wb;
+   pthread_mutex_lock(&wb->lock);
+   overlap = (pos < (wb->pos + wb->len)) && ((pos + len) > wb->pos);
+   pthread_mutex_unlock(&wb->lock);
+
+   return(overlap ? vmfs_file_flush(f) : 0);
+}
+
+/* Read data from a file at the specified position */
+ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+{
+   uint64_t file_size;
+   ssize_t res;
+   size_t done;
 
    if (f->flags & VMFS_FILE_FLAG_FD)
    {
@@ -165,6 +597,9 @@ ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
       return pread(f->fd, buf, len, pos);
    }
 
+   if ((res = vmfs_file_flush_range(f,pos,len)) < 0)
+      return(res);
+
    /* We don't handle RDM files */
    if (f->inode->type == VMFS_FILE_TYPE_RDM)
    {
@@ -172,111 +607,166 @@ ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
       return(-EIO);
    }
 
-   blk_size = vmfs_fs_get_blocksize(fs);
    file_size = vmfs_file_get_size(f);
-   dprintf("%s call with blk size %lu file size %lu\n", __FUNCTION__, blk_size, file_size);
-   while(len > 0) {
-      if (pos >= file_size)
-         break;
+   if (pos >= file_size)
+      return(0);
+   if ((pos + len) > file_size)
+      len = file_size - pos;
 
-      if ((err = vmfs_inode_get_block(f->inode,pos,&blk_id)) < 0)
-      {
-         dprintf("%s : fail to get block 0x%lx\n", __FUNCTION__, blk_id);
-         return(err);
-      }
+   pthread_mutex_lock(&f->ra_lock);
+   done = vmfs_file_ra_copy(f,buf,len,pos);
+   pthread_mutex_unlock(&f->ra_lock);
 
-#if 0
-      if (f->vol->debug_level > 1)
-         printf("vmfs_file_read: reading block 0x%8.8x\n",blk_id);
-#endif
+   if (done < len) {
+      res = vmfs_file_read_blocks(f,buf + done,len - done,pos + done);
 
-      blk_type = VMFS_BLK_FB_TBZ(blk_id) ?
-                    VMFS_BLK_TYPE_NONE : VMFS_BLK_TYPE(blk_id);
-      dprintf("%s : call for pos %ld , got blk_id %lu (0x%lx) type %u\n", __FUNCTION__, pos, blk_id, blk_id, blk_type);
+      if (res < 0)
+         return(res);
 
-      switch(blk_type) {
-         /* Unallocated block */
-         case VMFS_BLK_TYPE_NONE:
-            offset = pos % blk_size;
-            blk_len = blk_size - offset;
-            exp_len = m_min(blk_len,len);
-            res = m_min(exp_len,file_size - pos);
-            memset(buf,0,res);
-            break;
+      done += res;
+   }
 
-         /* File-Block */
-         case VMFS_BLK_TYPE_FB:
-	     case VMFS_BLK_TYPE_PB2:
-            exp_len = m_min(len,file_size - pos);
-            res = vmfs_block_read_fb(fs,blk_id,pos,buf,exp_len);
+   pthread_mutex_lock(&f->ra_lock);
+   vmfs_file_ra_update(f,pos,done);
+   pthread_mutex_unlock(&f->ra_lock);
 
-            break;
+   return(done);
+}
 
-         /* Sub-Block */
-         case VMFS_BLK_TYPE_SB: {
-            exp_len = m_min(len,file_size - pos);
-            res = vmfs_block_read_sb(fs,blk_id,pos,buf,exp_len);
+/* 
+ * Get the file descriptor ranges covering the specified piece of a file,
+ * up to its end. Returns the number of ranges, or -1 if the piece cannot
+ * be entirely read directly from file descriptors, or is better read with
+ * vmfs_file_pread(): part of a sequential stream, or already read ahead.
+ */
+int vmfs_file_get_fd_ranges(vmfs_file_t *f,off_t pos,size_t len,
+                            vmfs_file_range_t *ranges,u_int count)
+{
+   const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_inode_extent_t ext[VMFS_FILE_PREAD_EXTENTS];
+   uint64_t file_size;
+   size_t done = 0;
+   bool seq;
+   int i,n;
+
+   if (!fs || (f->inode->type == VMFS_FILE_TYPE_RDM))
+      return(-1);
+
+   if (vmfs_file_flush_range(f,pos,len) < 0)
+      return(-1);
+
+   file_size = vmfs_file_get_size(f);
+   if (pos >= file_size)
+      return(0);
+   if ((pos + len) > file_size)
+      len = file_size - pos;
+
+   /* 
+    * Direct reads are tracked as well, to detect sequential streams. Data
+    * already read ahead is not read again from the device.
+    */
+   pthread_mutex_lock(&f->ra_lock);
+   seq = (fs->read_ahead && (pos == f->ra_next) &&
+          ((f->ra_seq_len + len) >= VMFS_FILE_RA_MIN)) ||
+         vmfs_file_ra_covers(f,pos);
+   pthread_mutex_unlock(&f->ra_lock);
+
+   if (seq)
+      return(-1);
+
+   if (count > VMFS_FILE_PREAD_EXTENTS)
+      count = VMFS_FILE_PREAD_EXTENTS;
+
+   n = vmfs_inode_get_extents(f->inode,pos,len,ext,count);
+   if (n <= 0)
+      return(-1);
+
+   for(i=0;i<n;i++) {
+      ranges[i].pos = ext[i].pos;
+      ranges[i].len = ext[i].len;
+
+      switch(ext[i].type) {
+         case VMFS_INODE_EXTENT_HOLE:
+         case VMFS_INODE_EXTENT_TBZ:
+            ranges[i].fd = -1;
+            ranges[i].fd_pos = 0;
             break;
-         }
 
-        /* Large File-Block */
-         case VMFS_BLK_TYPE_LFB: {
-             exp_len = m_min(len,file_size - pos);
-             res = vmfs_block_read_lfb(fs,blk_id,pos,buf,exp_len);
-             break;
-        }
-        
-         /* Inline in the inode */
-         case VMFS_BLK_TYPE_FD:
-            if (blk_id == f->inode->id) {
-               exp_len = m_min(len,file_size - pos);
-               memcpy(buf, f->inode->content + pos, exp_len);
-               res = exp_len;
-               break;
-            }
+         case VMFS_INODE_EXTENT_DATA:
+            if (vmfs_fs_map_fd(fs,VMFS_BLK_FB_ITEM(ext[i].blk_id),
+                               ext[i].pos % vmfs_fs_get_blocksize(fs),
+                               ext[i].len,&ranges[i].fd,
+                               &ranges[i].fd_pos) < 0)
+               return(-1);
+            break;
 
          default:
-            fprintf(stderr,"VMFS: unknown block type 0x%2.2x\n",blk_type);
-            return(-EIO);
+            return(-1);
       }
-      dprintf("%s : call end with res %ld for type %d\n", __FUNCTION__, res, blk_type);
-      /* Error while reading block, abort immediately */
-      if (res < 0)
-         return(res);
-
-      /* Move file position and keep track of bytes currently read */
-      pos += res;
-      rlen += res;
 
-      /* Move buffer position */
-      buf += res;
-      len -= res;
+      done += ext[i].len;
    }
 
-   return(rlen);
+   /* The ranges have to cover the whole piece */
+   if (done != len)
+      return(-1);
+
+   pthread_mutex_lock(&f->ra_lock);
+   vmfs_file_ra_track(f,pos,len);
+   pthread_mutex_unlock(&f->ra_lock);
+   return(n);
 }
 
-/* Write data to a file at the specified position */
-ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
-{   
+/* 
+ * Get a pointer to a piece of a file in memory, valid until the filesystem
+ * is closed. Returns NULL if the piece has to be read with vmfs_file_pread().
+ */
+const u_char *vmfs_file_borrow(vmfs_file_t *f,off_t pos,size_t len)
+{
    const vmfs_fs_t *fs = vmfs_file_get_fs(f);
+   vmfs_inode_extent_t ext;
+
+   if (!fs || !fs->dev->borrow || vmfs_file_dirty(f) ||
+       (f->inode->type == VMFS_FILE_TYPE_RDM))
+      return NULL;
+
+   if ((pos + len) > vmfs_file_get_size(f))
+      return NULL;
+
+   /* The piece has to be held by physically contiguous file blocks */
+   if ((vmfs_inode_get_extents(f->inode,pos,len,&ext,1) != 1) ||
+       (ext.type != VMFS_INODE_EXTENT_DATA) || (ext.len < len))
+      return NULL;
+
+   return(vmfs_fs_borrow(fs,VMFS_BLK_FB_ITEM(ext.blk_id),
+                         pos % vmfs_fs_get_blocksize(fs),len));
+}
+
+/* Write data to an inode at the specified position, without buffering */
+static ssize_t vmfs_file_write_inode(vmfs_inode_t *inode,u_char *buf,
+                                     size_t len,off_t pos)
+{   
+   const vmfs_fs_t *fs = inode->fs;
    uint64_t blk_id;
    uint32_t blk_type;
    ssize_t res=0,wlen = 0;
    int err;
 
-   if (f->flags & VMFS_FILE_FLAG_FD)
-      return(-EIO);
-
    if (!vmfs_fs_readwrite(fs))
       return(-EROFS);
 
    /* We don't handle RDM files */
-   if (f->inode->type == VMFS_FILE_TYPE_RDM)
+   if (inode->type == VMFS_FILE_TYPE_RDM)
       return(-EIO);
 
    while(len > 0) {
-      if ((err = vmfs_inode_get_wrblock(f->inode,pos,&blk_id)) < 0)
+      /* Blocks entirely overwritten don't need to be zeroed first */
+      if (!(pos % inode->blk_size) && (len >= inode->blk_size))
+         err = vmfs_inode_get_wrblock_full(inode,pos,&blk_id);
+      else
+         err = vmfs_inode_get_wrblock(inode,pos,&blk_id);
+
+      if (err < 0)
          return(err);
 
 #if 0
@@ -315,57 +805,369 @@ ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
       len -= res;
    }
 
+   inode->data_seq++;
+
    /* Update file size */
-   if (pos > vmfs_file_get_size(f)) {
-      f->inode->size = pos;
-      f->inode->update_flags |= VMFS_INODE_SYNC_META;
+   if (pos > inode->size) {
+      inode->size = pos;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_META);
    }
 
    return(wlen);
 }
 
-/* Dump a file */
+/* Write data to a file at the specified position, without buffering */
+static ssize_t vmfs_file_pwrite_direct(vmfs_file_t *f,u_char *buf,size_t len,
+                                       off_t pos)
+{
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(-EIO);
+
+   return(vmfs_file_write_inode(f->inode,buf,len,pos));
+}
+
+/* Write out the data buffered for an inode (buffer locked) */
+static int vmfs_file_wb_write(vmfs_inode_t *inode,struct vmfs_file_wb *wb)
+{
+   ssize_t res;
+
+   if (!wb->len)
+      return(0);
+
+   /* The data stays buffered until it has been entirely written */
+   if ((res = vmfs_file_write_inode(inode,wb->buf,wb->len,wb->pos)) < 0)
+      return(res);
+
+   if (res != wb->len)
+      return(-EIO);
+
+   __atomic_store_n(&wb->len,0,__ATOMIC_RELAXED);
+   return(0);
+}
+
+/* Write data to a file at the specified position */
+ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos)
+{
+   vmfs_inode_t *inode = f->inode;
+   struct vmfs_file_wb *wb;
+   ssize_t res;
+
+   if (!(f->flags & VMFS_FILE_FLAG_WB) ||
+       (inode->type == VMFS_FILE_TYPE_RDM))
+      return(vmfs_file_pwrite_direct(f,buf,len,pos));
+
+   if (!vmfs_fs_readwrite(vmfs_file_get_fs(f)))
+      return(-EROFS);
+
+   wb = inode->wb;
+   pthread_mutex_lock(&wb->lock);
+
+   /* Start a new buffer unless the write extends or overwrites it */
+   if (!wb->len || (pos < wb->pos) || (pos > (wb->pos + wb->len)) ||
+       ((pos + len) > (wb->pos + VMFS_FILE_WB_SIZE)))
+   {
+      if ((res = vmfs_file_wb_write(inode,wb)) < 0)
+         goto done;
+
+      if ((len >= VMFS_FILE_WB_SIZE) ||
+          (!wb->buf && !(wb->buf = iobuffer_alloc(VMFS_FILE_WB_SIZE)))) {
+         res = vmfs_file_write_inode(inode,buf,len,pos);
+         goto done;
+      }
+
+      wb->pos = pos;
+   }
+
+   memcpy(wb->buf + (pos - wb->pos),buf,len);
+   __atomic_store_n(&wb->len,m_max(wb->len,pos + len - wb->pos),
+                    __ATOMIC_RELAXED);
+   inode->data_seq++;
+
+   if ((pos + len) > inode->size) {
+      inode->size = pos + len;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_META);
+   }
+
+   if ((wb->len < VMFS_FILE_WB_SIZE) || !(res = vmfs_file_wb_write(inode,wb)))
+      res = len;
+
+ done:
+   pthread_mutex_unlock(&wb->lock);
+   return(res);
+}
+
+/* Enable write-back buffering of a file */
+void vmfs_file_set_writeback(vmfs_file_t *f)
+{
+   vmfs_inode_t *inode = f->inode;
+   struct vmfs_file_wb *wb,*cur = NULL;
+
+   if (f->flags & (VMFS_FILE_FLAG_FD|VMFS_FILE_FLAG_WB))
+      return;
+
+   /* The buffer is shared by all the files opened on the inode */
+   if (!(wb = __atomic_load_n(&inode->wb,__ATOMIC_ACQUIRE))) {
+      if (!(wb = calloc(1,sizeof(*wb))))
+         return;
+
+      pthread_mutex_init(&wb->lock,NULL);
+
+      if (!__atomic_compare_exchange_n(&inode->wb,&cur,wb,false,
+                                       __ATOMIC_RELEASE,__ATOMIC_ACQUIRE)) {
+         pthread_mutex_destroy(&wb->lock);
+         free(wb);
+         wb = cur;
+      }
+   }
+
+   pthread_mutex_lock(&wb->lock);
+   wb->writers++;
+   pthread_mutex_unlock(&wb->lock);
+
+   f->flags |= VMFS_FILE_FLAG_WB;
+}
+
+/* Write out the data buffered for an inode, by any of its open files */
+int vmfs_file_flush_inode(vmfs_inode_t *inode)
+{
+   struct vmfs_file_wb *wb = __atomic_load_n(&inode->wb,__ATOMIC_ACQUIRE);
+   int res;
+
+   if (!wb)
+      return(0);
+
+   pthread_mutex_lock(&wb->lock);
+   res = vmfs_file_wb_write(inode,wb);
+   pthread_mutex_unlock(&wb->lock);
+   return(res);
+}
+
+/* Drop the data buffered for an inode being deleted, without writing it */
+void vmfs_file_discard_inode(vmfs_inode_t *inode)
+{
+   struct vmfs_file_wb *wb = __atomic_load_n(&inode->wb,__ATOMIC_ACQUIRE);
+
+   if (!wb)
+      return;
+
+   pthread_mutex_lock(&wb->lock);
+   __atomic_store_n(&wb->len,0,__ATOMIC_RELAXED);
+   pthread_mutex_unlock(&wb->lock);
+}
+
+/* Free the write-back buffer of an inode dropped from the cache */
+void vmfs_file_wb_destroy(vmfs_inode_t *inode)
+{
+   struct vmfs_file_wb *wb = inode->wb;
+
+   if (!wb)
+      return;
+
+   /* Closing the last writer normally left nothing to write */
+   if (wb->len && (vmfs_file_wb_write(inode,wb) < 0))
+      fprintf(stderr,"VMFS: unable to write buffered data of inode 0x%x, "
+              "%zu bytes lost\n",inode->id,(size_t)wb->len);
+
+   iobuffer_free(wb->buf);
+   pthread_mutex_destroy(&wb->lock);
+   free(wb);
+   inode->wb = NULL;
+}
+
+/* Write out the buffered data of a file */
+int vmfs_file_flush(vmfs_file_t *f)
+{
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(0);
+
+   return(vmfs_file_flush_inode(f->inode));
+}
+
+/* Write out the buffered data and the modified inode of a file */
+int vmfs_file_sync(vmfs_file_t *f)
+{
+   int res;
+
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(0);
+
+   if ((res = vmfs_file_flush(f)) < 0)
+      return(res);
+
+   return(vmfs_inode_sync(f->inode));
+}
+
+/* Find the first position at or after "pos" holding data or a hole */
+static off_t vmfs_file_seek_extent(vmfs_file_t *f,off_t pos,bool data)
+{
+   vmfs_inode_extent_t ext[VMFS_FILE_PREAD_EXTENTS];
+   uint64_t file_size;
+   bool hole;
+   int i,count;
+
+   if (f->flags & VMFS_FILE_FLAG_FD) {
+      pos = lseek(f->fd,pos,data ? SEEK_DATA : SEEK_HOLE);
+      return((pos == -1) ? -errno : pos);
+   }
+
+   if ((i = vmfs_file_flush(f)) < 0)
+      return(i);
+
+   file_size = vmfs_file_get_size(f);
+
+   if ((pos < 0) || (pos >= file_size))
+      return(-ENXIO);
+
+   while(pos < file_size) {
+      count = vmfs_inode_get_extents(f->inode,pos,file_size - pos,
+                                     ext,VMFS_FILE_PREAD_EXTENTS);
+      if (count <= 0)
+         return((count < 0) ? count : -EIO);
+
+      for(i=0;i<count;i++) {
+         hole = (ext[i].type == VMFS_INODE_EXTENT_HOLE) ||
+                (ext[i].type == VMFS_INODE_EXTENT_TBZ);
+
+         if (hole != data)
+            return(m_max(ext[i].pos,pos));
+      }
+
+      pos = ext[count-1].pos + ext[count-1].len;
+   }
+
+   /* There is an implicit hole at the end of the file */
+   return(data ? -ENXIO : file_size);
+}
+
+/* 
+ * Get the first position at or after "pos" holding data, or -ENXIO if
+ * there is none (SEEK_DATA semantics).
+ */
+off_t vmfs_file_next_data(vmfs_file_t *f,off_t pos)
+{
+   return(vmfs_file_seek_extent(f,pos,true));
+}
+
+/* 
+ * Get the first position at or after "pos" in a hole, the end of the file
+ * being one (SEEK_HOLE semantics).
+ */
+off_t vmfs_file_next_hole(vmfs_file_t *f,off_t pos)
+{
+   return(vmfs_file_seek_extent(f,pos,false));
+}
+
+/* Check whether holes can be skipped by seeking when writing to a stream */
+static bool vmfs_file_dump_sparse(FILE *fd_out)
+{
+   struct stat st;
+   int flags;
+
+   if (fflush(fd_out) || (fstat(fileno(fd_out),&st) == -1) ||
+       !S_ISREG(st.st_mode))
+      return(false);
+
+   /* Seeking only leaves zeroes when appending at the end of the file */
+   flags = fcntl(fileno(fd_out),F_GETFL);
+
+   return((flags != -1) && !(flags & O_APPEND) &&
+          (ftello(fd_out) == st.st_size));
+}
+
+/* 
+ * Dump a file. When written to a regular file, holes are skipped so that
+ * the output is sparse.
+ */
 int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out, bool isHex)
 {
    u_char *buf;
    ssize_t res;
    size_t clen,buf_len;
-   
+   off_t end,next;
+   bool sparse,skipped = false;
+   int ret = -1;
+
    if (f->flags & VMFS_FILE_FLAG_FD)
       return(-EIO);
 
-   if (!len)
-      len = vmfs_file_get_size(f);
+   end = vmfs_file_get_size(f);
+   if (len && (pos + len < end))
+      end = pos + len;
+
+   sparse = !isHex && vmfs_file_dump_sparse(fd_out);
 
    buf_len = 0x100000;
 
    if (!(buf = iobuffer_alloc(buf_len)))
       return(-1);
 
-   for(;pos < len; pos+=clen) {
-      clen = m_min(len,buf_len);
-      res = vmfs_file_pread(f,buf,clen,pos);
+   for(;pos < end;pos = next) {
+      next = end;
 
-      if (res < 0) {
-         fprintf(stderr,"vmfs_file_dump: problem reading input file.\n");
-         return(-1);
-      }
-      if (isHex)
-      {
-         hexdump(buf, res);
+      if (sparse) {
+         /* Only -ENXIO means that the rest of the file is a hole */
+         if ((next = vmfs_file_next_data(f,pos)) == -ENXIO)
+            next = end;
+         else if (next < 0)
+            goto err_read;
+
+         if (next > end)
+            next = end;
+
+         /* Skip the hole */
+         if (next > pos) {
+            if (fseeko(fd_out,next - pos,SEEK_CUR) == -1)
+               goto err_write;
+
+            skipped = true;
+            continue;
+         }
+
+         if ((next = vmfs_file_next_hole(f,pos)) < 0)
+            goto err_read;
+
+         if (next > end)
+            next = end;
       }
-      else {
-         if (fwrite(buf,1,res,fd_out) != res) {
-            fprintf(stderr,"vmfs_file_dump: error writing output file.\n");
-            return(-1);
+
+      for(;pos < next;pos += res) {
+         clen = m_min(next - pos,buf_len);
+         res = vmfs_file_pread(f,buf,clen,pos);
+
+         if (res < 0)
+            goto err_read;
+         if (isHex)
+         {
+            hexdump(buf, res);
+         }
+         else {
+            if (fwrite(buf,1,res,fd_out) != res)
+               goto err_write;
+         }
+         skipped = false;
+         if (res < clen) {
+            ret = 0;
+            goto done;
          }
       }
-      if (res < clen)
-         break;
    }
 
-   free(buf);
-   return(0);
+   /* A trailing hole still has to extend the output */
+   if (skipped && (fflush(fd_out) ||
+                   (ftruncate(fileno(fd_out),ftello(fd_out)) == -1)))
+      goto err_write;
+
+   ret = 0;
+   goto done;
+
+ err_read:
+   fprintf(stderr,"vmfs_file_dump: problem reading input file.\n");
+   goto done;
+ err_write:
+   fprintf(stderr,"vmfs_file_dump: error writing output file.\n");
+ done:
+   iobuffer_free(buf);
+   return(ret);
 }
 
 /* Get file status */
@@ -383,7 +1185,7 @@ int vmfs_file_stat_at(vmfs_dir_t *dir,const char *path,struct stat *buf)
    uint64_t blk_id;
 
    if (!(blk_id = vmfs_dir_resolve_path(dir,path,1)))
-      return(-ENOENT);
+      return((errno == ENOTDIR) ? -ENOTDIR : -ENOENT);
 
    return(vmfs_inode_stat_from_blkid(vmfs_dir_get_fs(dir),blk_id,buf));
 }
@@ -418,12 +1220,44 @@ int vmfs_file_lstat_at(vmfs_dir_t *dir,const char *path,struct stat *buf)
 /* Truncate a file (using a file descriptor) */
 int vmfs_file_truncate(vmfs_file_t *f,off_t length)
 {
+   int res;
+
    if (f->flags & VMFS_FILE_FLAG_FD)
       return(-EIO);
 
+   if ((res = vmfs_file_flush(f)) < 0)
+      return(res);
+
    return(vmfs_inode_truncate(f->inode,length));
 }
 
+/* 
+ * Allocate all the blocks backing the specified range of a file, extending
+ * it unless "keep_size" is set.
+ */
+int vmfs_file_fallocate(vmfs_file_t *f,off_t pos,off_t len,bool keep_size)
+{
+   int res;
+
+   if (f->flags & VMFS_FILE_FLAG_FD)
+      return(-EIO);
+
+   /* We don't handle RDM files */
+   if (f->inode->type == VMFS_FILE_TYPE_RDM)
+      return(-EIO);
+
+   if (((res = vmfs_file_flush(f)) < 0) ||
+       ((res = vmfs_inode_fallocate(f->inode,pos,len)) < 0))
+      return(res);
+
+   if (!keep_size && ((pos + len) > vmfs_file_get_size(f))) {
+      f->inode->size = pos + len;
+      vmfs_inode_set_dirty(f->inode,VMFS_INODE_SYNC_META);
+   }
+
+   return(0);
+}
+
 /* Truncate a file (using a path) */
 int vmfs_file_truncate_at(vmfs_dir_t *dir,const char *path,off_t length)
 {
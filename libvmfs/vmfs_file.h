@@ -31,6 +31,47 @@
 /* File flags */
 #define VMFS_FILE_FLAG_RW  0x01
 #define VMFS_FILE_FLAG_FD  0x02
+#define VMFS_FILE_FLAG_WB  0x04   /* Write-back buffering enabled */
+
+/* Number of extents resolved at once by vmfs_file_pread() */
+#define VMFS_FILE_PREAD_EXTENTS  32
+
+/* 
+ * Read-ahead: once a file has been read sequentially for VMFS_FILE_RA_MIN
+ * bytes, the following data is prefetched in VMFS_FILE_RA_WINDOWS windows
+ * growing with the length of the sequential stream, up to the read-ahead
+ * size of the filesystem.
+ */
+#define VMFS_FILE_RA_MIN      0x20000
+#define VMFS_FILE_RA_DEFAULT  0x400000
+#define VMFS_FILE_RA_WINDOWS  2
+
+/* 
+ * Write-back: with VMFS_FILE_FLAG_WB, contiguous writes are gathered in a
+ * buffer of VMFS_FILE_WB_SIZE bytes, written out as a single request when
+ * it is full, when a write doesn't follow it, or when the file is flushed.
+ * The buffer belongs to the inode, so that all the files opened on it, and
+ * truncation, see the buffered data.
+ */
+#define VMFS_FILE_WB_SIZE  0x100000
+
+struct vmfs_file_wb {
+   pthread_mutex_t lock;
+   u_int writers;         /* Open files with write-back enabled */
+   off_t pos;             /* Buffer holding "len" bytes of data at "pos" */
+   size_t len;
+   u_char *buf;
+};
+
+struct vmfs_file_ra_win {
+   off_t pos;
+   size_t len;            /* 0 when the window is unused */
+   u_int data_seq;        /* Inode data version the window was read from */
+   u_char *buf;
+   size_t buf_len;
+   u_int queued;
+   vmfs_io_req_t reqs[VMFS_FILE_PREAD_EXTENTS];
+};
 
 /* === VMFS file abstraction === */
 struct vmfs_file {
@@ -39,6 +80,20 @@ struct vmfs_file {
        int fd;
    };
    u_int flags;
+
+   /* Sequential access detection and read-ahead windows */
+   pthread_mutex_t ra_lock;
+   off_t ra_next;
+   uint64_t ra_seq_len;
+   struct vmfs_file_ra_win *ra;
+};
+
+/* Piece of a file readable directly from a file descriptor */
+struct vmfs_file_range {
+   off_t pos;          /* Position in the file */
+   size_t len;
+   int fd;             /* -1 when the range reads as zeroes */
+   off_t fd_pos;
 };
 
 static inline const vmfs_fs_t *vmfs_file_get_fs(vmfs_file_t *f)
@@ -94,10 +149,71 @@ int vmfs_file_close(vmfs_file_t *f);
 /* Read data from a file at the specified position */
 ssize_t vmfs_file_pread(vmfs_file_t *f,u_char *buf,size_t len,off_t pos);
 
+/* 
+ * Get the file descriptor ranges covering the specified piece of a file,
+ * up to its end. Returns the number of ranges, or -1 if the piece cannot
+ * be entirely read directly from file descriptors.
+ */
+int vmfs_file_get_fd_ranges(vmfs_file_t *f,off_t pos,size_t len,
+                            vmfs_file_range_t *ranges,u_int count);
+
+/* 
+ * Get a pointer to a piece of a file in memory, valid until the filesystem
+ * is closed. Returns NULL if the piece has to be read with vmfs_file_pread().
+ */
+const u_char *vmfs_file_borrow(vmfs_file_t *f,off_t pos,size_t len);
+
 /* Write data to a file at the specified position */
 ssize_t vmfs_file_pwrite(vmfs_file_t *f,u_char *buf,size_t len,off_t pos);
 
-/* Dump a file */
+/* Enable write-back buffering of a file */
+void vmfs_file_set_writeback(vmfs_file_t *f);
+
+/* Tell if an inode has buffered data not written yet */
+static inline bool vmfs_file_inode_dirty(const vmfs_inode_t *inode)
+{
+   struct vmfs_file_wb *wb = __atomic_load_n(&inode->wb,__ATOMIC_ACQUIRE);
+
+   return(wb && (__atomic_load_n(&wb->len,__ATOMIC_RELAXED) != 0));
+}
+
+/* Tell if a file has buffered data not written yet */
+static inline bool vmfs_file_dirty(const vmfs_file_t *f)
+{
+   return(!(f->flags & VMFS_FILE_FLAG_FD) && vmfs_file_inode_dirty(f->inode));
+}
+
+/* Write out the data buffered for an inode, by any of its open files */
+int vmfs_file_flush_inode(vmfs_inode_t *inode);
+
+/* Drop the data buffered for an inode being deleted, without writing it */
+void vmfs_file_discard_inode(vmfs_inode_t *inode);
+
+/* Free the write-back buffer of an inode dropped from the cache */
+void vmfs_file_wb_destroy(vmfs_inode_t *inode);
+
+/* Write out the buffered data of a file */
+int vmfs_file_flush(vmfs_file_t *f);
+
+/* Write out the buffered data and the modified inode of a file */
+int vmfs_file_sync(vmfs_file_t *f);
+
+/* 
+ * Get the first position at or after "pos" holding data, or -ENXIO if
+ * there is none (SEEK_DATA semantics).
+ */
+off_t vmfs_file_next_data(vmfs_file_t *f,off_t pos);
+
+/* 
+ * Get the first position at or after "pos" in a hole, the end of the file
+ * being one (SEEK_HOLE semantics).
+ */
+off_t vmfs_file_next_hole(vmfs_file_t *f,off_t pos);
+
+/* 
+ * Dump a file. When written to a regular file, holes are skipped so that
+ * the output is sparse.
+ */
 int vmfs_file_dump(vmfs_file_t *f,off_t pos,uint64_t len,FILE *fd_out, bool isHex);
 
 /* Get file status */
@@ -112,6 +228,12 @@ int vmfs_file_lstat_at(vmfs_dir_t *dir,const char *path,struct stat *buf);
 /* Truncate a file (using a file descriptor) */
 int vmfs_file_truncate(vmfs_file_t *f,off_t length);
 
+/* 
+ * Allocate all the blocks backing the specified range of a file, extending
+ * it unless "keep_size" is set.
+ */
+int vmfs_file_fallocate(vmfs_file_t *f,off_t pos,off_t len,bool keep_size);
+
 /* Truncate a file (using a path) */
 int vmfs_file_truncate_at(vmfs_dir_t *dir,const char *path,off_t length);
 
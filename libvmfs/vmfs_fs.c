@@ -24,6 +24,7 @@
 #define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "vmfs.h"
 
 /* VMFS meta-files */
@@ -45,6 +46,78 @@ ssize_t vmfs_fs_read(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
    return(vmfs_device_read(fs->dev,pos,buf,len));
 }
 
+/* Queue an asynchronous read of a block from the filesystem */
+int vmfs_fs_submit_read(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                        vmfs_io_req_t *req)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   req->op = VMFS_IO_READ;
+   return(vmfs_device_submit(fs->dev,req,pos));
+}
+
+/* Wait for completion of a set of queued requests */
+int vmfs_fs_wait(const vmfs_fs_t *fs,vmfs_io_req_t *reqs,u_int count)
+{
+   u_int i;
+   int res;
+
+   for(i=0;i<count;i++) {
+      while(!__atomic_load_n(&reqs[i].done,__ATOMIC_ACQUIRE)) {
+         if ((res = vmfs_device_complete(fs->dev,1)) < 0)
+            return(res);
+
+         /* 
+          * No progress while a request is pending. The request may also
+          * have been completed by another thread.
+          */
+         if ((res == 0) && !__atomic_load_n(&reqs[i].done,__ATOMIC_ACQUIRE))
+            return(-EIO);
+      }
+   }
+
+   return(0);
+}
+
+/* Pass queued requests to the device without waiting for them */
+int vmfs_fs_start_io(const vmfs_fs_t *fs)
+{
+   return(vmfs_device_complete(fs->dev,0));
+}
+
+/* 
+ * Get a file descriptor and offset giving direct access to a piece of a
+ * block of the filesystem.
+ */
+int vmfs_fs_map_fd(const vmfs_fs_t *fs,uint32_t blk,off_t offset,size_t len,
+                   int *fd,off_t *fd_pos)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   return(vmfs_device_map_fd(fs->dev,pos,len,fd,fd_pos));
+}
+
+/* 
+ * Get a pointer to a piece of a block of the filesystem in memory, NULL if
+ * it has to be read.
+ */
+const u_char *vmfs_fs_borrow(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                             size_t len)
+{
+   off_t pos;
+
+   pos  = (uint64_t)blk * vmfs_fs_get_blocksize(fs);
+   pos += offset;
+
+   return(vmfs_device_borrow(fs->dev,pos,len));
+}
+
 /* Write a block to the filesystem */
 ssize_t vmfs_fs_write(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
                       const u_char *buf,size_t len)
@@ -90,99 +163,122 @@ static int vmfs_fsinfo_read(vmfs_fs_t *fs)
    return(0);
 }
 
-static vmfs_bitmap_t *vmfs_open_meta_file(vmfs_dir_t *root_dir, char *name,
-                                          uint32_t max_item, uint32_t max_entry,
-                                          char *desc)
+/* Meta-files holding the bitmaps, indexed by block type */
+static const struct vmfs_meta_file {
+   char *name;
+   uint32_t max_item,max_entry;
+   char *desc;
+} vmfs_meta_files[] = {
+   [VMFS_BLK_TYPE_FB]  = { VMFS_FBB_FILENAME, 0, 0,
+                           "file-block bitmap (FBB)" },
+   [VMFS_BLK_TYPE_SB]  = { VMFS_SBC_FILENAME,
+                           VMFS_BLK_SB_MAX_ITEM, VMFS_BLK_SB_MAX_ENTRY,
+                           "pointer sub bitmap (SBC)" },
+   [VMFS_BLK_TYPE_PB]  = { VMFS_PBC_FILENAME,
+                           VMFS_BLK_PB_MAX_ITEM, VMFS_BLK_PB_MAX_ENTRY,
+                           "pointer block bitmap (PBC)" },
+   [VMFS_BLK_TYPE_FD]  = { VMFS_FDC_FILENAME,
+                           VMFS_BLK_FD_MAX_ITEM, VMFS_BLK_FD_MAX_ENTRY,
+                           "file descriptor bitmap (FDC)" },
+   [VMFS_BLK_TYPE_PB2] = { VMFS_PB2_FILENAME,
+                           VMFS_BLK_PB2_MAX_ITEM, VMFS_BLK_PB2_MAX_ENTRY,
+                           "pointer 2nd block bitmap (PB2)" },
+};
+
+/* Open and check the meta-file holding the bitmap of the given type */
+static vmfs_bitmap_t *vmfs_open_meta_file(const vmfs_fs_t *fs,
+                                          enum vmfs_block_type type)
 {
+   const struct vmfs_meta_file *meta = &vmfs_meta_files[type];
    vmfs_bitmap_t *bitmap;
+   vmfs_dir_t *root_dir;
 
-   dprintf("%s : call for metafile %s\n", __FUNCTION__, name);
-   bitmap = vmfs_bitmap_open_at(root_dir, name);
-   if (!bitmap) {
-      fprintf(stderr, "Unable to open %s.\n", desc);
+   dprintf("%s : call for metafile %s\n", __FUNCTION__, meta->name);
+
+   if (!(root_dir = vmfs_dir_open_from_blkid(fs,VMFS_BLK_FD_BUILD(0, 0, 0)))) {
+      fprintf(stderr,"VMFS: unable to open root directory\n");
       return NULL;
    }
 
-   if (bitmap->bmh.items_per_bitmap_entry > max_item) {
-      fprintf(stderr, "Unsupported number of items per entry in %s. %u %u\n", desc, bitmap->bmh.items_per_bitmap_entry, max_item);
+   bitmap = vmfs_bitmap_open_at(root_dir, meta->name);
+   vmfs_dir_close(root_dir);
+
+   if (!bitmap) {
+      fprintf(stderr, "Unable to open %s.\n", meta->desc);
       return NULL;
    }
-#if 0   
-   if ((bitmap->bmh.total_items==0)&&(strcmp(name,".pbd.sf")==0)) // since pbc.sf may be replaced by .sbc.sf
-   {
-   		bitmap->bmh.items_per_bitmap_entry = 0x100;
-   		bitmap->bmh.total_items = bitmap->bmh.items_per_bitmap_entry* bitmap->bmh.bmp_entries_per_area*bitmap->bmh.area_count;
-   		printf("Force to set items to 0x100\n");
-   		   	return bitmap;
-   	}
-#endif
+
+   if (type == VMFS_BLK_TYPE_FB) {
+      if (bitmap->bmh.total_items > VMFS_BLK_FB_MAX_ITEM) {
+         fprintf(stderr, "Unsupported number of items in file-block bitmap (FBB) (0x%x 0x%lx).\n", bitmap->bmh.total_items, VMFS_BLK_FB_MAX_ITEM);
+         goto err;
+      }
+      return bitmap;
+   }
+
+   if (bitmap->bmh.items_per_bitmap_entry > meta->max_item) {
+      fprintf(stderr, "Unsupported number of items per entry in %s. %u %u\n", meta->desc, bitmap->bmh.items_per_bitmap_entry, meta->max_item);
+      goto err;
+   }
+
 	if (bitmap->bmh.total_items==0) // if the bitmap is disabled then total_items will be 0. e.g. pbc.sf in vmfs6
 		return bitmap;
 		
    if ((bitmap->bmh.total_items + bitmap->bmh.items_per_bitmap_entry - 1) /
-        bitmap->bmh.items_per_bitmap_entry > max_entry) {
-      fprintf(stderr,"Unsupported number of entries in %s.\n", desc);
-      return NULL;
+        bitmap->bmh.items_per_bitmap_entry > meta->max_entry) {
+      fprintf(stderr,"Unsupported number of entries in %s.\n", meta->desc);
+      goto err;
    }
    return bitmap;
+
+ err:
+   vmfs_bitmap_close(bitmap);
+   return NULL;
 }
 
-/* Open all the VMFS meta files */
-static int vmfs_open_all_meta_files(vmfs_fs_t *fs)
+/* Open the bitmap corresponding to the given type, if not already done */
+vmfs_bitmap_t *vmfs_fs_open_bitmap(const vmfs_fs_t *fs,
+                                   enum vmfs_block_type type)
 {
-   vmfs_bitmap_t *fdc = fs->fdc;
-   vmfs_dir_t *root_dir;
+   vmfs_fs_t *fs_rw = (vmfs_fs_t *)fs;
+   vmfs_bitmap_t **bitmap;
+   vmfs_bitmap_t *bmp;
+   u_int mask = 1 << type;
 
-   /* Read the first inode */
-   if (!(root_dir = vmfs_dir_open_from_blkid(fs,VMFS_BLK_FD_BUILD(0, 0, 0)))) {
-      fprintf(stderr,"VMFS: unable to open root directory\n");
-      return(-1);
-   }
-   dprintf("Open root dir done\n");
-   if (!(fs->fbb = vmfs_bitmap_open_at(root_dir,VMFS_FBB_FILENAME))) {
-      fprintf(stderr,"Unable to open file-block bitmap (FBB).\n");
-      return(-1);
-   }
-   if (fs->fbb->bmh.total_items > VMFS_BLK_FB_MAX_ITEM) {
-      fprintf(stderr, "Unsupported number of items in file-block bitmap (FBB) (0x%x 0x%lx).\n", fs->fbb->bmh.total_items, VMFS_BLK_FB_MAX_ITEM);
-      return(-1);
-   }
+   if ((type <= VMFS_BLK_TYPE_NONE) || (type > VMFS_BLK_TYPE_PB2))
+      return NULL;
 
-   fs->fdc = vmfs_open_meta_file(root_dir, VMFS_FDC_FILENAME,
-                                 VMFS_BLK_FD_MAX_ITEM, VMFS_BLK_FD_MAX_ENTRY,
-                                 "file descriptor bitmap (FDC)");
-   if (!fs->fdc)
-      return(-1);
+   bitmap = &fs_rw->bitmaps[type];
 
-   fs->pbc = vmfs_open_meta_file(root_dir, VMFS_PBC_FILENAME,
-                                 VMFS_BLK_PB_MAX_ITEM, VMFS_BLK_PB_MAX_ENTRY,
-                                 "pointer block bitmap (PBC)");
-   if (!fs->pbc)
-      return(-1);
+   /* 
+    * The lock is recursive, as reading a meta-file may need another one.
+    * A bitmap needed to open itself, or that failed to open, is NULL.
+    */
+   pthread_mutex_lock(&fs_rw->meta_lock);
 
+   if (!(bmp = *bitmap) && !(fs->meta_opening & mask) &&
+       !(fs->meta_failed & mask))
+   {
+      fs_rw->meta_opening |= mask;
 
-   dprintf("open pb2\n");
-   fs->pb2 = vmfs_open_meta_file(root_dir, VMFS_PB2_FILENAME,
-                                 VMFS_BLK_PB2_MAX_ITEM, VMFS_BLK_PB2_MAX_ENTRY,
-                                 "pointer 2nd block bitmap (PB2)");
-   if (!fs->pb2)
-      return(-1);
+      if ((bmp = vmfs_open_meta_file(fs,type)))
+         __atomic_store_n(bitmap,bmp,__ATOMIC_RELEASE);
+      else
+         fs_rw->meta_failed |= mask;
 
-   dprintf("open sbc\n");
-   fs->sbc = vmfs_open_meta_file(root_dir, VMFS_SBC_FILENAME,
-                                 VMFS_BLK_SB_MAX_ITEM, VMFS_BLK_SB_MAX_ENTRY,
-                                 "pointer sub bitmap (SBC)");
-   if (!fs->sbc)
-      return(-1);
-   vmfs_bitmap_close(fdc);
-   vmfs_dir_close(root_dir);
-   return(0);
+      fs_rw->meta_opening &= ~mask;
+   }
+
+   pthread_mutex_unlock(&fs_rw->meta_lock);
+   return bmp;
 }
 
 /* Read FDC base information */
 static int vmfs_read_fdc_base(vmfs_fs_t *fs)
 {
    vmfs_inode_t inode = { { 0, }, };
+   struct vmfs_inode_data data = { 0, };
+   vmfs_bitmap_t *fdc;
    uint64_t fdc_base;
 
    /* 
@@ -206,22 +302,80 @@ static int vmfs_read_fdc_base(vmfs_fs_t *fs)
    inode.blk_size = fs->fs_info.block_size;
    inode.blk_count = 1;
    inode.zla = VMFS_BLK_TYPE_FB;
-   inode.blocks[0] = VMFS_BLK_FB_BUILD(fdc_base, 0);
+   vmfs_inode_set_resolver(&inode);
+   inode.data = &data;
+   data.ref_count = 1;
+   data.blocks[0] = VMFS_BLK_FB_BUILD(fdc_base, 0);
    inode.ref_count = 1;
-   dprintf("fdc_base %lu blocks0 %lx (%lx %lx shift %d)\n", fdc_base, inode.blocks[0], 
+   dprintf("fdc_base %lu blocks0 %lx (%lx %lx shift %d)\n", fdc_base, data.blocks[0], 
    	VMFS_BLK_VALUE(fdc_base, VMFS_BLK_FB_ITEM_VALUE_LSB_MASK),
    	VMFS_BLK_FILL(VMFS_BLK_VALUE(fdc_base, VMFS_BLK_FB_ITEM_VALUE_LSB_MASK), VMFS_BLK_FB_ITEM_LSB_MASK),
    	VMFS_BLK_SHIFT(VMFS_BLK_FB_ITEM_LSB_MASK));
 
-   fs->fdc = vmfs_bitmap_open_from_inode(&inode);
+   fs->bitmaps[VMFS_BLK_TYPE_FD] = vmfs_bitmap_open_from_inode(&inode);
 
-   /* Read the meta files */
-   if (vmfs_open_all_meta_files(fs) == -1)
-      return(-1);
+   /* 
+    * Replace the FDC bootstrap with the real one. Other meta-files are
+    * opened on first use.
+    */
+   fdc = vmfs_open_meta_file(fs,VMFS_BLK_TYPE_FD);
+   vmfs_bitmap_close(fs->bitmaps[VMFS_BLK_TYPE_FD]);
+   fs->bitmaps[VMFS_BLK_TYPE_FD] = fdc;
+
+   return(fdc ? 0 : -1);
+}
+
+/* 
+ * Open all the bitmaps of a FS at once, for tools going through all of
+ * them. Returns -1 if one of them can't be opened.
+ */
+int vmfs_fs_open_all_bitmaps(const vmfs_fs_t *fs)
+{
+   int type;
+
+   for(type=VMFS_BLK_TYPE_FB;type<=VMFS_BLK_TYPE_PB2;type++)
+      if (!vmfs_fs_get_bitmap(fs,type))
+         return(-1);
+
+   return(0);
+}
+
+/* 
+ * Load snapshots of all the bitmaps of a FS, so that block status
+ * lookups don't need disk accesses.
+ */
+int vmfs_fs_load_bitmap_snapshots(const vmfs_fs_t *fs)
+{
+   vmfs_bitmap_t *bmp;
+   int type;
+
+   for(type=VMFS_BLK_TYPE_FB;type<=VMFS_BLK_TYPE_PB2;type++) {
+      bmp = vmfs_fs_get_bitmap(fs,type);
+
+      /* Disabled bitmaps have no item */
+      if (!bmp || !bmp->bmh.total_items)
+         continue;
+
+      if (vmfs_bitmap_load_snapshot(bmp) == -1) {
+         vmfs_fs_drop_bitmap_snapshots(fs);
+         return(-1);
+      }
+   }
 
    return(0);
 }
 
+/* Drop the bitmap snapshots of a FS */
+void vmfs_fs_drop_bitmap_snapshots(const vmfs_fs_t *fs)
+{
+   vmfs_bitmap_t *bmp;
+   int type;
+
+   for(type=VMFS_BLK_TYPE_FB;type<=VMFS_BLK_TYPE_PB2;type++)
+      if ((bmp = vmfs_fs_get_bitmap(fs,type)))
+         vmfs_bitmap_drop_snapshot(bmp);
+}
+
 static vmfs_device_t *vmfs_device_open(char **paths, vmfs_flags_t flags)
 {
    vmfs_lvm_t *lvm;
@@ -249,6 +403,7 @@ static vmfs_device_t *vmfs_device_open(char **paths, vmfs_flags_t flags)
 /* Open a filesystem */
 vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
 {
+   pthread_mutexattr_t attr;
    vmfs_device_t *dev;
    vmfs_fs_t *fs;
 
@@ -259,16 +414,53 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
    if (!dev || !(fs = calloc(1,sizeof(*fs))))
       return NULL;
 
-   fs->inode_hash_buckets = VMFS_INODE_HASH_BUCKETS;
-   fs->inodes = calloc(fs->inode_hash_buckets,sizeof(vmfs_inode_t *));
+   pthread_mutex_init(&fs->hb_lock,NULL);
+   pthread_cond_init(&fs->hb_cond,NULL);
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&fs->meta_lock,&attr);
+   pthread_mutexattr_destroy(&attr);
+
+   /* The inode cache is sized once the FDC is known */
+   if (!(fs->icache = vmfs_icache_create(VMFS_ICACHE_MIN_BUCKETS))) {
+      free(fs);
+      return NULL;
+   }
+
+   if (!(fs->pbcache = vmfs_pbcache_create())) {
+      vmfs_icache_destroy(fs->icache);
+      free(fs);
+      return NULL;
+   }
+
+   if (!(fs->dcache = vmfs_dcache_create())) {
+      vmfs_pbcache_destroy(fs->pbcache);
+      vmfs_icache_destroy(fs->icache);
+      free(fs);
+      return NULL;
+   }
+
+   if (!(fs->iopool = vmfs_iopool_create())) {
+      vmfs_dcache_destroy(fs->dcache);
+      vmfs_pbcache_destroy(fs->pbcache);
+      vmfs_icache_destroy(fs->icache);
+      free(fs);
+      return NULL;
+   }
 
-   if (!fs->inodes) {
+   if (!(fs->stats = vmfs_stats_create())) {
+      vmfs_iopool_destroy(fs->iopool);
+      vmfs_dcache_destroy(fs->dcache);
+      vmfs_pbcache_destroy(fs->pbcache);
+      vmfs_icache_destroy(fs->icache);
       free(fs);
       return NULL;
    }
 
    fs->dev = dev;
+   dev->stats = fs->stats;
    fs->debug_level = flags.debug_level;
+   fs->read_ahead = VMFS_FILE_RA_DEFAULT;
 
    /* Read FS info */
    if (vmfs_fsinfo_read(fs) == -1) {
@@ -290,38 +482,25 @@ vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags)
       return NULL;
    }
 
+   vmfs_icache_resize(fs->icache,vmfs_fs_get_fdc(fs)->bmh.total_items);
+
    if (fs->debug_level > 0)
       printf("VMFS: filesystem opened successfully\n");
    return fs;
 }
 
-/* 
- * Check that all inodes have been released, and synchronize them if this 
- * is not the case. 
- */
-static void vmfs_fs_sync_inodes(vmfs_fs_t *fs)
-{
-   vmfs_inode_t *inode;
-   int i;
-
-   for(i=0;i<VMFS_INODE_HASH_BUCKETS;i++) {
-      for(inode=fs->inodes[i];inode;inode=inode->next) {
-#if 0
-         printf("Inode 0x%8.8x: ref_count=%u, update_flags=0x%x\n",
-                inode->id,inode->ref_count,inode->update_flags);
-#endif
-         if (inode->update_flags)
-            vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
-      }
-   }
-}
-
 /* Close a FS */
 void vmfs_fs_close(vmfs_fs_t *fs)
 {
+   int i;
+
    if (!fs)
       return;
 
+   /* Write back modified inodes while the heartbeat is still held */
+   vmfs_icache_sync(fs->icache);
+   vmfs_heartbeat_stop(fs);
+
    if (fs->hb_refcount > 0) {
       fprintf(stderr,
               "Warning: heartbeat still active in metadata (ref_count=%u)\n",
@@ -330,16 +509,19 @@ void vmfs_fs_close(vmfs_fs_t *fs)
 
    vmfs_heartbeat_unlock(fs,&fs->hb);
 
-   vmfs_bitmap_close(fs->fbb);
-   vmfs_bitmap_close(fs->fdc);
-   vmfs_bitmap_close(fs->pbc);
-   vmfs_bitmap_close(fs->pb2);   
-   vmfs_bitmap_close(fs->sbc);
+   for(i=VMFS_BLK_TYPE_FB;i<=VMFS_BLK_TYPE_PB2;i++)
+      vmfs_bitmap_close(fs->bitmaps[i]);
 
-   vmfs_fs_sync_inodes(fs);
+   vmfs_icache_destroy(fs->icache);
 
    vmfs_device_close(fs->dev);
-   free(fs->inodes);
+   vmfs_pbcache_destroy(fs->pbcache);
+   vmfs_dcache_destroy(fs->dcache);
+   vmfs_iopool_destroy(fs->iopool);
+   vmfs_stats_destroy(fs->stats);
    free(fs->fs_info.label);
+   pthread_cond_destroy(&fs->hb_cond);
+   pthread_mutex_destroy(&fs->meta_lock);
+   pthread_mutex_destroy(&fs->hb_lock);
    free(fs);
 }
@@ -83,7 +83,6 @@ struct vmfs_fsinfo {
 };
 
 /* === VMFS filesystem === */
-#define VMFS_INODE_HASH_BUCKETS  256
 
 struct vmfs_fs {
    int debug_level;
@@ -94,8 +93,13 @@ struct vmfs_fs {
    /* Associated VMFS Device */
    vmfs_device_t *dev;
 
-   /* Meta-files containing file system structures */
-   vmfs_bitmap_t *fbb,*sbc,*pbc,*fdc,*pb2;
+   /* 
+    * Meta-files containing file system structures, indexed by block type.
+    * Only the FDC is opened with the FS, the others on first use.
+    */
+   vmfs_bitmap_t *bitmaps[VMFS_BLK_TYPE_PB2 + 1];
+   pthread_mutex_t meta_lock;
+   u_int meta_opening,meta_failed;  /* Masks of block types */
 
    /* Heartbeat used to lock meta-data */
    vmfs_heartbeat_t hb;
@@ -103,24 +107,65 @@ struct vmfs_fs {
    uint64_t hb_seq;
    u_int hb_refcount;
    uint64_t hb_expire;
+   pthread_mutex_t hb_lock;
+
+   /* Background renewal of a heartbeat held until the FS is closed */
+   pthread_t hb_thread;
+   pthread_cond_t hb_cond;
+   bool hb_renew;
+   bool hb_renewing;     /* Renewal write in progress, without hb_lock */
 
    /* Counter for "gen" field in inodes */
    uint32_t inode_gen;
 
-   /* In-core inodes hash table */
-   u_int inode_hash_buckets;
-   vmfs_inode_t **inodes;
+   /* In-core inodes cache */
+   vmfs_icache_t *icache;
+
+   /* Cache of directory entries used for path resolution */
+   vmfs_dcache_t *dcache;
+
+   /* Aligned bounce buffers */
+   vmfs_iopool_t *iopool;
+
+   /* Counters of the hot paths, also updated by the device */
+   vmfs_stats_t *stats;
+
+   /* Maximum read-ahead window for sequential reads (0 disables it) */
+   size_t read_ahead;
+
+   /* Cache of pointer blocks used for block resolution */
+   vmfs_pbcache_t *pbcache;
+
+   /* File block address from which allocations without a hint start */
+   uint32_t fb_cursor;
 };
 
-/* Get the bitmap corresponding to the given type */
+/* Open the bitmap corresponding to the given type, if not already done */
+vmfs_bitmap_t *vmfs_fs_open_bitmap(const vmfs_fs_t *fs,
+                                   enum vmfs_block_type type);
+
+/* 
+ * Get the bitmap corresponding to the given type, opening it on first use.
+ * Returns NULL if it can't be opened.
+ */
 static inline vmfs_bitmap_t *vmfs_fs_get_bitmap(const vmfs_fs_t *fs,
                                                 enum vmfs_block_type type)
 {
-   if ((type > VMFS_BLK_TYPE_NONE) && (type < VMFS_BLK_TYPE_MAX)) {
-      vmfs_bitmap_t * const *bitmap = (vmfs_bitmap_t **)&fs->fbb;
-      return bitmap[type - 1];
-   }
-   return NULL;
+   vmfs_bitmap_t *bmp;
+
+   if ((type <= VMFS_BLK_TYPE_NONE) || (type > VMFS_BLK_TYPE_PB2))
+      return NULL;
+
+   if ((bmp = __atomic_load_n(&fs->bitmaps[type],__ATOMIC_ACQUIRE)))
+      return bmp;
+
+   return(vmfs_fs_open_bitmap(fs,type));
+}
+
+/* Get the FDC bitmap, opened with the FS */
+static inline vmfs_bitmap_t *vmfs_fs_get_fdc(const vmfs_fs_t *fs)
+{
+   return(fs->bitmaps[VMFS_BLK_TYPE_FD]);
 }
 
 /* Get block size of a volume */
@@ -139,10 +184,49 @@ static inline bool vmfs_fs_readwrite(const vmfs_fs_t *fs)
 ssize_t vmfs_fs_read(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
                      u_char *buf,size_t len);
 
+/* Queue an asynchronous read of a block from the filesystem */
+int vmfs_fs_submit_read(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                        vmfs_io_req_t *req);
+
+/* Wait for completion of a set of queued requests */
+int vmfs_fs_wait(const vmfs_fs_t *fs,vmfs_io_req_t *reqs,u_int count);
+
+/* Pass queued requests to the device without waiting for them */
+int vmfs_fs_start_io(const vmfs_fs_t *fs);
+
+/* 
+ * Get a file descriptor and offset giving direct access to a piece of a
+ * block of the filesystem.
+ */
+int vmfs_fs_map_fd(const vmfs_fs_t *fs,uint32_t blk,off_t offset,size_t len,
+                   int *fd,off_t *fd_pos);
+
+/* 
+ * Get a pointer to a piece of a block of the filesystem in memory, NULL if
+ * it has to be read.
+ */
+const u_char *vmfs_fs_borrow(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
+                             size_t len);
+
 /* Write a block to the filesystem */
 ssize_t vmfs_fs_write(const vmfs_fs_t *fs,uint32_t blk,off_t offset,
                       const u_char *buf,size_t len);
 
+/* 
+ * Open all the bitmaps of a FS at once, for tools going through all of
+ * them. Returns -1 if one of them can't be opened.
+ */
+int vmfs_fs_open_all_bitmaps(const vmfs_fs_t *fs);
+
+/* 
+ * Load snapshots of all the bitmaps of a FS, so that block status
+ * lookups don't need disk accesses.
+ */
+int vmfs_fs_load_bitmap_snapshots(const vmfs_fs_t *fs);
+
+/* Drop the bitmap snapshots of a FS */
+void vmfs_fs_drop_bitmap_snapshots(const vmfs_fs_t *fs);
+
 /* Open a FS */
 vmfs_fs_t *vmfs_fs_open(char **paths, vmfs_flags_t flags);
 
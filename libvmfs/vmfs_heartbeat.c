@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "utils.h"
 #include "vmfs.h"
@@ -175,32 +176,82 @@ int vmfs_heartbeat_update(vmfs_fs_t *fs,vmfs_heartbeat_t *hb)
    return((vmfs_device_write(fs->dev,hb->pos,buf,buf_len) == buf_len) ? 0 : -1);
 }
 
+/* Check that an heartbeat is still held on disk, with the same sequence */
+static int vmfs_heartbeat_check(vmfs_fs_t *fs,const vmfs_heartbeat_t *hb)
+{
+   DECL_ALIGNED_BUFFER(buf,VMFS_HB_SIZE);
+   vmfs_heartbeat_t cur;
+
+   if (vmfs_device_read(fs->dev,hb->pos,buf,buf_len) != buf_len)
+      return(-1);
+
+   vmfs_heartbeat_read(&cur,buf);
+
+   if (!vmfs_heartbeat_active(&cur) || (cur.seq != hb->seq) ||
+       uuid_compare(cur.uuid,hb->uuid))
+      return(-1);
+
+   return(0);
+}
+
 /* Acquire an heartbeat (ID is chosen automatically) */
 int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
 {
    vmfs_heartbeat_t hb;   
-   u_char *buf;
+   u_char *buf = NULL;
    size_t buf_len;
+   uint64_t now;
    int i,res = -1;
 
-   /* Heartbeat already active ? */
-   if (fs->hb_refcount > 0) {
-      fs->hb_refcount++;
-      fs->hb_expire = vmfs_host_get_uptime() + VMFS_HEARTBEAT_EXPIRE_DELAY;
-      return(0);
+   pthread_mutex_lock(&fs->hb_lock);
+
+   /* A renewal in progress updates hb_expire */
+   while(fs->hb_renewing)
+      pthread_cond_wait(&fs->hb_cond,&fs->hb_lock);
+
+   /* 
+    * Heartbeat already active ? It stays locked on disk once no longer
+    * referenced, until the filesystem is closed. Once expired, another
+    * host may have taken it over, so check it before renewing it.
+    */
+   if (vmfs_heartbeat_active(&fs->hb)) {
+      now = vmfs_host_get_uptime();
+
+      if (now < fs->hb_expire) {
+         fs->hb_refcount++;
+         res = 0;
+         goto done;
+      }
+
+      if (!vmfs_heartbeat_check(fs,&fs->hb) &&
+          !vmfs_heartbeat_update(fs,&fs->hb))
+      {
+         fs->hb_refcount++;
+         fs->hb_expire = now + VMFS_HEARTBEAT_EXPIRE_DELAY;
+         res = 0;
+         goto done;
+      }
+
+      fprintf(stderr,"VMFS: heartbeat expired, acquiring a new one.\n");
+      fs->hb.magic = VMFS_HB_MAGIC_OFF;
    }
 
    /* Try to reuse the current ID */
-   if (!vmfs_heartbeat_lock(fs,fs->hb_id,&fs->hb))
-      return(0);
+   if (!vmfs_heartbeat_lock(fs,fs->hb_id,&fs->hb)) {
+      fs->hb_seq = fs->hb.seq;
+      fs->hb_refcount++;
+      fs->hb_expire = vmfs_host_get_uptime() + VMFS_HEARTBEAT_EXPIRE_DELAY;
+      res = 0;
+      goto done;
+   }
 
    buf_len = VMFS_HB_NUM * VMFS_HB_SIZE;
 
    if (!(buf = iobuffer_alloc(buf_len)))
-      return(-1);
+      goto done;
 
    if (vmfs_device_read(fs->dev,VMFS_HB_BASE,buf,buf_len) != buf_len)
-      return(-1);
+      goto done;
 
    /* 
     * Heartbeat is taken by someone else, find a new one.
@@ -217,24 +268,116 @@ int vmfs_heartbeat_acquire(vmfs_fs_t *fs)
       if (!vmfs_heartbeat_lock(fs,i,&fs->hb)) {
          fs->hb_id  = i;
          fs->hb_seq = fs->hb.seq;
-         fs->hb_refcount = 1;
+         fs->hb_refcount++;
          fs->hb_expire = vmfs_host_get_uptime() + VMFS_HEARTBEAT_EXPIRE_DELAY;
          res = 0;
          break;
       }
    }
 
+ done:
    iobuffer_free(buf);
+   pthread_mutex_unlock(&fs->hb_lock);
    return(res);
 }
 
 /* Release an heartbeat */
 int vmfs_heartbeat_release(vmfs_fs_t *fs)
 {
-   if (fs->hb_refcount == 0)
-      return(-1);
+   int res = -1;
+
+   pthread_mutex_lock(&fs->hb_lock);
 
    /* The heartbeat will be eventually released by the background process */
-   fs->hb_refcount--;
+   if (fs->hb_refcount > 0) {
+      fs->hb_refcount--;
+      res = 0;
+   }
+
+   pthread_mutex_unlock(&fs->hb_lock);
+   return(res);
+}
+
+/* Renew a long-lived heartbeat before it expires, until asked to stop */
+static void *vmfs_heartbeat_renew(void *arg)
+{
+   vmfs_fs_t *fs = arg;
+   vmfs_heartbeat_t hb;
+   struct timespec ts;
+   uint64_t delay,now;
+   int res;
+
+   pthread_mutex_lock(&fs->hb_lock);
+
+   while(fs->hb_renew) {
+      clock_gettime(CLOCK_REALTIME,&ts);
+      delay = ts.tv_nsec + (uint64_t)VMFS_HEARTBEAT_RENEW_DELAY * 1000;
+      ts.tv_sec += delay / 1000000000;
+      ts.tv_nsec = delay % 1000000000;
+
+      if ((pthread_cond_timedwait(&fs->hb_cond,&fs->hb_lock,&ts) != ETIMEDOUT)
+          || !fs->hb_renew || !vmfs_heartbeat_active(&fs->hb))
+         continue;
+
+      /* Write a copy with hb_lock released, acquirers wait for it */
+      hb = fs->hb;
+      fs->hb_renewing = true;
+      pthread_mutex_unlock(&fs->hb_lock);
+
+      now = vmfs_host_get_uptime();
+      res = vmfs_heartbeat_update(fs,&hb);
+
+      pthread_mutex_lock(&fs->hb_lock);
+      fs->hb_renewing = false;
+
+      if (res == -1)
+         fprintf(stderr,"VMFS: unable to renew heartbeat.\n");
+      else {
+         fs->hb.uptime = hb.uptime;
+         fs->hb_expire = now + VMFS_HEARTBEAT_EXPIRE_DELAY;
+      }
+
+      pthread_cond_broadcast(&fs->hb_cond);
+   }
+
+   pthread_mutex_unlock(&fs->hb_lock);
+   return NULL;
+}
+
+/*
+ * Hold an heartbeat until vmfs_heartbeat_stop(), renewing it from a
+ * background thread.
+ */
+int vmfs_heartbeat_start(vmfs_fs_t *fs)
+{
+   if (fs->hb_renew)
+      return(0);
+
+   if (vmfs_heartbeat_acquire(fs) == -1)
+      return(-1);
+
+   fs->hb_renew = true;
+
+   if (pthread_create(&fs->hb_thread,NULL,vmfs_heartbeat_renew,fs)) {
+      fs->hb_renew = false;
+      vmfs_heartbeat_release(fs);
+      return(-1);
+   }
+
    return(0);
 }
+
+/* Stop renewing a long-lived heartbeat and release it */
+void vmfs_heartbeat_stop(vmfs_fs_t *fs)
+{
+   if (!fs->hb_renew)
+      return;
+
+   pthread_mutex_lock(&fs->hb_lock);
+   fs->hb_renew = false;
+   pthread_cond_broadcast(&fs->hb_cond);
+   pthread_mutex_unlock(&fs->hb_lock);
+
+   pthread_join(fs->hb_thread,NULL);
+   vmfs_heartbeat_release(fs);
+}
@@ -60,6 +60,9 @@ struct vmfs_heartbeat {
 /* Delay for heartbeat expiration when not referenced anymore */
 #define VMFS_HEARTBEAT_EXPIRE_DELAY  (3 * 1000000)
 
+/* Interval between two renewals of a long-lived heartbeat */
+#define VMFS_HEARTBEAT_RENEW_DELAY   (VMFS_HEARTBEAT_EXPIRE_DELAY / 3)
+
 static inline bool vmfs_heartbeat_active(vmfs_heartbeat_t *hb)
 {
    return(hb->magic == VMFS_HB_MAGIC_ON);
@@ -92,4 +95,13 @@ int vmfs_heartbeat_acquire(vmfs_fs_t *fs);
 /* Release an heartbeat */
 int vmfs_heartbeat_release(vmfs_fs_t *fs);
 
+/*
+ * Hold an heartbeat until vmfs_heartbeat_stop(), renewing it from a
+ * background thread.
+ */
+int vmfs_heartbeat_start(vmfs_fs_t *fs);
+
+/* Stop renewing a long-lived heartbeat and release it */
+void vmfs_heartbeat_stop(vmfs_fs_t *fs);
+
 #endif
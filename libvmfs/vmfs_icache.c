@@ -0,0 +1,512 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * In-core inode cache.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "vmfs.h"
+
+/* Hash function to retrieve an in-core inode */
+static inline u_int vmfs_icache_hash(uint64_t blk_id)
+{
+   return(blk_id ^ (blk_id >> 9) ^ (blk_id >> 20));
+}
+
+/* Get the shard holding an inode */
+static inline struct vmfs_icache_shard *
+vmfs_icache_get_shard(vmfs_icache_t *ic,uint64_t blk_id)
+{
+   return(&ic->shards[vmfs_icache_hash(blk_id) & (VMFS_ICACHE_SHARDS - 1)]);
+}
+
+/* Get the bucket of an inode in its shard */
+static inline vmfs_inode_t **
+vmfs_icache_get_bucket(struct vmfs_icache_shard *s,uint64_t blk_id)
+{
+   u_int hb = vmfs_icache_hash(blk_id) / VMFS_ICACHE_SHARDS;
+   return(&s->buckets[hb & (s->bucket_count - 1)]);
+}
+
+/* Get the number of buckets of each shard for a total number of buckets */
+static u_int vmfs_icache_shard_buckets(u_int buckets)
+{
+   u_int count = VMFS_ICACHE_MIN_BUCKETS;
+
+   buckets = m_min(buckets,VMFS_ICACHE_MAX_BUCKETS);
+   while(count < buckets)
+      count <<= 1;
+
+   return(count / VMFS_ICACHE_SHARDS);
+}
+
+/* Remove an inode from the LRU list (shard locked) */
+static void vmfs_icache_lru_remove(struct vmfs_icache_shard *s,
+                                   vmfs_inode_t *inode)
+{
+   if (inode->lru_prev)
+      inode->lru_prev->lru_next = inode->lru_next;
+   else
+      s->lru_head = inode->lru_next;
+
+   if (inode->lru_next)
+      inode->lru_next->lru_prev = inode->lru_prev;
+   else
+      s->lru_tail = inode->lru_prev;
+
+   inode->lru_prev = inode->lru_next = NULL;
+   s->lru_count--;
+}
+
+/* Add an inode at the head of the LRU list (shard locked) */
+static void vmfs_icache_lru_add(struct vmfs_icache_shard *s,
+                                vmfs_inode_t *inode)
+{
+   inode->lru_prev = NULL;
+   inode->lru_next = s->lru_head;
+
+   if (s->lru_head)
+      s->lru_head->lru_prev = inode;
+   else
+      s->lru_tail = inode;
+
+   s->lru_head = inode;
+   s->lru_count++;
+}
+
+/* Remove an inode from its hash bucket (shard locked) */
+static void vmfs_icache_unhash(vmfs_inode_t *inode)
+{
+   if (inode->next != NULL)
+      inode->next->pprev = inode->pprev;
+
+   *(inode->pprev) = inode->next;
+   inode->pprev = NULL;
+   inode->next = NULL;
+}
+
+/* Remove an inode from the dirty list (dirty list locked) */
+static void vmfs_icache_dirty_remove(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   if (inode->dirty_next != NULL)
+      inode->dirty_next->dirty_pprev = inode->dirty_pprev;
+
+   *(inode->dirty_pprev) = inode->dirty_next;
+   inode->dirty_pprev = NULL;
+   inode->dirty_next = NULL;
+   ic->dirty_count--;
+}
+
+/*
+ * Add an inode to the dirty list (dirty list locked). Inodes being synced
+ * are added back by vmfs_icache_sync() if modified meanwhile.
+ */
+static void vmfs_icache_dirty_add(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   if ((inode->dirty_pprev != NULL) || inode->syncing)
+      return;
+
+   inode->dirty_next  = ic->dirty_list;
+   inode->dirty_pprev = &ic->dirty_list;
+
+   if (inode->dirty_next != NULL)
+      inode->dirty_next->dirty_pprev = &inode->dirty_next;
+
+   ic->dirty_list = inode;
+   ic->dirty_count++;
+}
+
+/*
+ * Take an inode off the dirty list, waiting for a sync writing it to
+ * complete. Returns the update flags to write (dirty list locked).
+ */
+static u_int vmfs_icache_dirty_take(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   while(inode->syncing)
+      pthread_cond_wait(&ic->sync_cond,&ic->dirty_lock);
+
+   if (inode->dirty_pprev != NULL)
+      vmfs_icache_dirty_remove(ic,inode);
+
+   return(inode->update_flags);
+}
+
+/* Drop an unreferenced inode from the cache (shard locked) */
+static void vmfs_icache_evict(vmfs_icache_t *ic,struct vmfs_icache_shard *s,
+                              vmfs_inode_t *inode)
+{
+   u_int flags;
+
+   vmfs_icache_lru_remove(s,inode);
+   vmfs_icache_unhash(inode);
+
+   pthread_mutex_lock(&ic->dirty_lock);
+   flags = vmfs_icache_dirty_take(ic,inode);
+   pthread_mutex_unlock(&ic->dirty_lock);
+
+   if (flags)
+      vmfs_inode_update(inode,flags & VMFS_INODE_SYNC_BLK);
+
+   vmfs_inode_put_data(inode);
+   vmfs_dir_cache_drop(inode);
+   vmfs_file_wb_destroy(inode);
+   free(inode);
+}
+
+/* Compare the on-disk positions of two inodes, for qsort() */
+static int vmfs_icache_cmp_pos(const void *a,const void *b)
+{
+   const vmfs_inode_t *ia = *(const vmfs_inode_t **)a;
+   const vmfs_inode_t *ib = *(const vmfs_inode_t **)b;
+
+   if (ia->mdh.pos != ib->mdh.pos)
+      return((ia->mdh.pos < ib->mdh.pos) ? -1 : 1);
+
+   return(0);
+}
+
+/* Create an inode cache with the given total number of buckets */
+vmfs_icache_t *vmfs_icache_create(u_int buckets)
+{
+   vmfs_icache_t *ic;
+   u_int count;
+   int i;
+
+   if (!(ic = calloc(1,sizeof(*ic))))
+      return NULL;
+
+   pthread_mutex_init(&ic->dirty_lock,NULL);
+   pthread_cond_init(&ic->sync_cond,NULL);
+   count = vmfs_icache_shard_buckets(buckets);
+
+   for(i=0;i<VMFS_ICACHE_SHARDS;i++) {
+      struct vmfs_icache_shard *s = &ic->shards[i];
+
+      if (!(s->buckets = calloc(count,sizeof(vmfs_inode_t *)))) {
+         vmfs_icache_destroy(ic);
+         return NULL;
+      }
+
+      s->bucket_count = count;
+      pthread_mutex_init(&s->lock,NULL);
+   }
+
+   return ic;
+}
+
+/* Destroy an inode cache, freeing released inodes */
+void vmfs_icache_destroy(vmfs_icache_t *ic)
+{
+   int i;
+
+   if (!ic)
+      return;
+
+   for(i=0;i<VMFS_ICACHE_SHARDS;i++) {
+      struct vmfs_icache_shard *s = &ic->shards[i];
+
+      if (!s->buckets)
+         continue;
+
+      while(s->lru_tail)
+         vmfs_icache_evict(ic,s,s->lru_tail);
+
+      pthread_mutex_destroy(&s->lock);
+      free(s->buckets);
+   }
+
+   pthread_cond_destroy(&ic->sync_cond);
+   pthread_mutex_destroy(&ic->dirty_lock);
+   free(ic);
+}
+
+/* Change the total number of buckets of an inode cache */
+int vmfs_icache_resize(vmfs_icache_t *ic,u_int buckets)
+{
+   vmfs_inode_t **new_buckets,*inode,*next;
+   u_int count,old_count,j;
+   int i;
+
+   count = vmfs_icache_shard_buckets(buckets);
+
+   for(i=0;i<VMFS_ICACHE_SHARDS;i++) {
+      struct vmfs_icache_shard *s = &ic->shards[i];
+
+      if (s->bucket_count == count)
+         continue;
+
+      if (!(new_buckets = calloc(count,sizeof(vmfs_inode_t *))))
+         return(-ENOMEM);
+
+      pthread_mutex_lock(&s->lock);
+
+      old_count = s->bucket_count;
+      s->bucket_count = count;
+
+      for(j=0;j<old_count;j++) {
+         for(inode=s->buckets[j];inode;inode=next) {
+            vmfs_inode_t **bucket;
+
+            next = inode->next;
+            bucket = &new_buckets[(vmfs_icache_hash(inode->id) /
+                                   VMFS_ICACHE_SHARDS) & (count - 1)];
+
+            inode->next  = *bucket;
+            inode->pprev = bucket;
+
+            if (inode->next != NULL)
+               inode->next->pprev = &inode->next;
+
+            *bucket = inode;
+         }
+      }
+
+      free(s->buckets);
+      s->buckets = new_buckets;
+
+      pthread_mutex_unlock(&s->lock);
+   }
+
+   return(0);
+}
+
+/* Find an inode in a shard and take a reference on it (shard locked) */
+static vmfs_inode_t *vmfs_icache_find(struct vmfs_icache_shard *s,
+                                      uint64_t blk_id)
+{
+   vmfs_inode_t *inode;
+
+   for(inode=*vmfs_icache_get_bucket(s,blk_id);inode;inode=inode->next)
+      if (inode->id == blk_id) {
+         if (inode->ref_count++ == 0)
+            vmfs_icache_lru_remove(s,inode);
+         return inode;
+      }
+
+   return NULL;
+}
+
+/* Get an inode from the cache, taking a reference on it */
+vmfs_inode_t *vmfs_icache_lookup(vmfs_icache_t *ic,uint64_t blk_id)
+{
+   struct vmfs_icache_shard *s = vmfs_icache_get_shard(ic,blk_id);
+   vmfs_inode_t *inode;
+
+   pthread_mutex_lock(&s->lock);
+   inode = vmfs_icache_find(s,blk_id);
+   pthread_mutex_unlock(&s->lock);
+
+   __atomic_add_fetch(inode ? &ic->hits : &ic->misses,1,__ATOMIC_RELAXED);
+   return inode;
+}
+
+/*
+ * Insert an inode with a single reference. If the inode is already present,
+ * a reference is taken on the cached one, which is returned instead.
+ */
+vmfs_inode_t *vmfs_icache_insert(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   struct vmfs_icache_shard *s = vmfs_icache_get_shard(ic,inode->id);
+   vmfs_inode_t **bucket,*cur;
+
+   pthread_mutex_lock(&s->lock);
+
+   if ((cur = vmfs_icache_find(s,inode->id))) {
+      pthread_mutex_unlock(&s->lock);
+      return cur;
+   }
+
+   bucket = vmfs_icache_get_bucket(s,inode->id);
+
+   inode->ref_count = 1;
+   inode->lru_prev = inode->lru_next = NULL;
+
+   inode->next  = *bucket;
+   inode->pprev = bucket;
+
+   if (inode->next != NULL)
+      inode->next->pprev = &inode->next;
+
+   *bucket = inode;
+
+   pthread_mutex_unlock(&s->lock);
+   return inode;
+}
+
+/*
+ * Release a reference on an inode. Unreferenced inodes are written back
+ * (unless in write-back mode) and kept on the LRU list, unless they have
+ * been deleted.
+ */
+void vmfs_icache_release(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   struct vmfs_icache_shard *s = vmfs_icache_get_shard(ic,inode->id);
+
+   pthread_mutex_lock(&s->lock);
+   assert(inode->ref_count > 0);
+
+   if (--inode->ref_count == 0) {
+      if (inode->update_flags && !ic->write_back)
+         vmfs_icache_write_inode(ic,inode);
+
+      vmfs_icache_lru_add(s,inode);
+
+      if (!inode->nlink)
+         vmfs_icache_evict(ic,s,inode);
+      else if (s->lru_count > VMFS_ICACHE_LRU_MAX)
+         vmfs_icache_evict(ic,s,s->lru_tail);
+   }
+
+   pthread_mutex_unlock(&s->lock);
+}
+
+/* Drop an unreferenced inode from the cache */
+void vmfs_icache_forget(vmfs_icache_t *ic,uint64_t blk_id)
+{
+   struct vmfs_icache_shard *s = vmfs_icache_get_shard(ic,blk_id);
+   vmfs_inode_t *inode;
+
+   pthread_mutex_lock(&s->lock);
+
+   for(inode=*vmfs_icache_get_bucket(s,blk_id);inode;inode=inode->next)
+      if ((inode->id == blk_id) && !inode->ref_count) {
+         vmfs_icache_evict(ic,s,inode);
+         break;
+      }
+
+   pthread_mutex_unlock(&s->lock);
+}
+
+/* Add a modified inode to the dirty list */
+void vmfs_icache_mark_dirty(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   pthread_mutex_lock(&ic->dirty_lock);
+   vmfs_icache_dirty_add(ic,inode);
+   pthread_mutex_unlock(&ic->dirty_lock);
+}
+
+/* Write back a modified inode now */
+int vmfs_icache_write_inode(vmfs_icache_t *ic,vmfs_inode_t *inode)
+{
+   u_int flags;
+   int res = 0;
+
+   pthread_mutex_lock(&ic->dirty_lock);
+   flags = vmfs_icache_dirty_take(ic,inode);
+   pthread_mutex_unlock(&ic->dirty_lock);
+
+   if (!flags)
+      return(0);
+
+   if (vmfs_inode_update(inode,flags & VMFS_INODE_SYNC_BLK))
+      res = -EIO;
+   else
+      inode->update_flags = 0;
+
+   /* Keep the inode dirty if it failed or was modified meanwhile */
+   if (inode->update_flags)
+      vmfs_icache_mark_dirty(ic,inode);
+
+   return(res);
+}
+
+/* Enable or disable write-back of released inodes by vmfs_icache_sync() */
+void vmfs_icache_set_write_back(vmfs_icache_t *ic,bool enable)
+{
+   ic->write_back = enable;
+}
+
+/*
+ * Write back all modified inodes, in on-disk order. Returns the number of
+ * inodes that could not be written.
+ */
+int vmfs_icache_sync(vmfs_icache_t *ic)
+{
+   vmfs_inode_t **inodes,*inode;
+   u_int i,count;
+   int failed;
+
+   pthread_mutex_lock(&ic->dirty_lock);
+
+   if (!(count = ic->dirty_count)) {
+      pthread_mutex_unlock(&ic->dirty_lock);
+      return(0);
+   }
+
+   if (!(inodes = malloc(count * sizeof(*inodes)))) {
+      vmfs_inode_t *failed_list = NULL;
+
+      /* Write inodes one at a time, keeping failed ones aside */
+      for(failed=0;(inode = ic->dirty_list);) {
+         vmfs_icache_dirty_remove(ic,inode);
+         inode->syncing = true;
+         pthread_mutex_unlock(&ic->dirty_lock);
+
+         if (vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK))
+            failed++;
+         else
+            inode->update_flags = 0;
+
+         pthread_mutex_lock(&ic->dirty_lock);
+
+         if (inode->update_flags) {
+            inode->dirty_next = failed_list;
+            failed_list = inode;
+         } else
+            inode->syncing = false;
+
+         pthread_cond_broadcast(&ic->sync_cond);
+      }
+
+      while((inode = failed_list)) {
+         failed_list = inode->dirty_next;
+         inode->syncing = false;
+         vmfs_icache_dirty_add(ic,inode);
+      }
+
+      pthread_cond_broadcast(&ic->sync_cond);
+      pthread_mutex_unlock(&ic->dirty_lock);
+      return(failed);
+   }
+
+   /* Detach the dirty inodes, and write them with the list unlocked */
+   for(i=0;(inode = ic->dirty_list);i++) {
+      vmfs_icache_dirty_remove(ic,inode);
+      inode->syncing = true;
+      inodes[i] = inode;
+   }
+
+   pthread_mutex_unlock(&ic->dirty_lock);
+
+   qsort(inodes,count,sizeof(*inodes),vmfs_icache_cmp_pos);
+   failed = vmfs_inode_update_batch(inodes,count);
+
+   pthread_mutex_lock(&ic->dirty_lock);
+
+   for(i=0;i<count;i++) {
+      inodes[i]->syncing = false;
+
+      if (inodes[i]->update_flags)
+         vmfs_icache_dirty_add(ic,inodes[i]);
+   }
+
+   pthread_cond_broadcast(&ic->sync_cond);
+   pthread_mutex_unlock(&ic->dirty_lock);
+   free(inodes);
+   return(failed);
+}
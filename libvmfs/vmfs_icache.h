@@ -0,0 +1,102 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_ICACHE_H
+#define VMFS_ICACHE_H
+
+#include <stdbool.h>
+
+/*
+ * In-core inode cache: a hash table split in shards, each one with its own
+ * lock, buckets and LRU list of released inodes.
+ * All these values must be powers of two.
+ */
+#define VMFS_ICACHE_SHARDS       16
+#define VMFS_ICACHE_MIN_BUCKETS  256
+#define VMFS_ICACHE_MAX_BUCKETS  65536
+
+/* Maximum number of released inodes kept in each shard */
+#define VMFS_ICACHE_LRU_MAX      64
+
+struct vmfs_icache_shard {
+   pthread_mutex_t lock;
+   u_int bucket_count;
+   vmfs_inode_t **buckets;
+
+   /* Released inodes, most recently used first */
+   vmfs_inode_t *lru_head,*lru_tail;
+   u_int lru_count;
+};
+
+struct vmfs_icache {
+   struct vmfs_icache_shard shards[VMFS_ICACHE_SHARDS];
+
+   /* Modified inodes not yet written back */
+   pthread_mutex_t dirty_lock;
+   pthread_cond_t sync_cond;     /* Signaled when a sync completes */
+   vmfs_inode_t *dirty_list;
+   u_int dirty_count;
+
+   /* Keep modified inodes dirty when released, until the next sync */
+   bool write_back;
+
+   /* Statistics */
+   uint64_t hits,misses;
+};
+
+/* Create an inode cache with the given total number of buckets */
+vmfs_icache_t *vmfs_icache_create(u_int buckets);
+
+/* Destroy an inode cache, freeing released inodes */
+void vmfs_icache_destroy(vmfs_icache_t *ic);
+
+/* Change the total number of buckets of an inode cache */
+int vmfs_icache_resize(vmfs_icache_t *ic,u_int buckets);
+
+/* Get an inode from the cache, taking a reference on it */
+vmfs_inode_t *vmfs_icache_lookup(vmfs_icache_t *ic,uint64_t blk_id);
+
+/*
+ * Insert an inode with a single reference. If the inode is already present,
+ * a reference is taken on the cached one, which is returned instead.
+ */
+vmfs_inode_t *vmfs_icache_insert(vmfs_icache_t *ic,vmfs_inode_t *inode);
+
+/*
+ * Release a reference on an inode. Unreferenced inodes are written back
+ * (unless in write-back mode) and kept on the LRU list, unless they have
+ * been deleted.
+ */
+void vmfs_icache_release(vmfs_icache_t *ic,vmfs_inode_t *inode);
+
+/* Drop an unreferenced inode from the cache */
+void vmfs_icache_forget(vmfs_icache_t *ic,uint64_t blk_id);
+
+/* Add a modified inode to the dirty list */
+void vmfs_icache_mark_dirty(vmfs_icache_t *ic,vmfs_inode_t *inode);
+
+/* Write back a modified inode now */
+int vmfs_icache_write_inode(vmfs_icache_t *ic,vmfs_inode_t *inode);
+
+/* Enable or disable write-back of released inodes by vmfs_icache_sync() */
+void vmfs_icache_set_write_back(vmfs_icache_t *ic,bool enable);
+
+/*
+ * Write back all modified inodes, in on-disk order. Returns the number of
+ * inodes that could not be written.
+ */
+int vmfs_icache_sync(vmfs_icache_t *ic);
+
+#endif
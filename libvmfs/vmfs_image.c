@@ -0,0 +1,375 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* 
+ * Seekable VMFSIMG images.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "vmfs.h"
+#include "lz4.h"
+
+/* Image descriptor codes */
+#define VMFS_IMAGE_DESC_RAW    0x00
+#define VMFS_IMAGE_DESC_ZERO   0x01
+#define VMFS_IMAGE_DESC_LZ4    0x02
+#define VMFS_IMAGE_DESC_DUP    0x03
+#define VMFS_IMAGE_DESC_INDEX  0x7e
+#define VMFS_IMAGE_DESC_ADLER  0x7f
+
+#define VMFS_IMAGE_ADLER_MOD   65521
+#define VMFS_IMAGE_ADLER_NMAX  5552
+
+/* Compute the Adler-32 checksum of a buffer */
+static uint32_t vmfs_image_adler32(const u_char *buf,size_t len)
+{
+   uint32_t s1 = 1, s2 = 0;
+   size_t n;
+
+   while(len > 0) {
+      n = m_min(len,VMFS_IMAGE_ADLER_NMAX);
+      len -= n;
+
+      while(n--) {
+         s1 += *buf++;
+         s2 += s1;
+      }
+
+      s1 %= VMFS_IMAGE_ADLER_MOD;
+      s2 %= VMFS_IMAGE_ADLER_MOD;
+   }
+
+   return(s1 | (s2 << 16));
+}
+
+/* Read a variable-length number, returns the number of bytes used or -1 */
+static int vmfs_image_read_number(const u_char *buf,size_t len,
+                                  uint32_t *num)
+{
+   int i;
+
+   *num = 0;
+
+   for(i=0;(i < len) && (i < 5);i++) {
+      *num |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+
+      if (!(buf[i] & 0x80))
+         return(i+1);
+   }
+
+   return(-1);
+}
+
+/* 
+ * Decode a chunk of the image. A chunk referenced by a duplicated one must
+ * be compressed, so that references are followed only once.
+ */
+static int vmfs_image_decode_chunk(const vmfs_image_t *img,uint64_t id,
+                                   u_char *data,bool dup_target)
+{
+   size_t blks,len,pos = 0,blk = 0;
+   uint32_t num;
+   u_char *buf;
+   int res = -EIO;
+   ssize_t dlen;
+   int n;
+
+   blks = m_min(img->chunk_blks,img->blocks - (id * img->chunk_blks));
+   len = img->index[id+1] - img->index[id];
+
+   if (!(buf = malloc(len)))
+      return(-ENOMEM);
+
+   if (m_pread(img->fd,buf,len,img->index[id]) != len)
+      goto done;
+
+   while(pos < len) {
+      switch(buf[pos++]) {
+         case VMFS_IMAGE_DESC_RAW:
+            if ((n = vmfs_image_read_number(buf+pos,len-pos,&num)) < 0)
+               goto done;
+
+            pos += n;
+            num *= 4;
+
+            if ((blk >= blks) || (num > VMFS_IMAGE_BLK_SIZE) ||
+                (num > len - pos))
+               goto done;
+
+            memcpy(data + (blk * VMFS_IMAGE_BLK_SIZE),buf+pos,num);
+            memset(data + (blk * VMFS_IMAGE_BLK_SIZE) + num,0,
+                   VMFS_IMAGE_BLK_SIZE - num);
+            pos += num;
+            blk++;
+            break;
+
+         case VMFS_IMAGE_DESC_ZERO:
+            if ((n = vmfs_image_read_number(buf+pos,len-pos,&num)) < 0)
+               goto done;
+
+            pos += n;
+
+            if (num >= blks - blk)
+               goto done;
+
+            memset(data + (blk * VMFS_IMAGE_BLK_SIZE),0,
+                   (size_t)(num + 1) * VMFS_IMAGE_BLK_SIZE);
+            blk += num + 1;
+            break;
+
+         case VMFS_IMAGE_DESC_LZ4:
+            if ((n = vmfs_image_read_number(buf+pos,len-pos,&num)) < 0)
+               goto done;
+
+            pos += n;
+
+            if ((blk != 0) || (num > len - pos))
+               goto done;
+
+            dlen = lz4_decompress(buf+pos,num,data,blks * VMFS_IMAGE_BLK_SIZE);
+
+            if (dlen != blks * VMFS_IMAGE_BLK_SIZE)
+               goto done;
+
+            pos += num;
+            blk = blks;
+            break;
+
+         case VMFS_IMAGE_DESC_DUP:
+            /* Duplicated chunks reference previous compressed ones */
+            if ((n = vmfs_image_read_number(buf+pos,len-pos,&num)) < 0)
+               goto done;
+
+            pos += n;
+
+            if (dup_target || (blk != 0) || (num >= id) ||
+                (m_min(img->chunk_blks,img->blocks - (num*img->chunk_blks)) !=
+                 blks) ||
+                (vmfs_image_decode_chunk(img,num,data,true) < 0))
+               goto done;
+
+            blk = blks;
+            break;
+
+         case VMFS_IMAGE_DESC_ADLER:
+            /* The checksum ends the chunk */
+            if ((blk != blks) || (pos + 4 != len))
+               goto done;
+
+            if (read_le32(buf,pos) != 
+                vmfs_image_adler32(data,blks * VMFS_IMAGE_BLK_SIZE))
+            {
+               fprintf(stderr,"VMFS image: checksum mismatch in chunk "
+                       "%"PRIu64"\n",id);
+               goto done;
+            }
+
+            res = 0;
+            goto done;
+
+         default:
+            goto done;
+      }
+   }
+
+ done:
+   free(buf);
+   return(res);
+}
+
+/* Get a decoded chunk (image locked) */
+static const u_char *vmfs_image_get_chunk(vmfs_image_t *img,uint64_t id)
+{
+   struct vmfs_image_chunk *c,*victim = &img->cache[0];
+   int i;
+
+   for(i=0;i<VMFS_IMAGE_CACHE_SIZE;i++) {
+      c = &img->cache[i];
+
+      if (c->last_use && (c->id == id)) {
+         c->last_use = ++img->clock;
+         return(c->data);
+      }
+
+      if (c->last_use < victim->last_use)
+         victim = c;
+   }
+
+   /* Decode it in the least recently used slot */
+   if (!victim->data &&
+       !(victim->data = malloc((size_t)img->chunk_blks * VMFS_IMAGE_BLK_SIZE)))
+      return NULL;
+
+   victim->last_use = 0;
+
+   if (vmfs_image_decode_chunk(img,id,victim->data,false) < 0)
+      return NULL;
+
+   victim->id = id;
+   victim->last_use = ++img->clock;
+   return(victim->data);
+}
+
+/* Read data from the image */
+static ssize_t vmfs_image_read(const vmfs_device_t *dev,off_t pos,
+                               u_char *buf,size_t len)
+{
+   vmfs_image_t *img = (vmfs_image_t *) dev;
+   uint64_t chunk_size = (uint64_t)img->chunk_blks * VMFS_IMAGE_BLK_SIZE;
+   uint64_t size = img->blocks * VMFS_IMAGE_BLK_SIZE;
+   const u_char *data;
+   size_t hlen = 0,clen;
+   off_t offset;
+
+   if (pos < 0)
+      return(-1);
+
+   pthread_mutex_lock(&img->lock);
+
+   while((hlen < len) && (pos < size)) {
+      if (!(data = vmfs_image_get_chunk(img,pos / chunk_size))) {
+         pthread_mutex_unlock(&img->lock);
+         return(-1);
+      }
+
+      offset = pos % chunk_size;
+      clen = m_min(len - hlen,m_min(chunk_size - offset,size - pos));
+      memcpy(buf + hlen,data + offset,clen);
+
+      hlen += clen;
+      pos += clen;
+   }
+
+   pthread_mutex_unlock(&img->lock);
+   return(hlen);
+}
+
+/* Close an image */
+static void vmfs_image_close(vmfs_device_t *dev)
+{
+   vmfs_image_t *img = (vmfs_image_t *) dev;
+   int i;
+
+   if (!img)
+      return;
+
+   for(i=0;i<VMFS_IMAGE_CACHE_SIZE;i++)
+      free(img->cache[i].data);
+
+   pthread_mutex_destroy(&img->lock);
+   free(img->index);
+   free(img);
+}
+
+/* Read the block index of an image */
+static int vmfs_image_read_index(vmfs_image_t *img)
+{
+   u_char buf[13];
+   uint64_t i,index_pos;
+   struct stat st;
+   off_t size;
+   u_char *raw;
+   size_t len;
+
+   if (fstat(img->fd,&st) == -1)
+      return(-1);
+
+   if ((size = st.st_size) < 8 + sizeof(buf) + 8)
+      return(-1);
+
+   if (m_pread(img->fd,buf,8,size - 8) != 8)
+      return(-1);
+
+   index_pos = read_le64(buf,0);
+
+   if ((index_pos < 8) || (index_pos > size - sizeof(buf) - 8) ||
+       (m_pread(img->fd,buf,sizeof(buf),index_pos) != sizeof(buf)) ||
+       (buf[0] != VMFS_IMAGE_DESC_INDEX))
+      return(-1);
+
+   img->blocks = read_le64(buf,1);
+   img->chunk_blks = read_le32(buf,9);
+
+   if (!img->chunk_blks)
+      return(-1);
+
+   img->chunk_count = (img->blocks + img->chunk_blks - 1) / img->chunk_blks;
+   len = img->chunk_count * 8;
+
+   if (len != size - index_pos - sizeof(buf) - 8)
+      return(-1);
+
+   if (!(img->index = malloc((img->chunk_count + 1) * sizeof(uint64_t))) ||
+       !(raw = malloc(len + 1)))
+      return(-1);
+
+   if (m_pread(img->fd,raw,len,index_pos + sizeof(buf)) != len) {
+      free(raw);
+      return(-1);
+   }
+
+   for(i=0;i<img->chunk_count;i++)
+      img->index[i] = read_le64(raw,i*8);
+
+   img->index[img->chunk_count] = index_pos;
+   free(raw);
+
+   /* Offsets must be increasing */
+   for(i=0;i<img->chunk_count;i++)
+      if ((img->index[i] < 8) || (img->index[i] >= img->index[i+1]))
+         return(-1);
+
+   return(0);
+}
+
+/* 
+ * Open a seekable image from a file descriptor, which remains owned by the
+ * caller. Returns NULL if the file is not such an image.
+ */
+vmfs_image_t *vmfs_image_open(int fd)
+{
+   vmfs_image_t *img;
+   u_char hdr[8];
+
+   if ((m_pread(fd,hdr,sizeof(hdr),0) != sizeof(hdr)) ||
+       memcmp(hdr,"VMFSIMG",7))
+      return NULL;
+
+   if ((hdr[7] < VMFS_IMAGE_MIN_VERSION) || (hdr[7] > VMFS_IMAGE_VERSION)) {
+      fprintf(stderr,"VMFS image: format version %u can't be read "
+              "directly, convert it with imager -r\n",hdr[7]);
+      return NULL;
+   }
+
+   if (!(img = calloc(1,sizeof(*img))))
+      return NULL;
+
+   img->fd = fd;
+   pthread_mutex_init(&img->lock,NULL);
+
+   if (vmfs_image_read_index(img) == -1) {
+      fprintf(stderr,"VMFS image: invalid block index\n");
+      vmfs_image_close(&img->dev);
+      return NULL;
+   }
+
+   img->dev.read = vmfs_image_read;
+   img->dev.close = vmfs_image_close;
+   return img;
+}
@@ -0,0 +1,58 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_IMAGE_H
+#define VMFS_IMAGE_H
+
+/* 
+ * Seekable VMFSIMG images (format versions 3 and 4, see imager/imager.c),
+ * giving random read access to the imaged device without extracting it.
+ */
+#define VMFS_IMAGE_MIN_VERSION 3
+#define VMFS_IMAGE_VERSION     4
+#define VMFS_IMAGE_BLK_SIZE    512
+
+/* Number of decoded chunks kept in memory */
+#define VMFS_IMAGE_CACHE_SIZE  8
+
+struct vmfs_image_chunk {
+   uint64_t id;
+   uint64_t last_use;     /* 0 means the slot is unused */
+   u_char *data;
+};
+
+struct vmfs_image {
+   vmfs_device_t dev;
+   int fd;
+
+   uint64_t blocks;
+   uint32_t chunk_blks;
+   uint64_t chunk_count;
+
+   /* Offsets of the chunks, followed by the offset of the index */
+   uint64_t *index;
+
+   pthread_mutex_t lock;
+   struct vmfs_image_chunk cache[VMFS_IMAGE_CACHE_SIZE];
+   uint64_t clock;
+};
+
+/* 
+ * Open a seekable image from a file descriptor, which remains owned by the
+ * caller. Returns NULL if the file is not such an image.
+ */
+vmfs_image_t *vmfs_image_open(int fd);
+
+#endif
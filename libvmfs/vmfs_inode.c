@@ -38,11 +38,14 @@ static inline void vmfs_inode_write_blk_id(u_char *buf,u_int index,
    write_le64(buf,VMFS_INODE_OFS_BLK_ARRAY+(index*sizeof(uint64_t)),blk_id);
 }
 
-/* Read an inode */
-static int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf)
+/* Read an inode, except its block list or content (see below) */
+int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf)
 {
-   int i;
    int res;
+
+   /* The block list or content of a previous inode is not valid anymore */
+   vmfs_inode_put_data(inode);
+
    vmfs_metadata_hdr_read(&inode->mdh,buf);
    dprintf("called buf %p magic %x\n", buf, inode->mdh.magic);      
 
@@ -77,27 +80,88 @@ static int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf)
        inode->cmode = inode->mode | vmfs_file_type2mode(inode->type);
    dprintf("metadata done for inode type %d zla 0x%x\n", inode->type, inode->zla);   
 
-   if (inode->type == VMFS_FILE_TYPE_RDM) {
+   if (inode->type == VMFS_FILE_TYPE_RDM)
       inode->rdm_id = read_le32(buf,VMFS_INODE_OFS_RDM_ID);
+
+   vmfs_inode_set_resolver(inode);
+   return(0);
+}
+
+/* 
+ * Decode the block list or content of an inode from its on-disk record,
+ * which is read again if "buf" is NULL. Nothing is done if already loaded.
+ */
+int vmfs_inode_load_data(const vmfs_inode_t *inode,const u_char *buf)
+{
+   DECL_ALIGNED_BUFFER_WOL(rec,VMFS_INODE_SIZE);
+   struct vmfs_inode_data *data,*cur = NULL;
+   int i;
+
+   if (inode->data)
+      return(0);
+
+   /* Read the record again from the FDC, as done by vmfs_inode_get() */
+   if (!buf) {
+      vmfs_bitmap_t *fdc;
+
+      if (!inode->fs || !(fdc = vmfs_fs_get_fdc(inode->fs)))
+         return(-1);
+
+      if (!(buf = vmfs_bitmap_borrow_item(fdc,VMFS_BLK_FD_ENTRY(inode->id),
+                                          VMFS_BLK_FD_ITEM(inode->id))))
+      {
+         if (!vmfs_bitmap_get_item(fdc,VMFS_BLK_FD_ENTRY(inode->id),
+                                   VMFS_BLK_FD_ITEM(inode->id),rec))
+            return(-1);
+         buf = rec;
+      }
+
+      if ((read_le32(buf,VMFS_MDH_OFS_MAGIC) != VMFS_INODE_MAGIC) ||
+          (read_le32(buf,VMFS_INODE_OFS_ID) != inode->id))
+         return(-1);
+   }
+
+   if (!(data = calloc(1,sizeof(*data))))
+      return(-1);
+
+   data->ref_count = 1;
+
+   if (inode->type == VMFS_FILE_TYPE_RDM) {
+      /* Neither blocks nor content */
    } else if (inode->zla == VMFS5_ZLA_BASE + VMFS_BLK_TYPE_FD) {
-      memcpy(inode->content, buf + VMFS_INODE_OFS_CONTENT, inode->size);
+      memcpy(data->content, buf + VMFS_INODE_OFS_CONTENT,
+             m_min(inode->size,sizeof(data->content)));
    } else {
       dprintf("file id %d off %ld blk:\n", inode->id, VMFS_INODE_OFS_BLK_ARRAY);
-      //hexdump(buf+VMFS_INODE_OFS_BLK_ARRAY,256);
       for(i=0;i<VMFS_INODE_BLK_COUNT;i++)
       {
-         inode->blocks[i] = vmfs_inode_read_blk_id(buf,i);
-         if (inode->blocks[i] == 0)	      
-         	break;
-		 dprintf("%d:%016lx\n", i, inode->blocks[i]);				
-         	
-       }
-       dprintf("-------\n");
+         data->blocks[i] = vmfs_inode_read_blk_id(buf,i);
+         if (data->blocks[i] == 0)
+            break;
+         dprintf("%d:%016lx\n", i, data->blocks[i]);
+      }
    }
 
+   /* Another thread may have loaded it in the meantime */
+   if (!__atomic_compare_exchange_n((struct vmfs_inode_data **)&inode->data,
+                                    &cur,data,0,__ATOMIC_RELEASE,
+                                    __ATOMIC_ACQUIRE))
+      free(data);
+
    return(0);
 }
 
+/* Drop the reference of an inode on its block list or content */
+void vmfs_inode_put_data(vmfs_inode_t *inode)
+{
+   struct vmfs_inode_data *data = inode->data;
+
+   inode->data = NULL;
+
+   if (data && (__atomic_sub_fetch(&data->ref_count,1,__ATOMIC_ACQ_REL) == 0))
+      free(data);
+}
+
 /* Write an inode */
 static int vmfs_inode_write(const vmfs_inode_t *inode,u_char *buf)
 {
@@ -127,8 +191,10 @@ static void vmfs_inode_write_blk_list(const vmfs_inode_t *inode,u_char *buf)
 {
    int i;
 
+   assert(inode->data != NULL);
+
    for(i=0;i<VMFS_INODE_BLK_COUNT;i++)
-      vmfs_inode_write_blk_id(buf,i,inode->blocks[i]);
+      vmfs_inode_write_blk_id(buf,i,inode->data->blocks[i]);
 }
 
 /* Update an inode on disk */
@@ -136,6 +202,9 @@ int vmfs_inode_update(const vmfs_inode_t *inode,int update_blk_list)
 {
    DECL_ALIGNED_BUFFER(buf,VMFS_INODE_SIZE);
 
+   if (update_blk_list && !vmfs_inode_get_data(inode))
+      return(-1);
+
    memset(buf,0,VMFS_INODE_SIZE);
    vmfs_inode_write(inode,buf);
 
@@ -151,59 +220,128 @@ int vmfs_inode_update(const vmfs_inode_t *inode,int update_blk_list)
    return(0);
 }
 
-/* Get inode corresponding to a block id */
-int vmfs_inode_get(const vmfs_fs_t *fs,uint64_t blk_id,vmfs_inode_t *inode)
+/*
+ * Write back modified inodes sorted by on-disk position, merging adjacent
+ * records in single writes. Returns the number of inodes not written.
+ */
+int vmfs_inode_update_batch(vmfs_inode_t **inodes,u_int count)
 {
-   DECL_ALIGNED_BUFFER_WOL(buf,VMFS_INODE_SIZE);
-   dprintf("%s : called\n", __FUNCTION__);
-   if (VMFS_BLK_TYPE(blk_id) != VMFS_BLK_TYPE_FD)
-      return(-1);
+   size_t hdr_len = VMFS_INODE_SIZE - VMFS_INODE_BLK_COUNT * sizeof(uint32_t);
+   u_int i,j,k,failed = 0;
+   u_char *buf,*rec;
+   size_t len;
+
+   if (!(buf = iobuffer_alloc(VMFS_INODE_BATCH_MAX * VMFS_INODE_SIZE))) {
+      /* Fall back to one write per inode */
+      for(i=0;i<count;i++) {
+         if (vmfs_inode_update(inodes[i],
+                               inodes[i]->update_flags & VMFS_INODE_SYNC_BLK))
+            failed++;
+         else
+            inodes[i]->update_flags = 0;
+      }
+      return(failed);
+   }
 
-   if (!vmfs_bitmap_get_item(fs->fdc, VMFS_BLK_FD_ENTRY(blk_id),
-                             VMFS_BLK_FD_ITEM(blk_id), buf))
-      return(-1);
+   for(i=0;i<count;i=j) {
+      /*
+       * Extend the run while records follow each other on disk. Only the
+       * headers of inodes with an unchanged block list are written, which
+       * ends the run.
+       */
+      for(j=i+1;(j < count) && (j - i < VMFS_INODE_BATCH_MAX);j++)
+         if (!(inodes[j-1]->update_flags & VMFS_INODE_SYNC_BLK) ||
+             (inodes[j]->fs != inodes[i]->fs) ||
+             (inodes[j]->mdh.pos != inodes[j-1]->mdh.pos + VMFS_INODE_SIZE))
+            break;
 
-   return(vmfs_inode_read(inode,buf));
+      memset(buf,0,(j - i) * VMFS_INODE_SIZE);
+
+      for(k=i;k<j;k++) {
+         rec = buf + (k - i) * VMFS_INODE_SIZE;
+         vmfs_inode_write(inodes[k],rec);
+
+         if (inodes[k]->update_flags & VMFS_INODE_SYNC_BLK)
+            vmfs_inode_write_blk_list(inodes[k],rec);
+      }
+
+      len = (j - i - 1) * VMFS_INODE_SIZE;
+      len += (inodes[j-1]->update_flags & VMFS_INODE_SYNC_BLK) ?
+         VMFS_INODE_SIZE : hdr_len;
+
+      if (vmfs_device_write(inodes[i]->fs->dev,inodes[i]->mdh.pos,
+                            buf,len) != len)
+      {
+         failed += j - i;
+         continue;
+      }
+
+      for(k=i;k<j;k++)
+         inodes[k]->update_flags = 0;
+   }
+
+   iobuffer_free(buf);
+   return(failed);
 }
 
-/* Hash function to retrieve an in-core inode */
-static inline u_int vmfs_inode_hash(const vmfs_fs_t *fs,uint64_t blk_id)
+/* Record changes to write back for an inode */
+void vmfs_inode_set_dirty(vmfs_inode_t *inode,u_int flags)
 {
-   return( (blk_id ^ (blk_id >> 9)) & (fs->inode_hash_buckets - 1) );
+   inode->update_flags |= flags;
+
+   /* Inodes not coming from the cache are written back when released */
+   if (inode->pprev != NULL)
+      vmfs_icache_mark_dirty(inode->fs->icache,inode);
 }
 
-/* Register an inode in the in-core inode hash table */
-static void vmfs_inode_register(const vmfs_fs_t *fs,vmfs_inode_t *inode)
+/* Write back a modified inode now */
+int vmfs_inode_sync(vmfs_inode_t *inode)
 {
-   u_int hb;
+   if (!inode->update_flags)
+      return(0);
 
-   hb = vmfs_inode_hash(fs,inode->id);
+   if (inode->pprev != NULL)
+      return(vmfs_icache_write_inode(inode->fs->icache,inode));
 
-   inode->fs = fs;
-   inode->ref_count = 1;
-   
-   /* Insert into hash table */
-   inode->next  = fs->inodes[hb];
-   inode->pprev = &fs->inodes[hb];
+   if (vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK))
+      return(-EIO);
+
+   inode->update_flags = 0;
+   return(0);
+}
+
+/* Get inode corresponding to a block id */
+int vmfs_inode_get(const vmfs_fs_t *fs,uint64_t blk_id,vmfs_inode_t *inode)
+{
+   DECL_ALIGNED_BUFFER_WOL(buf,VMFS_INODE_SIZE);
+   vmfs_bitmap_t *fdc;
+   const u_char *ptr;
+
+   dprintf("%s : called\n", __FUNCTION__);
+   if (VMFS_BLK_TYPE(blk_id) != VMFS_BLK_TYPE_FD)
+      return(-1);
+
+   /* Decode the inode in place when the device is mapped */
+   fdc = vmfs_fs_get_fdc(fs);
 
-   if (inode->next != NULL)
-      inode->next->pprev = &inode->next;
+   if ((ptr = vmfs_bitmap_borrow_item(fdc,VMFS_BLK_FD_ENTRY(blk_id),
+                                      VMFS_BLK_FD_ITEM(blk_id))))
+      return(vmfs_inode_read(inode,ptr));
+
+   if (!vmfs_bitmap_get_item(fdc, VMFS_BLK_FD_ENTRY(blk_id),
+                             VMFS_BLK_FD_ITEM(blk_id), buf))
+      return(-1);
 
-   fs->inodes[hb] = inode;
+   return(vmfs_inode_read(inode,buf));
 }
 
 /* Acquire an inode */
 vmfs_inode_t *vmfs_inode_acquire(const vmfs_fs_t *fs,uint64_t blk_id)
 {
-   vmfs_inode_t *inode;
-   u_int hb;
+   vmfs_inode_t *inode,*cur;
 
-   hb = vmfs_inode_hash(fs,blk_id);
-   for(inode=fs->inodes[hb];inode;inode=inode->next)
-      if (inode->id == blk_id) {
-         inode->ref_count++;
-         return inode;
-      }
+   if ((inode = vmfs_icache_lookup(fs->icache,blk_id)))
+      return inode;
    
    /* Inode not yet used, allocate room for it */
    if (!(inode = calloc(1,sizeof(*inode))))
@@ -214,49 +352,61 @@ vmfs_inode_t *vmfs_inode_acquire(const vmfs_fs_t *fs,uint64_t blk_id)
       return NULL;
    }
 
-   vmfs_inode_register(fs,inode);
-   return inode;
+   inode->fs = fs;
+
+   /* Another thread may have loaded the same inode in the meantime */
+   if ((cur = vmfs_icache_insert(fs->icache,inode)) != inode)
+      free(inode);
+
+   return cur;
 }
 
 /* Release an inode */
 void vmfs_inode_release(vmfs_inode_t *inode)
 {
-   assert(inode->ref_count > 0);
- 
-   if (--inode->ref_count == 0) {
-      if (inode->update_flags)
-         vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+   /* Inodes not coming from the cache */
+   if (inode->pprev == NULL) {
+      assert(inode->ref_count > 0);
 
-      if (inode->pprev != NULL) {
-         /* remove the inode from hash table */
-         if (inode->next != NULL)
-            inode->next->pprev = inode->pprev;
-
-         *(inode->pprev) = inode->next;
-
-         free(inode);
-      }
+      if ((--inode->ref_count == 0) && inode->update_flags)
+         vmfs_inode_update(inode,inode->update_flags & VMFS_INODE_SYNC_BLK);
+      return;
    }
+
+   vmfs_icache_release(inode->fs->icache,inode);
 }
 
-/* Allocate a new inode */
-int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
+/* Allocate a new inode (within a metadata transaction) */
+static int vmfs_inode_alloc_fd(vmfs_fs_t *fs,u_int type,mode_t mode,
+                               vmfs_inode_t **inode)
 {
+   vmfs_bitmap_t *sbc;
    vmfs_inode_t *fdc_inode;
    off_t fdc_offset;
    uint64_t fdc_blk;
    uint64_t blk_id;
    time_t ct;
 
+   if (!(sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB)))
+      return(-EIO);
+
    time(&ct);
 
    if (!(*inode = calloc(1,sizeof(vmfs_inode_t))))
       return(-ENOMEM);
 
+   /* A new inode has an empty block list */
+   if (!((*inode)->data = calloc(1,sizeof(*(*inode)->data)))) {
+      free(*inode);
+      return(-ENOMEM);
+   }
+
+   (*inode)->data->ref_count = 1;
    (*inode)->mdh.magic = VMFS_INODE_MAGIC;
    (*inode)->type      = type;
-   (*inode)->blk_size  = fs->sbc->bmh.data_size;
+   (*inode)->blk_size  = sbc->bmh.data_size;
    (*inode)->zla       = VMFS_BLK_TYPE_SB;
+   vmfs_inode_set_resolver(*inode);
    (*inode)->mtime     = ct;
    (*inode)->ctime     = ct;
    (*inode)->atime     = ct;
@@ -266,15 +416,16 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
 
 
    if (vmfs_block_alloc(fs,VMFS_BLK_TYPE_FD,&blk_id) < 0) {
+      vmfs_inode_put_data(*inode);
       free(*inode);
       return(-ENOSPC);
    }
    (*inode)->id = (uint32_t)blk_id;
 
    /* Compute "physical" position of inode, using FDC file */
-   fdc_inode = fs->fdc->f->inode;
+   fdc_inode = vmfs_fs_get_fdc(fs)->f->inode;
 
-   fdc_offset = vmfs_bitmap_get_item_pos(fs->fdc,
+   fdc_offset = vmfs_bitmap_get_item_pos(vmfs_fs_get_fdc(fs),
                                          VMFS_BLK_FD_ENTRY((*inode)->id),
                                          VMFS_BLK_FD_ITEM((*inode)->id));
 
@@ -282,6 +433,7 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
        (VMFS_BLK_TYPE(fdc_blk) != VMFS_BLK_TYPE_FB))
    {
       vmfs_block_free(fs,(*inode)->id);
+      vmfs_inode_put_data(*inode);
       free(*inode);
       return(-ENOSPC);
    }
@@ -289,20 +441,46 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
    (*inode)->mdh.pos = fdc_inode->blk_size * VMFS_BLK_FB_ITEM(fdc_blk);
    (*inode)->mdh.pos += fdc_offset % fdc_inode->blk_size;
 
-   (*inode)->update_flags |= VMFS_INODE_SYNC_ALL;
-   vmfs_inode_register(fs,*inode);
+   (*inode)->fs = fs;
+
+   /* 
+    * Forget a previous inode cached with the same id. One still referenced
+    * cannot be dropped, so give up the slot rather than alias it.
+    */
+   vmfs_icache_forget(fs->icache,(*inode)->id);
+
+   if (vmfs_icache_insert(fs->icache,*inode) != *inode) {
+      vmfs_block_free(fs,(*inode)->id);
+      vmfs_inode_put_data(*inode);
+      free(*inode);
+      return(-EBUSY);
+   }
+
+   vmfs_inode_set_dirty(*inode,VMFS_INODE_SYNC_ALL);
    return(0);
 }
 
+/* Allocate a new inode */
+int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode)
+{
+   vmfs_metadata_txn_t txn;
+   int res;
+
+   vmfs_metadata_txn_begin(fs,&txn);
+   res = vmfs_inode_alloc_fd(fs,type,mode,inode);
+   vmfs_metadata_txn_end(fs,&txn);
+   return(res);
+}
+
 /* 
  * Get block ID corresponding the specified position. Double Indirecting Addressing, Pointer block
  */
 int doubleIndirectAddressing(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
 {
    const vmfs_fs_t *fs = inode->fs;
-   DECL_ALIGNED_BUFFER_WOL(buf,fs->sbc->bmh.data_size);
-
+   vmfs_bitmap_t *sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB);
    u_int blk_index;
+   int res;
    uint32_t blk_per_extendedPb;
    uint32_t blk_per_primary_pb;
    uint32_t blk_per_secondary_pb;
@@ -315,11 +493,14 @@ int doubleIndirectAddressing(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_i
    u_int secondary_pb_index;
    u_int secondary_sub_index;
 
+   if (!sbc || !vmfs_inode_get_data(inode))
+      return(-EIO);
+
    blk_index = pos / inode->blk_size;
    dprintf("blk_index: %d = pos/inode->blk_size: (%ld/%ld)\n",blk_index, pos, inode->blk_size);
 
-   blk_per_primary_pb = fs->sbc->bmh.data_size / sizeof(uint64_t); // 8192
-   blk_per_secondary_pb = fs->sbc->bmh.data_size / sizeof(uint64_t); // 8192
+   blk_per_primary_pb = sbc->bmh.data_size / sizeof(uint64_t); // 8192
+   blk_per_secondary_pb = sbc->bmh.data_size / sizeof(uint64_t); // 8192
    blk_per_extendedPb = blk_per_primary_pb * blk_per_secondary_pb;	// 64m
    dprintf("blk_per_extendedPb: %d\n",blk_per_extendedPb);
 
@@ -334,23 +515,26 @@ int doubleIndirectAddressing(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_i
    if (primary_pb_index >= VMFS_INODE_BLK_COUNT)
 	  return(-EINVAL);
 
-   primary_pb_blk_id = inode->blocks[primary_pb_index];
+   primary_pb_blk_id = inode->data->blocks[primary_pb_index];
    dprintf("primary_pb_blk_id: 0x%lx, \n", primary_pb_blk_id);
 
    if (!primary_pb_blk_id)
 	  return(-EINVAL);
 
-   if (!vmfs_bitmap_get_item(fs->sbc, VMFS_BLK_SB_ENTRY(primary_pb_blk_id), VMFS_BLK_SB_ITEM(primary_pb_blk_id), buf))
-	  return(-EIO);
-   dprintf("primary_pb_blk_id: 0x%lx, \n", primary_pb_blk_id);
-
-   secondary_pb_blk_id = read_le64(buf,secondary_pb_index*sizeof(uint64_t));
+   if ((res = vmfs_pbcache_get_blk_id(fs,sbc,
+                                      VMFS_BLK_SB_ENTRY(primary_pb_blk_id),
+                                      VMFS_BLK_SB_ITEM(primary_pb_blk_id),
+                                      primary_pb_blk_id,secondary_pb_index,
+                                      &secondary_pb_blk_id)) < 0)
+	  return(res);
    dprintf("secondary_pb_blk_id: 0x%lx, secondary_pb_index: %d\n", secondary_pb_blk_id, secondary_pb_index);
 
-   if (!vmfs_bitmap_get_item(fs->sbc, VMFS_BLK_SB_ENTRY(secondary_pb_blk_id), VMFS_BLK_SB_ITEM(secondary_pb_blk_id), buf))
-	  return(-EIO);
-
-    *blk_id = read_le64(buf,secondary_sub_index*sizeof(uint64_t));
+   if ((res = vmfs_pbcache_get_blk_id(fs,sbc,
+                                      VMFS_BLK_SB_ENTRY(secondary_pb_blk_id),
+                                      VMFS_BLK_SB_ITEM(secondary_pb_blk_id),
+                                      secondary_pb_blk_id,secondary_sub_index,
+                                      blk_id)) < 0)
+	  return(res);
     dprintf("blk_id: 0x%lx, secondary_sub_index: %d\n", *blk_id, secondary_sub_index);
 
 	return(0);
@@ -358,21 +542,17 @@ int doubleIndirectAddressing(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_i
 }
 
 /*
- * Get block ID corresponding the specified position. Pointer block
- * resolution is transparently done here.
+ * Generic block resolver, handling any addressing mode and geometry with
+ * divisions. Used when no specialised resolver applies.
  */
-int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
+static int vmfs_inode_get_block_generic(const vmfs_inode_t *inode,off_t pos,
+                                        uint64_t *blk_id)
 {
    const vmfs_fs_t *fs = inode->fs;
    u_int blk_index;
    uint32_t zla;
    int vmfs5_extension;
 
-   *blk_id = 0;
-
-   if (!inode->blk_size)
-      return(-EIO);
-
    /* This doesn't make much sense but looks like how it's being coded. At
     * least, the result has some sense. */
    zla = inode->zla;
@@ -393,18 +573,21 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
          if (blk_index >= VMFS_INODE_BLK_COUNT)
             return(-EINVAL);
 
-         *blk_id = inode->blocks[blk_index];
+         *blk_id = inode->data->blocks[blk_index];
          break;
   
 	  case VMFS_BLK_TYPE_PB2:
 	  {
-		  DECL_ALIGNED_BUFFER_WOL(buf,fs->pb2->bmh.data_size);
+		  vmfs_bitmap_t *pb2;
 		  uint64_t pb_blk_id;
 		  uint32_t blk_per_pb;
 		  u_int pb_index;
 		  u_int sub_index;
 		  
-		  blk_per_pb = fs->pb2->bmh.data_size / sizeof(uint64_t);
+		  if (!(pb2 = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB2)))
+			 return(-EIO);
+
+		  blk_per_pb = vmfs_bitmap_ptrs_per_item(pb2);
 		  blk_index = pos / inode->blk_size;
 		  
 		  pb_index	= blk_index / blk_per_pb;
@@ -413,18 +596,16 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
 		  if (pb_index >= VMFS_INODE_BLK_COUNT)
 			 return(-EINVAL);
 		  
-		  pb_blk_id = inode->blocks[pb_index];
+		  pb_blk_id = inode->data->blocks[pb_index];
 		  
 		  if (!pb_blk_id)
 			 break;
 			dprintf("get item for pb2 blk 0x%lx\n", pb_blk_id);
-		  if (!vmfs_bitmap_get_item(fs->pb2,
-									VMFS_BLK_PB2_ENTRY(pb_blk_id),
-									VMFS_BLK_PB2_ITEM(pb_blk_id),
-									buf))
+		  if (vmfs_pbcache_get_blk_id(fs,pb2,
+									  VMFS_BLK_PB2_ENTRY(pb_blk_id),
+									  VMFS_BLK_PB2_ITEM(pb_blk_id),
+									  pb_blk_id,sub_index,blk_id) < 0)
 			 return(-EIO);
-	  
-		  *blk_id = read_le64(buf,sub_index*sizeof(uint64_t));
 		  break;
 
 	  }
@@ -446,13 +627,17 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
 		      dprintf("PB blk_id 0x%lx\n", *blk_id);
 
           } else {
-	         DECL_ALIGNED_BUFFER_WOL(buf,fs->pbc->bmh.data_size);
+	         vmfs_bitmap_t *pbc,*sbc;
 	         uint64_t pb_blk_id;
 	         uint32_t blk_per_pb;
 	         u_int pb_index;
 	         u_int sub_index;
 
-	         blk_per_pb = fs->pbc->bmh.data_size / sizeof(uint64_t);
+	         if (!(pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB)) ||
+	             !(sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB)))
+	            return(-EIO);
+
+	         blk_per_pb = vmfs_bitmap_ptrs_per_item(pbc);
 	         blk_index = pos / inode->blk_size;
 
 	         pb_index  = blk_index / blk_per_pb;
@@ -461,18 +646,16 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
 	         if (pb_index >= VMFS_INODE_BLK_COUNT)
 	            return(-EINVAL);
 
-	         pb_blk_id = inode->blocks[pb_index];
+	         pb_blk_id = inode->data->blocks[pb_index];
 
 	         if (!pb_blk_id)
 	            break;
 	// under vmfs6 authors seems use sbc to replace pbc file for the index of a pb file
-	         if (!vmfs_bitmap_get_item(fs->sbc,
-	                                   VMFS_BLK_SB_ENTRY(pb_blk_id),
-	                                   VMFS_BLK_SB_ITEM(pb_blk_id),
-	                                   buf))
+	         if (vmfs_pbcache_get_blk_id(fs,sbc,
+	                                     VMFS_BLK_SB_ENTRY(pb_blk_id),
+	                                     VMFS_BLK_SB_ITEM(pb_blk_id),
+	                                     pb_blk_id,sub_index,blk_id) < 0)
 	            return(-EIO);
-	//		hexdump(buf, fs->pbc->bmh.data_size);
-	         *blk_id = read_le64(buf,sub_index*sizeof(uint64_t));
 			dprintf("PB pb idx %u sub idx %u get blk_id 0x%lx\n", pb_index, sub_index, *blk_id);
          }
 	         break;
@@ -491,25 +674,320 @@ int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
    return(0);
 }
 
+/* Resolver for file and sub-blocks addressed directly from the inode */
+static int vmfs_inode_get_block_direct(const vmfs_inode_t *inode,off_t pos,
+                                       uint64_t *blk_id)
+{
+   uint64_t blk_index = (uint64_t)pos >> inode->blk_shift;
+
+   if (blk_index >= VMFS_INODE_BLK_COUNT)
+      return(-EINVAL);
+
+   *blk_id = inode->data->blocks[blk_index];
+   return(0);
+}
+
+/* Resolver for blocks addressed through one level of PB2 pointer blocks */
+static int vmfs_inode_get_block_pb2(const vmfs_inode_t *inode,off_t pos,
+                                    uint64_t *blk_id)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *pb2 = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB2);
+   uint64_t blk_index,pb_index,pb_blk_id;
+   u_int shift;
+
+   if (!pb2 || !(shift = pb2->ptr_shift))
+      return(vmfs_inode_get_block_generic(inode,pos,blk_id));
+
+   blk_index = (uint64_t)pos >> inode->blk_shift;
+   pb_index  = blk_index >> shift;
+
+   if (pb_index >= VMFS_INODE_BLK_COUNT)
+      return(-EINVAL);
+
+   if (!(pb_blk_id = inode->data->blocks[pb_index]))
+      return(0);
+
+   if (vmfs_pbcache_get_blk_id(fs,pb2,
+                               VMFS_BLK_PB2_ENTRY(pb_blk_id),
+                               VMFS_BLK_PB2_ITEM(pb_blk_id),
+                               pb_blk_id,blk_index & ((1ULL << shift) - 1),
+                               blk_id) < 0)
+      return(-EIO);
+
+   return(0);
+}
+
+/* 
+ * Resolver for blocks addressed through one level of pointer blocks, whose
+ * geometry is given by the PBC but which are stored in sub-blocks.
+ */
+static int vmfs_inode_get_block_pb(const vmfs_inode_t *inode,off_t pos,
+                                   uint64_t *blk_id)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB);
+   vmfs_bitmap_t *sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB);
+   uint64_t blk_index,pb_index,pb_blk_id;
+   u_int shift;
+
+   if (!pbc || !sbc || !(shift = pbc->ptr_shift))
+      return(vmfs_inode_get_block_generic(inode,pos,blk_id));
+
+   blk_index = (uint64_t)pos >> inode->blk_shift;
+   pb_index  = blk_index >> shift;
+
+   if (pb_index >= VMFS_INODE_BLK_COUNT)
+      return(-EINVAL);
+
+   if (!(pb_blk_id = inode->data->blocks[pb_index]))
+      return(0);
+
+   if (vmfs_pbcache_get_blk_id(fs,sbc,
+                               VMFS_BLK_SB_ENTRY(pb_blk_id),
+                               VMFS_BLK_SB_ITEM(pb_blk_id),
+                               pb_blk_id,blk_index & ((1ULL << shift) - 1),
+                               blk_id) < 0)
+      return(-EIO);
+
+   return(0);
+}
+
+/* 
+ * Resolver for blocks addressed through two levels of pointer blocks
+ * stored in sub-blocks (VMFS5 extension of the PB mode).
+ */
+static int vmfs_inode_get_block_dind(const vmfs_inode_t *inode,off_t pos,
+                                     uint64_t *blk_id)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB);
+   uint64_t blk_index,primary_index,mask;
+   uint64_t primary_blk_id,secondary_blk_id;
+   u_int shift;
+   int res;
+
+   if (!sbc || !(shift = sbc->ptr_shift))
+      return(vmfs_inode_get_block_generic(inode,pos,blk_id));
+
+   mask = (1ULL << shift) - 1;
+   blk_index = (uint64_t)pos >> inode->blk_shift;
+   primary_index = blk_index >> (2 * shift);
+
+   if (primary_index >= VMFS_INODE_BLK_COUNT)
+      return(-EINVAL);
+
+   if (!(primary_blk_id = inode->data->blocks[primary_index]))
+      return(-EINVAL);
+
+   if ((res = vmfs_pbcache_get_blk_id(fs,sbc,
+                                      VMFS_BLK_SB_ENTRY(primary_blk_id),
+                                      VMFS_BLK_SB_ITEM(primary_blk_id),
+                                      primary_blk_id,
+                                      (blk_index >> shift) & mask,
+                                      &secondary_blk_id)) < 0)
+      return(res);
+
+   if ((res = vmfs_pbcache_get_blk_id(fs,sbc,
+                                      VMFS_BLK_SB_ENTRY(secondary_blk_id),
+                                      VMFS_BLK_SB_ITEM(secondary_blk_id),
+                                      secondary_blk_id,blk_index & mask,
+                                      blk_id)) < 0)
+      return(res);
+
+   return(0);
+}
+
+/* Resolver for data stored inline in the inode (VMFS5 extension) */
+static int vmfs_inode_get_block_fd(const vmfs_inode_t *inode,off_t pos,
+                                   uint64_t *blk_id)
+{
+   *blk_id = inode->id;
+   return(0);
+}
+
+/* 
+ * Choose the block resolver of an inode from its addressing mode (ZLA) and
+ * block size. Must be called again whenever one of them changes.
+ */
+void vmfs_inode_set_resolver(vmfs_inode_t *inode)
+{
+   uint32_t zla = inode->zla;
+   int vmfs5_extension = 0;
+
+   inode->get_block = vmfs_inode_get_block_generic;
+   inode->blk_shift = 0;
+
+   if (!inode->blk_size || (inode->blk_size & (inode->blk_size - 1)))
+      return;
+
+   inode->blk_shift = __builtin_ctzll(inode->blk_size);
+
+   if (zla >= VMFS5_ZLA_BASE) {
+      vmfs5_extension = 1;
+      zla -= VMFS5_ZLA_BASE;
+   }
+
+   switch(zla) {
+      case VMFS_BLK_TYPE_FB:
+      case VMFS_BLK_TYPE_SB:
+         inode->get_block = vmfs_inode_get_block_direct;
+         break;
+      case VMFS_BLK_TYPE_PB2:
+         inode->get_block = vmfs_inode_get_block_pb2;
+         break;
+      case VMFS_BLK_TYPE_PB:
+         inode->get_block = vmfs5_extension ? vmfs_inode_get_block_dind :
+                                              vmfs_inode_get_block_pb;
+         break;
+      case VMFS_BLK_TYPE_FD:
+         if (vmfs5_extension)
+            inode->get_block = vmfs_inode_get_block_fd;
+         break;
+   }
+}
+
+/*
+ * Get block ID corresponding the specified position. Pointer block
+ * resolution is transparently done here.
+ */
+int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
+{
+   *blk_id = 0;
+
+   if (!inode->blk_size || !vmfs_inode_get_data(inode))
+      return(-EIO);
+
+   if (!inode->get_block)
+      return(vmfs_inode_get_block_generic(inode,pos,blk_id));
+
+   return(inode->get_block(inode,pos,blk_id));
+}
+
+/* Get the extent type corresponding to a block ID */
+static u_int vmfs_inode_extent_type(const vmfs_inode_t *inode,uint64_t blk_id)
+{
+   if (!blk_id)
+      return(VMFS_INODE_EXTENT_HOLE);
+
+   if (VMFS_BLK_FB_TBZ(blk_id))
+      return(VMFS_INODE_EXTENT_TBZ);
+
+   switch(VMFS_BLK_TYPE(blk_id)) {
+      case VMFS_BLK_TYPE_FB:
+      case VMFS_BLK_TYPE_PB2:
+         if (inode->blk_size == vmfs_fs_get_blocksize(inode->fs))
+            return(VMFS_INODE_EXTENT_DATA);
+      default:
+         return(VMFS_INODE_EXTENT_BLOCK);
+   }
+}
+
+/*
+ * Get the extents mapping the specified range of a file. Returns the
+ * number of extents stored, which may cover less than the requested range
+ * if "count" is too small.
+ */
+int vmfs_inode_get_extents(const vmfs_inode_t *inode,off_t pos,uint64_t len,
+                           vmfs_inode_extent_t *extents,u_int count)
+{
+   vmfs_inode_extent_t *ext = NULL;
+   uint64_t blk_id,prev_blk_id = 0;
+   uint64_t blk_size,clen,end;
+   u_int type,n = 0;
+   int res;
+
+   if (!(blk_size = inode->blk_size))
+      return(-EIO);
+
+   end = m_min(pos + len,inode->size);
+
+   for(;pos < end;pos += clen) {
+      if ((res = vmfs_inode_get_block(inode,pos,&blk_id)) < 0)
+         return(res);
+
+      clen = m_min(blk_size - (pos % blk_size),end - pos);
+      type = vmfs_inode_extent_type(inode,blk_id);
+
+      /* Extend the current extent if possible */
+      if (ext && (ext->type == type)) {
+         switch(type) {
+            case VMFS_INODE_EXTENT_HOLE:
+            case VMFS_INODE_EXTENT_TBZ:
+               ext->len += clen;
+               continue;
+
+            /* 
+             * Don't let a run span LVM segments, since they may belong to
+             * different extents.
+             */
+            case VMFS_INODE_EXTENT_DATA:
+               if ((VMFS_BLK_FB_ITEM(blk_id) ==
+                    VMFS_BLK_FB_ITEM(prev_blk_id) + 1) &&
+                   ((VMFS_BLK_FB_ITEM(blk_id) * blk_size) %
+                    VMFS_LVM_SEGMENT_SIZE))
+               {
+                  ext->len += clen;
+                  prev_blk_id = blk_id;
+                  continue;
+               }
+         }
+      }
+
+      if (n == count)
+         break;
+
+      ext = &extents[n++];
+      ext->type   = type;
+      ext->pos    = pos;
+      ext->len    = clen;
+      ext->blk_id = blk_id;
+      prev_blk_id = blk_id;
+   }
+
+   return(n);
+}
+
+/* 
+ * Allocate up to "max" contiguous file blocks for an inode, following the
+ * last ones it got. Returns the number of blocks allocated.
+ */
+static int vmfs_inode_alloc_fb(vmfs_inode_t *inode,u_int max,uint64_t *blk_id)
+{
+   int count;
+
+   count = vmfs_block_alloc_fb_extent(inode->fs,inode->alloc_hint,max,blk_id);
+
+   if (count > 0)
+      inode->alloc_hint = VMFS_BLK_FB_ITEM(*blk_id) + count;
+
+   return(count);
+}
+
 /* Aggregate a sub-block to a file block */
 static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
 {
    const vmfs_fs_t *fs = inode->fs;
-   DECL_ALIGNED_BUFFER(buf,fs->sbc->bmh.data_size);
+   vmfs_bitmap_t *sbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_SB);
    uint64_t fb_blk,sb_blk;
    uint32_t fb_item;
    uint32_t sb_count;
    off_t pos;
    int i,res;
 
+   if (!sbc)
+      return(-EIO);
+
+   DECL_ALIGNED_BUFFER(buf,sbc->bmh.data_size);
+
    sb_count = vmfs_fs_get_blocksize(fs) / buf_len;
 
    if (!(buf = iobuffer_alloc(buf_len)))
       return(-ENOMEM);
 
-   sb_blk = inode->blocks[0];
+   sb_blk = inode->data->blocks[0];
 
-   if (!vmfs_bitmap_get_item(fs->sbc,
+   if (!vmfs_bitmap_get_item(sbc,
                              VMFS_BLK_SB_ENTRY(sb_blk),
                              VMFS_BLK_SB_ITEM(sb_blk),
                              buf)) 
@@ -518,7 +996,7 @@ static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
       goto err_sb_blk_read;
    }
 
-   if ((res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_FB,&fb_blk)) < 0)
+   if ((res = vmfs_inode_alloc_fb(inode,1,&fb_blk)) < 0)
       goto err_blk_alloc;
 
    fb_item = VMFS_BLK_FB_ITEM(fb_blk);
@@ -540,10 +1018,11 @@ static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
       pos += buf_len;
    }
 
-   inode->blocks[0] = fb_blk;
+   inode->data->blocks[0] = fb_blk;
    inode->zla = VMFS_BLK_TYPE_FB;
    inode->blk_size = vmfs_fs_get_blocksize(fs);
-   inode->update_flags |= VMFS_INODE_SYNC_BLK;
+   vmfs_inode_set_resolver(inode);
+   vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
 
    iobuffer_free(buf);
    return(0);
@@ -560,13 +1039,17 @@ static int vmfs_inode_aggregate_fb(vmfs_inode_t *inode)
 static int vmfs_inode_aggregate_pb(vmfs_inode_t *inode)
 {
    const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *pbc;
    uint32_t pb_len;
    uint64_t pb_blk;
    uint32_t item,entry;
    u_char *buf;
    int i,res;
 
-   pb_len = fs->pbc->bmh.data_size;
+   if (!(pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB)))
+      return(-EIO);
+
+   pb_len = pbc->bmh.data_size;
 
    if (pb_len < (VMFS_INODE_BLK_COUNT * sizeof(uint32_t))) {
       fprintf(stderr,"vmfs_inode_aggregate_pb: pb_len=0x%8.8x\n",pb_len);
@@ -582,20 +1065,23 @@ static int vmfs_inode_aggregate_pb(vmfs_inode_t *inode)
       goto err_blk_alloc;
 
    for(i=0;i<VMFS_INODE_BLK_COUNT;i++)
-      write_le32(buf,i*sizeof(uint32_t),inode->blocks[i]);
+      write_le32(buf,i*sizeof(uint32_t),inode->data->blocks[i]);
 
    entry = VMFS_BLK_PB_ENTRY(pb_blk);
    item  = VMFS_BLK_PB_ITEM(pb_blk);
 
-   if (vmfs_bitmap_set_item(fs->pbc,entry,item,buf) == -1) {
+   if (vmfs_bitmap_set_item(pbc,entry,item,buf) == -1) {
       res = -EIO;
       goto err_set_item;
    }
 
-   memset(inode->blocks,0,sizeof(inode->blocks));
-   inode->blocks[0] = pb_blk;
+   vmfs_pbcache_invalidate(fs,pb_blk);
+
+   memset(inode->data->blocks,0,sizeof(inode->data->blocks));
+   inode->data->blocks[0] = pb_blk;
    inode->zla = VMFS_BLK_TYPE_PB;
-   inode->update_flags |= VMFS_INODE_SYNC_BLK;
+   vmfs_inode_set_resolver(inode);
+   vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
 
    iobuffer_free(buf);
    return(0);
@@ -612,6 +1098,9 @@ static int vmfs_inode_aggregate(vmfs_inode_t *inode,off_t pos)
 {
    int res;
 
+   if (!vmfs_inode_get_data(inode))
+      return(-EIO);
+
    if ((inode->zla == VMFS_BLK_TYPE_SB) && (pos >= inode->blk_size))
    {
       /* A directory consists only of sub-blocks (except the root dir) */
@@ -629,8 +1118,12 @@ static int vmfs_inode_aggregate(vmfs_inode_t *inode,off_t pos)
    return(0);
 }
 
-/* Get a block for writing corresponding to the specified position */
-int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
+/* 
+ * Get a block for writing corresponding to the specified position.
+ * TBZ blocks are zeroed first, unless they are about to be overwritten.
+ */
+static int vmfs_inode_get_wrblock_int(vmfs_inode_t *inode,off_t pos,
+                                      uint64_t *blk_id,bool overwrite)
 {
    const vmfs_fs_t *fs = inode->fs;
    u_int blk_index;
@@ -645,16 +1138,20 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
       return(res);
 
    if (inode->zla == VMFS_BLK_TYPE_PB) {
-      DECL_ALIGNED_BUFFER_WOL(buf,fs->pbc->bmh.data_size);
+      vmfs_bitmap_t *pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB);
       uint64_t pb_blk_id;
       uint32_t blk_per_pb;
       u_int pb_index;
       u_int sub_index;
       bool update_pb;
       
+      if (!pbc)
+         return(-EIO);
+
+      DECL_ALIGNED_BUFFER_WOL(buf,pbc->bmh.data_size);
       update_pb = 0;
 
-      blk_per_pb = fs->pbc->bmh.data_size / sizeof(uint32_t);
+      blk_per_pb = vmfs_bitmap_ptrs_per_item(pbc);
       blk_index = pos / inode->blk_size;
 
       pb_index  = blk_index / blk_per_pb;
@@ -663,19 +1160,19 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
       if (pb_index >= VMFS_INODE_BLK_COUNT)
          return(-EINVAL);
 
-      pb_blk_id = inode->blocks[pb_index];
+      pb_blk_id = inode->data->blocks[pb_index];
 
       /* Allocate a Pointer Block if none is currently present */
       if (!pb_blk_id) {
          if ((res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_PB,&pb_blk_id)) < 0)
             return(res);
 
-         memset(buf,0,fs->pbc->bmh.data_size);
-         inode->blocks[pb_index] = pb_blk_id;
-         inode->update_flags |= VMFS_INODE_SYNC_BLK;
+         memset(buf,0,pbc->bmh.data_size);
+         inode->data->blocks[pb_index] = pb_blk_id;
+         vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
          update_pb = 1;
       } else {
-         if (!vmfs_bitmap_get_item(fs->pbc,
+         if (!vmfs_bitmap_get_item(pbc,
                                    VMFS_BLK_PB_ENTRY(pb_blk_id),
                                    VMFS_BLK_PB_ITEM(pb_blk_id),
                                    buf))
@@ -685,32 +1182,36 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
       }
 
       if (!*blk_id) {
-         if ((res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_FB,blk_id)) < 0)
+         if ((res = vmfs_inode_alloc_fb(inode,1,blk_id)) < 0)
             return(res);
 
          write_le64(buf,sub_index*sizeof(uint64_t),*blk_id);
          inode->blk_count++;
-         inode->update_flags |= VMFS_INODE_SYNC_BLK;
+         vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
          update_pb = 1;
       } else {
          if (VMFS_BLK_FB_TBZ(*blk_id)) {
-            if ((res = vmfs_block_zeroize_fb(fs,*blk_id)) < 0)
+            if (!overwrite && (res = vmfs_block_zeroize_fb(fs,*blk_id)) < 0)
                return(res);
 
             *blk_id = VMFS_BLK_FB_TBZ_CLEAR(*blk_id);
             write_le64(buf,sub_index*sizeof(uint64_t),*blk_id);
             inode->tbz--;
-            inode->update_flags |= VMFS_INODE_SYNC_BLK;
+            vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
             update_pb = 1;
          }
       }
 
       /* Update the pointer block on disk if it has been modified */
-      if (update_pb && !vmfs_bitmap_set_item(fs->pbc,
-                                             VMFS_BLK_PB_ENTRY(pb_blk_id),
-                                             VMFS_BLK_PB_ITEM(pb_blk_id),
-                                             buf))
-         return(-EIO);
+      if (update_pb) {
+         vmfs_pbcache_invalidate(fs,pb_blk_id);
+
+         if (!vmfs_bitmap_set_item(pbc,
+                                   VMFS_BLK_PB_ENTRY(pb_blk_id),
+                                   VMFS_BLK_PB_ITEM(pb_blk_id),
+                                   buf))
+            return(-EIO);
+      }
    } else {
       /* File Block or Sub-Block */
       blk_index = pos / inode->blk_size;
@@ -718,24 +1219,29 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
       if (blk_index >= VMFS_INODE_BLK_COUNT)
          return(-EINVAL);
 
-      *blk_id = inode->blocks[blk_index];
+      *blk_id = inode->data->blocks[blk_index];
 
       if (!*blk_id) {
-         if ((res = vmfs_block_alloc(fs,inode->zla,blk_id)) < 0)
+         if (inode->zla == VMFS_BLK_TYPE_FB)
+            res = vmfs_inode_alloc_fb(inode,1,blk_id);
+         else
+            res = vmfs_block_alloc(fs,inode->zla,blk_id);
+
+         if (res < 0)
             return(res);
 
-         inode->blocks[blk_index] = *blk_id;
+         inode->data->blocks[blk_index] = *blk_id;
          inode->blk_count++;
-         inode->update_flags |= VMFS_INODE_SYNC_BLK;
+         vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
       } else {
          if ((inode->zla == VMFS_BLK_TYPE_FB) && VMFS_BLK_FB_TBZ(*blk_id)) {
-            if ((res = vmfs_block_zeroize_fb(fs,*blk_id)) < 0)
+            if (!overwrite && (res = vmfs_block_zeroize_fb(fs,*blk_id)) < 0)
                return(res);
 
             *blk_id = VMFS_BLK_FB_TBZ_CLEAR(*blk_id);
-            inode->blocks[blk_index] = *blk_id;
+            inode->data->blocks[blk_index] = *blk_id;
             inode->tbz--;
-            inode->update_flags |= VMFS_INODE_SYNC_BLK;
+            vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
          }
       }
    }
@@ -743,6 +1249,194 @@ int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
    return(0);
 }
 
+/* Get a block for writing corresponding to the specified position */
+int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id)
+{
+   return(vmfs_inode_get_wrblock_int(inode,pos,blk_id,0));
+}
+
+/* 
+ * Get a block for writing which is about to be entirely overwritten, so
+ * that it doesn't need to be zeroed first.
+ */
+int vmfs_inode_get_wrblock_full(vmfs_inode_t *inode,off_t pos,
+                                uint64_t *blk_id)
+{
+   return(vmfs_inode_get_wrblock_int(inode,pos,blk_id,1));
+}
+
+/* Allocate the missing file blocks of a pointer block, from start to end */
+static int vmfs_inode_fallocate_pb_blocks(vmfs_inode_t *inode,
+                                          u_int pb_index,
+                                          u_int start,u_int end)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB);
+   uint64_t pb_blk_id,blk_id;
+   bool update_pb = 0;
+   int res = 0;
+   u_int i,count;
+
+   if (!pbc)
+      return(-EIO);
+
+   DECL_ALIGNED_BUFFER(buf,pbc->bmh.data_size);
+
+   if (end > vmfs_bitmap_ptrs_per_item(pbc))
+      return(-EFBIG);
+
+   pb_blk_id = inode->data->blocks[pb_index];
+
+   if (!pb_blk_id) {
+      if ((res = vmfs_block_alloc(fs,VMFS_BLK_TYPE_PB,&pb_blk_id)) < 0)
+         return(res);
+
+      memset(buf,0,buf_len);
+      inode->data->blocks[pb_index] = pb_blk_id;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
+      update_pb = 1;
+   } else {
+      if (!vmfs_bitmap_get_item(pbc,
+                                VMFS_BLK_PB_ENTRY(pb_blk_id),
+                                VMFS_BLK_PB_ITEM(pb_blk_id),
+                                buf))
+         return(-EIO);
+   }
+
+   /* New blocks are flagged TBZ, so that they read as zeroes */
+   for(i=start;i<end;i+=count) {
+      count = 1;
+
+      if (read_le64(buf,i*sizeof(uint64_t)))
+         continue;
+
+      /* Allocate each run of missing blocks as a single extent */
+      while((i + count < end) && !read_le64(buf,(i+count)*sizeof(uint64_t)))
+         count++;
+
+      if ((res = vmfs_inode_alloc_fb(inode,count,&blk_id)) < 0)
+         break;
+
+      for(count=0;count<res;count++)
+         write_le64(buf,(i+count)*sizeof(uint64_t),
+                    VMFS_BLK_FB_BUILD(VMFS_BLK_FB_ITEM(blk_id) + count,
+                                      VMFS_BLK_FB_TBZ_FLAG));
+
+      inode->blk_count += res;
+      inode->tbz += res;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
+      update_pb = 1;
+   }
+
+   /* Write the pointer block once for all its new blocks */
+   if (update_pb) {
+      vmfs_pbcache_invalidate(fs,pb_blk_id);
+
+      if (!vmfs_bitmap_set_item(pbc,
+                                VMFS_BLK_PB_ENTRY(pb_blk_id),
+                                VMFS_BLK_PB_ITEM(pb_blk_id),
+                                buf))
+         return(-EIO);
+   }
+
+   return((res < 0) ? res : 0);
+}
+
+/* 
+ * Allocate the missing file blocks of a pointer block, from start to end,
+ * under a single reservation.
+ */
+static int vmfs_inode_fallocate_pb(vmfs_inode_t *inode,u_int pb_index,
+                                   u_int start,u_int end)
+{
+   vmfs_fs_t *fs = (vmfs_fs_t *)inode->fs;
+   vmfs_metadata_txn_t txn;
+   int res;
+
+   vmfs_metadata_txn_begin(fs,&txn);
+   res = vmfs_inode_fallocate_pb_blocks(inode,pb_index,start,end);
+   vmfs_metadata_txn_end(fs,&txn);
+   return(res);
+}
+
+/* 
+ * Allocate all the blocks backing the specified range of a file, without
+ * changing its size.
+ */
+int vmfs_inode_fallocate(vmfs_inode_t *inode,off_t pos,off_t len)
+{
+   const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *pbc;
+   uint64_t start,end,blk_id;
+   uint32_t blk_per_pb;
+   u_int pb_index,sub_end;
+   int res;
+
+   if (!vmfs_fs_readwrite(fs))
+      return(-EROFS);
+
+   if ((pos < 0) || (len <= 0))
+      return(-EINVAL);
+
+   if ((res = vmfs_inode_aggregate(inode,pos + len - 1)) < 0)
+      return(res);
+
+   inode->data_seq++;
+
+   start = pos / inode->blk_size;
+   end   = ALIGN_NUM(pos + len,inode->blk_size) / inode->blk_size;
+
+   if (inode->zla == VMFS_BLK_TYPE_PB) {
+      if (!(pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB)))
+         return(-EIO);
+
+      blk_per_pb = vmfs_bitmap_ptrs_per_item(pbc);
+
+      if (((end - 1) / blk_per_pb) >= VMFS_INODE_BLK_COUNT)
+         return(-EFBIG);
+
+      while(start < end) {
+         pb_index = start / blk_per_pb;
+         sub_end  = m_min(end - (uint64_t)pb_index * blk_per_pb,blk_per_pb);
+
+         res = vmfs_inode_fallocate_pb(inode,pb_index,start % blk_per_pb,
+                                       sub_end);
+         if (res < 0)
+            return(res);
+
+         start = (uint64_t)(pb_index + 1) * blk_per_pb;
+      }
+
+      return(0);
+   }
+
+   /* File Blocks or Sub-Blocks */
+   if (end > VMFS_INODE_BLK_COUNT)
+      return(-EFBIG);
+
+   for(;start<end;start++) {
+      if (inode->data->blocks[start])
+         continue;
+
+      if (inode->zla == VMFS_BLK_TYPE_FB) {
+         if ((res = vmfs_inode_alloc_fb(inode,1,&blk_id)) < 0)
+            return(res);
+
+         blk_id = VMFS_BLK_FB_TBZ_SET(blk_id);
+         inode->tbz++;
+      } else {
+         if ((res = vmfs_block_alloc(fs,inode->zla,&blk_id)) < 0)
+            return(res);
+      }
+
+      inode->data->blocks[start] = blk_id;
+      inode->blk_count++;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
+   }
+
+   return(0);
+}
+
 /* Truncate file */
 int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
 {
@@ -756,12 +1450,17 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
    if (new_len == inode->size)
       return(0);
 
+   if (!vmfs_inode_get_data(inode))
+      return(-EIO);
+
+   inode->data_seq++;
+
    if (new_len > inode->size) {
       if ((res = vmfs_inode_aggregate(inode,new_len)) < 0)
          return(res);
 
       inode->size = new_len;
-      inode->update_flags |= VMFS_INODE_SYNC_META;
+      vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_META);
       return(0);
    }
 
@@ -775,10 +1474,10 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
          end   = inode->size / inode->blk_size;
 
          for(i=start;i<=end;i++) {
-            if (inode->blocks[i] != 0) {
-               vmfs_block_free(fs,inode->blocks[i]);
+            if (inode->data->blocks[i] != 0) {
+               vmfs_block_free(fs,inode->data->blocks[i]);
                inode->blk_count--;
-               inode->blocks[i] = 0;
+               inode->data->blocks[i] = 0;
             }
          }
          break;
@@ -786,13 +1485,17 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
 
       case VMFS_BLK_TYPE_PB:
       {
+         vmfs_bitmap_t *pbc;
          uint32_t blk_per_pb;
          u_int pb_start,pb_end;
          u_int sub_start,start;
          u_int blk_index;
          int count;
 
-         blk_per_pb = fs->pbc->bmh.data_size / sizeof(uint32_t);
+         if (!(pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB)))
+            return(-EIO);
+
+         blk_per_pb = vmfs_bitmap_ptrs_per_item(pbc);
          blk_index = ALIGN_NUM(new_len,inode->blk_size) / inode->blk_size;
 
          pb_start  = blk_index / blk_per_pb;
@@ -801,18 +1504,19 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
          pb_end = inode->size / (inode->blk_size * blk_per_pb);
 
          for(i=pb_start;i<=pb_end;i++) {
-            if (inode->blocks[i] != 0) {
+            if (inode->data->blocks[i] != 0) {
                start = (i == pb_start) ? sub_start : 0;
 
                /* Free blocks contained in PB */
-               count = vmfs_block_free_pb(fs,inode->blocks[i],
+               count = vmfs_block_free_pb(fs,inode->data->blocks[i],
                                           start,blk_per_pb);
+               vmfs_pbcache_invalidate(fs,inode->data->blocks[i]);
 
                if (count > 0)
                   inode->blk_count -= count;
 
                if (start == 0)
-                  inode->blocks[i] = 0;
+                  inode->data->blocks[i] = 0;
             }
          }
 
@@ -824,7 +1528,7 @@ int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len)
    }
 
    inode->size = new_len;
-   inode->update_flags |= VMFS_INODE_SYNC_BLK;
+   vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_BLK);
    return(0);
 }
 
@@ -834,6 +1538,7 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
                              void *opt_arg)
 {  
    const vmfs_fs_t *fs = inode->fs;
+   vmfs_bitmap_t *pbc = NULL;
    uint64_t blk_size;
    uint32_t blk_per_pb;
    uint64_t blk_id;
@@ -846,13 +1551,16 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
 
    blk_size = inode->blk_size;
 
-   if (!blk_size)
+   if (!blk_size || !vmfs_inode_get_data(inode))
       return(-1);
 
    blk_count = (inode->size + blk_size - 1) / blk_size;
 
    if (inode->zla == VMFS_BLK_TYPE_PB) {
-      blk_per_pb = fs->pbc->bmh.data_size / sizeof(uint32_t);
+      if (!(pbc = vmfs_fs_get_bitmap(fs,VMFS_BLK_TYPE_PB)))
+         return(-1);
+
+      blk_per_pb = pbc->bmh.data_size / sizeof(uint32_t);
       blk_total = blk_count;
       blk_count = (blk_count + blk_per_pb - 1) / blk_per_pb;
    }
@@ -861,7 +1569,7 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
       return(-1);
 
    for(i=0;i<blk_count;i++) {
-      blk_id = inode->blocks[i];
+      blk_id = inode->data->blocks[i];
 
       if (!blk_id)
          continue;
@@ -871,11 +1579,11 @@ int vmfs_inode_foreach_block(const vmfs_inode_t *inode,
       /* Analyze pointer block */
       if (inode->zla == VMFS_BLK_TYPE_PB) 
       {
-         DECL_ALIGNED_BUFFER_WOL(buf,fs->pbc->bmh.data_size);
+         DECL_ALIGNED_BUFFER_WOL(buf,pbc->bmh.data_size);
          uint32_t blk_id2;
          u_int blk_rem;
 
-         if (!vmfs_bitmap_get_item(fs->pbc,
+         if (!vmfs_bitmap_get_item(pbc,
                                    VMFS_BLK_PB_ENTRY(blk_id),
                                    VMFS_BLK_PB_ITEM(blk_id),
                                    buf))
@@ -933,6 +1641,6 @@ int vmfs_inode_stat_from_blkid(const vmfs_fs_t *fs,uint64_t blk_id,
 int vmfs_inode_chmod(vmfs_inode_t *inode,mode_t mode)
 {
    inode->mode = mode;
-   inode->update_flags |= VMFS_INODE_SYNC_META;
+   vmfs_inode_set_dirty(inode,VMFS_INODE_SYNC_META);
    return(0);
 }
@@ -85,9 +85,24 @@ struct vmfs_inode_raw {
 #define VMFS_INODE_SYNC_BLK   0x02
 #define VMFS_INODE_SYNC_ALL   (VMFS_INODE_SYNC_META | VMFS_INODE_SYNC_BLK)
 
+/* Maximum number of adjacent inode records merged in a single write */
+#define VMFS_INODE_BATCH_MAX  16
+
 /* Some VMFS 5 features use a weird ZLA */
 #define VMFS5_ZLA_BASE 4301 //0x10d1
 
+/* 
+ * Block list or inline content of an in-core inode, only decoded when
+ * first needed.
+ */
+struct vmfs_inode_data {
+   u_int ref_count;
+   union {
+     uint64_t blocks[VMFS_INODE_BLK_COUNT];
+     char content[VMFS_INODE_BLK_COUNT * sizeof(uint64_t)+0x400];
+   };
+};
+
 struct vmfs_inode {
    vmfs_metadata_hdr_t mdh;
    uint32_t id,id2;
@@ -102,16 +117,40 @@ struct vmfs_inode {
    uint32_t mode,cmode;
    uint32_t zla,tbz,cow;
    uint32_t rdm_id;
-   union {
-     uint64_t blocks[VMFS_INODE_BLK_COUNT];
-     char content[VMFS_INODE_BLK_COUNT * sizeof(uint64_t)+0x400];
-   };
+
+   /* See vmfs_inode_get_data() */
+   struct vmfs_inode_data *data;
 
    /* In-core inode information */
    const vmfs_fs_t *fs;
    vmfs_inode_t **pprev,*next;
+   vmfs_inode_t *lru_prev,*lru_next;
+   vmfs_inode_t **dirty_pprev,*dirty_next;
    u_int ref_count;
    u_int update_flags;
+   bool syncing;          /* Being written back by vmfs_icache_sync() */
+   u_int data_seq;        /* Changed each time file data is modified */
+   struct vmfs_dir_cache *dir_cache;  /* Directory content, if a directory */
+   struct vmfs_file_wb *wb;           /* Write-back buffer, see vmfs_file.h */
+   uint32_t alloc_hint;   /* File block address following the last one
+                             allocated, where the next allocation starts */
+
+   /* Block resolver for the addressing mode, see vmfs_inode_set_resolver() */
+   int (*get_block)(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id);
+   u_int blk_shift;       /* log2(blk_size) */
+};
+
+/* Extent types, as returned by vmfs_inode_get_extents() */
+#define VMFS_INODE_EXTENT_HOLE   0x00   /* Not allocated, reads as zeroes */
+#define VMFS_INODE_EXTENT_TBZ    0x01   /* To be zeroed, reads as zeroes */
+#define VMFS_INODE_EXTENT_DATA   0x02   /* Physically contiguous file blocks */
+#define VMFS_INODE_EXTENT_BLOCK  0x03   /* Single block of another type */
+
+struct vmfs_inode_extent {
+   u_int type;
+   off_t pos;          /* Position in the file */
+   uint64_t len;       /* Length in bytes */
+   uint64_t blk_id;    /* First block (not set for holes) */
 };
 
 /* Callback function for vmfs_inode_foreach_block() */
@@ -123,6 +162,43 @@ typedef void (*vmfs_inode_foreach_block_cbk_t)(const vmfs_inode_t *inode,
 /* Update an inode on disk */
 int vmfs_inode_update(const vmfs_inode_t *inode,int update_blk_list);
 
+/*
+ * Write back modified inodes sorted by on-disk position, merging adjacent
+ * records in single writes. Returns the number of inodes not written.
+ */
+int vmfs_inode_update_batch(vmfs_inode_t **inodes,u_int count);
+
+/* Record changes to write back for an inode */
+void vmfs_inode_set_dirty(vmfs_inode_t *inode,u_int flags);
+
+/* Write back a modified inode now */
+int vmfs_inode_sync(vmfs_inode_t *inode);
+
+/* Read an inode, except its block list or content (see below) */
+int vmfs_inode_read(vmfs_inode_t *inode,const u_char *buf);
+
+/* 
+ * Decode the block list or content of an inode from its on-disk record,
+ * which is read again if "buf" is NULL. Nothing is done if already loaded.
+ */
+int vmfs_inode_load_data(const vmfs_inode_t *inode,const u_char *buf);
+
+/* Get the block list or content of an inode, loading it on first use */
+static inline struct vmfs_inode_data *
+vmfs_inode_get_data(const vmfs_inode_t *inode)
+{
+   struct vmfs_inode_data *data;
+
+   if (!(data = __atomic_load_n(&inode->data,__ATOMIC_ACQUIRE)) &&
+       !vmfs_inode_load_data(inode,NULL))
+      data = inode->data;
+
+   return data;
+}
+
+/* Drop the reference of an inode on its block list or content */
+void vmfs_inode_put_data(vmfs_inode_t *inode);
+
 /* Get inode corresponding to a block id */
 int vmfs_inode_get(const vmfs_fs_t *fs,uint64_t blk_id,vmfs_inode_t *inode);
 
@@ -140,15 +216,42 @@ int vmfs_inode_alloc(vmfs_fs_t *fs,u_int type,mode_t mode,vmfs_inode_t **inode);
  */
 int doubleIndirectAddressing(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id);
 
+/* 
+ * Choose the block resolver of an inode from its addressing mode (ZLA) and
+ * block size. Must be called again whenever one of them changes.
+ */
+void vmfs_inode_set_resolver(vmfs_inode_t *inode);
+
 /* 
  * Get block ID corresponding the specified position. Pointer block
  * resolution is transparently done here.
  */
 int vmfs_inode_get_block(const vmfs_inode_t *inode,off_t pos,uint64_t *blk_id);
 
+/*
+ * Get the extents mapping the specified range of a file. Returns the
+ * number of extents stored, which may cover less than the requested range
+ * if "count" is too small.
+ */
+int vmfs_inode_get_extents(const vmfs_inode_t *inode,off_t pos,uint64_t len,
+                           vmfs_inode_extent_t *extents,u_int count);
+
 /* Get a block for writing corresponding to the specified position */
 int vmfs_inode_get_wrblock(vmfs_inode_t *inode,off_t pos,uint64_t *blk_id);
 
+/* 
+ * Get a block for writing which is about to be entirely overwritten, so
+ * that it doesn't need to be zeroed first.
+ */
+int vmfs_inode_get_wrblock_full(vmfs_inode_t *inode,off_t pos,
+                                uint64_t *blk_id);
+
+/* 
+ * Allocate all the blocks backing the specified range of a file, without
+ * changing its size.
+ */
+int vmfs_inode_fallocate(vmfs_inode_t *inode,off_t pos,off_t len);
+
 /* Truncate file */
 int vmfs_inode_truncate(vmfs_inode_t *inode,off_t new_len);
 
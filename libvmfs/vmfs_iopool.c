@@ -0,0 +1,139 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Pool of aligned bounce buffers.
+ */
+
+#include <stdlib.h>
+#include "vmfs.h"
+
+#define VMFS_IOPOOL_STAT_INC(p,name) \
+   __atomic_add_fetch(&(p)->stats.name,1,__ATOMIC_RELAXED)
+
+/* Get the size class for a length, -1 if it is too large to be pooled */
+static int vmfs_iopool_get_class(size_t len)
+{
+   size_t size = M_DIO_BLK_SIZE;
+   int i;
+
+   for(i=0;i<VMFS_IOPOOL_CLASSES;i++,size<<=1)
+      if (len <= size)
+         return(i);
+
+   return(-1);
+}
+
+/* Create a buffer pool */
+vmfs_iopool_t *vmfs_iopool_create(void)
+{
+   vmfs_iopool_t *p;
+   int i;
+
+   if (!(p = calloc(1,sizeof(*p))))
+      return NULL;
+
+   for(i=0;i<VMFS_IOPOOL_CLASSES;i++)
+      pthread_mutex_init(&p->classes[i].lock,NULL);
+
+   return p;
+}
+
+/* Destroy a buffer pool, freeing cached buffers */
+void vmfs_iopool_destroy(vmfs_iopool_t *p)
+{
+   u_int j;
+   int i;
+
+   if (!p)
+      return;
+
+   for(i=0;i<VMFS_IOPOOL_CLASSES;i++) {
+      for(j=0;j<p->classes[i].count;j++)
+         iobuffer_free(p->classes[i].bufs[j]);
+      pthread_mutex_destroy(&p->classes[i].lock);
+   }
+
+   free(p);
+}
+
+/* Get an aligned buffer of at least "len" bytes */
+u_char *vmfs_iopool_get(vmfs_iopool_t *p,size_t len)
+{
+   struct vmfs_iopool_class *c;
+   u_char *buf = NULL;
+   int i;
+
+   VMFS_IOPOOL_STAT_INC(p,gets);
+
+   if ((i = vmfs_iopool_get_class(len)) == -1) {
+      VMFS_IOPOOL_STAT_INC(p,oversize);
+      return(iobuffer_alloc(len));
+   }
+
+   c = &p->classes[i];
+
+   pthread_mutex_lock(&c->lock);
+   if (c->count > 0)
+      buf = c->bufs[--c->count];
+   pthread_mutex_unlock(&c->lock);
+
+   if (buf) {
+      VMFS_IOPOOL_STAT_INC(p,hits);
+      return buf;
+   }
+
+   VMFS_IOPOOL_STAT_INC(p,misses);
+   return(iobuffer_alloc((size_t)M_DIO_BLK_SIZE << i));
+}
+
+/* Give back a buffer obtained with vmfs_iopool_get() for the same length */
+void vmfs_iopool_put(vmfs_iopool_t *p,u_char *buf,size_t len)
+{
+   struct vmfs_iopool_class *c;
+   int i;
+
+   if (!buf)
+      return;
+
+   if ((i = vmfs_iopool_get_class(len)) == -1) {
+      iobuffer_free(buf);
+      return;
+   }
+
+   c = &p->classes[i];
+
+   pthread_mutex_lock(&c->lock);
+   if (c->count < VMFS_IOPOOL_CLASS_MAX) {
+      c->bufs[c->count++] = buf;
+      buf = NULL;
+   }
+   pthread_mutex_unlock(&c->lock);
+
+   if (buf) {
+      VMFS_IOPOOL_STAT_INC(p,drops);
+      iobuffer_free(buf);
+   }
+}
+
+/* Get a snapshot of the pool statistics */
+void vmfs_iopool_get_stats(vmfs_iopool_t *p,struct vmfs_iopool_stats *stats)
+{
+   stats->gets     = __atomic_load_n(&p->stats.gets,__ATOMIC_RELAXED);
+   stats->hits     = __atomic_load_n(&p->stats.hits,__ATOMIC_RELAXED);
+   stats->misses   = __atomic_load_n(&p->stats.misses,__ATOMIC_RELAXED);
+   stats->oversize = __atomic_load_n(&p->stats.oversize,__ATOMIC_RELAXED);
+   stats->drops    = __atomic_load_n(&p->stats.drops,__ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_IOPOOL_H
+#define VMFS_IOPOOL_H
+
+/*
+ * Pool of bounce buffers aligned for direct I/O, used for unaligned block
+ * accesses and bitmap scans. Buffers are kept in size classes, from
+ * M_DIO_BLK_SIZE to M_DIO_BLK_SIZE << (VMFS_IOPOOL_CLASSES - 1), each one
+ * with its own lock. Larger requests are not pooled.
+ */
+#define VMFS_IOPOOL_CLASSES     9
+#define VMFS_IOPOOL_CLASS_MAX   8
+
+struct vmfs_iopool_class {
+   pthread_mutex_t lock;
+   u_int count;
+   u_char *bufs[VMFS_IOPOOL_CLASS_MAX];
+};
+
+struct vmfs_iopool_stats {
+   uint64_t gets;            /* Buffers requested */
+   uint64_t hits;            /* Requests served from the pool */
+   uint64_t misses;          /* Requests needing a new pooled buffer */
+   uint64_t oversize;        /* Requests too large to be pooled */
+   uint64_t drops;           /* Buffers freed because their class was full */
+};
+
+struct vmfs_iopool {
+   struct vmfs_iopool_class classes[VMFS_IOPOOL_CLASSES];
+   struct vmfs_iopool_stats stats;
+};
+
+/* Create a buffer pool */
+vmfs_iopool_t *vmfs_iopool_create(void);
+
+/* Destroy a buffer pool, freeing cached buffers */
+void vmfs_iopool_destroy(vmfs_iopool_t *p);
+
+/* Get an aligned buffer of at least "len" bytes */
+u_char *vmfs_iopool_get(vmfs_iopool_t *p,size_t len);
+
+/* Give back a buffer obtained with vmfs_iopool_get() for the same length */
+void vmfs_iopool_put(vmfs_iopool_t *p,u_char *buf,size_t len);
+
+/* Get a snapshot of the pool statistics */
+void vmfs_iopool_get_stats(vmfs_iopool_t *p,struct vmfs_iopool_stats *stats);
+
+#endif
@@ -21,31 +21,42 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
 #include "vmfs.h"
 
 /* 
- * Until we uncover the details of the segment descriptors format,
- * it is useless to try to do something more efficient.
+ * Get the extent holding a position. Extents are kept sorted by their first
+ * segment, so that it can be found with a binary search.
  */
-
 static vmfs_volume_t *vmfs_lvm_get_extent_from_offset(const vmfs_lvm_t *lvm,
                                                       off_t pos)
 {
-   int extent;
-   off_t segment = pos / VMFS_LVM_SEGMENT_SIZE;
-
-   for (extent = 0; extent < lvm->loaded_extents; extent++) {
-      if ((segment >= lvm->extents[extent]->vol_info.first_segment) &&
-          (segment <= lvm->extents[extent]->vol_info.last_segment))
-      {
-      	dprintf("Got extents %d (%u %u %u) for segment %ld\n", extent, 
-      		lvm->extents[extent]->vol_info.first_segment, lvm->extents[extent]->vol_info.last_segment,
-      		lvm->extents[extent]->vol_info.num_segments, segment);
-        return(lvm->extents[extent]);
-      }
+   uint64_t segment = pos / VMFS_LVM_SEGMENT_SIZE;
+   vmfs_volume_t *extent;
+   int low = 0,high = lvm->loaded_extents,mid;
+
+   /* Find the last extent starting at or before the segment */
+   while(low < high) {
+      mid = (low + high) / 2;
+
+      if (lvm->extents[mid]->vol_info.first_segment <= segment)
+         low = mid + 1;
+      else
+         high = mid;
    }
 
-   return(NULL);
+   if (!low)
+      return(NULL);
+
+   extent = lvm->extents[low-1];
+
+   if (segment > extent->vol_info.last_segment)
+      return(NULL);
+
+   dprintf("Got extent %d (%u %u %u) for segment %lu\n",low-1,
+           extent->vol_info.first_segment,extent->vol_info.last_segment,
+           extent->vol_info.num_segments,segment);
+   return(extent);
 }
 
 /* Get extent size */
@@ -54,25 +65,82 @@ static inline uint64_t vmfs_lvm_extent_size(const vmfs_volume_t *extent)
    return((uint64_t)extent->vol_info.num_segments * VMFS_LVM_SEGMENT_SIZE);
 }
 
-typedef ssize_t (*vmfs_vol_io_func)(const vmfs_device_t *,off_t,u_char *,size_t);
-
-/* Read a raw block of data on logical volume */
-static inline ssize_t vmfs_lvm_io(const vmfs_lvm_t *lvm,off_t pos,u_char *buf,
-                                  size_t len,vmfs_vol_io_func func)
+/* 
+ * Read or write data on the logical volume. Requests spanning several
+ * extents are split, and the pieces queued on their extents at once.
+ */
+static ssize_t vmfs_lvm_io(const vmfs_lvm_t *lvm,off_t pos,u_char *buf,
+                           size_t len,u_int op)
 {
-   vmfs_volume_t *extent = vmfs_lvm_get_extent_from_offset(lvm,pos);
-
-   if (!extent)
+   vmfs_io_req_t reqs[VMFS_LVM_MAX_EXTENTS];
+   vmfs_volume_t *extents[VMFS_LVM_MAX_EXTENTS];
+   vmfs_volume_t *extent;
+   uint64_t extent_pos;
+   size_t done = 0;
+   int i,n,res;
+
+   if (!(extent = vmfs_lvm_get_extent_from_offset(lvm,pos)))
       return(-1);
 
-   pos -= (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
-   if ((pos + len) > vmfs_lvm_extent_size(extent)) {
-      /* TODO: Handle this case */
-      fprintf(stderr,"VMFS: i/o spanned pos %ld len %ld over several extents is unsupported %ld\n", pos, len, vmfs_lvm_extent_size(extent));
+   extent_pos = pos - 
+      (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+   dprintf("%s : pos 0x%lx len %ld\n", __FUNCTION__, pos, len);
+
+   /* Most requests are on a single extent */
+   if ((extent_pos + len) <= vmfs_lvm_extent_size(extent)) {
+      if (op == VMFS_IO_WRITE)
+         return(vmfs_device_write(&extent->dev,extent_pos,buf,len));
+
+      return(vmfs_device_read(&extent->dev,extent_pos,buf,len));
+   }
+
+   for(n=0;done < len;n++) {
+      if ((n == VMFS_LVM_MAX_EXTENTS) ||
+          (n && !(extent = vmfs_lvm_get_extent_from_offset(lvm,pos + done))))
+         break;
+
+      extent_pos = pos + done -
+         (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+
+      reqs[n].op  = op;
+      reqs[n].buf = buf + done;
+      reqs[n].len = m_min(len - done,
+                          vmfs_lvm_extent_size(extent) - extent_pos);
+      extents[n] = extent;
+
+      if (vmfs_device_submit(&extent->dev,&reqs[n],extent_pos) < 0)
+         break;
+
+      done += reqs[n].len;
+   }
+
+   /* Wait for all the queued pieces, even after a failure */
+   for(i=0;i<n;i++) {
+      while(!__atomic_load_n(&reqs[i].done,__ATOMIC_ACQUIRE)) {
+         res = vmfs_device_complete(&extents[i]->dev,1);
+
+         if ((res <= 0) && !__atomic_load_n(&reqs[i].done,__ATOMIC_ACQUIRE)) {
+            reqs[i].res = -EIO;
+            break;
+         }
+      }
+   }
+
+   /* Only report the data transferred up to the first short piece */
+   if (done < len)
       return(-1);
+
+   for(i=0,done=0;i<n;i++) {
+      if (reqs[i].res < 0)
+         return(done ? done : -1);
+
+      done += reqs[i].res;
+
+      if (reqs[i].res < reqs[i].len)
+         break;
    }
-   dprintf("%s : pos 0x%lx len %ld\n", __FUNCTION__, pos, len);
-   return(func(&extent->dev,pos,buf,len));
+
+   return(done);
 }
 
 /* Read a raw block of data on logical volume */
@@ -80,7 +148,7 @@ static ssize_t vmfs_lvm_read(const vmfs_device_t *dev,off_t pos,
                              u_char *buf,size_t len)
 {
    vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
-   return(vmfs_lvm_io(lvm,pos,buf,len,vmfs_device_read));
+   return(vmfs_lvm_io(lvm,pos,buf,len,VMFS_IO_READ));
 }
 
 /* Write a raw block of data on logical volume */
@@ -88,7 +156,82 @@ static ssize_t vmfs_lvm_write(const vmfs_device_t *dev,off_t pos,
                               const u_char *buf,size_t len)
 {
    vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
-   return(vmfs_lvm_io(lvm,pos,(u_char *)buf,len,(vmfs_vol_io_func)vmfs_device_write));
+   return(vmfs_lvm_io(lvm,pos,(u_char *)buf,len,VMFS_IO_WRITE));
+}
+
+/* Queue an asynchronous I/O request on the extent holding the position */
+static int vmfs_lvm_submit(const vmfs_device_t *dev,vmfs_io_req_t *req,
+                           off_t pos)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_volume_t *extent;
+
+   if ((req->op == VMFS_IO_WRITE) && !lvm->flags.read_write)
+      return(-EROFS);
+
+   if (!(extent = vmfs_lvm_get_extent_from_offset(lvm,pos)))
+      return(-EINVAL);
+
+   pos -= (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+   if ((pos + req->len) > vmfs_lvm_extent_size(extent))
+      return(-EINVAL);
+
+   return(vmfs_device_submit(&extent->dev,req,pos));
+}
+
+/* 
+ * Wait for completion of asynchronous I/O requests on all extents. Extents
+ * only wait for as many requests as they have in flight.
+ */
+static int vmfs_lvm_complete(const vmfs_device_t *dev,u_int min)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   int i,res,count = 0;
+
+   for (i = 0; i < lvm->loaded_extents; i++) {
+      res = vmfs_device_complete(&lvm->extents[i]->dev,
+                                 (min > count) ? min - count : 0);
+      if (res < 0)
+         return(res);
+
+      count += res;
+   }
+
+   return(count);
+}
+
+/* Get the file descriptor and offset corresponding to a range */
+static int vmfs_lvm_map_fd(const vmfs_device_t *dev,off_t pos,size_t len,
+                           int *fd,off_t *fd_pos)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_volume_t *extent;
+
+   if (!(extent = vmfs_lvm_get_extent_from_offset(lvm,pos)))
+      return(-1);
+
+   pos -= (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+   if ((pos + len) > vmfs_lvm_extent_size(extent))
+      return(-1);
+
+   return(vmfs_device_map_fd(&extent->dev,pos,len,fd,fd_pos));
+}
+
+/* Get a pointer to a range of the underlying volume, if mapped */
+static const u_char *vmfs_lvm_borrow(const vmfs_device_t *dev,off_t pos,
+                                     size_t len)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   vmfs_volume_t *extent;
+
+   if (!(extent = vmfs_lvm_get_extent_from_offset(lvm,pos)))
+      return NULL;
+
+   pos -= (uint64_t)extent->vol_info.first_segment * VMFS_LVM_SEGMENT_SIZE;
+   if ((pos + len) > vmfs_lvm_extent_size(extent))
+      return NULL;
+
+   return(vmfs_device_borrow(&extent->dev,pos,len));
 }
 
 /* Reserve the underlying volume given a LVM position */
@@ -169,6 +312,16 @@ int vmfs_lvm_add_extent(vmfs_lvm_t *lvm, vmfs_volume_t *vol)
    return(0);
 }
 
+/* Set up the extents again in a forked child */
+static void vmfs_lvm_atfork_child(vmfs_device_t *dev)
+{
+   vmfs_lvm_t *lvm = (vmfs_lvm_t *)dev;
+   int i;
+
+   for (i = 0; i < lvm->loaded_extents; i++)
+      vmfs_device_atfork_child(&lvm->extents[i]->dev);
+}
+
 /* Close an LVM */
 static void vmfs_lvm_close(vmfs_device_t *dev)
 {
@@ -196,6 +349,11 @@ int vmfs_lvm_open(vmfs_lvm_t *lvm)
       lvm->dev.write = vmfs_lvm_write;
    lvm->dev.reserve = vmfs_lvm_reserve;
    lvm->dev.release = vmfs_lvm_release;
+   lvm->dev.submit = vmfs_lvm_submit;
+   lvm->dev.complete = vmfs_lvm_complete;
+   lvm->dev.map_fd = vmfs_lvm_map_fd;
+   lvm->dev.borrow = vmfs_lvm_borrow;
+   lvm->dev.atfork_child = vmfs_lvm_atfork_child;
    lvm->dev.close = vmfs_lvm_close;
    lvm->dev.uuid = &lvm->lvm_info.uuid;
    return(0);
@@ -24,6 +24,9 @@
 #include <sys/stat.h>
 #include "vmfs.h"
 
+/* Transaction open by the current thread, see vmfs_metadata_txn_begin() */
+static __thread vmfs_metadata_txn_t *vmfs_metadata_txn;
+
 /* Read a metadata header */
 int vmfs_metadata_hdr_read(vmfs_metadata_hdr_t *mdh,const u_char *buf)
 {
@@ -53,13 +56,19 @@ int vmfs_metadata_hdr_write(const vmfs_metadata_hdr_t *mdh,u_char *buf)
    return(0);
 }
 
-/* Lock and read metadata at specified position */
+/* 
+ * Lock and read metadata at specified position. Within a transaction, the
+ * volume reservation is kept until the transaction ends.
+ */
 int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
                        vmfs_metadata_hdr_t *mdh)
 {
+   vmfs_metadata_txn_t *txn = vmfs_metadata_txn;
+   uint64_t start = vmfs_stats_now();
+
    /* Acquire heartbeat */
    if (vmfs_heartbeat_acquire(fs) == -1)
-      return(-1);
+      goto err_hb;
 
    /* Reserve volume */
    if (vmfs_device_reserve(fs->dev,pos) == -1) {
@@ -94,13 +103,21 @@ int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
       goto err_io;
    }
 
-   vmfs_device_release(fs->dev,pos);
+   if (txn && (txn->fs == fs) &&
+       (txn->reserved_count < VMFS_METADATA_TXN_MAX))
+      txn->reserved[txn->reserved_count++] = pos;
+   else
+      vmfs_device_release(fs->dev,pos);
+
+   vmfs_stats_op_end(&fs->stats->md_lock,start,0,0);
    return(0);
 
  err_io:
    vmfs_device_release(fs->dev,pos);
  err_reserve:
    vmfs_heartbeat_release(fs);
+ err_hb:
+   vmfs_stats_op_end(&fs->stats->md_lock,start,-1,0);
    return(-1);
 }
 
@@ -109,6 +126,8 @@ int vmfs_metadata_unlock(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh)
 {
    DECL_ALIGNED_BUFFER(buf,VMFS_METADATA_HDR_SIZE);
 
+   VMFS_STATS_INC(fs->stats,md_unlock);
+
    mdh->hb_lock = 0;
    uuid_clear(mdh->hb_uuid);
    vmfs_metadata_hdr_write(mdh,buf);
@@ -122,3 +141,34 @@ int vmfs_metadata_unlock(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh)
 
    return(vmfs_heartbeat_release(fs));
 }
+
+/* 
+ * Open a metadata lock transaction. A transaction only gathers the locks
+ * taken by the thread which opened it, and a thread has at most one
+ * outermost transaction: nested ones, even on another filesystem, join it
+ * (locks on another filesystem then don't keep their reservation).
+ */
+void vmfs_metadata_txn_begin(vmfs_fs_t *fs,vmfs_metadata_txn_t *txn)
+{
+   txn->fs = fs;
+   txn->outer = vmfs_metadata_txn;
+   txn->reserved_count = 0;
+
+   if (!txn->outer)
+      vmfs_metadata_txn = txn;
+}
+
+/* Close a transaction, releasing its reservations */
+int vmfs_metadata_txn_end(vmfs_fs_t *fs,vmfs_metadata_txn_t *txn)
+{
+   u_int i;
+
+   if (!txn->outer) {
+      for(i=0;i<txn->reserved_count;i++)
+         vmfs_device_release(fs->dev,txn->reserved[i]);
+
+      vmfs_metadata_txn = NULL;
+   }
+
+   return(0);
+}
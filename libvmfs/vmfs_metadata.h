@@ -56,6 +56,22 @@ struct vmfs_metadata_hdr {
    uint64_t mtime;
 };
 
+/* 
+ * Metadata lock transaction: all the locks taken by a thread while it has
+ * a transaction open on a filesystem share the volume reservations, taken
+ * once and released at the end. Nested transactions join the outermost one.
+ */
+#define VMFS_METADATA_TXN_MAX  16
+
+struct vmfs_metadata_txn {
+   const vmfs_fs_t *fs;
+   vmfs_metadata_txn_t *outer;
+
+   /* Positions whose reservation is held (outermost transaction) */
+   u_int reserved_count;
+   off_t reserved[VMFS_METADATA_TXN_MAX];
+};
+
 static inline bool vmfs_metadata_is_locked(vmfs_metadata_hdr_t *mdh)
 {
    return(mdh->hb_lock != 0);
@@ -67,11 +83,20 @@ int vmfs_metadata_hdr_read(vmfs_metadata_hdr_t *mdh,const u_char *buf);
 /* Write a metadata header */
 int vmfs_metadata_hdr_write(const vmfs_metadata_hdr_t *mdh,u_char *buf);
 
-/* Lock and read metadata at specified position */
+/* 
+ * Lock and read metadata at specified position. Within a transaction, the
+ * volume reservation is kept until the transaction ends.
+ */
 int vmfs_metadata_lock(vmfs_fs_t *fs,off_t pos,u_char *buf,size_t buf_len,
                        vmfs_metadata_hdr_t *mdh);
 
 /* Unlock metadata */
 int vmfs_metadata_unlock(vmfs_fs_t *fs,vmfs_metadata_hdr_t *mdh);
 
+/* Open a metadata lock transaction */
+void vmfs_metadata_txn_begin(vmfs_fs_t *fs,vmfs_metadata_txn_t *txn);
+
+/* Close a transaction, releasing its reservations */
+int vmfs_metadata_txn_end(vmfs_fs_t *fs,vmfs_metadata_txn_t *txn);
+
 #endif
@@ -0,0 +1,156 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Cache of pointer blocks, shared by the PB, PB2 and double indirect
+ * block resolution paths. All accesses are serialized by a mutex.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "vmfs.h"
+
+/* Hash function to find the set of a pointer block */
+static inline u_int vmfs_pbcache_hash(uint64_t pb_blk_id)
+{
+   pb_blk_id ^= (pb_blk_id >> 32) ^ (pb_blk_id >> 56);
+   return( (pb_blk_id ^ (pb_blk_id >> 6) ^ (pb_blk_id >> 12)) &
+           (VMFS_PBCACHE_SETS - 1) );
+}
+
+/* Create a pointer block cache */
+vmfs_pbcache_t *vmfs_pbcache_create(void)
+{
+   vmfs_pbcache_t *pbc;
+
+   if (!(pbc = calloc(1,sizeof(*pbc))))
+      return NULL;
+
+   pthread_mutex_init(&pbc->lock,NULL);
+   return pbc;
+}
+
+/* Destroy a pointer block cache */
+void vmfs_pbcache_destroy(vmfs_pbcache_t *pbc)
+{
+   int i,j;
+
+   if (!pbc)
+      return;
+
+   for(i=0;i<VMFS_PBCACHE_SETS;i++)
+      for(j=0;j<VMFS_PBCACHE_WAYS;j++)
+         iobuffer_free(pbc->slots[i][j].buf);
+
+   pthread_mutex_destroy(&pbc->lock);
+   free(pbc);
+}
+
+/* Load a pointer block into the least recently used slot of its set */
+static struct vmfs_pbcache_slot *
+vmfs_pbcache_load(vmfs_pbcache_t *pbc,vmfs_bitmap_t *bmp,
+                  uint32_t entry,uint32_t item,uint64_t pb_blk_id)
+{
+   struct vmfs_pbcache_slot *set,*slot;
+   uint32_t len = bmp->bmh.data_size;
+   int i;
+
+   set = pbc->slots[vmfs_pbcache_hash(pb_blk_id)];
+   slot = &set[0];
+
+   for(i=1;i<VMFS_PBCACHE_WAYS;i++)
+      if (set[i].last_use < slot->last_use)
+         slot = &set[i];
+
+   if (slot->len != len) {
+      iobuffer_free(slot->buf);
+      slot->len = 0;
+      if (!(slot->buf = iobuffer_alloc(len)))
+         return NULL;
+      slot->len = len;
+   }
+
+   slot->pb_blk_id = 0;
+   if (!vmfs_bitmap_get_item(bmp,entry,item,slot->buf))
+      return NULL;
+
+   slot->pb_blk_id = pb_blk_id;
+   return slot;
+}
+
+/*
+ * Get the block ID stored at "index" in a pointer block, reading the
+ * pointer block from the given bitmap item if it is not cached yet.
+ */
+int vmfs_pbcache_get_blk_id(const vmfs_fs_t *fs,vmfs_bitmap_t *bmp,
+                            uint32_t entry,uint32_t item,
+                            uint64_t pb_blk_id,u_int index,
+                            uint64_t *blk_id)
+{
+   vmfs_pbcache_t *pbc = fs->pbcache;
+   struct vmfs_pbcache_slot *set,*slot = NULL;
+   int i,res = 0;
+
+   set = pbc->slots[vmfs_pbcache_hash(pb_blk_id)];
+
+   pthread_mutex_lock(&pbc->lock);
+   for(i=0;i<VMFS_PBCACHE_WAYS;i++)
+      if (set[i].pb_blk_id == pb_blk_id) {
+         slot = &set[i];
+         break;
+      }
+
+   if (slot) {
+      pbc->hits++;
+   } else {
+      pbc->misses++;
+      if (!(slot = vmfs_pbcache_load(pbc,bmp,entry,item,pb_blk_id))) {
+         res = -EIO;
+         goto done;
+      }
+   }
+
+   if ((index + 1) * sizeof(uint64_t) > slot->len) {
+      res = -EINVAL;
+      goto done;
+   }
+
+   slot->last_use = ++pbc->tick;
+   *blk_id = read_le64(slot->buf,index*sizeof(uint64_t));
+
+ done:
+   pthread_mutex_unlock(&pbc->lock);
+   return(res);
+}
+
+/* Drop a pointer block from the cache (it has been rewritten or freed) */
+void vmfs_pbcache_invalidate(const vmfs_fs_t *fs,uint64_t pb_blk_id)
+{
+   struct vmfs_pbcache_slot *set;
+   int i;
+
+   if (!fs->pbcache)
+      return;
+
+   set = fs->pbcache->slots[vmfs_pbcache_hash(pb_blk_id)];
+
+   pthread_mutex_lock(&fs->pbcache->lock);
+   for(i=0;i<VMFS_PBCACHE_WAYS;i++)
+      if (set[i].pb_blk_id == pb_blk_id) {
+         set[i].pb_blk_id = 0;
+         set[i].last_use = 0;
+      }
+   pthread_mutex_unlock(&fs->pbcache->lock);
+}
@@ -0,0 +1,60 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_PBCACHE_H
+#define VMFS_PBCACHE_H
+
+/*
+ * Pointer block cache: set-associative, keyed by pointer block id.
+ * VMFS_PBCACHE_SETS must be a power of two.
+ */
+#define VMFS_PBCACHE_SETS  16
+#define VMFS_PBCACHE_WAYS  4
+
+struct vmfs_pbcache_slot {
+   uint64_t pb_blk_id;       /* 0 means the slot is empty */
+   uint64_t last_use;
+   uint32_t len;
+   u_char *buf;
+};
+
+struct vmfs_pbcache {
+   struct vmfs_pbcache_slot slots[VMFS_PBCACHE_SETS][VMFS_PBCACHE_WAYS];
+   uint64_t tick;
+   pthread_mutex_t lock;
+
+   /* Statistics */
+   uint64_t hits,misses;
+};
+
+/* Create a pointer block cache */
+vmfs_pbcache_t *vmfs_pbcache_create(void);
+
+/* Destroy a pointer block cache */
+void vmfs_pbcache_destroy(vmfs_pbcache_t *pbc);
+
+/*
+ * Get the block ID stored at "index" in a pointer block, reading the
+ * pointer block from the given bitmap item if it is not cached yet.
+ */
+int vmfs_pbcache_get_blk_id(const vmfs_fs_t *fs,vmfs_bitmap_t *bmp,
+                            uint32_t entry,uint32_t item,
+                            uint64_t pb_blk_id,u_int index,
+                            uint64_t *blk_id);
+
+/* Drop a pointer block from the cache (it has been rewritten or freed) */
+void vmfs_pbcache_invalidate(const vmfs_fs_t *fs,uint64_t pb_blk_id);
+
+#endif
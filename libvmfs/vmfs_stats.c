@@ -0,0 +1,146 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Filesystem statistics.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "vmfs.h"
+
+/* Output buffer, keeping track of the complete length */
+struct vmfs_stats_out {
+   char *buf;
+   size_t len;
+   size_t pos;
+};
+
+static void vmfs_stats_printf(struct vmfs_stats_out *out,const char *fmt,...)
+{
+   va_list ap;
+   size_t left;
+   int res;
+
+   left = (out->pos < out->len) ? out->len - out->pos : 0;
+
+   va_start(ap,fmt);
+   res = vsnprintf(left ? out->buf + out->pos : NULL,left,fmt,ap);
+   va_end(ap);
+
+   if (res > 0)
+      out->pos += res;
+}
+
+static inline uint64_t vmfs_stats_load(const uint64_t *counter)
+{
+   return(__atomic_load_n(counter,__ATOMIC_RELAXED));
+}
+
+static void vmfs_stats_put(struct vmfs_stats_out *out,const char *name,
+                           const uint64_t *counter)
+{
+   vmfs_stats_printf(out,"%s %llu\n",name,
+                     (unsigned long long)vmfs_stats_load(counter));
+}
+
+static void vmfs_stats_put_op(struct vmfs_stats_out *out,const char *name,
+                              const struct vmfs_stats_op *op,bool bytes)
+{
+   int i,last;
+
+   vmfs_stats_printf(out,"%s.count %llu\n",name,
+                     (unsigned long long)vmfs_stats_load(&op->count));
+
+   if (bytes)
+      vmfs_stats_printf(out,"%s.bytes %llu\n",name,
+                        (unsigned long long)vmfs_stats_load(&op->bytes));
+
+   vmfs_stats_printf(out,"%s.errors %llu\n",name,
+                     (unsigned long long)vmfs_stats_load(&op->errors));
+   vmfs_stats_printf(out,"%s.ns %llu\n",name,
+                     (unsigned long long)vmfs_stats_load(&op->ns));
+
+   /* Histogram buckets, up to the last non-empty one */
+   for(last=VMFS_STATS_HIST_BUCKETS-1;last>0;last--)
+      if (vmfs_stats_load(&op->hist[last]))
+         break;
+
+   vmfs_stats_printf(out,"%s.hist_us",name);
+
+   for(i=0;i<=last;i++)
+      vmfs_stats_printf(out," %llu",
+                        (unsigned long long)vmfs_stats_load(&op->hist[i]));
+
+   vmfs_stats_printf(out,"\n");
+}
+
+/* Create the counters of a filesystem */
+vmfs_stats_t *vmfs_stats_create(void)
+{
+   return(calloc(1,sizeof(vmfs_stats_t)));
+}
+
+/* Destroy the counters of a filesystem */
+void vmfs_stats_destroy(vmfs_stats_t *stats)
+{
+   free(stats);
+}
+
+/*
+ * Format all the statistics of a filesystem, including those of its
+ * caches, as "name value" lines. Returns the length of the complete
+ * output, which is truncated if larger than the buffer, like snprintf().
+ */
+size_t vmfs_stats_format(const vmfs_fs_t *fs,char *buf,size_t len)
+{
+   struct vmfs_stats_out out = { buf, len, 0 };
+   const vmfs_stats_t *s = fs->stats;
+   struct vmfs_iopool_stats pool;
+
+   if (len > 0)
+      buf[0] = 0;
+
+   vmfs_stats_put_op(&out,"dev.read",&s->dev_read,true);
+   vmfs_stats_put_op(&out,"dev.write",&s->dev_write,true);
+   vmfs_stats_put_op(&out,"dev.submit",&s->dev_submit,true);
+   vmfs_stats_put_op(&out,"dev.map",&s->dev_map,true);
+   vmfs_stats_put(&out,"dev.read_unaligned",&s->read_unaligned);
+   vmfs_stats_put(&out,"dev.write_unaligned",&s->write_unaligned);
+   vmfs_stats_put_op(&out,"dev.reserve",&s->reserve,false);
+   vmfs_stats_put(&out,"dev.release",&s->release);
+
+   vmfs_stats_put_op(&out,"md.lock",&s->md_lock,false);
+   vmfs_stats_put(&out,"md.unlock",&s->md_unlock);
+
+   vmfs_iopool_get_stats(fs->iopool,&pool);
+   vmfs_stats_put(&out,"iopool.gets",&pool.gets);
+   vmfs_stats_put(&out,"iopool.hits",&pool.hits);
+   vmfs_stats_put(&out,"iopool.misses",&pool.misses);
+   vmfs_stats_put(&out,"iopool.oversize",&pool.oversize);
+   vmfs_stats_put(&out,"iopool.drops",&pool.drops);
+
+   vmfs_stats_put(&out,"pbcache.hits",&fs->pbcache->hits);
+   vmfs_stats_put(&out,"pbcache.misses",&fs->pbcache->misses);
+   vmfs_stats_put(&out,"icache.hits",&fs->icache->hits);
+   vmfs_stats_put(&out,"icache.misses",&fs->icache->misses);
+   vmfs_stats_put(&out,"dcache.hits",&fs->dcache->hits);
+   vmfs_stats_put(&out,"dcache.misses",&fs->dcache->misses);
+   vmfs_stats_put(&out,"dircache.hits",&s->dir_cache_hits);
+   vmfs_stats_put(&out,"dircache.misses",&s->dir_cache_misses);
+
+   return(out.pos);
+}
@@ -0,0 +1,106 @@
+/*
+ * vmfs-tools - Tools to access VMFS filesystems
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VMFS_STATS_H
+#define VMFS_STATS_H
+
+#include <time.h>
+
+/*
+ * Latency histograms: bucket 0 counts operations under 1 microsecond,
+ * bucket n those between 2^(n-1) and 2^n microseconds, and the last one
+ * everything slower.
+ */
+#define VMFS_STATS_HIST_BUCKETS  24
+
+/* Counters of a timed operation */
+struct vmfs_stats_op {
+   uint64_t count;
+   uint64_t bytes;
+   uint64_t errors;           /* Failed or short operations */
+   uint64_t ns;               /* Total latency */
+   uint64_t hist[VMFS_STATS_HIST_BUCKETS];
+};
+
+/* Counters of a filesystem, always updated with relaxed atomic operations */
+struct vmfs_stats {
+   /* Accesses to the device, timed by the vmfs_device_* wrappers */
+   struct vmfs_stats_op dev_read;
+   struct vmfs_stats_op dev_write;
+   struct vmfs_stats_op dev_submit;  /* Queued asynchronous requests */
+   struct vmfs_stats_op dev_map;     /* Ranges read directly, e.g. spliced */
+   struct vmfs_stats_op reserve;     /* Volume reservations */
+   uint64_t release;
+
+   /* Block accesses going through a bounce buffer because of alignment */
+   uint64_t read_unaligned;
+   uint64_t write_unaligned;
+
+   /* Metadata lock cycles, from heartbeat acquisition to header update */
+   struct vmfs_stats_op md_lock;
+   uint64_t md_unlock;
+
+   /* Shared directory content reused or (re)built */
+   uint64_t dir_cache_hits,dir_cache_misses;
+};
+
+#define VMFS_STATS_INC(stats,name) \
+   __atomic_add_fetch(&(stats)->name,1,__ATOMIC_RELAXED)
+
+/* Get a timestamp for vmfs_stats_op_end() */
+static inline uint64_t vmfs_stats_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* Account for an operation started at "start", which returned "res" */
+static inline void vmfs_stats_op_end(struct vmfs_stats_op *op,uint64_t start,
+                                     ssize_t res,size_t len)
+{
+   uint64_t ns = vmfs_stats_now() - start;
+   uint64_t us = ns / 1000;
+   u_int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+   if (bucket >= VMFS_STATS_HIST_BUCKETS)
+      bucket = VMFS_STATS_HIST_BUCKETS - 1;
+
+   __atomic_add_fetch(&op->count,1,__ATOMIC_RELAXED);
+   __atomic_add_fetch(&op->ns,ns,__ATOMIC_RELAXED);
+   __atomic_add_fetch(&op->hist[bucket],1,__ATOMIC_RELAXED);
+
+   if (res > 0)
+      __atomic_add_fetch(&op->bytes,res,__ATOMIC_RELAXED);
+
+   if ((res < 0) || ((size_t)res != len))
+      __atomic_add_fetch(&op->errors,1,__ATOMIC_RELAXED);
+}
+
+/* Create the counters of a filesystem */
+vmfs_stats_t *vmfs_stats_create(void);
+
+/* Destroy the counters of a filesystem */
+void vmfs_stats_destroy(vmfs_stats_t *stats);
+
+/*
+ * Format all the statistics of a filesystem, including those of its
+ * caches, as "name value" lines. Returns the length of the complete
+ * output, which is truncated if larger than the buffer, like snprintf().
+ */
+size_t vmfs_stats_format(const vmfs_fs_t *fs,char *buf,size_t len);
+
+#endif
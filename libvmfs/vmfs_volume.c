@@ -26,19 +26,45 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <assert.h>
 
 #include "vmfs.h"
 #include "scsi.h"
 
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* Read raw data from the underlying device or image */
+static ssize_t vmfs_vol_pread(const vmfs_volume_t *vol,u_char *buf,
+                              size_t len,off_t pos)
+{
+   if (vol->image)
+      return(vmfs_device_read(&vol->image->dev,pos,buf,len));
+
+   if (vol->map) {
+      if (pos >= vol->map_len)
+         return(0);
+
+      len = m_min(len,vol->map_len - pos);
+      memcpy(buf,vol->map + pos,len);
+      return(len);
+   }
+
+   return(m_pread(vol->fd,buf,len,pos));
+}
+
 /* Read a raw block of data on logical volume */
 static ssize_t vmfs_vol_read(const vmfs_device_t *dev,off_t pos,
                              u_char *buf,size_t len)
 {
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
-   pos += vol->vmfs_base + 0x1000000; 
+   pos += vol->vmfs_base + VMFS_VOL_DATA_OFFSET;
    dprintf("abs read loc 0x%lx len %ld\n", pos, len);
-   return(m_pread(vol->fd,buf,len,pos));
+   return(vmfs_vol_pread(vol,buf,len,pos));
 }
 
 /* Write a raw block of data on logical volume */
@@ -46,23 +72,362 @@ static ssize_t vmfs_vol_write(const vmfs_device_t *dev,off_t pos,
                               const u_char *buf,size_t len)
 {
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
-   pos += vol->vmfs_base + 0x1000000; 
+   pos += vol->vmfs_base + VMFS_VOL_DATA_OFFSET;
 
    return(m_pwrite(vol->fd,buf,len,pos));
 }
 
-/* Volume reservation */
+#ifdef HAVE_IO_URING
+/* io_uring submission and completion rings */
+struct vmfs_vol_ring {
+   int fd;
+   pthread_mutex_t lock;   /* Serializes accesses to the rings */
+   pthread_cond_t reaped;  /* Signaled when the waiting thread reaped */
+   bool waiting;     /* A thread waits in the kernel, ring unlocked */
+   u_int pending;    /* Queued, not yet passed to the kernel */
+   u_int inflight;   /* Queued and not completed */
+   uint64_t completed;  /* Completions reaped so far */
+
+   void *sq_ptr,*cq_ptr;
+   size_t sq_len,cq_len;
+   unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+   unsigned *cq_head,*cq_tail,*cq_mask;
+   struct io_uring_sqe *sqes;
+   size_t sqes_len;
+   struct io_uring_cqe *cqes;
+   u_int entries;
+};
+
+/* Setup an io_uring instance for a volume */
+static struct vmfs_vol_ring *vmfs_vol_ring_setup(void)
+{
+   struct io_uring_params p;
+   struct vmfs_vol_ring *ring;
+   u_char *sq,*cq;
+
+   if (!(ring = calloc(1,sizeof(*ring))))
+      return NULL;
+
+   memset(&p,0,sizeof(p));
+   ring->fd = syscall(__NR_io_uring_setup,VMFS_VOL_RING_ENTRIES,&p);
+   if (ring->fd < 0)
+      goto err_setup;
+
+   ring->entries = p.sq_entries;
+   ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      ring->sq_len = ring->cq_len = m_max(ring->sq_len,ring->cq_len);
+
+   ring->sq_ptr = mmap(NULL,ring->sq_len,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQ_RING);
+   if (ring->sq_ptr == MAP_FAILED)
+      goto err_sq;
+
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      ring->cq_ptr = ring->sq_ptr;
+   else {
+      ring->cq_ptr = mmap(NULL,ring->cq_len,PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+      if (ring->cq_ptr == MAP_FAILED)
+         goto err_cq;
+   }
+
+   ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL,ring->sqes_len,PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQES);
+   if (ring->sqes == MAP_FAILED)
+      goto err_sqes;
+
+   sq = ring->sq_ptr;
+   ring->sq_head  = (unsigned *)(sq + p.sq_off.head);
+   ring->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+   ring->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+   ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+   cq = ring->cq_ptr;
+   ring->cq_head  = (unsigned *)(cq + p.cq_off.head);
+   ring->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+   ring->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+   ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+   pthread_mutex_init(&ring->lock,NULL);
+   pthread_cond_init(&ring->reaped,NULL);
+   return ring;
+
+ err_sqes:
+   if (ring->cq_ptr != ring->sq_ptr)
+      munmap(ring->cq_ptr,ring->cq_len);
+ err_cq:
+   munmap(ring->sq_ptr,ring->sq_len);
+ err_sq:
+   close(ring->fd);
+ err_setup:
+   free(ring);
+   return NULL;
+}
+
+/* Destroy an io_uring instance */
+static void vmfs_vol_ring_destroy(struct vmfs_vol_ring *ring)
+{
+   if (!ring)
+      return;
+
+   munmap(ring->sqes,ring->sqes_len);
+   if (ring->cq_ptr != ring->sq_ptr)
+      munmap(ring->cq_ptr,ring->cq_len);
+   munmap(ring->sq_ptr,ring->sq_len);
+   close(ring->fd);
+   pthread_cond_destroy(&ring->reaped);
+   pthread_mutex_destroy(&ring->lock);
+   free(ring);
+}
+
+/* 
+ * Pass queued requests to the kernel, optionally waiting for completions.
+ * Returns the number of requests submitted.
+ */
+static int vmfs_vol_ring_enter(int fd,u_int to_submit,u_int min)
+{
+   int res;
+
+   do {
+      res = syscall(__NR_io_uring_enter,fd,to_submit,min,
+                    min ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+   } while ((res < 0) && (errno == EINTR));
+
+   return((res < 0) ? -errno : res);
+}
+
+/* Process the completion queue (ring locked) */
+static int vmfs_vol_ring_reap(const vmfs_volume_t *vol)
+{
+   struct vmfs_vol_ring *ring = vol->ring;
+   struct io_uring_cqe *cqe;
+   vmfs_io_req_t *req;
+   unsigned head;
+   int count = 0;
+
+   head = *ring->cq_head;
+
+   while(head != __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      req = (vmfs_io_req_t *)(uintptr_t)cqe->user_data;
+      req->res = cqe->res;
+      head++;
+
+      __atomic_store_n(ring->cq_head,head,__ATOMIC_RELEASE);
+      ring->inflight--;
+      ring->completed++;
+      count++;
+
+      /* Complete short transfers synchronously */
+      if ((req->res >= 0) && (req->res < req->len)) {
+         off_t pos = cqe->res;
+         ssize_t res;
+
+         if (req->op == VMFS_IO_WRITE)
+            res = m_pwrite(vol->fd,req->buf + pos,req->len - pos,
+                           (off_t)req->dev_pos + pos);
+         else
+            res = m_pread(vol->fd,req->buf + pos,req->len - pos,
+                          (off_t)req->dev_pos + pos);
+         req->res = (res < 0) ? res : req->res + res;
+      }
+
+      __atomic_store_n(&req->done,1,__ATOMIC_RELEASE);
+   }
+
+   return(count);
+}
+
+/* 
+ * Wait for at least min completions (ring locked). Only one thread waits in
+ * the kernel, with the ring unlocked so that requests can still be queued;
+ * the others wait for it to reap the completion queue. Returns the number
+ * of completions reaped meanwhile.
+ */
+static int vmfs_vol_ring_wait(const vmfs_volume_t *vol,u_int min)
+{
+   struct vmfs_vol_ring *ring = vol->ring;
+   uint64_t start = ring->completed;
+   u_int to_submit,wait;
+   int res = 0;
+
+   while((res >= 0) && ((ring->completed - start) < min)) {
+      if (ring->waiting) {
+         pthread_cond_wait(&ring->reaped,&ring->lock);
+         continue;
+      }
+
+      /* Requests may have been reaped by other threads */
+      wait = m_min(min - (u_int)(ring->completed - start),ring->inflight);
+      if (!wait)
+         break;
+
+      ring->waiting = true;
+      to_submit = ring->pending;
+      pthread_mutex_unlock(&ring->lock);
+
+      res = vmfs_vol_ring_enter(ring->fd,to_submit,wait);
+
+      pthread_mutex_lock(&ring->lock);
+      ring->waiting = false;
+
+      if (res > 0)
+         ring->pending -= m_min((u_int)res,ring->pending);
+
+      vmfs_vol_ring_reap(vol);
+      pthread_cond_broadcast(&ring->reaped);
+   }
+
+   return((res < 0) ? res : (int)(ring->completed - start));
+}
+
+/* Queue an asynchronous I/O request */
+static int vmfs_vol_submit(const vmfs_device_t *dev,vmfs_io_req_t *req,
+                           off_t pos)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   struct vmfs_vol_ring *ring = vol->ring;
+   struct io_uring_sqe *sqe;
+   unsigned tail,idx;
+   int res;
+
+   if ((req->op == VMFS_IO_WRITE) && !vol->flags.read_write)
+      return(-EROFS);
+
+   pthread_mutex_lock(&ring->lock);
+
+   /* Make room in the ring if needed */
+   while(ring->inflight >= ring->entries) {
+      if ((res = vmfs_vol_ring_wait(vol,1)) < 0) {
+         pthread_mutex_unlock(&ring->lock);
+         return(res);
+      }
+   }
+
+   pos += vol->vmfs_base + VMFS_VOL_DATA_OFFSET;
+   req->dev_pos = pos;
+
+   tail = *ring->sq_tail;
+   idx  = tail & *ring->sq_mask;
+   sqe  = &ring->sqes[idx];
+
+   memset(sqe,0,sizeof(*sqe));
+   sqe->opcode = (req->op == VMFS_IO_WRITE) ? IORING_OP_WRITE : IORING_OP_READ;
+   sqe->fd = vol->fd;
+   sqe->off = pos;
+   sqe->addr = (uintptr_t)req->buf;
+   sqe->len = req->len;
+   sqe->user_data = (uintptr_t)req;
+
+   ring->sq_array[idx] = idx;
+   __atomic_store_n(ring->sq_tail,tail + 1,__ATOMIC_RELEASE);
+
+   ring->pending++;
+   ring->inflight++;
+   pthread_mutex_unlock(&ring->lock);
+   return(0);
+}
+
+/* Wait for completion of queued I/O requests */
+static int vmfs_vol_complete(const vmfs_device_t *dev,u_int min)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+   struct vmfs_vol_ring *ring = vol->ring;
+   int res;
+
+   pthread_mutex_lock(&ring->lock);
+
+   if (min)
+      res = vmfs_vol_ring_wait(vol,m_min(min,ring->inflight));
+   else if ((res = vmfs_vol_ring_enter(ring->fd,ring->pending,0)) >= 0) {
+      /* Only pass queued requests to the kernel, without blocking */
+      ring->pending -= m_min((u_int)res,ring->pending);
+      res = vmfs_vol_ring_reap(vol);
+   }
+
+   pthread_mutex_unlock(&ring->lock);
+   return(res);
+}
+
+/* 
+ * Give a forked child its own ring: the inherited one is shared with the
+ * parent, which would see the child's submissions and completions.
+ */
+static void vmfs_vol_atfork_child(vmfs_device_t *dev)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+
+   vmfs_vol_ring_destroy(vol->ring);
+
+   if (!(vol->ring = vmfs_vol_ring_setup())) {
+      vol->dev.submit = NULL;
+      vol->dev.complete = NULL;
+   }
+}
+#endif
+
+/* Get the file descriptor and offset corresponding to a range */
+static int vmfs_vol_map_fd(const vmfs_device_t *dev,off_t pos,size_t len,
+                           int *fd,off_t *fd_pos)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+
+   /* Block devices are opened for direct I/O */
+   if (vol->is_blkdev &&
+       (!ALIGN_CHECK(pos,M_DIO_BLK_SIZE) || !ALIGN_CHECK(len,M_DIO_BLK_SIZE)))
+      return(-1);
+
+   *fd = vol->fd;
+   *fd_pos = pos + vol->vmfs_base + VMFS_VOL_DATA_OFFSET;
+   return(0);
+}
+
+/* Get a pointer to a range of a mapped image file */
+static const u_char *vmfs_vol_borrow(const vmfs_device_t *dev,off_t pos,
+                                     size_t len)
+{
+   vmfs_volume_t *vol = (vmfs_volume_t *) dev;
+
+   pos += vol->vmfs_base + VMFS_VOL_DATA_OFFSET;
+
+   if ((pos < 0) || (pos + len > vol->map_len))
+      return NULL;
+
+   return(vol->map + pos);
+}
+
+/* Volume reservation, only the outermost one reaching the device */
 static int vmfs_vol_reserve(const vmfs_device_t *dev, off_t pos)
 {
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
-   return(scsi_reserve(vol->fd));
+   int res = 0;
+
+   /* Other threads wait until the reservation is actually held */
+   pthread_mutex_lock(&vol->reserve_lock);
+
+   if ((vol->reserve_count++ == 0) && ((res = scsi_reserve(vol->fd)) < 0))
+      vol->reserve_count--;
+
+   pthread_mutex_unlock(&vol->reserve_lock);
+   return(res);
 }
 
 /* Volume release */
 static int vmfs_vol_release(const vmfs_device_t *dev, off_t pos)
 {
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
-   return(scsi_release(vol->fd));
+   int res = 0;
+
+   pthread_mutex_lock(&vol->reserve_lock);
+
+   if (vol->reserve_count && (--vol->reserve_count == 0))
+      res = scsi_release(vol->fd);
+
+   pthread_mutex_unlock(&vol->reserve_lock);
+   return(res);
 }
 
 /* 
@@ -96,7 +461,7 @@ static int vmfs_volinfo_read(vmfs_volume_t *volume)
    DECL_ALIGNED_BUFFER(buf,8192); 
    vmfs_volinfo_t *vol = &volume->vol_info;
 
-   if (m_pread(volume->fd,buf,buf_len,volume->vmfs_base) != buf_len)
+   if (vmfs_vol_pread(volume,buf,buf_len,volume->vmfs_base) != buf_len)
       return(-1);
 
    vol->magic = read_le32(buf,VMFS_VOLINFO_OFS_MAGIC);
@@ -152,9 +517,17 @@ static void vmfs_vol_close(vmfs_device_t *dev)
    vmfs_volume_t *vol = (vmfs_volume_t *) dev;
    if (!vol)
       return;
+#ifdef HAVE_IO_URING
+   vmfs_vol_ring_destroy(vol->ring);
+#endif
+   if (vol->image)
+      vmfs_device_close(&vol->image->dev);
+   if (vol->map)
+      munmap((void *)vol->map,vol->map_len);
    close(vol->fd);
    free(vol->device);
    free(vol->vol_info.name);
+   pthread_mutex_destroy(&vol->reserve_lock);
    free(vol);
 }
 
@@ -168,6 +541,8 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    if (!(vol = calloc(1,sizeof(*vol))))
       return NULL;
 
+   pthread_mutex_init(&vol->reserve_lock,NULL);
+
    if (!(vol->device = strdup(filename)))
       goto err_filename;
 
@@ -181,6 +556,26 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    vol->flags = flags;
    fstat(vol->fd,&st);
    vol->is_blkdev = S_ISBLK(st.st_mode);
+
+   /* Seekable images are read through their index */
+   if (!vol->is_blkdev && (vol->image = vmfs_image_open(vol->fd))) {
+      if (flags.read_write) {
+         fprintf(stderr,"VMFS: Images can only be opened read-only\n");
+         goto err_open;
+      }
+   }
+
+   /* Plain image files opened read-only are accessed through a mapping */
+   if (S_ISREG(st.st_mode) && !vol->image && !flags.read_write &&
+       (st.st_size > 0))
+   {
+      void *map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,vol->fd,0);
+
+      if (map != MAP_FAILED) {
+         vol->map = map;
+         vol->map_len = st.st_size;
+      }
+   }
 #if defined(O_DIRECT) || defined(DIRECTIO_ON)
    if (vol->is_blkdev)
 #ifdef O_DIRECT
@@ -199,7 +594,7 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
       DECL_ALIGNED_BUFFER(buf,512);
       uint16_t magic;
       /* Look for the MBR magic number */
-      m_pread(vol->fd,buf,buf_len,0);
+      vmfs_vol_pread(vol,buf,buf_len,0);
       magic = read_le16(buf, 510);
       if (magic == 0xaa55) {
          /* Scan partition table */
@@ -242,13 +637,31 @@ vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags)
    if (vol->flags.read_write)
       vol->dev.write = vmfs_vol_write;
    vol->dev.close = vmfs_vol_close;
+   if (!vol->image)
+      vol->dev.map_fd = vmfs_vol_map_fd;
+   if (vol->map)
+      vol->dev.borrow = vmfs_vol_borrow;
    vol->dev.uuid = &vol->vol_info.lvm_uuid;
 
+#ifdef HAVE_IO_URING
+   /* Use asynchronous I/O when the kernel supports it */
+   if (!vol->image && !vol->map && (vol->ring = vmfs_vol_ring_setup()) != NULL) {
+      vol->dev.submit = vmfs_vol_submit;
+      vol->dev.complete = vmfs_vol_complete;
+      vol->dev.atfork_child = vmfs_vol_atfork_child;
+   }
+#endif
+
    return vol;
 
  err_open:
+   if (vol->image)
+      vmfs_device_close(&vol->image->dev);
+   if (vol->map)
+      munmap((void *)vol->map,vol->map_len);
    free(vol->device);
  err_filename:
+   pthread_mutex_destroy(&vol->reserve_lock);
    free(vol);
    return NULL;
 }
@@ -25,6 +25,9 @@
 #define VMFS_VOLINFO_BASE   0x100000
 #define VMFS_VOLINFO_MAGIC  0xc001d00d
 
+/* Offset of the logical volume data from the VMFS volume base */
+#define VMFS_VOL_DATA_OFFSET 0x1000000
+
 struct vmfs_volinfo_raw {
    uint32_t magic;
    uint32_t ver;
@@ -124,14 +127,29 @@ struct vmfs_volume {
    vmfs_flags_t flags;
    int is_blkdev;
    int scsi_reservation;
+   pthread_mutex_t reserve_lock;
+   u_int reserve_count;       /* Number of nested reservations held */
 
    /* VMFS volume base */
    off_t vmfs_base;
 
    /* Volume and FS information */
    vmfs_volinfo_t vol_info;
+
+   /* Asynchronous I/O ring (io_uring), if available */
+   struct vmfs_vol_ring *ring;
+
+   /* Seekable image the volume is read from, if any */
+   vmfs_image_t *image;
+
+   /* Read-only mapping of a plain image file, if any */
+   const u_char *map;
+   size_t map_len;
 };
 
+/* Queue depth of the asynchronous I/O ring */
+#define VMFS_VOL_RING_ENTRIES  64
+
 /* Open a VMFS volume */
 vmfs_volume_t *vmfs_vol_open(const char *filename,vmfs_flags_t flags);
 
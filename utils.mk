@@ -62,6 +62,20 @@ $$(call result,$$(HAS_$$(__name)))
 endef
 LINK_CHECK = $(eval $(call _LINK_CHECK,$(1),$(2)))
 
+#Usage: $(call HEADER_CHECK,name,header,symbol)
+# Try to compile a simple program including header and using symbol
+# Sets HAS_NAME
+define _HEADER_CHECK
+$$(call checking,$(2))
+__name := $(call UC,$(1))
+__$$(__name) := $$(shell printf '\043include <%s>\nint main(void) { return((int)$(3)); }\n' $(2) > __conftest.c; $(CC) -c -o __conftest.o __conftest.c 2> /dev/null && echo yes || echo no; rm -f __conftest*)
+ifeq ($$(__$$(__name)),yes)
+HAS_$$(__name) := 1
+endif
+$$(call result,$$(HAS_$$(__name)))
+endef
+HEADER_CHECK = $(eval $(call _HEADER_CHECK,$(1),$(2),$(3)))
+
 GEN_VERSION = $(shell \
 	(if [ -d .git ]; then \
 		VER=$$(git describe --match "v[0-9].*" --abbrev=0 HEAD); \
@@ -22,10 +22,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include "vmfs.h"
 
 static vmfs_fs_t *fs;
 
+/* 
+ * Requests only reading the filesystem run concurrently, those modifying
+ * it run alone.
+ */
+static pthread_rwlock_t vmfs_fuse_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline void vmfs_fuse_rdlock(void)
+{
+   pthread_rwlock_rdlock(&vmfs_fuse_lock);
+}
+
+static inline void vmfs_fuse_wrlock(void)
+{
+   pthread_rwlock_wrlock(&vmfs_fuse_lock);
+}
+
+static inline void vmfs_fuse_unlock(void)
+{
+   pthread_rwlock_unlock(&vmfs_fuse_lock);
+}
+
 static inline uint32_t ino2blkid(fuse_ino_t ino)
 {
    if (ino == FUSE_ROOT_ID)
@@ -46,11 +70,14 @@ static void vmfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
    struct stat stbuf = { 0, };
 
+   vmfs_fuse_rdlock();
+
    if (!vmfs_inode_stat_from_blkid(fs, ino2blkid(ino), &stbuf)) {
       stbuf.st_ino = ino;
       fuse_reply_attr(req, &stbuf, 1.0);
    } else
       fuse_reply_err(req, ENOENT);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, 
@@ -61,8 +88,11 @@ static void vmfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
    struct stat stbuf = { 0, };
    vmfs_inode_t *inode;
 
+   vmfs_fuse_wrlock();
+
    if (!(inode = vmfs_inode_acquire(fs,ino2blkid(ino)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -81,14 +111,18 @@ static void vmfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
    if (to_set & FUSE_SET_ATTR_MTIME)
       inode->atime = attr->st_mtime;
 
-   if (to_set & FUSE_SET_ATTR_SIZE)
+   if (to_set & FUSE_SET_ATTR_SIZE) {
+      /* Data buffered by any open file must not come back afterwards */
+      vmfs_file_flush_inode(inode);
       vmfs_inode_truncate(inode,attr->st_size);
+   }
 
    vmfs_inode_stat(inode,&stbuf);
    stbuf.st_ino = blkid2ino(inode->id);
 
    fuse_reply_attr(req, &stbuf, 1.0);
    vmfs_inode_release(inode);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
@@ -98,8 +132,11 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
    size_t str_len;
    char *str;
 
+   vmfs_fuse_rdlock();
+
    if (!(f = vmfs_file_open_from_blkid(fs, ino2blkid(ino)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -108,6 +145,7 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
    if (!(str = malloc(str_len+1))) {
       vmfs_file_close(f);
       fuse_reply_err(req, ENOMEM);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -115,6 +153,7 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
       vmfs_file_close(f);
       free(str);
       fuse_reply_err(req, EIO);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -122,6 +161,7 @@ static void vmfs_fuse_readlink(fuse_req_t req,fuse_ino_t ino)
 
    fuse_reply_readlink(req,str);
    free(str);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_mknod(fuse_req_t req,fuse_ino_t parent,const char *name,
@@ -132,13 +172,17 @@ static void vmfs_fuse_mknod(fuse_req_t req,fuse_ino_t parent,const char *name,
    vmfs_dir_t *dir;
    int res;
 
+   vmfs_fuse_wrlock();
+
    if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    }        
 
    if ((res = vmfs_file_create(dir,name,mode,&inode)) < 0) {
       fuse_reply_err(req, -res);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -152,6 +196,7 @@ static void vmfs_fuse_mknod(fuse_req_t req,fuse_ino_t parent,const char *name,
    fuse_reply_entry(req, &entry);
 
    vmfs_inode_release(inode);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
@@ -162,13 +207,17 @@ static void vmfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
    vmfs_dir_t *dir;
    int res;
 
+   vmfs_fuse_wrlock();
+
    if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    }        
 
    if ((res = vmfs_dir_create(dir,name,mode,&inode)) < 0) {
       fuse_reply_err(req, -res);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -183,6 +232,7 @@ static void vmfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
    fuse_reply_entry(req, &entry);
 
    vmfs_inode_release(inode);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_unlink(fuse_req_t req,fuse_ino_t parent,const char *name) 
@@ -190,8 +240,11 @@ static void vmfs_fuse_unlink(fuse_req_t req,fuse_ino_t parent,const char *name)
    vmfs_dir_t *dir;
    int res;
 
+   vmfs_fuse_wrlock();
+
    if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    } 
 
@@ -199,6 +252,7 @@ static void vmfs_fuse_unlink(fuse_req_t req,fuse_ino_t parent,const char *name)
    vmfs_dir_close(dir);
 
    fuse_reply_err(req,-res);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_rmdir(fuse_req_t req,fuse_ino_t parent,const char *name) 
@@ -206,8 +260,11 @@ static void vmfs_fuse_rmdir(fuse_req_t req,fuse_ino_t parent,const char *name)
    vmfs_dir_t *dir;
    int res;
 
+   vmfs_fuse_wrlock();
+
    if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    } 
 
@@ -215,6 +272,7 @@ static void vmfs_fuse_rmdir(fuse_req_t req,fuse_ino_t parent,const char *name)
    vmfs_dir_close(dir);
 
    fuse_reply_err(req,-res);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
@@ -222,12 +280,15 @@ static void vmfs_fuse_opendir(fuse_req_t req, fuse_ino_t ino,
 {
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
 
+   vmfs_fuse_rdlock();
+
    fi->fh = (uint64_t)(unsigned long)
             vmfs_dir_open_from_blkid(fs, ino2blkid(ino));
    if (fi->fh)
       fuse_reply_open(req, fi);
    else
       fuse_reply_err(req, ENOTDIR);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -239,8 +300,11 @@ static void vmfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
    struct stat st = {0, };
    size_t sz;
 
+   vmfs_fuse_rdlock();
+
    if (!fi->fh) {
       fuse_reply_err(req, EBADF);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -254,58 +318,117 @@ static void vmfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
       fuse_reply_buf(req, buf, sz);
    } else
       fuse_reply_buf(req, NULL, 0);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
                                  struct fuse_file_info *fi)
 {
+   vmfs_fuse_rdlock();
+
    if (!fi->fh) {
       fuse_reply_err(req, EBADF);
+      vmfs_fuse_unlock();
       return;
    }
    vmfs_dir_close((vmfs_dir_t *)(unsigned long)fi->fh);
    fuse_reply_err(req, 0);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
 {  
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   vmfs_bitmap_t *fbb;
    struct statvfs st;
    u_int alloc_count;
 
+   vmfs_fuse_rdlock();
+
+   if (!(fbb = vmfs_fs_get_bitmap(fs, VMFS_BLK_TYPE_FB))) {
+      fuse_reply_err(req, EIO);
+      vmfs_fuse_unlock();
+      return;
+   }
+
    memset(&st,0,sizeof(st));
 
    /* Blocks */
-   alloc_count = vmfs_bitmap_allocated_items(fs->fbb);
+   alloc_count = vmfs_bitmap_allocated_items(fbb);
    st.f_bsize = st.f_frsize = vmfs_fs_get_blocksize(fs);
-   st.f_blocks = fs->fbb->bmh.total_items;
+   st.f_blocks = fbb->bmh.total_items;
    st.f_bfree = st.f_bavail = st.f_blocks - alloc_count;
    
    /* Inodes */
-   alloc_count = vmfs_bitmap_allocated_items(fs->fdc);
-   st.f_files = fs->fdc->bmh.total_items;
+   alloc_count = vmfs_bitmap_allocated_items(vmfs_fs_get_fdc(fs));
+   st.f_files = vmfs_fs_get_fdc(fs)->bmh.total_items;
    st.f_ffree = st.f_favail = st.f_files - alloc_count;
 
    fuse_reply_statfs(req,&st);
+   vmfs_fuse_unlock();
 }
 
-static void vmfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
-                             const char *name)
+/* Extended attribute of the root directory giving the filesystem statistics */
+#define VMFS_FUSE_XATTR_STATS  "user.vmfs.stats"
+
+/* Reply with an extended attribute value, or its size if "size" is 0 */
+static void vmfs_fuse_reply_xattr(fuse_req_t req, const char *value,
+                                  size_t len, size_t size)
+{
+   if (size == 0)
+      fuse_reply_xattr(req, len);
+   else if (size < len)
+      fuse_reply_err(req, ERANGE);
+   else
+      fuse_reply_buf(req, value, len);
+}
+
+/* Statistics are only read with atomic loads, without the filesystem lock */
+static void vmfs_fuse_getxattr(fuse_req_t req, fuse_ino_t ino,
+                               const char *name, size_t size)
 {
-   struct fuse_entry_param entry = { 0, };
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
-   vmfs_dir_t *d = vmfs_dir_open_from_blkid(fs, ino2blkid(parent));
-   const vmfs_dirent_t *rec;
+   size_t len;
+   char *buf;
 
-   if (!d) {
-      fuse_reply_err(req, ENOENT);
+   if ((ino != FUSE_ROOT_ID) || strcmp(name, VMFS_FUSE_XATTR_STATS)) {
+      fuse_reply_err(req, ENODATA);
+      return;
+   }
+
+   len = vmfs_stats_format(fs, NULL, 0) + 1;
+
+   if (!(buf = malloc(len))) {
+      fuse_reply_err(req, ENOMEM);
       return;
    }
 
-   rec = vmfs_dir_lookup(d, name);
+   len = m_min(vmfs_stats_format(fs, buf, len), len - 1);
+   vmfs_fuse_reply_xattr(req, buf, len, size);
+   free(buf);
+}
+
+static void vmfs_fuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+   if (ino != FUSE_ROOT_ID)
+      vmfs_fuse_reply_xattr(req, NULL, 0, size);
+   else
+      vmfs_fuse_reply_xattr(req, VMFS_FUSE_XATTR_STATS,
+                            sizeof(VMFS_FUSE_XATTR_STATS), size);
+}
+
+static void vmfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
+                             const char *name)
+{
+   struct fuse_entry_param entry = { 0, };
+   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   vmfs_dirent_t rec;
 
-   if (rec && !vmfs_inode_stat_from_blkid(fs, rec->block_id, &entry.attr)) {
-      entry.ino = entry.attr.st_ino = blkid2ino(rec->block_id);
+   vmfs_fuse_rdlock();
+
+   if (vmfs_dir_lookup_from_blkid(fs, ino2blkid(parent), name, &rec) == 1 &&
+       !vmfs_inode_stat_from_blkid(fs, rec.block_id, &entry.attr)) {
+      entry.ino = entry.attr.st_ino = blkid2ino(rec.block_id);
       entry.generation = 1;
       entry.attr_timeout = 1.0;
       entry.entry_timeout = 1.0;
@@ -313,20 +436,28 @@ static void vmfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
    } else
       fuse_reply_err(req, ENOENT);
 
-   vmfs_dir_close(d);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
                            struct fuse_file_info *fi)
 {
    vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   vmfs_file_t *f;
 
-   fi->fh = (uint64_t)(unsigned long)
-            vmfs_file_open_from_blkid(fs, ino2blkid(ino));
-   if (fi->fh)
+   vmfs_fuse_rdlock();
+
+   f = vmfs_file_open_from_blkid(fs, ino2blkid(ino));
+   fi->fh = (uint64_t)(unsigned long)f;
+
+   if (f) {
+      /* Gather small writes instead of writing each one through */
+      if ((fi->flags & O_ACCMODE) != O_RDONLY)
+         vmfs_file_set_writeback(f);
       fuse_reply_open(req, fi);
-   else
+   } else
       fuse_reply_err(req, ENOTDIR);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
@@ -339,13 +470,17 @@ static void vmfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
    vmfs_file_t *f;
    int res;
 
+   vmfs_fuse_wrlock();
+
    if (!(dir = vmfs_dir_open_from_blkid(fs, ino2blkid(parent)))) {
       fuse_reply_err(req, ENOENT);
+      vmfs_fuse_unlock();
       return;
    }      
 
    if ((res = vmfs_file_create(dir,name,mode,&inode)) < 0) {
       fuse_reply_err(req, -res);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -354,9 +489,12 @@ static void vmfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
    if (!(f = vmfs_file_open_from_inode(inode))) {
       vmfs_inode_release(inode);
       fuse_reply_err(req,ENOMEM);
+      vmfs_fuse_unlock();
+      return;
    }
 
    fi->fh = (uint64_t)(unsigned long)f;
+   vmfs_file_set_writeback(f);
 
    vmfs_inode_stat(inode,&entry.attr);
    entry.ino = entry.attr.st_ino = blkid2ino(inode->id);
@@ -364,28 +502,105 @@ static void vmfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
    entry.attr_timeout = 1.0;
    entry.entry_timeout = 1.0;
    fuse_reply_create(req,&entry,fi);
+   vmfs_fuse_unlock();
+}
+
+#if FUSE_VERSION >= 29
+/* Maximum number of pieces in a spliced read reply */
+#define VMFS_FUSE_SPLICE_BUFS  16
+
+/* 
+ * Reply to a read request with buffers pointing to the underlying device
+ * file descriptors, so that the data can be spliced to the kernel without
+ * being copied in userland. Returns -1 if the request can't be handled
+ * that way.
+ */
+static int vmfs_fuse_read_splice(fuse_req_t req, vmfs_file_t *f,
+                                 size_t size, off_t off)
+{
+   vmfs_file_range_t ranges[VMFS_FUSE_SPLICE_BUFS];
+   struct fuse_bufvec *bufv;
+   char *zero = NULL;
+   int i, count;
+
+   count = vmfs_file_get_fd_ranges(f, off, size, ranges,
+                                   VMFS_FUSE_SPLICE_BUFS);
+   if (count <= 0)
+      return(-1);
+
+   if (!(bufv = calloc(1, sizeof(*bufv) + count * sizeof(struct fuse_buf))))
+      return(-1);
+
+   bufv->count = count;
+   for (i = 0; i < count; i++) {
+      struct fuse_buf *buf = &bufv->buf[i];
+
+      buf->size = ranges[i].len;
+      if (ranges[i].fd == -1) {
+         if (!zero && !(zero = calloc(1, size))) {
+            free(bufv);
+            return(-1);
+         }
+         buf->mem = zero;
+      } else {
+         buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+         buf->fd = ranges[i].fd;
+         buf->pos = ranges[i].fd_pos;
+      }
+   }
+
+   fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+   free(zero);
+   free(bufv);
+   return(0);
 }
+#endif
 
 static void vmfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                            off_t off, struct fuse_file_info *fi)
 {
-   char buf[size];
+   vmfs_fs_t *fs = (vmfs_fs_t *) fuse_req_userdata(req);
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+   u_char *buf;
    ssize_t sz;
 
-   if (!fi->fh) {
+   vmfs_fuse_rdlock();
+
+   if (!f) {
       fuse_reply_err(req, EBADF);
+      vmfs_fuse_unlock();
       return;
    }
 
-   sz = vmfs_file_pread((vmfs_file_t *)(unsigned long)fi->fh,
-                        (u_char *)buf, size, off);
+   /* Reading buffered data writes it out first */
+   if (vmfs_file_dirty(f)) {
+      vmfs_fuse_unlock();
+      vmfs_fuse_wrlock();
+   }
 
-   if (sz < 0) {
-      fuse_reply_err(req, -sz);
+#if FUSE_VERSION >= 29
+   /* Sequential streams are read below, with read-ahead */
+   if (vmfs_fuse_read_splice(req, f, size, off) == 0) {
+      vmfs_fuse_unlock();
+      return;
+   }
+#endif
+
+   if (!(buf = vmfs_iopool_get(fs->iopool, size))) {
+      fuse_reply_err(req, ENOMEM);
+      vmfs_fuse_unlock();
       return;
    }
 
-   fuse_reply_buf(req, buf, sz);
+   sz = vmfs_file_pread(f, buf, size, off);
+
+   if (sz < 0)
+      fuse_reply_err(req, -sz);
+   else
+      fuse_reply_buf(req, (char *)buf, sz);
+
+   vmfs_iopool_put(fs->iopool, buf, size);
+   vmfs_fuse_unlock();
 }
 
 static void vmfs_fuse_write(fuse_req_t req, fuse_ino_t ino, 
@@ -394,8 +609,11 @@ static void vmfs_fuse_write(fuse_req_t req, fuse_ino_t ino,
 {
    ssize_t sz;
 
+   vmfs_fuse_wrlock();
+
    if (!fi->fh) {
       fuse_reply_err(req, EBADF);
+      vmfs_fuse_unlock();
       return;
    }
 
@@ -404,24 +622,120 @@ static void vmfs_fuse_write(fuse_req_t req, fuse_ino_t ino,
 
    if (sz < 0) {
       fuse_reply_err(req, -sz);
+      vmfs_fuse_unlock();
       return;
    }
 
    fuse_reply_write(req,sz);
+   vmfs_fuse_unlock();
 }
 
+/* Write out buffered data, on each close() of a file descriptor */
+static void vmfs_fuse_flush(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi)
+{
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+
+   if (!f) {
+      fuse_reply_err(req, EBADF);
+      return;
+   }
+
+   vmfs_fuse_wrlock();
+   fuse_reply_err(req, -vmfs_file_flush(f));
+   vmfs_fuse_unlock();
+}
+
+static void vmfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi)
+{
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+   int res;
+
+   if (!f) {
+      fuse_reply_err(req, EBADF);
+      return;
+   }
+
+   /*
+    * The inode is written back even for fdatasync(), as the size changes.
+    * With a flusher, the other modified inodes are written along with it.
+    */
+   vmfs_fuse_wrlock();
+   if (!(res = vmfs_file_sync(f)) && fs->icache->write_back &&
+       vmfs_icache_sync(fs->icache))
+      res = -EIO;
+   fuse_reply_err(req, -res);
+   vmfs_fuse_unlock();
+}
+
+#if FUSE_VERSION >= 29
+/* Mode flag of the FUSE protocol, as defined on Linux */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+/* Reserve file blocks, punching holes being unsupported */
+static void vmfs_fuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                                off_t off, off_t len,
+                                struct fuse_file_info *fi)
+{
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+   int res;
+
+   if (!f) {
+      fuse_reply_err(req, EBADF);
+      return;
+   }
+
+   if (mode & ~FALLOC_FL_KEEP_SIZE) {
+      fuse_reply_err(req, EOPNOTSUPP);
+      return;
+   }
+
+   vmfs_fuse_wrlock();
+   res = vmfs_file_fallocate(f, off, len, mode & FALLOC_FL_KEEP_SIZE);
+   fuse_reply_err(req, -res);
+   vmfs_fuse_unlock();
+}
+#endif
+
 static void vmfs_fuse_release(fuse_req_t req, fuse_ino_t ino,
                               struct fuse_file_info *fi)
 {
-   if (!fi->fh) {
+   vmfs_file_t *f = (vmfs_file_t *)(unsigned long)fi->fh;
+   int res;
+
+   if (!f) {
       fuse_reply_err(req, EBADF);
       return;
    }
-   vmfs_file_close((vmfs_file_t *)(unsigned long)fi->fh);
-   fuse_reply_err(req, 0);
+
+   /* Closing a modified file writes its data and inode back */
+   vmfs_fuse_rdlock();
+   if (f->inode->update_flags || vmfs_file_dirty(f)) {
+      vmfs_fuse_unlock();
+      vmfs_fuse_wrlock();
+   }
+
+   res = vmfs_file_close(f);
+   fuse_reply_err(req, (res < 0) ? -res : 0);
+   vmfs_fuse_unlock();
+}
+
+static void vmfs_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+#if FUSE_VERSION >= 29
+   /* Allow read replies to be spliced from the device */
+   if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+      conn->want |= FUSE_CAP_SPLICE_WRITE;
+   if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+      conn->want |= FUSE_CAP_SPLICE_MOVE;
+#endif
 }
 
 const static struct fuse_lowlevel_ops vmfs_oper = {
+   .init = vmfs_fuse_init,
    .getattr = vmfs_fuse_getattr,
    .setattr = vmfs_fuse_setattr,
    .readlink = vmfs_fuse_readlink,
@@ -433,12 +747,19 @@ const static struct fuse_lowlevel_ops vmfs_oper = {
    .readdir = vmfs_fuse_readdir,
    .releasedir = vmfs_fuse_releasedir,
    .statfs = vmfs_fuse_statfs,
+   .getxattr = vmfs_fuse_getxattr,
+   .listxattr = vmfs_fuse_listxattr,
    .lookup = vmfs_fuse_lookup,
    .open = vmfs_fuse_open,
    .create = vmfs_fuse_create,
    .read = vmfs_fuse_read,
    .write = vmfs_fuse_write,
+   .flush = vmfs_fuse_flush,
    .release = vmfs_fuse_release,
+   .fsync = vmfs_fuse_fsync,
+#if FUSE_VERSION >= 29
+   .fallocate = vmfs_fuse_fallocate,
+#endif
 };
 
 struct vmfs_fuse_opts {
@@ -446,12 +767,21 @@ struct vmfs_fuse_opts {
    char *paths[VMFS_LVM_MAX_EXTENTS + 1];
    char *mountpoint;
    int foreground;
+   u_int threads;
+   int readahead;
+   u_int flush_interval;
+   int heartbeat;
 };
 
 static const struct fuse_opt vmfs_fuse_args[] = {
   { "-d", offsetof(struct vmfs_fuse_opts, foreground), 1 },
   { "-f", offsetof(struct vmfs_fuse_opts, foreground), 1 },
+  { "threads=%u", offsetof(struct vmfs_fuse_opts, threads), 0 },
+  { "readahead=%d", offsetof(struct vmfs_fuse_opts, readahead), 0 },
+  { "flush_interval=%u", offsetof(struct vmfs_fuse_opts, flush_interval), 0 },
+  { "heartbeat", offsetof(struct vmfs_fuse_opts, heartbeat), 1 },
   FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
+  FUSE_OPT_END
 };
 
 static int vmfs_fuse_opts_func(void *data, const char *arg, int key,
@@ -478,11 +808,101 @@ static int vmfs_fuse_opts_func(void *data, const char *arg, int key,
    return 1;
 }
 
+/* Process requests until the session exits */
+static void *vmfs_fuse_worker(void *arg)
+{
+   struct fuse_session *session = (struct fuse_session *) arg;
+   struct fuse_chan *chan = fuse_session_next_chan(session, NULL);
+   size_t bufsize = fuse_chan_bufsize(chan);
+   char *buf;
+   int res = 0;
+
+   if (!(buf = malloc(bufsize))) {
+      fuse_session_exit(session);
+      return((void *)(long)-1);
+   }
+
+   while (!fuse_session_exited(session)) {
+      struct fuse_chan *tmpch = chan;
+
+      res = fuse_chan_recv(&tmpch, buf, bufsize);
+      if (res == -EINTR)
+         continue;
+      if (res <= 0)
+         break;
+
+      /* Workers are only cancelled between requests */
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+      fuse_session_process(session, buf, res, tmpch);
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+   }
+
+   free(buf);
+   fuse_session_exit(session);
+   return((void *)(long)(res < 0 ? -1 : 0));
+}
+
+/* 
+ * Process requests with a fixed number of threads, the calling one being
+ * one of them.
+ */
+static int vmfs_fuse_loop_mt(struct fuse_session *session, u_int threads)
+{
+   pthread_t workers[threads - 1];
+   u_int i, count;
+   int err;
+
+   for (count = 0; count < threads - 1; count++)
+      if (pthread_create(&workers[count], NULL, vmfs_fuse_worker, session))
+         break;
+
+   err = (int)(long)vmfs_fuse_worker(session);
+
+   /* Remaining workers are blocked waiting for requests */
+   for (i = 0; i < count; i++)
+      pthread_cancel(workers[i]);
+   for (i = 0; i < count; i++)
+      pthread_join(workers[i], NULL);
+
+   return(err);
+}
+
+static pthread_mutex_t vmfs_fuse_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vmfs_fuse_flusher_cond = PTHREAD_COND_INITIALIZER;
+static int vmfs_fuse_flusher_stop;
+
+/* Periodically write back the modified inodes, until asked to stop */
+static void *vmfs_fuse_flusher(void *arg)
+{
+   u_int interval = *(u_int *)arg;
+   struct timespec ts;
+
+   pthread_mutex_lock(&vmfs_fuse_flusher_lock);
+
+   while (!vmfs_fuse_flusher_stop) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += interval;
+      pthread_cond_timedwait(&vmfs_fuse_flusher_cond,
+                             &vmfs_fuse_flusher_lock, &ts);
+      pthread_mutex_unlock(&vmfs_fuse_flusher_lock);
+
+      vmfs_fuse_wrlock();
+      vmfs_icache_sync(fs->icache);
+      vmfs_fuse_unlock();
+
+      pthread_mutex_lock(&vmfs_fuse_flusher_lock);
+   }
+
+   pthread_mutex_unlock(&vmfs_fuse_flusher_lock);
+   return NULL;
+}
+
 int main(int argc, char *argv[])
 {
    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
    struct vmfs_fuse_opts opts = { 0, };
    struct fuse_chan *chan;
+   pthread_t flusher;
    vmfs_flags_t flags;
    int err = -1;
 
@@ -495,6 +915,7 @@ int main(int argc, char *argv[])
    flags.allow_missing_extents = 1;
 
    opts.path = &opts.paths[0];
+   opts.readahead = -1;
    if ((fuse_opt_parse(&args, &opts, vmfs_fuse_args,
                        &vmfs_fuse_opts_func) == -1) ||
        (fuse_opt_add_arg(&args, "-odefault_permissions"))) {
@@ -506,6 +927,10 @@ int main(int argc, char *argv[])
       goto cleanup;
    }
 
+   /* Read-ahead size is given in KiB */
+   if (opts.readahead >= 0)
+      fs->read_ahead = (size_t)opts.readahead * 1024;
+
    if ((chan = fuse_mount(opts.mountpoint, &args)) != NULL) {
    struct fuse_session *session;
       session = fuse_lowlevel_new(&args, &vmfs_oper,
@@ -514,7 +939,35 @@ int main(int argc, char *argv[])
          fuse_daemonize(opts.foreground);
          if (fuse_set_signal_handlers(session) != -1) {
             fuse_session_add_chan(session, chan);
-            err = fuse_session_loop(session);
+
+            /* Threads are started once daemonized */
+            if (opts.heartbeat && flags.read_write &&
+                vmfs_heartbeat_start(fs))
+               fprintf(stderr, "Unable to hold a heartbeat\n");
+
+            /* Modified inodes are written back by the flusher (in seconds) */
+            if (opts.flush_interval &&
+                !pthread_create(&flusher, NULL, vmfs_fuse_flusher,
+                                &opts.flush_interval))
+               vmfs_icache_set_write_back(fs->icache, true);
+            else
+               opts.flush_interval = 0;
+
+            if (opts.threads > 1)
+               err = vmfs_fuse_loop_mt(session, opts.threads);
+            else
+               err = fuse_session_loop(session);
+
+            if (opts.flush_interval) {
+               pthread_mutex_lock(&vmfs_fuse_flusher_lock);
+               vmfs_fuse_flusher_stop = 1;
+               pthread_cond_signal(&vmfs_fuse_flusher_cond);
+               pthread_mutex_unlock(&vmfs_fuse_flusher_lock);
+               pthread_join(flusher, NULL);
+            }
+
+            vmfs_heartbeat_stop(fs);
+
             fuse_remove_signal_handlers(session);
             fuse_session_remove_chan(chan);
          }
@@ -28,6 +28,7 @@ static int cmd_remove(vmfs_fs_t *fs,int argc,char *argv[])
 {
    /* Dangerous */
    vmfs_lvm_t *lvm = (vmfs_lvm_t *)fs->dev;
+   vmfs_bitmap_t *fbb;
    vmfs_volume_t *extent;
    DECL_ALIGNED_BUFFER(buf,512);
    vmfs_bitmap_entry_t entry;
@@ -64,22 +65,27 @@ static int cmd_remove(vmfs_fs_t *fs,int argc,char *argv[])
       }
 
    /* At filesystem level, only the FBB needs to be downsized */
-   fs->fbb->bmh.total_items -= extent->vol_info.num_segments * blocks_per_segment;
-   items_per_area = fs->fbb->bmh.items_per_bitmap_entry *
-                    fs->fbb->bmh.bmp_entries_per_area;
-   old_area_count = fs->fbb->bmh.area_count;
-   fs->fbb->bmh.area_count = (fs->fbb->bmh.total_items + items_per_area - 1) /
+   if (!(fbb = vmfs_fs_get_bitmap(fs, VMFS_BLK_TYPE_FB))) {
+      fprintf(stderr, "Unable to open file-block bitmap\n");
+      return(1);
+   }
+
+   fbb->bmh.total_items -= extent->vol_info.num_segments * blocks_per_segment;
+   items_per_area = fbb->bmh.items_per_bitmap_entry *
+                    fbb->bmh.bmp_entries_per_area;
+   old_area_count = fbb->bmh.area_count;
+   fbb->bmh.area_count = (fbb->bmh.total_items + items_per_area - 1) /
                              items_per_area;
 
    memset(buf, 0, buf_len);
-   vmfs_bmh_write(&fs->fbb->bmh, buf);
+   vmfs_bmh_write(&fbb->bmh, buf);
    /* TODO: Error handling */
-   vmfs_file_pwrite(fs->fbb->f, buf, buf_len, 0);
+   vmfs_file_pwrite(fbb->f, buf, buf_len, 0);
 
    /* Adjust new last entry */
    if ((items_in_last_entry =
-        fs->fbb->bmh.total_items % fs->fbb->bmh.items_per_bitmap_entry)) {
-      vmfs_bitmap_get_entry(fs->fbb, 0, fs->fbb->bmh.total_items, &entry);
+        fbb->bmh.total_items % fbb->bmh.items_per_bitmap_entry)) {
+      vmfs_bitmap_get_entry(fbb, 0, fbb->bmh.total_items, &entry);
       entry.free -= entry.total - items_in_last_entry;
       entry.total = items_in_last_entry;
       if (entry.ffree > entry.total)
@@ -89,20 +95,20 @@ static int cmd_remove(vmfs_fs_t *fs,int argc,char *argv[])
          entry.bitmap[items_in_last_entry / 8] &=
             0xff << (8 - (items_in_last_entry % 8));
       memset(&entry.bitmap[(items_in_last_entry + 7) / 8], 0,
-         (fs->fbb->bmh.items_per_bitmap_entry - items_in_last_entry - 7) / 8);
+         (fbb->bmh.items_per_bitmap_entry - items_in_last_entry - 7) / 8);
       vmfs_bme_update(fs, &entry);
    }
    /* Truncate the fbb file depending on the new area count */
-   if (old_area_count != fs->fbb->bmh.area_count)
-      vmfs_file_truncate(fs->fbb->f, fs->fbb->bmh.hdr_size +
-                            fs->fbb->bmh.area_count * fs->fbb->bmh.area_size);
+   if (old_area_count != fbb->bmh.area_count)
+      vmfs_file_truncate(fbb->f, fbb->bmh.hdr_size +
+                            fbb->bmh.area_count * fbb->bmh.area_size);
    /* Adjust entries after the new last one */
-   for (i = fs->fbb->bmh.total_items + (items_in_last_entry ?
-           (fs->fbb->bmh.items_per_bitmap_entry - items_in_last_entry) : 0);
-        i < fs->fbb->bmh.area_count * items_per_area;
-        i += fs->fbb->bmh.items_per_bitmap_entry) {
+   for (i = fbb->bmh.total_items + (items_in_last_entry ?
+           (fbb->bmh.items_per_bitmap_entry - items_in_last_entry) : 0);
+        i < fbb->bmh.area_count * items_per_area;
+        i += fbb->bmh.items_per_bitmap_entry) {
       uint64_t pos;
-      vmfs_bitmap_get_entry(fs->fbb, 0, i, &entry);
+      vmfs_bitmap_get_entry(fbb, 0, i, &entry);
       pos = entry.mdh.pos;
       memset(&entry, 0, sizeof(entry));
       vmfs_device_write(fs->dev, pos, (u_char *)&entry, sizeof(entry));